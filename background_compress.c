@@ -28,6 +28,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <utime.h>
+#include <time.h>
 
 #include "structs.h"
 #include "globals.h"
@@ -37,6 +38,227 @@
 #include "log.h"
 #include "direct_compress.h"
 #include "background_compress.h"
+#include "space.h"
+#include "journal.h"
+
+/*
+ * The queue is ordered by a key that is the time an entry was queued,
+ * moved forward by the bytes it is expected to save and back for files
+ * that have just been written:
+ *
+ *  COMP_PRIO_RATE = Bytes of expected savings worth a second of waiting.
+ *                   Compressing a file is expected to save the expect
+ *                   percentage of the compressor chosen for it, nothing
+ *                   for files that are left uncompressed, deduplicating
+ *                   it COMP_DEDUP_EXPECT percent.
+ *  COMP_PRIO_FULL = When the backing filesystem is more than this many
+ *                   percent full, the savings count up to
+ *                   COMP_PRIO_PRESSURE times as much, so the files that
+ *                   free up the most space go first. The whole queue is
+ *                   re-keyed when this multiplier changes.
+ *  COMP_PRIO_MAX = Most seconds an entry is moved forward.
+ *  COMP_PRIO_FRESH = Files written less than this many seconds ago are
+ *                    held back by the remainder, they are likely to be
+ *                    written again.
+ *
+ * As the key is a point in time, an entry only waits for those queued
+ * at most COMP_PRIO_MAX seconds after it, so nothing starves.
+ */
+#define COMP_PRIO_RATE (256 * 1024)
+#define COMP_PRIO_FULL 80
+#define COMP_PRIO_PRESSURE 16
+#define COMP_PRIO_MAX 3600
+#define COMP_PRIO_FRESH 300
+#define COMP_DEDUP_EXPECT 10
+
+#define COMP_HEAP_MIN 64
+
+/* Most deduplication entries a worker takes at once with -o dedup_batch */
+#define COMP_DEDUP_BATCH 256
+
+/* Set to tell the workers to exit, protected by comp_database.lock */
+static int comp_stop = FALSE;
+
+/* Set to make the workers give up the files they are working on */
+static volatile int comp_abort = FALSE;
+
+/* Multiplier of the savings in the keys of the queue, protected by
+   comp_database.lock */
+static int comp_pressure = 1;
+
+/**
+ * Fill in what the entry is expected to save and for how long it is
+ * held back, the parts of its key that depend on the file.
+ */
+static void comp_estimate(compress_t *entry)
+{
+	file_t       *file = entry->file;
+	compressor_t *compressor;
+	int           expect = COMP_DEDUP_EXPECT;
+	time_t        now;
+
+	NEED_LOCK(&file->lock);
+
+	now = time(NULL);
+
+	if (!entry->is_dedup)
+	{
+		compressor = choose_compressor(file);
+		expect = compressor ? compressor->expect : 0;
+	}
+	entry->saved = file->size / 100 * expect;
+
+	entry->queued = now;
+	entry->hold = 0;
+	if (file->last_write && file->last_write + COMP_PRIO_FRESH > now)
+		entry->hold = file->last_write + COMP_PRIO_FRESH - now;
+}
+
+static time_t comp_key(const compress_t *entry)
+{
+	off_t bonus = entry->saved * comp_pressure / COMP_PRIO_RATE;
+
+	if (bonus > COMP_PRIO_MAX)
+		bonus = COMP_PRIO_MAX;
+
+	return entry->queued + entry->hold - bonus;
+}
+
+static int comp_pressure_now(void)
+{
+	int used = space_used_percent();
+
+	if (used <= COMP_PRIO_FULL)
+		return 1;
+
+	return 1 + (COMP_PRIO_PRESSURE - 1) * (used - COMP_PRIO_FULL) /
+	           (100 - COMP_PRIO_FULL);
+}
+
+static inline void comp_heap_swap(int i, int j)
+{
+	compress_t *tmp = comp_database.heap[i];
+
+	comp_database.heap[i] = comp_database.heap[j];
+	comp_database.heap[j] = tmp;
+}
+
+static void comp_heap_sift_down(int i)
+{
+	int child;
+
+	while ((child = 2 * i + 1) < comp_database.entries)
+	{
+		if (child + 1 < comp_database.entries &&
+		    comp_database.heap[child + 1]->key < comp_database.heap[child]->key)
+			child++;
+		if (comp_database.heap[i]->key <= comp_database.heap[child]->key)
+			break;
+		comp_heap_swap(i, child);
+		i = child;
+	}
+}
+
+/**
+ * Re-key all entries if the filesystem has filled up or been freed up
+ * enough to change the multiplier of the savings.
+ */
+static void comp_heap_pressure(void)
+{
+	int pressure = comp_pressure_now();
+	int i;
+
+	NEED_LOCK(&comp_database.lock);
+
+	if (pressure == comp_pressure)
+		return;
+
+	DEBUG_("savings now count %d times, re-keying %d entries",
+	       pressure, comp_database.entries);
+	comp_pressure = pressure;
+	for (i = 0; i < comp_database.entries; i++)
+		comp_database.heap[i]->key = comp_key(comp_database.heap[i]);
+	for (i = comp_database.entries / 2 - 1; i >= 0; i--)
+		comp_heap_sift_down(i);
+}
+
+static int comp_heap_push(compress_t *entry)
+{
+	int i;
+
+	NEED_LOCK(&comp_database.lock);
+
+	comp_heap_pressure();
+	entry->key = comp_key(entry);
+
+	if (comp_database.entries == comp_database.size)
+	{
+		int          size = comp_database.size ? comp_database.size * 2 : COMP_HEAP_MIN;
+		compress_t **heap = realloc(comp_database.heap, sizeof(compress_t *) * size);
+
+		if (!heap)
+			return FAIL;
+		comp_database.heap = heap;
+		comp_database.size = size;
+	}
+
+	i = comp_database.entries++;
+	comp_database.heap[i] = entry;
+	while (i > 0 && comp_database.heap[(i - 1) / 2]->key > entry->key)
+	{
+		comp_heap_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+	return 0;
+}
+
+static compress_t *comp_heap_pop(void)
+{
+	compress_t *entry;
+
+	NEED_LOCK(&comp_database.lock);
+	assert(comp_database.entries > 0);
+
+	comp_heap_pressure();
+	entry = comp_database.heap[0];
+	comp_database.heap[0] = comp_database.heap[--comp_database.entries];
+	comp_heap_sift_down(0);
+
+	return entry;
+}
+
+#ifdef WITH_DEDUP
+/**
+ * Take the deduplication entries out of the queue, whatever their keys,
+ * until batch holds max entries. Compression entries stay where they are.
+ *
+ * @param count Number of entries already in batch.
+ * @return Number of entries in batch.
+ */
+static int comp_heap_take_dedup(compress_t **batch, int count, int max)
+{
+	int i;
+	int kept = 0;
+
+	NEED_LOCK(&comp_database.lock);
+
+	for (i = 0; i < comp_database.entries; i++)
+	{
+		compress_t *entry = comp_database.heap[i];
+
+		if (entry->is_dedup && count < max)
+			batch[count++] = entry;
+		else
+			comp_database.heap[kept++] = entry;
+	}
+	comp_database.entries = kept;
+
+	for (i = kept / 2 - 1; i >= 0; i--)
+		comp_heap_sift_down(i);
+
+	return count;
+}
+#endif
 
 /**
  * Add entry to the list of the files that will be compressed or
@@ -58,10 +280,6 @@ void background_compress_dedup(file_t *file, int dedup)
 	/* For compression entries, compressor must not be set. */
 	assert(dedup || !file->compressor);
 
-	// Increase accesses by 1, so entry is not flushed from the database.
-	//
-	file->accesses++;
-
 	entry = (compress_t *) malloc(sizeof(compress_t));
 	if (!entry)
 	{
@@ -70,14 +288,26 @@ void background_compress_dedup(file_t *file, int dedup)
 	}
 	entry->file = file;
 	entry->is_dedup = dedup;
+	comp_estimate(entry);
 
 	// Add us to the database
 	//
 	LOCK(&comp_database.lock);
-	list_add_tail(&entry->list, &comp_database.head);
+	if (comp_heap_push(entry) == FAIL)
+	{
+		UNLOCK(&comp_database.lock);
+		ERR_("malloc failed!");
+		free(entry);
+		return;
+	}
 	pthread_cond_signal(&comp_database.cond);
-	comp_database.entries++;
 	UNLOCK(&comp_database.lock);
+	file->queued[dedup ? 1 : 0]++;
+	journal_queued(file, dedup);
+
+	// Increase accesses by 1, so entry is not flushed from the database.
+	//
+	file->accesses++;
 }
 
 void background_compress(file_t *file)
@@ -90,10 +320,77 @@ void background_dedup(file_t *file)
 	background_compress_dedup(file, 1);
 }
 
+/**
+ * Done with entry, taken from the queue by a worker. A job given up on by
+ * background_compress_abort() goes back to the queue, which is saved for
+ * the next mount, anything else is marked done in the journal.
+ */
+static void comp_entry_done(compress_t *entry)
+{
+	file_t *file = entry->file;
+	int     res;
+
+	NEED_LOCK(&file->lock);
+
+	if (comp_abort && !file->deleted &&
+	    (entry->is_dedup ? !file->deduped : !file->compressor))
+	{
+		LOCK(&comp_database.lock);
+		res = comp_heap_push(entry);
+		UNLOCK(&comp_database.lock);
+		if (res != FAIL)
+			return;
+	}
+	file->queued[entry->is_dedup ? 1 : 0]--;
+	journal_done(file, entry->is_dedup);
+	free(entry);
+
+	// Restore entry->accesses to original value
+	// (@see background_compress_dedup())
+	//
+	file->accesses--;
+}
+
+#ifdef WITH_DEDUP
+/**
+ * Deduplicate the files of several entries in one go, see do_dedup_batch().
+ */
+static void comp_dedup_batch(compress_t **batch, int count)
+{
+	file_t *files[COMP_DEDUP_BATCH];
+	int     i;
+
+	for (i = 0; i < count; i++)
+		files[i] = batch[i]->file;
+	DEBUG_("deduping %d files", count);
+	do_dedup_batch(files, count, background_compress_aborting);
+
+	for (i = 0; i < count; i++)
+	{
+		LOCK(&files[i]->lock);
+		comp_entry_done(batch[i]);
+		UNLOCK(&files[i]->lock);
+	}
+}
+#endif
+
+/**
+ * Background worker. Each of the workers takes one entry at a time from
+ * comp_database, or with -o dedup_batch all the deduplication entries up
+ * to COMP_DEDUP_BATCH once it comes across one. Codecs keep their state
+ * on the stack of the worker, so different files are compressed in
+ * parallel, while the accesses count taken by background_compress_dedup()
+ * keeps the workers off files that are in use, including by another
+ * worker.
+ */
 void *thread_compress(void *arg)
 {
 	file_t     *file;
 	compress_t *entry;
+#ifdef WITH_DEDUP
+	compress_t *batch[COMP_DEDUP_BATCH];
+	int         count;
+#endif
 	
 	while (TRUE)
 	{
@@ -103,27 +400,40 @@ void *thread_compress(void *arg)
 
 		// Wait for new entry in database
 		//
-		while (list_empty(&comp_database.head))
+		while (comp_database.entries == 0 && !comp_stop)
 		{
 			pthread_cond_wait(&comp_database.cond, &comp_database.lock);
 		}
+		if (comp_stop)
+		{
+			UNLOCK(&comp_database.lock);
+			break;
+		}
 		STAT_(STAT_BACKGROUND_COMPRESS);
 
-		// Grab first comp_entry
+		// Grab the most urgent comp_entry, it is removed from
+		// the queue
 		//
-		entry = list_entry((&comp_database.head)->next, typeof(*entry), list);
+		entry = comp_heap_pop();
 		assert(entry);
+
+#ifdef WITH_DEDUP
+		if (entry->is_dedup && dedup_batch)
+		{
+			batch[0] = entry;
+			count = comp_heap_take_dedup(batch, 1, COMP_DEDUP_BATCH);
+			UNLOCK(&comp_database.lock);
+
+			comp_dedup_batch(batch, count);
+			continue;
+		}
+#endif
 		
 		// Get file from entry
 		//
 		file = entry->file;
 		assert(file);
 
-		// We have file, we can delete and free entry
-		//
-		list_del(&entry->list);
-		comp_database.entries--;
-
 		UNLOCK(&comp_database.lock);
 
 		// This is safe, entry cannot be freed because entry->accesses++ in
@@ -163,14 +473,70 @@ void *thread_compress(void *arg)
 			}
 		}
 #endif
-		free(entry);
-
-		// Restore entry->accesses to original value
-		// (@see background_compress_dedup())
-		//
-		file->accesses--;
+		comp_entry_done(entry);
 
 		UNLOCK(&file->lock);
 	}
 
+	return NULL;
+}
+
+void background_compress_start(void)
+{
+	int i;
+
+	pt_comp = malloc(sizeof(pthread_t) * comp_workers);
+	if (!pt_comp)
+	{
+		CRIT_("No memory!");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < comp_workers; i++)
+	{
+		if (pthread_create(&pt_comp[i], NULL, thread_compress, NULL) != 0)
+		{
+			CRIT_("Cannot start compress worker!");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+void background_compress_stop(void)
+{
+	int i;
+
+	LOCK(&comp_database.lock);
+	comp_stop = TRUE;
+	pthread_cond_broadcast(&comp_database.cond);
+	UNLOCK(&comp_database.lock);
+
+	for (i = 0; i < comp_workers; i++)
+		pthread_join(pt_comp[i], NULL);
+
+	free(pt_comp);
+	pt_comp = NULL;
+}
+
+void background_compress_abort(void)
+{
+	comp_abort = TRUE;
+	background_compress_stop();
+}
+
+int background_compress_aborting(void)
+{
+	return comp_abort;
+}
+
+compress_t *background_compress_take(void)
+{
+	compress_t *entry = NULL;
+
+	LOCK(&comp_database.lock);
+	if (comp_database.entries > 0)
+		entry = comp_heap_pop();
+	UNLOCK(&comp_database.lock);
+
+	return entry;
 }
@@ -24,3 +24,33 @@
  */
 void background_compress(file_t *file);
 void background_dedup(file_t *file);
+
+/**
+ * Start comp_workers threads working on the comp_database queue.
+ */
+void background_compress_start(void);
+
+/**
+ * Let the workers finish the files they are working on and wait for
+ * them to exit.
+ */
+void background_compress_stop(void);
+
+/**
+ * Like background_compress_stop(), but the workers cancel the files they
+ * are working on rather than finish them.
+ */
+void background_compress_abort(void);
+
+/**
+ * @return TRUE once background_compress_abort() has been called.
+ */
+int background_compress_aborting(void);
+
+/**
+ * Remove the most urgent entry from the queue. The caller gets the access
+ * to the file taken when it was queued.
+ *
+ * @return Entry to be freed by the caller, NULL if the queue is empty.
+ */
+compress_t *background_compress_take(void);
@@ -31,14 +31,17 @@
 #include <utime.h>
 #include <stdio.h>
 #include <errno.h>
-#include <sys/statvfs.h>
 
 #include "structs.h"
 #include "globals.h"
 #include "log.h"
 #include "file.h"
 #include "direct_compress.h"
+#include "disk_cache.h"
+#include "space.h"
+#include "inplace.h"
 #include "dedup.h"
+#include "background_compress.h"
 
 int compress_testcancel(void *cancel_cookie)
 {
@@ -47,16 +50,131 @@ int compress_testcancel(void *cancel_cookie)
 
 	assert(cancel_cookie);
 
+	if (background_compress_aborting())
+		return TRUE;
+
 	file = (file_t *) cancel_cookie;
 
-	LOCK(&file->lock);
-	if (file->status & CANCEL)
+	// This is called for every chunk, so it doesn't take file->lock.
+	// A stale value only delays the cancellation by one chunk.
+	//
+	if (__atomic_load_n(&file->status, __ATOMIC_ACQUIRE) & CANCEL)
 		r = TRUE;
-	UNLOCK(&file->lock);
 
 	return r;
 }
 
+ssize_t compress_read(void *cancel_cookie, int fd_source, void *buf, size_t size)
+{
+	ssize_t rd;
+
+	rd = read(fd_source, buf, size);
+#ifdef WITH_DEDUP
+	if (rd > 0)
+		dedup_hash_update((file_t *) cancel_cookie, buf, rd);
+#endif
+	return rd;
+}
+
+/*
+ * A background compression that is cancelled because the file is being
+ * opened keeps what it has compressed so far, if the codec can continue
+ * a file with a new stream. The next compression of the file picks the
+ * temporary file up again, unless the file has changed meanwhile.
+ *
+ * RESUME_MIN_SIZE = Compressions cancelled before getting this far start
+ *                   over instead
+ */
+#define RESUME_MIN_SIZE (1024 * 1024)
+
+void compress_resume_discard(file_t *file)
+{
+	NEED_LOCK(&file->lock);
+
+	if (!file->resume)
+		return;
+
+	unlink(file->resume->temp);
+	free(file->resume->temp);
+	free(file->resume);
+	file->resume = NULL;
+}
+
+static inline int compress_timespec_equal(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/**
+ * Take the checkpoint of file if it still matches the file on disk. The
+ * times are compared with nanoseconds, so that a rewrite of the same size
+ * within the same second is noticed. file->version only catches changes
+ * made through us.
+ *
+ * @return Checkpoint to be freed by the caller, or NULL.
+ */
+static resume_t *compress_resume_take(file_t *file, const struct stat *statbuf)
+{
+	resume_t *resume = file->resume;
+
+	NEED_LOCK(&file->lock);
+
+	if (!resume)
+		return NULL;
+
+	if (resume->ino != statbuf->st_ino ||
+	    !compress_timespec_equal(&resume->mtime, &statbuf->st_mtim) ||
+	    !compress_timespec_equal(&resume->ctime, &statbuf->st_ctim) ||
+	    resume->size != statbuf->st_size ||
+	    resume->version != file->version)
+	{
+		DEBUG_("\tdropping stale checkpoint %s", resume->temp);
+		compress_resume_discard(file);
+		return NULL;
+	}
+
+	file->resume = NULL;
+	return resume;
+}
+
+/**
+ * Keep temp, which holds the first offset bytes of file compressed, for
+ * the next compression of file.
+ *
+ * @return TRUE if temp has been taken over, FALSE if it is to be removed.
+ */
+static int compress_resume_save(file_t *file, const struct stat *statbuf,
+                                compressor_t *compressor, char *temp,
+                                int fd_temp, off_t offset)
+{
+	resume_t *resume;
+	off_t     length;
+
+	NEED_LOCK(&file->lock);
+
+	length = lseek(fd_temp, 0, SEEK_END);
+	if (length == (off_t) FAIL)
+		return FALSE;
+
+	resume = malloc(sizeof(resume_t));
+	if (!resume)
+		return FALSE;
+
+	resume->temp = temp;
+	resume->compressor = compressor;
+	resume->offset = offset;
+	resume->length = length;
+	resume->version = file->version;
+	resume->ino = statbuf->st_ino;
+	resume->mtime = statbuf->st_mtim;
+	resume->ctime = statbuf->st_ctim;
+	resume->size = statbuf->st_size;
+
+	DEBUG_("\tcheckpoint %s at %zd", temp, offset);
+	file->resume = resume;
+	return TRUE;
+}
+
 compressor_t *choose_compressor(const file_t *file)
 {
 	/* don't compress already compressed file formats */
@@ -94,6 +212,10 @@ compressor_t *choose_compressor(const file_t *file)
 				return NULL;
 		}
 	}
+#ifdef WITH_DEDUP
+	if (dedup_chunks)
+		return &module_chunk;
+#endif
 	/* TODO: decide about compressor and it's compression level from size */
 	return compressor_default;
 }
@@ -114,6 +236,8 @@ int do_decompress(file_t *file)
 	char *temp;
 	off_t size;
 	off_t header_size;
+	off_t reserved;
+	int inplace;
 	struct stat stbuf;
 	struct utimbuf buf;
 
@@ -125,16 +249,15 @@ int do_decompress(file_t *file)
 	STAT_(STAT_DECOMPRESS);
 
 	DEBUG_("file size %zd",file->size);
-	struct statvfs stat;
-	if(statvfs(file->filename, &stat) < 0)
+
+	if (file->status & BROKEN)
+	{
+		errno = EIO;
 		return FALSE;
-	if(stat.f_bsize * stat.f_bavail < file->size) {
-		if(!(geteuid() == 0 && stat.f_bsize * stat.f_bfree >= file->size)) {
-			errno = ENOSPC;
-			return FALSE;
-		}
 	}
 
+	file->version++;
+	disk_cache_invalidate(file);
 	flush_file_cache(file);
 	
 	// Open file
@@ -152,6 +275,7 @@ int do_decompress(file_t *file)
 	res = file_read_header_fd(fd_source, &header_compressor, &header_size);
 	if (res < 0) {
 		CRIT_("I/O error reading header on '%s': %s", file->filename, strerror(errno));
+		file_close(&fd_source);
 		return FALSE;
 	}
 	if (!header_compressor) {
@@ -163,6 +287,16 @@ int do_decompress(file_t *file)
 		return TRUE;
 	}
 
+	// Reserve room for the decompressed data. file->size may still be
+	// unknown (-1) here, the header has the real size.
+	//
+	reserved = header_size > 0 ? header_size : 0;
+	if (!space_reserve(reserved))
+	{
+		file_close(&fd_source);
+		return FALSE;
+	}
+
 	// Set compressor (it'll be unset if we're called from
 	// truncate for example)
 	//
@@ -188,9 +322,25 @@ int do_decompress(file_t *file)
 	{
 		file_close(&fd_source);
 		WARN_("fstat failed on '%s'", file->filename);
+		space_release(reserved, 0);
 		return FALSE;
 	}
 
+	// Hard-linked files are rewritten in place, which needs room for
+	// the temporary file and the rewritten file at the same time
+	//
+	inplace = inode_identity && stbuf.st_nlink > 1;
+	if (inplace)
+	{
+		if (!space_reserve(reserved))
+		{
+			file_close(&fd_source);
+			space_release(reserved, 0);
+			return FALSE;
+		}
+		reserved *= 2;
+	}
+
 	// Create temp file
 	//
 	temp = file_create_temp(&fd_temp);
@@ -198,6 +348,7 @@ int do_decompress(file_t *file)
 	{
 		CRIT_("can't create tempfile for '%s'", file->filename);
 		//exit(EXIT_FAILURE);
+		space_release(reserved, 0);
 		return FALSE;
 	}
 	
@@ -228,9 +379,40 @@ int do_decompress(file_t *file)
 		unlink(temp);
 		CRIT_("decompression of '%s' has failed!", file->filename);
 		//exit(EXIT_FAILURE);
+		space_release(reserved, 0);
 		return FALSE;
 	}
 
+	if (inplace)
+	{
+		file_close(&fd_source);
+		res = inplace_replace(file->filename, temp, fd_temp);
+		file_close(&fd_temp);
+		if (res == INPLACE_FAILED)
+			unlink(temp);
+		free(temp);
+		if (res == INPLACE_PENDING)
+		{
+			// The file is half decompressed, don't serve it
+			// until inplace_recover() has finished the job
+			//
+			file->status |= BROKEN;
+			errno = EIO;
+		}
+		if (res != INPLACE_OK)
+		{
+			CRIT_("rewriting '%s' has failed!", file->filename);
+			space_release(reserved, 0);
+			return FALSE;
+		}
+		space_release(reserved, size - stbuf.st_size);
+
+		list_for_each_entry(descriptor, &file->head, list) {
+			descriptor->fd = file_open(file->filename, O_RDWR);
+		}
+		goto times;
+	}
+
 	// reopen all fd's (BEFORE fchmod, so we dont get any
 	// permission denied problems)
 	//
@@ -258,9 +440,11 @@ int do_decompress(file_t *file)
 	{
 		CRIT_("Rename failed on '%s' -> '%s'!", temp, file->filename);
 		//exit(EXIT_FAILURE);
+		space_release(reserved, size);
 		return FALSE;
 	}
 	free(temp);
+	space_release(reserved, size - stbuf.st_size);
 
 	// Close source file
 	//
@@ -270,6 +454,7 @@ int do_decompress(file_t *file)
 	//
 	file_close(&fd_temp);
 
+times:
 	// access and modification time can be only changed
 	// after the descriptor is closed 
 	//
@@ -301,7 +486,10 @@ void do_compress(file_t *file)
 	int res;
 	char *temp = NULL;
 	off_t filesize;
+	off_t offset = 0;
+	off_t reserved = 0;
 	compressor_t *compressor;
+	resume_t *resume;
 	struct stat statbuf;
 	struct utimbuf timebuf;
 
@@ -337,6 +525,12 @@ void do_compress(file_t *file)
 	if (statbuf.st_size < min_filesize_background)
 		goto out;
 
+	// Hard-linked files are rewritten in place, which is only safe if
+	// all links share this file_t
+	//
+	if (inode_identity && statbuf.st_nlink > 1 && file->shared)
+		goto out;
+
 	// This could be compressed file if this is a result of direct_rename.
 	//
 	if (statbuf.st_size >= sizeof(header_t))
@@ -348,6 +542,7 @@ void do_compress(file_t *file)
 			// Compressor was updated by file_read_header_fd, this prevents
 			// additon of this file to the background compress queue again.
 			//
+			compress_resume_discard(file);
 			goto out;
 		}
 
@@ -356,33 +551,96 @@ void do_compress(file_t *file)
 		lseek(fd, SEEK_SET, 0);
 	}
 
-	// Choose compressor
+	// Continue an interrupted compression, or choose compressor
 	//
-	compressor = choose_compressor(file);
+	resume = compress_resume_take(file, &statbuf);
+	if (resume)
+		compressor = resume->compressor;
+	else
+		compressor = choose_compressor(file);
 	if (!compressor)
 		goto out;
 
-	// Create temp file
+	// Reserve space for the worst case, the compressed file being as
+	// big as the original
 	//
-	temp = file_create_temp(&fd_temp);
-	if (fd_temp == FAIL) {
-		CRIT_("\tcan't create tempfile");
-		//exit(EXIT_FAILURE);
-		return;
+	if (!space_reserve(statbuf.st_size))
+	{
+		DEBUG_("\tnot enough space to compress");
+		if (resume)
+			file->resume = resume;
+		goto out;
 	}
-	DEBUG_("\tusing tempfile %s", temp);
+	reserved = statbuf.st_size;
 
-	// Write header
-	//
-	res = file_write_header(fd_temp, compressor, statbuf.st_size);
-	if (res == FAIL) {
-		FILEERR_(file, "\tfailed to write header");
-		goto out;
+	if (resume)
+	{
+		// Drop whatever may have been written after the checkpoint
+		// and append to it
+		//
+		temp = resume->temp;
+		offset = resume->offset;
+		fd_temp = file_open(temp, O_RDWR);
+		if (fd_temp == FAIL ||
+		    ftruncate(fd_temp, resume->length) == FAIL ||
+		    lseek(fd_temp, resume->length, SEEK_SET) == (off_t) FAIL ||
+		    lseek(fd, offset, SEEK_SET) == (off_t) FAIL)
+		{
+			// Throw the checkpoint away and compress the whole
+			// file into a new tempfile
+			//
+			WARN_("\tcannot resume from %s, starting over", temp);
+			if (fd_temp != FAIL)
+				close(fd_temp);
+			fd_temp = FAIL;
+			unlink(temp);
+			free(temp);
+			temp = NULL;
+			offset = 0;
+			if (lseek(fd, 0, SEEK_SET) == (off_t) FAIL)
+			{
+				free(resume);
+				goto out;
+			}
+		}
+		else
+			DEBUG_("\tresuming tempfile %s at %zd", temp, offset);
+		free(resume);
+	}
+
+	if (!temp)
+	{
+		// Create temp file
+		//
+		temp = file_create_temp(&fd_temp);
+		if (fd_temp == FAIL) {
+			CRIT_("\tcan't create tempfile");
+			//exit(EXIT_FAILURE);
+			space_release(reserved, 0);
+			return;
+		}
+		DEBUG_("\tusing tempfile %s", temp);
+
+		// Write header
+		//
+		res = file_write_header(fd_temp, compressor, statbuf.st_size);
+		if (res == FAIL) {
+			FILEERR_(file, "\tfailed to write header");
+			goto out;
+		}
 	}
 
 	// Do actual compression. This may take a long time...
 	//
 
+#ifdef WITH_DEDUP
+	// Hash the data for dedup on the way, unless part of it has been
+	// compressed before
+	//
+	if (dedup_enabled && offset == 0)
+		dedup_hash_start(file);
+#endif
+
 	// Mark file as beeing compressing. This allows us to unlock the lock.
 	//
 	file->status |= COMPRESSING;
@@ -395,6 +653,8 @@ void do_compress(file_t *file)
 	LOCK(&file->lock);
 
 	file->status &= ~COMPRESSING;
+	if (filesize != (off_t) FAIL)
+		filesize += offset;
 
 	if ((filesize     == (off_t) FAIL) ||
 	    (filesize     != statbuf.st_size) ||
@@ -403,20 +663,57 @@ void do_compress(file_t *file)
 		DEBUG_("\tfile->compressor->compress(file, fd, fd_temp) failed");
 		DEBUG_("\tfilesize: %zi, file->size: %zi, file->status & CANCEL: %d",
 				filesize, file->size, (file->status & CANCEL));
+#ifdef WITH_DEDUP
+		if (dedup_enabled)
+			dedup_hash_drop(file);
+#endif
 
 		if (file->status & CANCEL)
 		{
 			file->status &= ~CANCEL;
 
+			// Keep the streams that have been completed, a later
+			// compression continues with the rest of the file
+			//
+			if (filesize != (off_t) FAIL && filesize < statbuf.st_size &&
+			    !background_compress_aborting() &&
+			    filesize >= RESUME_MIN_SIZE && compressor->resumable &&
+			    compress_resume_save(file, &statbuf, compressor, temp, fd_temp, filesize))
+				temp = NULL;
+
 			pthread_cond_broadcast(&file->cond);
 		}
-		else
+		else if (!background_compress_aborting())
 		{
 			WARN_("\tfailed to compress file");
 		}
 		goto out;
 	}
 
+	// Replacing a hard-linked file would leave the other links with
+	// the uncompressed data, so it is rewritten in place
+	//
+	if (inode_identity && statbuf.st_nlink > 1)
+	{
+		res = inplace_replace(file->filename, temp, fd_temp);
+		if (res == INPLACE_PENDING)
+		{
+			// Leave temp for inplace_recover(), the half
+			// rewritten file must not be served until then
+			//
+			file->status |= BROKEN;
+			file->dontcompress = TRUE;
+			free(temp);
+			temp = NULL;
+		}
+		if (res != INPLACE_OK)
+			goto out;
+
+		free(temp);
+		temp = NULL;
+		goto compressed;
+	}
+
 	res = fchown(fd_temp, statbuf.st_uid, statbuf.st_gid);
 	if (res == FAIL) {
 #if 0 // some backing filesystems (vfat, for instance) do not support users
@@ -437,6 +734,7 @@ void do_compress(file_t *file)
 	if (res == FAIL) {
 		CRIT_("\tclose failed on tempfile");
 		//exit(EXIT_FAILURE);
+		space_release(reserved, 0);
 		return;
 	}
 	fd_temp = FAIL;
@@ -445,6 +743,7 @@ void do_compress(file_t *file)
 	if (res == FAIL) {
 		CRIT_("\tclose failed");
 		//exit(EXIT_FAILURE);
+		space_release(reserved, 0);
 		return;
 	}
 	fd = FAIL;
@@ -457,16 +756,22 @@ void do_compress(file_t *file)
 	free(temp);
 	temp = NULL;
 
+compressed:
 	// File is compressed - update data in file
 	//
 	file->compressor = compressor;
 	file->size = filesize;
+	file->version++;
+	file->compressed_at = time(NULL);
 
 #ifdef WITH_DEDUP
 	/* no longer present in uncompressed form, so we need to make
 	   sure it is removed from the deduplication database */
 	if (dedup_enabled)
+	{
 		dedup_discard(file);
+		dedup_hash_finish(file, filesize);
+	}
 #endif
 	
 	// Access and modification time can be only changed
@@ -480,6 +785,11 @@ void do_compress(file_t *file)
 		goto out;
 	}
 out:
+	// The space freed by compression is picked up by the next refresh
+	//
+	if (reserved)
+		space_release(reserved, 0);
+
 	if (fd != FAIL) {
 		res = close(fd);
 		if (res == FAIL) {
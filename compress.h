@@ -21,6 +21,7 @@
 #include "compress_lzo.h"
 #include "compress_null.h"
 #include "compress_lzma.h"
+#include "compress_chunk.h"
 
 compressor_t *choose_compressor(const file_t *file);
 
@@ -49,3 +50,13 @@ void do_compress(file_t *file);
  *         Otherwise FALSE is returned.
  */
 int compress_testcancel(void *cancel_cookie);
+
+/**
+ * Read from the source file of a compression, passing the data to the
+ * dedup hash if one is made in passing.
+ *
+ * @return Same as read()
+ */
+ssize_t compress_read(void *cancel_cookie, int fd_source, void *buf, size_t size);
+
+void compress_resume_discard(file_t *file);
@@ -18,6 +18,7 @@
 #include "globals.h"
 #include "log.h"
 #include "compress.h"
+#include "throttle.h"
 
 #define BUF_SIZE 4096
 
@@ -65,7 +66,7 @@ static off_t bz2Compress(void *cancel_cookie, int fd_source, int fd_dest)
 		return (off_t) FAIL;
 	}
 
-	while ((rd = read(fd_source, buf, sizeof(buf))) > 0)
+	while ((rd = compress_read(cancel_cookie, fd_source, buf, sizeof(buf))) > 0)
 	{
 		size += rd;
 
@@ -80,6 +81,7 @@ static off_t bz2Compress(void *cancel_cookie, int fd_source, int fd_dest)
 		{
 			break;
 		}
+		throttle_io(rd);
 	}
 
 	if (rd < 0)
@@ -148,4 +150,5 @@ compressor_t module_bz2 = {
 	.write = (int (*)(void *file, void *, unsigned int len)) BZ2_bzwrite,
 	.read = (int (*)(void *file, void *, unsigned int len)) BZ2_bzread,
 	.close = (int (*)(void *file)) bz2Close,
+	.expect = 65,
 };
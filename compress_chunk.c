@@ -0,0 +1,620 @@
+/* Content-defined chunking for fusecompress.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * With "-o dedup_chunks", files are compressed with module_chunk: they
+ * are cut into chunks, every chunk is stored once in CHUNK_STORE, and the
+ * file itself only keeps the list of its chunks. Files that differ in a
+ * few places, like successive snapshots of the same data, share most of
+ * their chunks, while hardlink_file() can only share identical files.
+ *
+ * Cut points are chosen by the contents, with a gear rolling hash and the
+ * normalized chunking of FastCDC, so that an insertion or deletion only
+ * changes the chunks around it. A cut point only depends on the data
+ * since the start of its chunk, which is why streaming writes and
+ * background compression split a file the same way.
+ *
+ * Every chunk is a fusecompress file of its own, compressed with the
+ * default compressor, and named after its dedup_digest hash:
+ * CHUNK_STORE/<digest>/<first byte>/<rest of the hash>.<variant>. The
+ * variant tells apart chunks whose hashes collide, so it can only be
+ * non-zero with a digest that needs verification.
+ *
+ * Layout of a chunk-mapped file: the header, a chunk_map_t, and one
+ * chunk_ref_t per chunk, in order.
+ *
+ * Chunks are never removed while mounted, "fsck.fusecompress -g" removes
+ * the ones no file refers to anymore.
+ *
+ *  CHUNK_MIN = No cut point in the first CHUNK_MIN bytes of a chunk.
+ *  CHUNK_AVG = Cut points are less likely before, and more likely after
+ *              it, which keeps chunk sizes close to CHUNK_AVG.
+ *  CHUNK_MAX = Chunks are cut at CHUNK_MAX bytes at the latest.
+ *  CHUNK_MAX_VARIANTS = Number of different chunks with the same hash.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "structs.h"
+#include "globals.h"
+#include "compress.h"
+#include "file.h"
+#include "log.h"
+#include "throttle.h"
+#include "digest.h"
+#include "utils.h"
+
+#define CHUNK_MIN (16 * 1024)
+#define CHUNK_AVG (64 * 1024)
+#define CHUNK_MAX (256 * 1024)
+#define CHUNK_MAX_VARIANTS 16
+
+/* Bits of the gear hash that must be clear at a cut point, before and
+   after CHUNK_AVG; the top bits depend on the last 64 bytes */
+#define CHUNK_MASK_SMALL (((1ULL << 18) - 1) << 46)
+#define CHUNK_MASK_LARGE (((1ULL << 14) - 1) << 50)
+
+#define CHUNK_MAGIC "fCchunk"
+
+#define BUF_SIZE 65536
+
+typedef struct
+{
+	char magic[7];
+	char digest;		// Type of the digest naming the chunks
+} __attribute__((packed)) chunk_map_t;
+
+typedef struct
+{
+	unsigned char hash[DIGEST_SIZE];
+	uint32_t length;	// Uncompressed length, little endian
+	uint32_t variant;	// Little endian
+} __attribute__((packed)) chunk_ref_t;
+
+typedef struct
+{
+	int            fd;	/**< The chunk map */
+	int            writing;
+	digest_t      *digest;
+
+	unsigned char *buf;	/**< Reading: the current chunk, writing: data
+				     not cut into chunks yet */
+	size_t         len;	/**< Bytes in buf */
+	size_t         pos;	/**< Reading: bytes of buf already returned */
+
+	chunk_ref_t   *refs;	/**< Reading: the whole chunk map */
+	size_t         count;
+	size_t         next;	/**< Reading: index of the next chunk */
+} chunk_file_t;
+
+static uint64_t chunk_gear[256];
+static pthread_once_t chunk_gear_once = PTHREAD_ONCE_INIT;
+
+/* The gear table defines where files are cut, so it must never change */
+static void chunk_gear_init(void)
+{
+	uint64_t x = 0x6663636875686b73ULL;
+	int      i;
+
+	// splitmix64
+	//
+	for (i = 0; i < 256; i++)
+	{
+		uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		chunk_gear[i] = z ^ (z >> 31);
+	}
+}
+
+/**
+ * Find the end of the chunk starting at buf.
+ *
+ * @return Length of the chunk, or 0 if more than len bytes are needed
+ *         to tell.
+ */
+static size_t chunk_cut(const unsigned char *buf, size_t len)
+{
+	uint64_t h = 0;
+	size_t   end = len < CHUNK_MAX ? len : CHUNK_MAX;
+	size_t   i;
+
+	for (i = CHUNK_MIN; i < end; i++)
+	{
+		h = (h << 1) + chunk_gear[buf[i]];
+		if (!(h & (i < CHUNK_AVG ? CHUNK_MASK_SMALL : CHUNK_MASK_LARGE)))
+			return i + 1;
+	}
+	return len >= CHUNK_MAX ? CHUNK_MAX : 0;
+}
+
+static void chunk_path(char *path, const digest_t *digest, const chunk_ref_t *ref)
+{
+	char hex[2 * DIGEST_SIZE + 1];
+	int  i;
+
+	for (i = 1; i < DIGEST_SIZE; i++)
+		sprintf(hex + 2 * (i - 1), "%02x", ref->hash[i]);
+	snprintf(path, PATH_MAX, CHUNK_STORE "/%s/%02x/%s.%u", digest->name,
+		 ref->hash[0], hex, from_le32(ref->variant));
+}
+
+/**
+ * Create the directories for the chunk at path.
+ */
+static void chunk_mkdirs(const char *path)
+{
+	char  dir[PATH_MAX];
+	char *p;
+
+	strcpy(dir, path);
+	for (p = strchr(dir, '/'); p; p = strchr(p + 1, '/'))
+	{
+		*p = '\0';
+		if (mkdir(dir, 0700) == FAIL && errno != EEXIST)
+			WARN_("cannot create '%s': %s", dir, strerror(errno));
+		*p = '/';
+	}
+}
+
+/**
+ * Read the contents of a stored chunk into buf.
+ *
+ * @return 0 on success, FAIL if the chunk is missing, damaged, or does
+ *         not have the expected length.
+ */
+static int chunk_load(const char *path, unsigned char *buf, size_t length)
+{
+	int           fd;
+	int           rd;
+	size_t        done = 0;
+	off_t         size = -1;
+	void         *handle;
+	compressor_t *compressor = NULL;
+
+	fd = file_open(path, O_RDONLY);
+	if (fd == FAIL)
+		return FAIL;
+
+	if (file_read_header_fd(fd, &compressor, &size) == FAIL ||
+	    !compressor || compressor == &module_chunk || size != length)
+	{
+		ERR_("invalid chunk '%s'", path);
+		close(fd);
+		return FAIL;
+	}
+
+	handle = compressor->open(fd, "rb");
+	if (!handle)
+	{
+		close(fd);
+		return FAIL;
+	}
+	while (done < length &&
+	       (rd = compressor->read(handle, buf + done, length - done)) > 0)
+		done += rd;
+	compressor->close(handle);
+
+	if (done != length)
+	{
+		ERR_("short read in chunk '%s'", path);
+		return FAIL;
+	}
+	return 0;
+}
+
+/**
+ * Write a new chunk to a temporary file.
+ *
+ * @return Name of the temporary file, or NULL.
+ */
+static char *chunk_write_temp(const unsigned char *data, size_t len)
+{
+	int           fd;
+	int           ok;
+	char         *temp;
+	void         *handle;
+	compressor_t *compressor = compressor_default;
+
+	// module_chunk cannot store its own chunks
+	//
+	if (!compressor || compressor == &module_chunk)
+		compressor = &module_null;
+
+	temp = file_create_temp(&fd);
+	if (fd == FAIL)
+		return NULL;
+
+	if (file_write_header(fd, compressor, len) == FAIL ||
+	    !(handle = compressor->open(fd, COMPRESSLEVEL_BACKGROUND)))
+	{
+		close(fd);
+		unlink(temp);
+		free(temp);
+		return NULL;
+	}
+	ok = compressor->write(handle, (void *) data, len) == len;
+	ok = compressor->close(handle) == 0 && ok;
+	if (!ok)
+	{
+		unlink(temp);
+		free(temp);
+		return NULL;
+	}
+	return temp;
+}
+
+/**
+ * Put a chunk into the store, unless it is already there, and append
+ * the reference to it to the chunk map.
+ */
+static int chunk_store(chunk_file_t *cf, const unsigned char *data, size_t len)
+{
+	char           path[PATH_MAX];
+	char          *temp = NULL;
+	unsigned char *stored = NULL;
+	chunk_ref_t    ref;
+	void          *ctx;
+	unsigned int   variant = 0;
+	int            res = FAIL;
+
+	ctx = cf->digest->init();
+	if (!ctx)
+		return FAIL;
+	cf->digest->update(ctx, data, len);
+	cf->digest->final(ctx, ref.hash);
+	ref.length = to_le32(len);
+
+	while (variant < CHUNK_MAX_VARIANTS)
+	{
+		ref.variant = to_le32(variant);
+		chunk_path(path, cf->digest, &ref);
+
+		if (access(path, F_OK) == 0)
+		{
+			if (!cf->digest->verify)
+				break;
+			if (!stored && !(stored = malloc(CHUNK_MAX)))
+				goto out;
+			if (chunk_load(path, stored, len) == 0 &&
+			    memcmp(stored, data, len) == 0)
+				break;
+			DEBUG_("hash collision on chunk '%s'", path);
+			variant++;
+			continue;
+		}
+
+		if (!temp && !(temp = chunk_write_temp(data, len)))
+			goto out;
+
+		// link() fails if another worker has just stored a chunk
+		// with the same name, that one is compared then
+		//
+		if (link(temp, path) == 0)
+			break;
+		if (errno == ENOENT)
+		{
+			chunk_mkdirs(path);
+			if (link(temp, path) == 0)
+				break;
+		}
+		if (errno != EEXIST)
+		{
+			ERR_("cannot store chunk '%s': %s", path, strerror(errno));
+			goto out;
+		}
+	}
+	if (variant == CHUNK_MAX_VARIANTS)
+	{
+		ERR_("too many chunks with the same hash as '%s'", path);
+		goto out;
+	}
+
+	if (write(cf->fd, &ref, sizeof(ref)) != sizeof(ref))
+		goto out;
+	res = 0;
+
+out:
+	if (temp)
+	{
+		unlink(temp);
+		free(temp);
+	}
+	free(stored);
+	return res;
+}
+
+static void *chunkOpen(int fd, const char *mode)
+{
+	chunk_file_t *cf;
+	chunk_map_t   map;
+	struct stat   stbuf;
+	off_t         offset;
+
+	pthread_once(&chunk_gear_once, chunk_gear_init);
+
+	cf = calloc(1, sizeof(chunk_file_t));
+	if (!cf)
+		return NULL;
+	cf->fd = fd;
+
+	if (strchr(mode, 'w'))
+	{
+		cf->writing = TRUE;
+		cf->digest = dedup_digest;
+		cf->buf = malloc(CHUNK_MAX);
+		if (!cf->buf)
+			goto fail;
+
+		memcpy(map.magic, CHUNK_MAGIC, sizeof(map.magic));
+		map.digest = cf->digest->type;
+		if (write(fd, &map, sizeof(map)) != sizeof(map))
+			goto fail;
+		return cf;
+	}
+
+	if (read(fd, &map, sizeof(map)) != sizeof(map) ||
+	    memcmp(map.magic, CHUNK_MAGIC, sizeof(map.magic)) != 0 ||
+	    !(cf->digest = find_digest(map.digest)))
+	{
+		ERR_("invalid chunk map");
+		goto fail;
+	}
+
+	offset = lseek(fd, 0, SEEK_CUR);
+	if (offset == (off_t) FAIL || fstat(fd, &stbuf) == FAIL)
+		goto fail;
+	cf->count = (stbuf.st_size - offset) / sizeof(chunk_ref_t);
+	cf->refs = malloc(cf->count * sizeof(chunk_ref_t) + 1);
+	cf->buf = malloc(CHUNK_MAX);
+	if (!cf->refs || !cf->buf ||
+	    read(fd, cf->refs, cf->count * sizeof(chunk_ref_t)) !=
+	    cf->count * sizeof(chunk_ref_t))
+		goto fail;
+	return cf;
+
+fail:
+	free(cf->refs);
+	free(cf->buf);
+	free(cf);
+	return NULL;
+}
+
+static int chunkRead(void *file, void *buf, unsigned int len)
+{
+	chunk_file_t *cf = file;
+	char          path[PATH_MAX];
+	unsigned int  done = 0;
+	size_t        n;
+
+	while (done < len)
+	{
+		if (cf->pos == cf->len)
+		{
+			chunk_ref_t *ref;
+
+			if (cf->next == cf->count)
+				break;
+			ref = &cf->refs[cf->next];
+			if (from_le32(ref->length) > CHUNK_MAX)
+			{
+				ERR_("invalid chunk map");
+				return FAIL;
+			}
+			chunk_path(path, cf->digest, ref);
+			if (chunk_load(path, cf->buf, from_le32(ref->length)) == FAIL)
+				return FAIL;
+			cf->len = from_le32(ref->length);
+			cf->pos = 0;
+			cf->next++;
+		}
+
+		n = cf->len - cf->pos;
+		if (n > len - done)
+			n = len - done;
+		memcpy((char *) buf + done, cf->buf + cf->pos, n);
+		cf->pos += n;
+		done += n;
+	}
+	return done;
+}
+
+static int chunkWrite(void *file, void *buf, unsigned int len)
+{
+	chunk_file_t *cf = file;
+	unsigned int  done = 0;
+	size_t        n;
+	size_t        cut;
+
+	while (done < len)
+	{
+		n = CHUNK_MAX - cf->len;
+		if (n > len - done)
+			n = len - done;
+		memcpy(cf->buf + cf->len, (char *) buf + done, n);
+		cf->len += n;
+		done += n;
+
+		// Chunks are only cut from a full buffer, so that the cut
+		// points do not depend on the size of the writes
+		//
+		if (cf->len == CHUNK_MAX)
+		{
+			cut = chunk_cut(cf->buf, cf->len);
+			if (chunk_store(cf, cf->buf, cut) == FAIL)
+				return FAIL;
+			memmove(cf->buf, cf->buf + cut, cf->len - cut);
+			cf->len -= cut;
+		}
+	}
+	return len;
+}
+
+static int chunkClose(void *file)
+{
+	chunk_file_t *cf = file;
+	size_t        cut;
+	int           res = 0;
+
+	if (cf->writing)
+	{
+		while (res == 0 && cf->len)
+		{
+			cut = chunk_cut(cf->buf, cf->len);
+			if (!cut)
+				cut = cf->len;
+			res = chunk_store(cf, cf->buf, cut);
+			memmove(cf->buf, cf->buf + cut, cf->len - cut);
+			cf->len -= cut;
+		}
+	}
+
+	if (close(cf->fd) == FAIL)
+		res = FAIL;
+	free(cf->refs);
+	free(cf->buf);
+	free(cf);
+	return res;
+}
+
+/**
+ * Compress data from fd_source into fd_dest.
+ *
+ * @param fd_source	Source file descriptor
+ * @param fd_dest	Destination file descriptor
+ * @return 		Number of bytes read from fd_source or (off_t)-1 on error
+ */
+static off_t chunkCompress(void *cancel_cookie, int fd_source, int fd_dest)
+{
+	char          buf[BUF_SIZE];
+	int           rd;
+	int           dup_fd;
+	off_t         size = 0;
+	chunk_file_t *cf;
+
+	dup_fd = dup(fd_dest);
+	if (dup_fd == -1)
+		return (off_t) FAIL;
+
+	cf = chunkOpen(dup_fd, COMPRESSLEVEL_BACKGROUND);
+	if (!cf)
+	{
+		file_close(&dup_fd);
+		return (off_t) FAIL;
+	}
+
+	while ((rd = compress_read(cancel_cookie, fd_source, buf, sizeof(buf))) > 0)
+	{
+		if (chunkWrite(cf, buf, rd) == FAIL)
+		{
+			chunkClose(cf);
+			return (off_t) FAIL;
+		}
+		size += rd;
+
+		if (compress_testcancel(cancel_cookie))
+			break;
+		throttle_io(rd);
+	}
+
+	if (chunkClose(cf) == FAIL || rd < 0)
+		return (off_t) FAIL;
+	return size;
+}
+
+/**
+ * Decompress data from fd_source into fd_dest.
+ *
+ * @param fd_source	Source file descriptor
+ * @param fd_dest	Destination file descriptor
+ * @return 		Number of bytes written to fd_dest or (off_t)-1 on error
+ */
+static off_t chunkDecompress(int fd_source, int fd_dest)
+{
+	char          buf[BUF_SIZE];
+	int           rd;
+	int           dup_fd;
+	off_t         size = 0;
+	chunk_file_t *cf;
+
+	dup_fd = dup(fd_source);
+	if (dup_fd == -1)
+		return (off_t) FAIL;
+
+	cf = chunkOpen(dup_fd, "rb");
+	if (!cf)
+	{
+		file_close(&dup_fd);
+		return (off_t) FAIL;
+	}
+
+	while ((rd = chunkRead(cf, buf, sizeof(buf))) > 0)
+	{
+		if (write(fd_dest, buf, rd) != rd)
+		{
+			chunkClose(cf);
+			return (off_t) FAIL;
+		}
+		size += rd;
+	}
+
+	chunkClose(cf);
+	if (rd < 0)
+		return (off_t) FAIL;
+	return size;
+}
+
+int chunk_refs(int fd, void (*fn)(const char *path, void *arg), void *arg)
+{
+	chunk_file_t *cf;
+	char          path[PATH_MAX];
+	size_t        i;
+
+	cf = chunkOpen(fd, "rb");
+	if (!cf)
+		return FAIL;
+
+	for (i = 0; i < cf->count; i++)
+	{
+		chunk_path(path, cf->digest, &cf->refs[i]);
+		fn(path, arg);
+	}
+	return chunkClose(cf);
+}
+
+compressor_t module_chunk = {
+	.type = 0x05,
+	.name = "chunk",
+	.compress = chunkCompress,
+	.decompress = chunkDecompress,
+	.open = chunkOpen,
+	.write = chunkWrite,
+	.read = chunkRead,
+	.close = chunkClose,
+	.resumable = FALSE,
+	.expect = 50,
+};
@@ -0,0 +1,9 @@
+extern compressor_t module_chunk;
+
+/**
+ * Call fn with the name of every chunk the chunk map on fd refers to.
+ * fd must be positioned after the header, it is closed.
+ *
+ * @return 0 on success, FAIL if the chunk map is invalid.
+ */
+int chunk_refs(int fd, void (*fn)(const char *path, void *arg), void *arg);
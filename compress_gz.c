@@ -18,6 +18,7 @@
 #include "compress.h"
 #include "file.h"
 #include "log.h"
+#include "throttle.h"
 
 #define BUF_SIZE 4096
 
@@ -75,7 +76,7 @@ static off_t gzCompress(void *cancel_cookie, int fd_source, int fd_dest)
 		return (off_t) FAIL;
 	}
 
-	while ((rd = read(fd_source, buf, sizeof(buf))) > 0)
+	while ((rd = compress_read(cancel_cookie, fd_source, buf, sizeof(buf))) > 0)
 	{
 		size += rd;
 
@@ -90,6 +91,7 @@ static off_t gzCompress(void *cancel_cookie, int fd_source, int fd_dest)
 		{
 			break;
 		}
+		throttle_io(rd);
 	}
 
 	if (rd < 0)
@@ -162,5 +164,7 @@ compressor_t module_gzip = {
 	.write = (int (*)(void *file, void *buf, unsigned int len)) gzwrite,
 	.read = (int (*)(void *file, void *buf, unsigned int len)) gzread,
 	.close = (int (*)(void *file)) gzClose,
+	.resumable = TRUE,
+	.expect = 60,
 };
 
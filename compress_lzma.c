@@ -29,6 +29,7 @@
 #include "file.h"
 #include "log.h"
 #include "compress.h"
+#include "throttle.h"
 
 #define BUF_SIZE 4096
 
@@ -65,7 +66,7 @@ static off_t lzmaCompress(void *cancel_cookie, int fd_source, int fd_dest)
 		return (off_t)FAIL;
 	}
 	
-	while ((rd = read(fd_source, bufin, sizeof(bufin))) > 0)
+	while ((rd = compress_read(cancel_cookie, fd_source, bufin, sizeof(bufin))) > 0)
 	{
 		lstr.next_in = (const uint8_t*)bufin;
 		lstr.avail_in = rd;
@@ -96,6 +97,7 @@ static off_t lzmaCompress(void *cancel_cookie, int fd_source, int fd_dest)
 		{	/* we're told to cancel compression */
 			break;
 		}
+		throttle_io(rd);
 	}
 
 	if (rd < 0)
@@ -338,4 +340,5 @@ compressor_t module_lzma = {
 	.write = (int (*)(void *file, void *buf, unsigned int len)) lzmaWrite,
 	.read = (int (*)(void *file, void *buf, unsigned int len)) lzmaRead,
 	.close = (int (*)(void *file)) lzmaClose,
+	.expect = 70,
 };
@@ -19,6 +19,7 @@
 #include "log.h"
 #include "minilzo/lzo.h"
 #include "compress.h"
+#include "throttle.h"
 
 #define BUF_SIZE 4096
 
@@ -70,7 +71,7 @@ static off_t lzoCompress(void *cancel_cookie, int fd_source, int fd_dest)
 		return (off_t) FAIL;
 	}
 
-	while ((rd = read(fd_source, buf, sizeof(buf))) > 0)
+	while ((rd = compress_read(cancel_cookie, fd_source, buf, sizeof(buf))) > 0)
 	{
 		size += rd;
 
@@ -86,6 +87,7 @@ static off_t lzoCompress(void *cancel_cookie, int fd_source, int fd_dest)
 		{
 			break;
 		}
+		throttle_io(rd);
 	}
 
 	if (rd < 0)
@@ -159,4 +161,5 @@ compressor_t module_lzo = {
 	.write = (int (*)(void *file, void *buf, unsigned int len)) lzowrite,
 	.read = (int (*)(void *file, void *buf, unsigned int len)) lzoread,
 	.close = (int (*)(void *file)) lzoClose,
+	.expect = 45,
 };
@@ -18,6 +18,7 @@
 #include "file.h"
 #include "log.h"
 #include "compress.h"
+#include "throttle.h"
 
 #define BUF_SIZE 4096
 
@@ -40,7 +41,7 @@ static off_t nullCompress(void *cancel_cookie, int fd_source, int fd_dest)
 	int rd;
 	off_t size = 0;
 
-	while ((rd = read(fd_source, buf, sizeof(buf))) > 0)
+	while ((rd = compress_read(cancel_cookie, fd_source, buf, sizeof(buf))) > 0)
 	{
 		size += rd;
 
@@ -54,6 +55,7 @@ static off_t nullCompress(void *cancel_cookie, int fd_source, int fd_dest)
 		{
 			break;
 		}
+		throttle_io(rd);
 	}
 
 	if (rd < 0)
@@ -105,4 +107,6 @@ compressor_t module_null = {
 	.write = (int (*)(void *file, void *buf, unsigned int len)) write,
 	.read = (int (*)(void *file, void *buf, unsigned int len)) read,
 	.close = (int (*)(void *file)) close,
+	.resumable = TRUE,
+	.expect = 0,
 };
@@ -0,0 +1,393 @@
+/* Background crawler for fusecompress.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Files only get compressed once they are looked up through the mount.
+ * With "-o crawl", a thread walks the backing directory and hands the
+ * uncompressed files it finds to the janitor, which applies the same
+ * policy as for files released through the mount.
+ *
+ * Directories are walked in alphabetical order, so the path of the last
+ * file looked at is enough to continue the walk later. It is saved in
+ * CRAWL_POSITION every CRAWL_SAVE_INTERVAL seconds and when the crawler
+ * is stopped; the file is removed once the walk is complete, so the
+ * next mount starts over.
+ *
+ * The crawler thread runs with SCHED_IDLE, or at CRAWL_NICE where that
+ * is not available, and in the idle I/O class, so walking the tree only
+ * uses time the disk and CPUs would otherwise spend idle. The files it
+ * finds are compressed by the workers like any other.
+ *
+ *  crawl_rate = Files looked at per second.
+ *  CRAWL_MAX_PENDING = The crawler waits while this many files per
+ *                      worker are waiting for the janitor or the workers.
+ *  CRAWL_NICE = Nice value of the crawler thread without SCHED_IDLE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "structs.h"
+#include "globals.h"
+#include "log.h"
+#include "file.h"
+#include "direct_compress.h"
+#include "crawler.h"
+
+#define CRAWL_POSITION FUSECOMPRESS_PREFIX "crawl"
+#define CRAWL_SAVE_INTERVAL 30
+#define CRAWL_MAX_PENDING 16
+#define CRAWL_NICE 19
+
+// Not in the C library headers, from linux/ioprio.h
+//
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;		/**< Signalled to stop the crawler */
+	int stop;			/**< Set to stop the crawler, protected by lock */
+	int running;			/**< Set if thread has been started */
+	pthread_t thread;
+	dev_t dev;			/**< Device of the backing directory, the crawler
+					     doesn't cross into other filesystems */
+	char position[PATH_MAX];	/**< Last file looked at */
+	time_t saved;			/**< When position was last saved */
+	long long next;			/**< Earliest time in ns the next file may be looked at */
+} crawler = {
+	.lock = LOCK_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.stop = FALSE,
+	.running = FALSE,
+};
+
+static void crawl_save(void)
+{
+	int   fd;
+	int   ok;
+	char *tmp;
+
+	tmp = file_create_temp(&fd);
+	if (fd == FAIL)
+		return;
+	ok = write(fd, crawler.position, strlen(crawler.position) + 1) ==
+	     strlen(crawler.position) + 1;
+	ok = (close(fd) == 0) && ok;
+	if (!ok || rename(tmp, CRAWL_POSITION) == FAIL)
+		unlink(tmp);
+	free(tmp);
+
+	crawler.saved = time(NULL);
+}
+
+static void crawl_load(void)
+{
+	int     fd;
+	ssize_t len;
+
+	crawler.position[0] = '\0';
+
+	fd = open(CRAWL_POSITION, O_RDONLY);
+	if (fd == FAIL)
+		return;
+	len = read(fd, crawler.position, sizeof(crawler.position) - 1);
+	close(fd);
+
+	if (len <= 0)
+		len = 0;
+	crawler.position[len] = '\0';
+	if (crawler.position[0])
+		INFO_("crawler continuing after '%s'", crawler.position);
+}
+
+/**
+ * Sleep until time ns or until the crawler is stopped.
+ *
+ * @return TRUE if the crawler has been stopped.
+ */
+static int crawl_wait(long long ns)
+{
+	int             stop;
+	struct timespec deadline;
+
+	deadline.tv_sec = ns / 1000000000LL;
+	deadline.tv_nsec = ns % 1000000000LL;
+
+	LOCK(&crawler.lock);
+	while (!crawler.stop &&
+	       pthread_cond_timedwait(&crawler.cond, &crawler.lock, &deadline) != ETIMEDOUT)
+		;
+	stop = crawler.stop;
+	UNLOCK(&crawler.lock);
+
+	return stop;
+}
+
+static long long crawl_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Wait for our turn to look at the next file, both for the rate limit
+ * and until the workers have caught up.
+ *
+ * @return TRUE if the crawler has been stopped.
+ */
+static int crawl_pace(void)
+{
+	long long now;
+
+	while (comp_database.entries + database.recent_entries >
+	       CRAWL_MAX_PENDING * comp_workers)
+	{
+		if (crawl_wait(crawl_now() + 1000000000LL))
+			return TRUE;
+	}
+
+	now = crawl_now();
+	if (crawl_rate > 0)
+	{
+		if (crawler.next < now)
+			crawler.next = now;
+		crawler.next += 1000000000LL / crawl_rate;
+		if (crawler.next > now && crawl_wait(crawler.next))
+			return TRUE;
+	}
+	else if (crawl_wait(0))
+		return TRUE;
+
+	if (time(NULL) - crawler.saved >= CRAWL_SAVE_INTERVAL)
+		crawl_save();
+
+	return FALSE;
+}
+
+static void crawl_file(const char *path, const struct stat *stbuf)
+{
+	file_t        *file;
+	compressor_t  *compressor = NULL;
+	off_t          size = stbuf->st_size;
+
+	if (stbuf->st_size <= min_filesize_background || !is_compressible(path))
+		return;
+
+	// Don't fill the database with files that are already compressed
+	//
+	if (stbuf->st_size >= sizeof(header_t) &&
+	    (file_read_header_name(path, &compressor, &size) == FAIL || compressor))
+		return;
+
+	DEBUG_("crawler found '%s'", path);
+	file = direct_open_found(path, stbuf);
+	if (file)
+		UNLOCK(&file->lock);
+}
+
+static int crawl_filter(const struct dirent *entry)
+{
+	return strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0 &&
+	       strncmp(entry->d_name, FUSECOMPRESS_PREFIX, sizeof(FUSECOMPRESS_PREFIX) - 1) != 0 &&
+	       strncmp(entry->d_name, FUSE, sizeof(FUSE) - 1) != 0;
+}
+
+/**
+ * Walk directory dir ("." for the top), skipping everything up to and
+ * including the path resume, relative to dir, if set.
+ *
+ * @return TRUE if the crawler has been stopped.
+ */
+static int crawl_dir(const char *dir, const char *resume)
+{
+	struct dirent **entries;
+	struct stat     stbuf;
+	char            path[PATH_MAX];
+	const char     *rest = NULL;
+	size_t          len = 0;
+	int             stop = FALSE;
+	int             count;
+	int             i;
+
+	count = scandir(dir, &entries, crawl_filter, alphasort);
+	if (count < 0)
+	{
+		DEBUG_("cannot read '%s': %s", dir, strerror(errno));
+		return FALSE;
+	}
+
+	if (resume)
+	{
+		rest = strchr(resume, '/');
+		len = rest ? rest - resume : strlen(resume);
+		if (rest)
+			rest++;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		const char *name = entries[i]->d_name;
+		const char *skip = NULL;
+
+		if (stop)
+			continue;
+
+		// Continue where the last walk has stopped
+		//
+		if (resume)
+		{
+			int cmp = strncmp(name, resume, len);
+
+			if (cmp == 0 && name[len] != '\0')
+				cmp = 1;
+			if (cmp < 0)
+				continue;
+			if (cmp == 0)
+			{
+				if (!rest)
+				{
+					resume = NULL;
+					continue;
+				}
+				skip = rest;
+			}
+			resume = NULL;
+		}
+
+		if (strcmp(dir, ".") == 0)
+			snprintf(path, sizeof(path), "%s", name);
+		else
+			snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+		if (lstat(path, &stbuf) == FAIL || stbuf.st_dev != crawler.dev)
+			continue;
+
+		if (S_ISDIR(stbuf.st_mode))
+		{
+			stop = crawl_dir(path, skip);
+			continue;
+		}
+		if (!S_ISREG(stbuf.st_mode))
+			continue;
+
+		if (crawl_pace())
+		{
+			stop = TRUE;
+			continue;
+		}
+		crawl_file(path, &stbuf);
+		strcpy(crawler.position, path);
+	}
+
+	for (i = 0; i < count; i++)
+		free(entries[i]);
+	free(entries);
+
+	return stop;
+}
+
+/**
+ * Move the calling thread to idle CPU and I/O priority. On Linux both
+ * setpriority() and ioprio_set() with a pid of 0 only apply to the
+ * calling thread, so the workers keep their priority.
+ */
+static void crawl_lower_priority(void)
+{
+#ifdef SCHED_IDLE
+	struct sched_param param = { .sched_priority = 0 };
+
+	if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0)
+#endif
+	{
+#ifdef __linux__
+		if (setpriority(PRIO_PROCESS, 0, CRAWL_NICE) == FAIL)
+			DEBUG_("cannot lower crawler priority: %s", strerror(errno));
+#endif
+	}
+
+#ifdef SYS_ioprio_set
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+	            IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == FAIL)
+		DEBUG_("cannot lower crawler I/O priority: %s", strerror(errno));
+#endif
+}
+
+static void *thread_crawler(void *arg)
+{
+	crawl_lower_priority();
+	crawler.saved = time(NULL);
+
+	if (crawl_dir(".", crawler.position[0] ? crawler.position : NULL))
+	{
+		crawl_save();
+		return NULL;
+	}
+
+	INFO_("crawler has finished");
+	unlink(CRAWL_POSITION);
+	return NULL;
+}
+
+void crawler_start(void)
+{
+	struct stat stbuf;
+
+	if (stat(".", &stbuf) == FAIL)
+		return;
+	crawler.dev = stbuf.st_dev;
+
+	crawl_load();
+
+	if (pthread_create(&crawler.thread, NULL, thread_crawler, NULL) != 0)
+	{
+		ERR_("cannot start crawler");
+		return;
+	}
+	crawler.running = TRUE;
+}
+
+void crawler_stop(void)
+{
+	if (!crawler.running)
+		return;
+
+	LOCK(&crawler.lock);
+	crawler.stop = TRUE;
+	pthread_cond_signal(&crawler.cond);
+	UNLOCK(&crawler.lock);
+
+	pthread_join(crawler.thread, NULL);
+	crawler.running = FALSE;
+}
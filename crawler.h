@@ -0,0 +1,33 @@
+/* Background crawler for fusecompress.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef CRAWLER_H
+#define CRAWLER_H
+
+/**
+ * Start walking the backing directory for files to compress, where the
+ * last walk has stopped. Must be called with the backing directory as
+ * the working directory.
+ */
+void crawler_start(void);
+
+/**
+ * Stop the walk and remember where it has got to.
+ */
+void crawler_stop(void);
+
+#endif
@@ -22,33 +22,514 @@
 #include "log.h"
 #include "globals.h"
 #include "file.h"
+#include "space.h"
+#include "throttle.h"
+#include "digest.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include <sys/time.h>
-#include <sys/statvfs.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <utime.h>
-#include <mhash.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <limits.h>
+#ifdef HAVE_LINUX_FS_H
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
+/* The dedup database keeps its entries in one array, found through three
+   open-addressing indexes, by MD5 hash, by file name hash and by size.
+   Collisions are resolved by linear probing; removals move the following
+   slots of the probe sequence back, so there are no tombstones. The
+   indexes are doubled when they are more than DEDUP_INDEX_LOAD percent
+   full.
+
+   File names are stored back to back in a single buffer. Names of removed
+   entries are left in place until they make up half of the buffer, which
+   is then compacted.
+
+   Files are only hashed as far as needed to tell them from the files of
+   the same size: a file with a size of its own is not hashed at all, and
+   otherwise a hash of its first and last DEDUP_PARTIAL bytes rules out
+   most candidates before the whole file is hashed. Entries of the same
+   size are hashed as far as the new file when it arrives.
+
+   The MD5 and file name indexes have counting Bloom filters in front of
+   them, so that dedup_db_has_md5() and dedup_db_has_filehash() answer
+   most misses without taking the lock. An entry increments
+   DEDUP_FILTER_PROBES of the DEDUP_FILTER_COUNTERS counters per index
+   slot, and decrements them again when it is removed; a counter that
+   overflows stays at its maximum for good. The filters are only built
+   once they are asked, so mounting still does not look at the entries.
+   They are changed under the lock; when the indexes grow, filters of the
+   new size replace them, and the old ones are kept until the database is
+   dropped, as readers without the lock may still use them. */
+
+#define DEDUP_INDEX_MIN 1024		/* slots */
+#define DEDUP_INDEX_LOAD 70		/* percent */
+#define DEDUP_NAMES_MIN 65536		/* bytes */
+#define DEDUP_PARTIAL 65536		/* bytes at each end of a file */
+#define DEDUP_FILTER_COUNTERS 8		/* per index slot */
+#define DEDUP_FILTER_PROBES 3
+
+#define DEDUP_SIZE_UNKNOWN ((uint64_t)-1)	/* entries of older databases */
+
+#define DEDUP_LOG_ENTRY 'e'
+#define DEDUP_LOG_REMOVE 'r'
+
+#define DEDUP_NAME(dp) (dedup_database.names + (dp)->filename)
+
+static void dedup_log(char op, const dedup_t *dp, const char *filename);
+
+/** Checks if an array of the database is part of the mapped database file.
+ */
+static inline int dedup_mapped(void *ptr)
+{
+  return dedup_database.map && (char *)ptr >= (char *)dedup_database.map &&
+         (char *)ptr < (char *)dedup_database.map + dedup_database.map_size;
+}
+
+/** realloc() an array of the database, copying it out of the mapped
+ * database file if necessary.
+ * @param old Size of the array in bytes.
+ * @param size New size in bytes.
+ */
+static void *dedup_realloc(void *ptr, size_t old, size_t size)
+{
+  if (!dedup_mapped(ptr))
+    return realloc(ptr, size);
+  void *p = malloc(size);
+  if (p)
+    memcpy(p, ptr, old < size ? old : size);
+  return p;
+}
+
+static void dedup_free(void *ptr)
+{
+  if (!dedup_mapped(ptr))
+    free(ptr);
+}
+
+static inline uint32_t dedup_md5_slot(const unsigned char *md5)
+{
+  /* MD5 hashes are evenly distributed already */
+  uint32_t h;
+  memcpy(&h, md5, sizeof(h));
+  return h & dedup_database.mask;
+}
+
+static inline uint32_t dedup_name_slot(unsigned int filename_hash)
+{
+  /* gethash() has few distinct low bits for similar names, mix them */
+  uint32_t h = filename_hash * 2654435761U;
+  return (h ^ (h >> 15)) & dedup_database.mask;
+}
+
+static inline uint32_t dedup_size_slot(uint64_t size)
+{
+  uint32_t h = (uint32_t)(size ^ (size >> 32)) * 2654435761U;
+  return (h ^ (h >> 15)) & dedup_database.mask;
+}
+
+typedef struct dedup_filter {
+  struct dedup_filter *retired;	/* filter replaced by this one */
+  uint32_t mask;		/* number of counters minus one */
+  unsigned char counter[];
+} dedup_filter_t;
+
+static struct {
+  dedup_filter_t *md5;		/* NULL until asked for */
+  dedup_filter_t *name;
+} dedup_filters;
+
+/** Counters of a filter an MD5 hash or file name hash maps to; two hashes
+ * other than the one used for the index slot are combined for the probes.
+ */
+static inline void dedup_filter_md5_keys(const unsigned char *md5, uint32_t *h1, uint32_t *h2)
+{
+  memcpy(h1, md5 + 4, sizeof(*h1));
+  memcpy(h2, md5 + 8, sizeof(*h2));
+  *h2 |= 1;
+}
+
+static inline void dedup_filter_name_keys(unsigned int filename_hash, uint32_t *h1, uint32_t *h2)
+{
+  *h1 = filename_hash * 0x85ebca6bU;
+  *h1 ^= *h1 >> 13;
+  *h2 = (filename_hash ^ (filename_hash >> 16)) * 0xc2b2ae35U | 1;
+}
+
+/** Add or remove a key.
+ * @param delta 1 to add, -1 to remove.
+ */
+static void dedup_filter_update(dedup_filter_t *f, uint32_t h1, uint32_t h2, int delta)
+{
+  int i;
+  for (i = 0; i < DEDUP_FILTER_PROBES; i++) {
+    unsigned char *c = &f->counter[(h1 + i * h2) & f->mask];
+    unsigned char v = __atomic_load_n(c, __ATOMIC_RELAXED);
+    if (v == UCHAR_MAX || (delta < 0 && !v))
+      continue;
+    __atomic_store_n(c, v + delta, __ATOMIC_RELAXED);
+  }
+}
+
+/** Check for a key, may be called without the lock.
+ * @return FALSE if the key is certainly not there.
+ */
+static int dedup_filter_test(const dedup_filter_t *f, uint32_t h1, uint32_t h2)
+{
+  int i;
+  for (i = 0; i < DEDUP_FILTER_PROBES; i++) {
+    if (!__atomic_load_n(&f->counter[(h1 + i * h2) & f->mask], __ATOMIC_RELAXED))
+      return FALSE;
+  }
+  return TRUE;
+}
+
+/** Update the filters for an entry being added or removed.
+ * @param delta 1 when adding, -1 when removing.
+ */
+static void dedup_filters_update(const dedup_t *dp, int delta)
+{
+  uint32_t h1, h2;
+  if (dedup_filters.md5 && (dp->hashed & DEDUP_HASHED_FULL)) {
+    dedup_filter_md5_keys(dp->md5, &h1, &h2);
+    dedup_filter_update(dedup_filters.md5, h1, h2, delta);
+  }
+  if (dedup_filters.name) {
+    dedup_filter_name_keys(dp->filename_hash, &h1, &h2);
+    dedup_filter_update(dedup_filters.name, h1, h2, delta);
+  }
+}
+
+/** Build a filter sized for the current indexes.
+ * @param md5 TRUE for the MD5 filter, FALSE for the file name filter.
+ * @return The filter, or NULL if out of memory.
+ */
+static dedup_filter_t *dedup_filter_build(int md5)
+{
+  uint32_t slots = dedup_database.by_md5 ? dedup_database.mask + 1 : DEDUP_INDEX_MIN;
+  uint32_t counters = slots * DEDUP_FILTER_COUNTERS;
+  dedup_filter_t *f = calloc(1, sizeof(dedup_filter_t) + counters);
+  if (!f)
+    return NULL;
+  f->mask = counters - 1;
+
+  int n;
+  for (n = 0; n < dedup_database.entries; n++) {
+    dedup_t *dp = &dedup_database.entry[n];
+    uint32_t h1, h2;
+    if (md5) {
+      if (!(dp->hashed & DEDUP_HASHED_FULL))
+        continue;
+      dedup_filter_md5_keys(dp->md5, &h1, &h2);
+    }
+    else
+      dedup_filter_name_keys(dp->filename_hash, &h1, &h2);
+    dedup_filter_update(f, h1, h2, 1);
+  }
+  return f;
+}
+
+/** Put a new filter in place of an old one, which may still be in use by
+ * readers without the lock.
+ */
+static void dedup_filter_replace(dedup_filter_t **fp, dedup_filter_t *f)
+{
+  f->retired = *fp;
+  __atomic_store_n(fp, f, __ATOMIC_RELEASE);
+}
+
+/** Build the filters again for indexes of a new size. */
+static void dedup_filters_resize(void)
+{
+  dedup_filter_t *f;
+  if (dedup_filters.md5 && (f = dedup_filter_build(TRUE)))
+    dedup_filter_replace(&dedup_filters.md5, f);
+  if (dedup_filters.name && (f = dedup_filter_build(FALSE)))
+    dedup_filter_replace(&dedup_filters.name, f);
+}
+
+/** Free a filter and the ones it has replaced. */
+static void dedup_filter_free(dedup_filter_t *f)
+{
+  while (f) {
+    dedup_filter_t *retired = f->retired;
+    free(f);
+    f = retired;
+  }
+}
+
+/** Slot an entry would ideally occupy in an index.
+ * @param index dedup_database.by_md5, by_filename or by_size
+ * @param n Entry number.
+ */
+static uint32_t dedup_home(uint32_t *index, uint32_t n)
+{
+  dedup_t *dp = &dedup_database.entry[n];
+  if (index == dedup_database.by_md5)
+    return dedup_md5_slot(dp->md5);
+  if (index == dedup_database.by_size)
+    return dedup_size_slot(dp->size);
+  return dedup_name_slot(dp->filename_hash);
+}
+
+static void dedup_index_insert(uint32_t *index, uint32_t slot, uint32_t n)
+{
+  while (index[slot])
+    slot = (slot + 1) & dedup_database.mask;
+  index[slot] = n + 1;
+}
+
+/** Find the slot of an index referring to entry n.
+ * @param slot Home slot of the entry.
+ */
+static uint32_t dedup_index_find(uint32_t *index, uint32_t slot, uint32_t n)
+{
+  while (index[slot] != n + 1)
+    slot = (slot + 1) & dedup_database.mask;
+  return slot;
+}
+
+/** Empty a slot of an index, moving back entries further down the probe
+ * sequence that would otherwise no longer be found.
+ */
+static void dedup_index_remove(uint32_t *index, uint32_t slot)
+{
+  uint32_t mask = dedup_database.mask;
+  uint32_t next = slot;
+  for (;;) {
+    next = (next + 1) & mask;
+    if (!index[next])
+      break;
+    /* the entry may take the empty slot if that is not before its home */
+    uint32_t home = dedup_home(index, index[next] - 1);
+    if (((next - home) & mask) >= ((next - slot) & mask)) {
+      index[slot] = index[next];
+      slot = next;
+    }
+  }
+  index[slot] = 0;
+}
+
+static int dedup_index_resize(uint32_t size)
+{
+  uint32_t *by_md5 = calloc(size, sizeof(uint32_t));
+  uint32_t *by_filename = calloc(size, sizeof(uint32_t));
+  uint32_t *by_size = calloc(size, sizeof(uint32_t));
+  if (!by_md5 || !by_filename || !by_size) {
+    free(by_md5);
+    free(by_filename);
+    free(by_size);
+    return FAIL;
+  }
+  dedup_free(dedup_database.by_md5);
+  dedup_free(dedup_database.by_filename);
+  dedup_free(dedup_database.by_size);
+  dedup_database.by_md5 = by_md5;
+  dedup_database.by_filename = by_filename;
+  dedup_database.by_size = by_size;
+  dedup_database.mask = size - 1;
+
+  uint32_t n;
+  for (n = 0; n < dedup_database.entries; n++) {
+    if (dedup_database.entry[n].hashed & DEDUP_HASHED_FULL)
+      dedup_index_insert(by_md5, dedup_home(by_md5, n), n);
+    dedup_index_insert(by_filename, dedup_home(by_filename, n), n);
+    dedup_index_insert(by_size, dedup_home(by_size, n), n);
+  }
+  dedup_filters_resize();
+  return 0;
+}
+
+/** Drop the names of removed entries from the name buffer. */
+static void dedup_names_compact(void)
+{
+  size_t size = (dedup_database.names_used - dedup_database.names_garbage) * 2;
+  if (size < DEDUP_NAMES_MIN)
+    size = DEDUP_NAMES_MIN;
+  char *names = malloc(size);
+  if (!names)
+    return;
+
+  size_t used = 0;
+  int n;
+  for (n = 0; n < dedup_database.entries; n++) {
+    dedup_t *dp = &dedup_database.entry[n];
+    size_t len = strlen(DEDUP_NAME(dp)) + 1;
+    memcpy(names + used, DEDUP_NAME(dp), len);
+    dp->filename = used;
+    used += len;
+  }
+  dedup_free(dedup_database.names);
+  dedup_database.names = names;
+  dedup_database.names_size = size;
+  dedup_database.names_used = used;
+  dedup_database.names_garbage = 0;
+}
+
+/** Look up an entry by MD5 hash.
+ * @return Entry number, -1 if not found.
+ */
+static int dedup_find_md5(const unsigned char *md5)
+{
+  if (!dedup_database.entries)
+    return -1;
+  uint32_t slot = dedup_md5_slot(md5);
+  uint32_t n;
+  while ((n = dedup_database.by_md5[slot])) {
+    if (memcmp(md5, dedup_database.entry[n - 1].md5, 16) == 0)
+      return n - 1;
+    slot = (slot + 1) & dedup_database.mask;
+  }
+  return -1;
+}
+
+/** Look up an entry by file name.
+ * @param filename File name, NULL to match any name with the given hash.
+ * @param filename_hash File name hash.
+ * @return Entry number, -1 if not found.
+ */
+static int dedup_find_name(const char *filename, unsigned int filename_hash)
+{
+  if (!dedup_database.entries)
+    return -1;
+  uint32_t slot = dedup_name_slot(filename_hash);
+  uint32_t n;
+  while ((n = dedup_database.by_filename[slot])) {
+    dedup_t *dp = &dedup_database.entry[n - 1];
+    if (dp->filename_hash == filename_hash &&
+        (!filename || !strcmp(filename, DEDUP_NAME(dp))))
+      return n - 1;
+    slot = (slot + 1) & dedup_database.mask;
+  }
+  return -1;
+}
+
+/** Remove an entry from the dedup database.
+ * The last entry is moved into its place to keep the array dense.
+ * @param n Entry number.
+ */
+static void dedup_remove(uint32_t n)
+{
+  dedup_t *dp = &dedup_database.entry[n];
+  uint32_t last = dedup_database.entries - 1;
+  /* stays valid until the name buffer is compacted */
+  const char *filename = DEDUP_NAME(dp);
+
+  if (dp->hashed & DEDUP_HASHED_FULL)
+    dedup_index_remove(dedup_database.by_md5,
+                       dedup_index_find(dedup_database.by_md5, dedup_md5_slot(dp->md5), n));
+  dedup_index_remove(dedup_database.by_filename,
+                     dedup_index_find(dedup_database.by_filename, dedup_name_slot(dp->filename_hash), n));
+  dedup_index_remove(dedup_database.by_size,
+                     dedup_index_find(dedup_database.by_size, dedup_size_slot(dp->size), n));
+  dedup_filters_update(dp, -1);
+  dedup_database.names_garbage += strlen(filename) + 1;
+
+  if (n != last) {
+    dedup_t *lp = &dedup_database.entry[last];
+    if (lp->hashed & DEDUP_HASHED_FULL)
+      dedup_database.by_md5[dedup_index_find(dedup_database.by_md5, dedup_md5_slot(lp->md5), last)] = n + 1;
+    dedup_database.by_filename[dedup_index_find(dedup_database.by_filename, dedup_name_slot(lp->filename_hash), last)] = n + 1;
+    dedup_database.by_size[dedup_index_find(dedup_database.by_size, dedup_size_slot(lp->size), last)] = n + 1;
+    *dp = *lp;
+  }
+  dedup_database.entries--;
+  dedup_log(DEDUP_LOG_REMOVE, NULL, filename);
+
+  if (dedup_database.names_garbage > DEDUP_NAMES_MIN &&
+      dedup_database.names_garbage * 2 > dedup_database.names_used)
+    dedup_names_compact();
+}
 
-inline DATABASE_HASH_QUEUE_T md5_to_hash(unsigned char *md5)
+/** Memory used by the dedup database.
+ * @return Size in bytes.
+ */
+size_t dedup_db_memory(void)
 {
-  return *((DATABASE_HASH_QUEUE_T *)md5);
+  size_t size = dedup_database.capacity * sizeof(dedup_t) + dedup_database.names_size;
+  if (dedup_database.by_md5)
+    size += 3 * ((size_t)dedup_database.mask + 1) * sizeof(uint32_t);
+  if (dedup_filters.md5)
+    size += (size_t)dedup_filters.md5->mask + 1;
+  if (dedup_filters.name)
+    size += (size_t)dedup_filters.name->mask + 1;
+  return size;
 }
 
-/** Add a filename/MD5 pair to the dedup database.
- * @param md5 MD5 hash
+/** Add a file to the dedup database.
+ * @param sum Size and hashes of the file; the other fields are ignored.
  * @param filename File name.
  */
-void dedup_add(unsigned char *md5, const char *filename)
+void dedup_add(const dedup_t *sum, const char *filename)
 {
-  dedup_t *dp = (dedup_t *)malloc(sizeof(dedup_t));
-  memcpy(dp->md5, md5, 16);
-  dp->filename = strdup(filename);
   int len;
-  dp->filename_hash = gethash(filename, &len);
-  list_add_tail(&dp->list_filename_hash, &dedup_database.head_filename[dp->filename_hash & DATABASE_HASH_MASK]);
-  list_add_tail(&dp->list_md5, &dedup_database.head_md5[md5_to_hash(md5)]);
-  dedup_database.entries++;
+  unsigned int hash = gethash(filename, &len);
+
+  if (dedup_database.entries == dedup_database.capacity) {
+    int capacity = dedup_database.capacity ? dedup_database.capacity * 2 : DEDUP_INDEX_MIN;
+    dedup_t *entry = dedup_realloc(dedup_database.entry,
+                                   dedup_database.capacity * sizeof(dedup_t),
+                                   capacity * sizeof(dedup_t));
+    if (!entry)
+      goto out_nomem;
+    dedup_database.entry = entry;
+    dedup_database.capacity = capacity;
+  }
+  if (!dedup_database.by_md5) {
+    if (dedup_index_resize(DEDUP_INDEX_MIN))
+      goto out_nomem;
+  }
+  else if ((uint64_t)(dedup_database.entries + 1) * 100 >
+           ((uint64_t)dedup_database.mask + 1) * DEDUP_INDEX_LOAD) {
+    if (dedup_index_resize((dedup_database.mask + 1) * 2))
+      goto out_nomem;
+  }
+  if (dedup_database.names_used + len > dedup_database.names_size) {
+    if (dedup_database.names_garbage * 2 > dedup_database.names_used)
+      dedup_names_compact();
+  }
+  if (dedup_database.names_used + len > dedup_database.names_size) {
+    size_t size = dedup_database.names_size ? dedup_database.names_size * 2 : DEDUP_NAMES_MIN;
+    while (size < dedup_database.names_used + len)
+      size *= 2;
+    char *names = dedup_realloc(dedup_database.names, dedup_database.names_used, size);
+    if (!names)
+      goto out_nomem;
+    dedup_database.names = names;
+    dedup_database.names_size = size;
+  }
+
+  uint32_t n = dedup_database.entries++;
+  dedup_t *dp = &dedup_database.entry[n];
+  *dp = *sum;
+  /* the partial hash of a small file is that of the whole file */
+  if ((dp->hashed & DEDUP_HASHED_FULL) && dp->size <= 2 * DEDUP_PARTIAL) {
+    memcpy(&dp->partial, dp->md5, sizeof(dp->partial));
+    dp->hashed |= DEDUP_HASHED_PARTIAL;
+  }
+  dp->filename_hash = hash;
+  dp->filename = dedup_database.names_used;
+  memcpy(DEDUP_NAME(dp), filename, len);
+  dedup_database.names_used += len;
+  if (dp->hashed & DEDUP_HASHED_FULL)
+    dedup_index_insert(dedup_database.by_md5, dedup_md5_slot(dp->md5), n);
+  dedup_index_insert(dedup_database.by_filename, dedup_name_slot(hash), n);
+  dedup_index_insert(dedup_database.by_size, dedup_size_slot(dp->size), n);
+  dedup_filters_update(dp, 1);
+  dedup_log(DEDUP_LOG_ENTRY, dp, filename);
+  return;
+
+out_nomem:
+  ERR_("out of memory, not adding '%s' to dedup DB", filename);
 }
 
 /** Get attribute file name.
@@ -89,238 +570,1128 @@ static int create_attr(const char *full_attr, struct stat *st)
   return 0;
 }
 
-/** Hard-link filename to a file from the dedup database with the same MD5
- * hash.
- * @param md5 file content's 128-bit MD5 hash
- * @param filename file name
- * @return target file name if file was a duplicate and could be deduped, NULL otherwise
- */
-const char *hardlink_file(unsigned char *md5, const char *filename)
-{
-  DEBUG_("looking for '%s' in md5 database", filename);
-  /* search for entry with matching MD5 hash */
-  LOCK(&dedup_database.lock);
-  dedup_t* dp;
-
-  list_for_each_entry(dp, &dedup_database.head_md5[md5_to_hash(md5)], list_md5) {
-    if (memcmp(md5, dp->md5, 16) == 0) {
-      /* Check if this entry points to the file itself. */
-      /* XXX: This is something that should not actually happen, although
-         should at worst be a performance problem. */
-      if(strcmp(filename, dp->filename) == 0) {
-        DEBUG_("second run for '%s', ignoring", filename);
-        UNLOCK(&dedup_database.lock);
-        return NULL;
-      }
+/* Attribute overlay: for each file name looked at, what its attribute file
+   says, or that it has none, so that getattr() does not have to look for
+   the attribute file every time. Most files have none, so only the
+   DEDUP_ATTRS_NEGATIVE most recently used of those are remembered, and
+   they are not saved. The attribute files themselves stay, as
+   fsck and older versions use them; everything here that changes one
+   forgets the name in the overlay, and the attribute file is looked at
+   again the next time it is needed. A change also bumps the generation, so
+   a lookup racing with it does not put back what the attribute file
+   looked like before.
 
-      DEBUG_("duping it up with the '%s' man", dp->filename);
-
-      /* We cannot just unlink the duplicate file because some filesystems
-         (Btrfs, NTFS) have severe limits on the number of hardlinks per
-         directory or per inode; we therefore create a differently-named
-         link first, and if that succeeds, we move (rename()) it over the
-         existing file. */
-      char *tmpname = malloc(strlen(filename) + sizeof(FUSECOMPRESS_PREFIX) + 17);
-      char *dn = strdup(filename);
-      char *dirn = dirname(dn);
-      char *bn = strdup(filename);
-      char *basen = basename(bn);
-      sprintf(tmpname, "%s/" FUSECOMPRESS_PREFIX "t_%s.%d", dirn, basen, getpid());
-      free(bn);
-      free(dn);
-
-      if (link(dp->filename, tmpname)) {
-        DEBUG_("linking '%s' to '%s' failed", dp->filename, tmpname);
-        free(tmpname);
-        UNLOCK(&dedup_database.lock);
-        return NULL;
-      }
-      else {
-        /* Check if we need an attribute file. */
-        struct stat st_src;
-        struct stat st_target;
-        char *full_attr = fuseattr_name(filename);
-        /* try any existing attribute file first */
-        /* no need to merge the stats of the real and the attr file here
-           because all attributes we look at here are in the attribute
-           file; we don't look at size and stuff */
-        if (lstat(full_attr, &st_src) < 0) {
-          if (lstat(filename, &st_src) < 0) {
-            ERR_("failed to stat '%s'", filename);
-          }
-        }
-        if (lstat(tmpname, &st_target) < 0) {
-          ERR_("failed to stat '%s'", filename);
-        }
-        DEBUG_("'%s // %s' mtime %zd/%zd uid %d gid %d mode %d, '%s' mtime %zd/%zd uid %d gid %d mode %d", filename, full_attr,
-               st_src.st_mtim.tv_sec, st_src.st_mtim.tv_nsec, st_src.st_uid, st_src.st_gid, st_src.st_mode,
-               tmpname, st_target.st_mtim.tv_sec, st_target.st_mtim.tv_nsec, st_target.st_uid, st_target.st_gid, st_target.st_mode);
-        if (st_src.st_uid != st_target.st_uid ||
-            st_src.st_gid != st_target.st_gid ||
-            st_src.st_mode != st_target.st_mode ||
-#ifdef EXACT_ATIME
-            st_src.st_atim.tv_sec != st_target.st_atim.tv_sec ||
-            st_src.st_atim.tv_nsec != st_target.st_atim.tv_nsec ||
-#endif
-            st_src.st_mtim.tv_sec != st_target.st_mtim.tv_sec ||
-            st_src.st_mtim.tv_nsec != st_target.st_mtim.tv_nsec) {
-          create_attr(full_attr, &st_src);
-        }
-        else {
-          /* no attribute file needed, remove it if present */
-          unlink(full_attr);
-        }
-        free(full_attr);
-
-        /* Try to move the link over the original file. */
-        if (rename(tmpname, filename)) {
-          DEBUG_("renaming hardlink from '%s' to '%s' failed", tmpname, filename);
-          if (unlink(tmpname)) {
-            ERR_("failed to delete link");
-          }
-          free(tmpname);
-          UNLOCK(&dedup_database.lock);
-          return NULL;
-        }
-        /* If filename and tmpname are the same inode already, rename() will
-           succeed without removing tmpname, so we better do it ourselves.
-           This happens frequently if redup is enabled. */
-        unlink(tmpname);
-        free(tmpname);
+   At unmount the overlay is written to DEDUP_ATTRS_FILE next to the
+   database file, and the next mount reads it back if the database file is
+   still the same. It is removed once read, so it never outlives a crash.
+   Like the database, it does not notice attribute files changed while the
+   filesystem is not mounted. */
 
-        UNLOCK(&dedup_database.lock);
-        return dp->filename;
-      }
+#define DEDUP_ATTRS_MIN 1024		/* hash chains */
+#define DEDUP_ATTRS_NEGATIVE 65536	/* entries without attribute file */
+#define DEDUP_ATTRS_MAGIC "DEDUPATR"
+#define DEDUP_ATTRS_MAGIC_SIZE (sizeof(DEDUP_ATTRS_MAGIC) - 1)
 
-    }
+typedef struct dedup_attr {
+  struct dedup_attr *next;
+  struct list_head lru;		/* in dedup_attrs.negative unless present */
+  unsigned int filename_hash;
+  int present;			/* FALSE if there is no attribute file */
+  uid_t uid;
+  gid_t gid;
+  mode_t mode;
+  struct timespec atim;
+  struct timespec mtim;
+  char filename[];
+} dedup_attr_t;
+
+/* Attributes of an overlay entry in DEDUP_ATTRS_FILE */
+typedef struct {
+  int64_t atime;
+  int64_t mtime;
+  uint32_t atime_nsec;
+  uint32_t mtime_nsec;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t mode;
+} dedup_attr_image_t;
+
+#define DEDUP_ATTR_PRESENT 'p'	/* record followed by dedup_attr_image_t */
+
+static struct {
+  pthread_mutex_t lock;
+  dedup_attr_t **head;		/* hash chains */
+  uint32_t mask;		/* number of chains minus one */
+  int entries;
+  struct list_head negative;	/* entries without attribute file, most
+				   recently used first */
+  int negatives;
+  unsigned int generation;	/* bumped whenever an attribute file changes */
+} dedup_attrs = {
+  .lock = LOCK_INITIALIZER,
+  .negative = LIST_HEAD_INIT(dedup_attrs.negative),
+};
+
+static inline uint32_t dedup_attr_slot(unsigned int filename_hash)
+{
+  uint32_t h = filename_hash * 2654435761U;
+  return (h ^ (h >> 15)) & dedup_attrs.mask;
+}
+
+/** Find the overlay entry of a file.
+ * @return Pointer to the link to the entry, or NULL if there is none.
+ */
+static dedup_attr_t **dedup_attr_find(const char *filename, unsigned int filename_hash)
+{
+  NEED_LOCK(&dedup_attrs.lock);
+  if (!dedup_attrs.head)
+    return NULL;
+  dedup_attr_t **pp;
+  for (pp = &dedup_attrs.head[dedup_attr_slot(filename_hash)]; *pp; pp = &(*pp)->next) {
+    if ((*pp)->filename_hash == filename_hash && !strcmp((*pp)->filename, filename))
+      return pp;
   }
-  
-  /* If we reach this point, we haven't found any duplicate for this file,
-     so we add it as a new entry into the dedup database. */
-  DEBUG_("unique file '%s', adding to dedup DB", filename);
-  dedup_add(md5, filename);
-  UNLOCK(&dedup_database.lock);
   return NULL;
 }
 
-/** Checks if an entry matching the given MD5 hash is in the database.
- * @param md5 MD5 hash.
+/** Make an overlay entry.
+ * @param st Stats of the attribute file, or NULL if there is none.
  */
-int dedup_db_has_md5(unsigned char *md5)
+static dedup_attr_t *dedup_attr_new(const char *filename, unsigned int filename_hash,
+                                    const struct stat *st)
 {
-  dedup_t *dp;
-  list_for_each_entry(dp, &dedup_database.head_md5[md5_to_hash(md5)], list_md5) {
-    if (memcmp(md5, dp->md5, 16) == 0) {
-      return TRUE;
-    }
+  dedup_attr_t *attr = malloc(sizeof(dedup_attr_t) + strlen(filename) + 1);
+  if (!attr)
+    return NULL;
+  memset(attr, 0, sizeof(dedup_attr_t));
+  attr->filename_hash = filename_hash;
+  strcpy(attr->filename, filename);
+  if (st) {
+    attr->present = TRUE;
+    attr->uid = st->st_uid;
+    attr->gid = st->st_gid;
+    attr->mode = st->st_mode;
+    attr->atim = st->st_atim;
+    attr->mtim = st->st_mtim;
   }
-  return FALSE;
+  return attr;
 }
 
-/** Checks if an entry matching the given file name hash is in the database.
- * @param filename_hash File name hash.
+/** Free an entry that has been unlinked from its hash chain.
  */
-int dedup_db_has_filehash(unsigned int filename_hash)
+static void dedup_attr_free(dedup_attr_t *attr)
 {
-  dedup_t *dp;
-  list_for_each_entry(dp, &dedup_database.head_filename[filename_hash & DATABASE_HASH_MASK], list_filename_hash) {
-    if (dp->filename_hash == filename_hash) {
-      return TRUE;
-    }
+  NEED_LOCK(&dedup_attrs.lock);
+  if (!attr->present) {
+    list_del(&attr->lru);
+    dedup_attrs.negatives--;
   }
-  return FALSE;
+  dedup_attrs.entries--;
+  free(attr);
 }
 
-/** Calculate the MD5 hash of the decompressed data in a given file.
- * @param name File name to be hashed.
- * @param md5 16-byte buffer the MD5 hash will be written to.
+/** Add an entry to the overlay, doubling the hash chains when there are
+ * more entries than chains, and dropping the least recently used entry
+ * without attribute file when there are too many of those.
  */
-int dedup_hash_file(const char *name, unsigned char *md5)
+static void dedup_attr_insert(dedup_attr_t *attr)
 {
-  MHASH mh = mhash_init(MHASH_MD5);
-  int fd = open(name, O_RDONLY);
-  if (fd < 0)
-    return 1;
+  NEED_LOCK(&dedup_attrs.lock);
+  if (!dedup_attrs.head || dedup_attrs.entries > dedup_attrs.mask) {
+    uint32_t chains = dedup_attrs.head ? (dedup_attrs.mask + 1) * 2 : DEDUP_ATTRS_MIN;
+    dedup_attr_t **head = calloc(chains, sizeof(dedup_attr_t *));
+    if (head) {
+      dedup_attr_t **old = dedup_attrs.head;
+      uint32_t old_chains = old ? dedup_attrs.mask + 1 : 0;
+      uint32_t i;
+      dedup_attrs.head = head;
+      dedup_attrs.mask = chains - 1;
+      for (i = 0; i < old_chains; i++) {
+        while (old[i]) {
+          dedup_attr_t *a = old[i];
+          old[i] = a->next;
+          uint32_t slot = dedup_attr_slot(a->filename_hash);
+          a->next = head[slot];
+          head[slot] = a;
+        }
+      }
+      free(old);
+    }
+    else if (!dedup_attrs.head) {
+      /* the overlay is only a cache */
+      free(attr);
+      return;
+    }
+  }
+  uint32_t slot = dedup_attr_slot(attr->filename_hash);
+  attr->next = dedup_attrs.head[slot];
+  dedup_attrs.head[slot] = attr;
+  dedup_attrs.entries++;
 
-  /* check if this is a compressed file */
-  int compressed;
-  compressor_t *compr;
-  void *handle = NULL;
-  off_t size;
-  const unsigned char magic[] = { 037, 0135, 0211 };
-  unsigned char m[3];
-  if (read(fd, m, 3) != 3 || memcmp(magic, m, 3)) {
-    /* no magic bytes, this is an uncompressed file */
-    lseek(fd, 0, SEEK_SET);
-    compressed = FALSE;
+  if (attr->present)
+    return;
+  list_add(&attr->lru, &dedup_attrs.negative);
+  if (++dedup_attrs.negatives > DEDUP_ATTRS_NEGATIVE) {
+    dedup_attr_t *old = list_entry(dedup_attrs.negative.prev, dedup_attr_t, lru);
+    dedup_attr_t **pp = dedup_attr_find(old->filename, old->filename_hash);
+    *pp = old->next;
+    dedup_attr_free(old);
   }
-  else {
-    lseek(fd, 0, SEEK_SET);
-    compressed = TRUE;
-    if (file_read_header_fd(fd, &compr, &size) == FAIL) {
-      close(fd);
-      return 1;
-    }
-    handle = compr->open(fd, "r");
-    if (!handle) {
-      close(fd);
-      return 1;
+}
+
+/** Drop all entries of the overlay.
+ */
+static void dedup_attrs_clear(void)
+{
+  uint32_t i;
+  LOCK(&dedup_attrs.lock);
+  for (i = 0; dedup_attrs.head && i <= dedup_attrs.mask; i++) {
+    while (dedup_attrs.head[i]) {
+      dedup_attr_t *a = dedup_attrs.head[i];
+      dedup_attrs.head[i] = a->next;
+      dedup_attr_free(a);
     }
   }
+  free(dedup_attrs.head);
+  dedup_attrs.head = NULL;
+  dedup_attrs.mask = 0;
+  dedup_attrs.generation++;
+  UNLOCK(&dedup_attrs.lock);
+}
 
-  /* hash file contents */
-  int count;
-  int failed = 0;
-  char buf[4096];
-  for(;;) {
-    if (!compressed)
-      count = read(fd, buf, 4096);
+/** Get the stats of the attribute file of a file, from the overlay if it
+ * is there.
+ * @param full Full path to file.
+ * @param st_attr Set to the stats of the attribute file, if there is one;
+ *                only owner, mode and timestamps are filled in.
+ * @return TRUE if there is an attribute file, FALSE otherwise.
+ */
+static int dedup_attr_get(const char *full, struct stat *st_attr)
+{
+  int len;
+  unsigned int hash = gethash(full, &len);
+
+  LOCK(&dedup_attrs.lock);
+  dedup_attr_t **pp = dedup_attr_find(full, hash);
+  if (pp) {
+    dedup_attr_t *attr = *pp;
+    int present = attr->present;
+    if (!present)
+      list_move(&attr->lru, &dedup_attrs.negative);
     else {
-      count = compr->read(handle, buf, 4096);
-    }
-    if (count < 0) {
-      DEBUG_("read failed on '%s' while deduping", name);
-      failed = 1;
-      break;
+      memset(st_attr, 0, sizeof(struct stat));
+      st_attr->st_uid = attr->uid;
+      st_attr->st_gid = attr->gid;
+      st_attr->st_mode = attr->mode;
+      st_attr->st_atim = attr->atim;
+      st_attr->st_mtim = attr->mtim;
     }
-    if (count == 0)
-      break;
-    mhash(mh, buf, count);
-    /* XXX: It would be good for performance to occasionally check
-       file->status & CANCEL. */
+    UNLOCK(&dedup_attrs.lock);
+    return present;
   }
+  unsigned int generation = dedup_attrs.generation;
+  UNLOCK(&dedup_attrs.lock);
 
-  mhash_deinit(mh, md5);
-  DEBUG_("hashed %s to %02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X",
-         name, md5[0], md5[1], md5[2], md5[3], md5[4], md5[5], md5[6], md5[7], md5[8], md5[9], md5[10], md5[11], md5[12], md5[13], md5[14], md5[15]);
+  char *full_attr = fuseattr_name(full);
+  int present = lstat(full_attr, st_attr) == 0;
+  free(full_attr);
 
-  if (compressed)
-    compr->close(handle);
+  dedup_attr_t *attr = dedup_attr_new(full, hash, present ? st_attr : NULL);
+  if (!attr)
+    return present;
+  LOCK(&dedup_attrs.lock);
+  /* if an attribute file has changed in the meantime, st_attr may be
+     stale */
+  if (generation == dedup_attrs.generation && !dedup_attr_find(full, hash))
+    dedup_attr_insert(attr);
   else
-    close(fd);
+    free(attr);
+  UNLOCK(&dedup_attrs.lock);
+  return present;
+}
 
-  return failed;
+/** Forget what the overlay knows about the attribute file of a file; to be
+ * called whenever it is changed.
+ * @param full Full path to file.
+ */
+static void dedup_attr_forget(const char *full)
+{
+  int len;
+  unsigned int hash = gethash(full, &len);
+
+  LOCK(&dedup_attrs.lock);
+  dedup_attrs.generation++;
+  dedup_attr_t **pp = dedup_attr_find(full, hash);
+  if (pp) {
+    dedup_attr_t *attr = *pp;
+    *pp = attr->next;
+    dedup_attr_free(attr);
+  }
+  UNLOCK(&dedup_attrs.lock);
 }
 
-/** Attempt deduplication of file.
- * @param file File to be deduplicated.
+/** Forget what the overlay knows about the files in a directory and its
+ * subdirectories, which have been moved away.
+ * @param dir Full path to directory.
  */
-void do_dedup(file_t *file)
+static void dedup_attr_forget_dir(const char *dir)
 {
-  NEED_LOCK(&file->lock);
-  STAT_(STAT_DO_DEDUP);
-  
-  file->status |= DEDUPING;
-  /* No need to keep the file under lock while calculating the hash; should
-     it change in the meantime, we will be informed through file->status. */
-  UNLOCK(&file->lock);
-  
-  /* Calculate MD5 hash. */
-  unsigned char md5[16];
-  int failed = dedup_hash_file(file->filename, md5);
-  
-  /* See if everything went fine. */
-  LOCK(&file->lock);
+  size_t len = strlen(dir);
+  uint32_t i;
+
+  LOCK(&dedup_attrs.lock);
+  dedup_attrs.generation++;
+  for (i = 0; dedup_attrs.head && i <= dedup_attrs.mask; i++) {
+    dedup_attr_t **pp = &dedup_attrs.head[i];
+    while (*pp) {
+      dedup_attr_t *attr = *pp;
+      if (!strncmp(attr->filename, dir, len) && attr->filename[len] == '/') {
+        *pp = attr->next;
+        dedup_attr_free(attr);
+      }
+      else
+        pp = &attr->next;
+    }
+  }
+  UNLOCK(&dedup_attrs.lock);
+}
+
+/* Set once cloning has failed in a way that shows the backing filesystem
+   cannot do it, protected by dedup_database.lock */
+static int dedup_reflink_unsupported = FALSE;
+
+/** Replace a file by a clone of another one that shares its data blocks
+ * but has an inode of its own, so the file keeps its attributes and is
+ * copied on write by the backing filesystem.
+ * @param source File to clone.
+ * @param filename File to replace.
+ * @param tmpname Name for the clone until it replaces filename.
+ * @return 0 on success, 1 if the file has to be hard-linked instead, -1 on
+ *         failure.
+ */
+static int reflink_file(const char *source, const char *filename, const char *tmpname)
+{
+#ifdef FICLONE
+  NEED_LOCK(&dedup_database.lock);
+  if (!dedup_reflink || dedup_reflink_unsupported)
+    return 1;
+
+  /* a deduplicated file has its attributes in the attribute file */
+  struct stat st;
+  char *full_attr = fuseattr_name(filename);
+  if (!dedup_attr_get(filename, &st) && lstat(filename, &st) < 0) {
+    free(full_attr);
+    return -1;
+  }
+
+  int fd_src = open(source, O_RDONLY);
+  if (fd_src < 0) {
+    free(full_attr);
+    return -1;
+  }
+  int fd = open(tmpname, O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 07777);
+  if (fd < 0) {
+    close(fd_src);
+    free(full_attr);
+    return -1;
+  }
+  if (ioctl(fd, FICLONE, fd_src) < 0) {
+    int err = errno;
+    DEBUG_("cloning '%s' to '%s' failed: %s", source, tmpname, strerror(err));
+    if (err == EOPNOTSUPP || err == ENOTTY || err == ENOSYS) {
+      INFO_("backing filesystem cannot clone files, deduplicating with hardlinks");
+      dedup_reflink_unsupported = TRUE;
+    }
+    close(fd);
+    close(fd_src);
+    unlink(tmpname);
+    free(full_attr);
+    /* other errors may only concern these files */
+    return 1;
+  }
+  close(fd_src);
+
+  /* owner and permissions may fail on some backing filesystems, just as
+     for attribute files */
+  fchown(fd, st.st_uid, st.st_gid);
+  fchmod(fd, st.st_mode & 07777);
+  struct timespec ts[2];
+  ts[0] = st.st_atim;
+  ts[1] = st.st_mtim;
+  futimens(fd, ts);
+  if (close(fd) < 0 || rename(tmpname, filename)) {
+    DEBUG_("replacing '%s' by clone '%s' failed", filename, tmpname);
+    unlink(tmpname);
+    free(full_attr);
+    return -1;
+  }
+  unlink(full_attr);
+  dedup_attr_forget(filename);
+  free(full_attr);
+  return 0;
+#else
+  return 1;
+#endif
+}
+
+/** Hard-link filename to a file from the dedup database with the same
+ * contents.
+ * @param sum size and hashes of the file, see dedup_prefilter()
+ * @param filename file name
+ * @param target file found by dedup_match(), or NULL
+ * @return TRUE if file was a duplicate and could be deduped, FALSE otherwise
+ */
+int hardlink_file(const dedup_t *sum, const char *filename, const char *target)
+{
+  DEBUG_("looking for '%s' in md5 database", filename);
+  /* search for entry with matching hash */
+  LOCK(&dedup_database.lock);
+  int n = (sum->hashed & DEDUP_HASHED_FULL) ? dedup_find_md5(sum->md5) : -1;
+
+  if (n >= 0) {
+    dedup_t *dp = &dedup_database.entry[n];
+    /* The entry may point to the file itself, have the same hash but
+       different contents, or have changed since dedup_match(). */
+    /* XXX: The first is something that should not actually happen,
+       although should at worst be a performance problem. */
+    if (!target || strcmp(target, DEDUP_NAME(dp)) != 0) {
+      DEBUG_("no match for '%s' in '%s', ignoring", filename, DEDUP_NAME(dp));
+      UNLOCK(&dedup_database.lock);
+      return FALSE;
+    }
+
+    DEBUG_("duping it up with the '%s' man", DEDUP_NAME(dp));
+
+    /* We cannot just unlink the duplicate file because some filesystems
+       (Btrfs, NTFS) have severe limits on the number of hardlinks per
+       directory or per inode; we therefore create a differently-named
+       link first, and if that succeeds, we move (rename()) it over the
+       existing file. */
+    char *tmpname = malloc(strlen(filename) + sizeof(FUSECOMPRESS_PREFIX) + 17);
+    char *dn = strdup(filename);
+    char *dirn = dirname(dn);
+    char *bn = strdup(filename);
+    char *basen = basename(bn);
+    sprintf(tmpname, "%s/" FUSECOMPRESS_PREFIX "t_%s.%d", dirn, basen, getpid());
+    free(bn);
+    free(dn);
+
+    /* With dedup_reflink, filesystems that can clone files share the
+       data without the attribute files and the copy on the first write
+       that hardlinks need. */
+    int res = reflink_file(DEDUP_NAME(dp), filename, tmpname);
+    if (res <= 0) {
+      free(tmpname);
+      UNLOCK(&dedup_database.lock);
+      return res == 0;
+    }
+
+    if (link(DEDUP_NAME(dp), tmpname)) {
+      DEBUG_("linking '%s' to '%s' failed", DEDUP_NAME(dp), tmpname);
+      free(tmpname);
+      UNLOCK(&dedup_database.lock);
+      return FALSE;
+    }
+    else {
+      /* Check if we need an attribute file. */
+      struct stat st_src;
+      struct stat st_target;
+      char *full_attr = fuseattr_name(filename);
+      /* try any existing attribute file first */
+      /* no need to merge the stats of the real and the attr file here
+         because all attributes we look at here are in the attribute
+         file; we don't look at size and stuff */
+      if (!dedup_attr_get(filename, &st_src)) {
+        if (lstat(filename, &st_src) < 0) {
+          ERR_("failed to stat '%s'", filename);
+        }
+      }
+      if (lstat(tmpname, &st_target) < 0) {
+        ERR_("failed to stat '%s'", filename);
+      }
+      DEBUG_("'%s // %s' mtime %zd/%zd uid %d gid %d mode %d, '%s' mtime %zd/%zd uid %d gid %d mode %d", filename, full_attr,
+             st_src.st_mtim.tv_sec, st_src.st_mtim.tv_nsec, st_src.st_uid, st_src.st_gid, st_src.st_mode,
+             tmpname, st_target.st_mtim.tv_sec, st_target.st_mtim.tv_nsec, st_target.st_uid, st_target.st_gid, st_target.st_mode);
+      if (st_src.st_uid != st_target.st_uid ||
+          st_src.st_gid != st_target.st_gid ||
+          st_src.st_mode != st_target.st_mode ||
+#ifdef EXACT_ATIME
+          st_src.st_atim.tv_sec != st_target.st_atim.tv_sec ||
+          st_src.st_atim.tv_nsec != st_target.st_atim.tv_nsec ||
+#endif
+          st_src.st_mtim.tv_sec != st_target.st_mtim.tv_sec ||
+          st_src.st_mtim.tv_nsec != st_target.st_mtim.tv_nsec) {
+        create_attr(full_attr, &st_src);
+      }
+      else {
+        /* no attribute file needed, remove it if present */
+        unlink(full_attr);
+      }
+      dedup_attr_forget(filename);
+      free(full_attr);
+
+      /* Try to move the link over the original file. */
+      if (rename(tmpname, filename)) {
+        DEBUG_("renaming hardlink from '%s' to '%s' failed", tmpname, filename);
+        if (unlink(tmpname)) {
+          ERR_("failed to delete link");
+        }
+        free(tmpname);
+        UNLOCK(&dedup_database.lock);
+        return FALSE;
+      }
+      /* If filename and tmpname are the same inode already, rename() will
+         succeed without removing tmpname, so we better do it ourselves.
+         This happens frequently if redup is enabled. */
+      unlink(tmpname);
+      free(tmpname);
+
+      UNLOCK(&dedup_database.lock);
+      return TRUE;
+    }
+  }
+  
+  /* If we reach this point, we haven't found any duplicate for this file,
+     so we add it as a new entry into the dedup database. */
+  DEBUG_("unique file '%s', adding to dedup DB", filename);
+  dedup_add(sum, filename);
+  UNLOCK(&dedup_database.lock);
+  return FALSE;
+}
+
+/** Checks if an entry matching the given MD5 hash is in the database.
+ * @param md5 MD5 hash.
+ */
+int dedup_db_has_md5(unsigned char *md5)
+{
+  uint32_t h1, h2;
+  dedup_filter_md5_keys(md5, &h1, &h2);
+  dedup_filter_t *f = __atomic_load_n(&dedup_filters.md5, __ATOMIC_ACQUIRE);
+  if (f && !dedup_filter_test(f, h1, h2))
+    return FALSE;
+
+  LOCK(&dedup_database.lock);
+  if (!dedup_filters.md5 && (f = dedup_filter_build(TRUE)))
+    dedup_filter_replace(&dedup_filters.md5, f);
+  int found = dedup_find_md5(md5) >= 0;
+  UNLOCK(&dedup_database.lock);
+  return found;
+}
+
+/** Checks if an entry matching the given file name hash is in the database.
+ * @param filename_hash File name hash.
+ */
+int dedup_db_has_filehash(unsigned int filename_hash)
+{
+  uint32_t h1, h2;
+  dedup_filter_name_keys(filename_hash, &h1, &h2);
+  dedup_filter_t *f = __atomic_load_n(&dedup_filters.name, __ATOMIC_ACQUIRE);
+  if (f && !dedup_filter_test(f, h1, h2))
+    return FALSE;
+
+  LOCK(&dedup_database.lock);
+  if (!dedup_filters.name && (f = dedup_filter_build(FALSE)))
+    dedup_filter_replace(&dedup_filters.name, f);
+  int found = dedup_find_name(NULL, filename_hash) >= 0;
+  UNLOCK(&dedup_database.lock);
+  return found;
+}
+
+#define DEDUP_BUF_SIZE 65536
+#define DEDUP_BATCH_BUF_SIZE (1024 * 1024)	/* for files hashed in a batch */
+
+/* Decompressed contents of a file. */
+typedef struct {
+  int fd;
+  compressor_t *compr;	/* NULL if the file is not compressed */
+  void *handle;
+} dedup_stream_t;
+
+/** Open a file for reading its decompressed contents.
+ * @return 0 on success, 1 on failure.
+ */
+static int dedup_open(const char *name, dedup_stream_t *s)
+{
+  s->fd = open(name, O_RDONLY);
+  if (s->fd < 0)
+    return 1;
+
+  /* check if this is a compressed file */
+  off_t size;
+  const unsigned char magic[] = { 037, 0135, 0211 };
+  unsigned char m[3];
+  s->compr = NULL;
+  if (read(s->fd, m, 3) != 3 || memcmp(magic, m, 3)) {
+    /* no magic bytes, this is an uncompressed file */
+    lseek(s->fd, 0, SEEK_SET);
+    return 0;
+  }
+  lseek(s->fd, 0, SEEK_SET);
+  if (file_read_header_fd(s->fd, &s->compr, &size) == FAIL) {
+    close(s->fd);
+    return 1;
+  }
+  s->handle = s->compr->open(s->fd, "r");
+  if (!s->handle) {
+    close(s->fd);
+    return 1;
+  }
+  return 0;
+}
+
+/** Read decompressed data, filling the buffer unless the end of the file is
+ * reached.
+ * @return Number of bytes read, -1 on failure.
+ */
+static int dedup_read(dedup_stream_t *s, char *buf, int len)
+{
+  int done = 0;
+  while (done < len) {
+    int count;
+    if (!s->compr)
+      count = read(s->fd, buf + done, len - done);
+    else
+      count = s->compr->read(s->handle, buf + done, len - done);
+    if (count < 0)
+      return -1;
+    if (count == 0)
+      break;
+    done += count;
+  }
+  return done;
+}
+
+static void dedup_close(dedup_stream_t *s)
+{
+  if (s->compr)
+    s->compr->close(s->handle);
+  else
+    close(s->fd);
+}
+
+/** Set the partial hash from the first and last DEDUP_PARTIAL bytes of a
+ * file larger than twice that.
+ * @param split The last bytes are tail + split up to the end of tail,
+ *              followed by tail up to tail + split.
+ */
+static void dedup_sum_partial(dedup_t *sum, const char *head, const char *tail, int split)
+{
+  unsigned char digest[DIGEST_SIZE];
+  void *ctx = dedup_digest->init();
+  if (!ctx)
+    return;
+  dedup_digest->update(ctx, head, DEDUP_PARTIAL);
+  dedup_digest->update(ctx, tail + split, DEDUP_PARTIAL - split);
+  dedup_digest->update(ctx, tail, split);
+  dedup_digest->final(ctx, digest);
+  memcpy(&sum->partial, digest, sizeof(sum->partial));
+  sum->hashed |= DEDUP_HASHED_PARTIAL;
+}
+
+/* Full and partial hash of data passed in order, made while a file is
+   read or written for another reason. The ends of the data kept for the
+   partial hash grow with the data seen, and are freed once the hash is
+   finished; only the result is kept until the file changes. */
+struct dedup_hasher {
+  void *ctx;		/* digest context, NULL once finished */
+  uint64_t total;	/* bytes hashed so far */
+  char *head;		/* the first bytes, up to DEDUP_PARTIAL */
+  size_t head_size;	/* bytes allocated for head */
+  char *tail;		/* the last bytes past the head, ending at
+			   total % DEDUP_PARTIAL; NULL until there are any */
+  int nomem;		/* set if the ends could not be kept */
+  dedup_t sum;		/* the result, once finished */
+  unsigned int version;	/* file->version the result is valid for */
+};
+
+#define DEDUP_HEAD_MIN 4096	/* bytes first allocated for the head */
+
+static dedup_hasher_t *dedup_hasher_new(void)
+{
+  dedup_hasher_t *h = calloc(1, sizeof(dedup_hasher_t));
+  if (!h)
+    return NULL;
+  h->ctx = dedup_digest->init();
+  if (!h->ctx) {
+    free(h);
+    return NULL;
+  }
+  return h;
+}
+
+static void dedup_hasher_free_ends(dedup_hasher_t *h)
+{
+  free(h->head);
+  free(h->tail);
+  h->head = h->tail = NULL;
+  h->head_size = 0;
+}
+
+static void dedup_hasher_update(dedup_hasher_t *h, const char *buf, size_t len)
+{
+  dedup_digest->update(h->ctx, buf, len);
+  if (h->total < DEDUP_PARTIAL) {
+    size_t n = len < DEDUP_PARTIAL - h->total ? len : DEDUP_PARTIAL - h->total;
+    if (h->total + n > h->head_size && !h->nomem) {
+      size_t size = h->head_size ? h->head_size : DEDUP_HEAD_MIN;
+      while (size < h->total + n)
+        size *= 2;
+      if (size > DEDUP_PARTIAL)
+        size = DEDUP_PARTIAL;
+      char *head = realloc(h->head, size);
+      if (head) {
+        h->head = head;
+        h->head_size = size;
+      }
+      else
+        h->nomem = 1;
+    }
+    if (!h->nomem)
+      memcpy(h->head + h->total, buf, n);
+    buf += n;
+    len -= n;
+    h->total += n;
+  }
+  if (!len)
+    return;
+  if (!h->tail && !h->nomem) {
+    h->tail = malloc(DEDUP_PARTIAL);
+    if (!h->tail)
+      h->nomem = 1;
+  }
+  /* only the last DEDUP_PARTIAL bytes of buf can end up in the tail */
+  size_t skip = len > DEDUP_PARTIAL ? len - DEDUP_PARTIAL : 0;
+  size_t pos = (h->total + skip) % DEDUP_PARTIAL;
+  buf += skip;
+  len -= skip;
+  h->total += skip;
+  while (len) {
+    size_t n = len < DEDUP_PARTIAL - pos ? len : DEDUP_PARTIAL - pos;
+    if (!h->nomem)
+      memcpy(h->tail + pos, buf, n);
+    buf += n;
+    len -= n;
+    h->total += n;
+    pos = 0;
+  }
+}
+
+/** Finish the hashes, setting h->sum, and free the ends of the data. */
+static void dedup_hasher_final(dedup_hasher_t *h)
+{
+  dedup_t *sum = &h->sum;
+  dedup_digest->final(h->ctx, sum->md5);
+  h->ctx = NULL;
+  sum->size = h->total;
+  sum->hashed = DEDUP_HASHED_FULL;
+  if (h->total <= 2 * DEDUP_PARTIAL) {
+    memcpy(&sum->partial, sum->md5, sizeof(sum->partial));
+    sum->hashed |= DEDUP_HASHED_PARTIAL;
+  }
+  else if (!h->nomem)
+    dedup_sum_partial(sum, h->head, h->tail, h->total % DEDUP_PARTIAL);
+  dedup_hasher_free_ends(h);
+}
+
+static void dedup_hasher_free(dedup_hasher_t *h)
+{
+  if (!h)
+    return;
+  if (h->ctx) {
+    unsigned char digest[DIGEST_SIZE];
+    dedup_digest->final(h->ctx, digest);
+  }
+  dedup_hasher_free_ends(h);
+  free(h);
+}
+
+/** Start hashing the data of a file as it is passed to dedup_hash_update(),
+ * replacing any hash made before.
+ * @param file File whose data is read or written from the beginning.
+ */
+void dedup_hash_start(file_t *file)
+{
+  NEED_LOCK(&file->lock);
+  dedup_hasher_free(file->hasher);
+  file->hasher = dedup_hasher_new();
+}
+
+/** Hash the next bytes of the file started with dedup_hash_start().
+ * This is called without the file lock, so only the thread that has
+ * started the hash may call it.
+ */
+void dedup_hash_update(file_t *file, const void *buf, size_t len)
+{
+  dedup_hasher_t *h = file->hasher;
+  if (h && h->ctx)
+    dedup_hasher_update(h, buf, len);
+}
+
+/** Finish the hash started with dedup_hash_start(), keeping it for
+ * do_dedup() until the file changes.
+ * @param size Size of the file, the hash is dropped if it doesn't cover
+ *             all of it.
+ */
+void dedup_hash_finish(file_t *file, off_t size)
+{
+  NEED_LOCK(&file->lock);
+  dedup_hasher_t *h = file->hasher;
+  if (!h || !h->ctx)
+    return;
+  if (h->total != size) {
+    dedup_hash_drop(file);
+    return;
+  }
+  dedup_hasher_final(h);
+  h->version = file->version;
+  DEBUG_("hashed '%s' in passing", file->filename);
+}
+
+/** Drop the hash of a file made in passing.
+ */
+void dedup_hash_drop(file_t *file)
+{
+  NEED_LOCK(&file->lock);
+  dedup_hasher_free(file->hasher);
+  file->hasher = NULL;
+}
+
+/** Take the hash of a file made in passing, if it is still valid.
+ * @param sum Set to the size and hashes of the file.
+ * @return TRUE if there was a valid hash.
+ */
+static int dedup_hash_take(file_t *file, dedup_t *sum)
+{
+  NEED_LOCK(&file->lock);
+  dedup_hasher_t *h = file->hasher;
+  int valid = h && !h->ctx && h->version == file->version;
+  if (valid)
+    *sum = h->sum;
+  dedup_hash_drop(file);
+  return valid;
+}
+
+/** Hash the decompressed data in a given file.
+ * Unless full is set, only the first and last DEDUP_PARTIAL bytes of an
+ * uncompressed file are read. Compressed files cannot be read from the
+ * end, so they are always hashed completely, as are small files, whose
+ * partial hash is that of the whole file.
+ * @param name File name to be hashed.
+ * @param sum Its size must be set, or DEDUP_SIZE_UNKNOWN; the hashes made
+ *            are set and added to its hashed flags.
+ * @param full TRUE if the full hash is needed.
+ * @param bufsize Bytes read at a time for the full hash.
+ * @return 0 on success, 1 on failure.
+ */
+static int dedup_hash_sum_buf(const char *name, dedup_t *sum, int full, int bufsize)
+{
+  dedup_stream_t s;
+  if (dedup_open(name, &s))
+    return 1;
+  char *buf = malloc(bufsize);
+  dedup_hasher_t *h = NULL;
+  int failed = 1;
+  if (!buf)
+    goto out;
+
+  if (!full && !s.compr && sum->size != DEDUP_SIZE_UNKNOWN &&
+      sum->size > 2 * DEDUP_PARTIAL) {
+    char *ends = malloc(2 * DEDUP_PARTIAL);
+    if (ends &&
+        dedup_read(&s, ends, DEDUP_PARTIAL) == DEDUP_PARTIAL &&
+        lseek(s.fd, sum->size - DEDUP_PARTIAL, SEEK_SET) >= 0 &&
+        dedup_read(&s, ends + DEDUP_PARTIAL, DEDUP_PARTIAL) == DEDUP_PARTIAL) {
+      throttle_io(2 * DEDUP_PARTIAL);
+      dedup_sum_partial(sum, ends, ends + DEDUP_PARTIAL, 0);
+      failed = !(sum->hashed & DEDUP_HASHED_PARTIAL);
+    }
+    free(ends);
+    goto out;
+  }
+
+  h = dedup_hasher_new();
+  if (!h)
+    goto out;
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(s.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  /* hash file contents */
+  int count;
+  for(;;) {
+    count = dedup_read(&s, buf, bufsize);
+    if (count < 0) {
+      DEBUG_("read failed on '%s' while deduping", name);
+      break;
+    }
+    if (count == 0)
+      break;
+    dedup_hasher_update(h, buf, count);
+    throttle_io(count);
+    /* XXX: It would be good for performance to occasionally check
+       file->status & CANCEL. */
+  }
+  if (count < 0 || (sum->size != DEDUP_SIZE_UNKNOWN && h->total != sum->size))
+    goto out;
+  dedup_hasher_final(h);
+  memcpy(sum->md5, h->sum.md5, DIGEST_SIZE);
+  sum->partial = h->sum.partial;
+  sum->size = h->sum.size;
+  sum->hashed |= h->sum.hashed;
+  DEBUG_("hashed %s to %02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X",
+         name, sum->md5[0], sum->md5[1], sum->md5[2], sum->md5[3], sum->md5[4], sum->md5[5], sum->md5[6], sum->md5[7],
+         sum->md5[8], sum->md5[9], sum->md5[10], sum->md5[11], sum->md5[12], sum->md5[13], sum->md5[14], sum->md5[15]);
+  failed = 0;
+
+out:
+  dedup_hasher_free(h);
+  free(buf);
+  dedup_close(&s);
+  return failed;
+}
+
+static int dedup_hash_sum(const char *name, dedup_t *sum, int full)
+{
+  return dedup_hash_sum_buf(name, sum, full, DEDUP_BUF_SIZE);
+}
+
+/** Calculate the hash of the decompressed data in a given file.
+ * @param name File name to be hashed.
+ * @param md5 DIGEST_SIZE-byte buffer the hash will be written to.
+ */
+int dedup_hash_file(const char *name, unsigned char *md5)
+{
+  dedup_t sum;
+  memset(&sum, 0, sizeof(sum));
+  sum.size = DEDUP_SIZE_UNKNOWN;
+  int failed = dedup_hash_sum(name, &sum, TRUE);
+  memcpy(md5, sum.md5, DIGEST_SIZE);
+  return failed;
+}
+
+/** Size of the decompressed data in a given file.
+ * @return Size in bytes, -1 on failure.
+ */
+static off_t dedup_file_size(const char *name)
+{
+  compressor_t *compr = NULL;
+  off_t size;
+  struct stat st;
+  if (lstat(name, &st) < 0)
+    return -1;
+  if (file_read_header_name(name, &compr, &size) == FAIL)
+    return -1;
+  return compr ? size : st.st_size;
+}
+
+/** Compare the decompressed data of two files.
+ * @return TRUE if the contents are the same.
+ */
+static int dedup_same_content(const char *name1, const char *name2)
+{
+  dedup_stream_t s1, s2;
+  if (dedup_open(name1, &s1))
+    return FALSE;
+  if (dedup_open(name2, &s2)) {
+    dedup_close(&s1);
+    return FALSE;
+  }
+  char *buf1 = malloc(DEDUP_BUF_SIZE);
+  char *buf2 = malloc(DEDUP_BUF_SIZE);
+  int same = buf1 && buf2;
+  while (same) {
+    int count1 = dedup_read(&s1, buf1, DEDUP_BUF_SIZE);
+    int count2 = dedup_read(&s2, buf2, DEDUP_BUF_SIZE);
+    if (count1 < 0 || count1 != count2 || memcmp(buf1, buf2, count1))
+      same = FALSE;
+    else if (count1 == 0)
+      break;
+    throttle_io(count1 + count2);
+  }
+  free(buf1);
+  free(buf2);
+  dedup_close(&s1);
+  dedup_close(&s2);
+  return same;
+}
+
+/** Find a file with the same contents in the dedup database.
+ * If the hash is not collision resistant, the contents are compared, so
+ * this should not be called with any locks held.
+ * @param md5 Hash of the file as calculated by dedup_hash_file().
+ * @param filename File name.
+ * @return Name of the file to be passed to hardlink_file(), must be freed
+ *         by the caller; NULL if there is none.
+ */
+char *dedup_match(unsigned char *md5, const char *filename)
+{
+  LOCK(&dedup_database.lock);
+  int n = dedup_find_md5(md5);
+  char *target = n >= 0 ? strdup(DEDUP_NAME(&dedup_database.entry[n])) : NULL;
+  UNLOCK(&dedup_database.lock);
+
+  if (!target || !strcmp(target, filename)) {
+    free(target);
+    return NULL;
+  }
+  if (dedup_digest->verify && !dedup_same_content(filename, target)) {
+    WARN_("'%s' and '%s' have the same hash but different contents", filename, target);
+    free(target);
+    return NULL;
+  }
+  return target;
+}
+
+/** Look at the other entries with the size of a file.
+ * @param filename File name, its own entry is skipped.
+ * @param sum Size, and partial hash if match is set.
+ * @param match FALSE to collect the names of the entries without a partial
+ *              hash, TRUE for those with the partial hash of sum but no
+ *              full hash.
+ * @param names Set to a malloc()ed array of the names collected, to be
+ *              freed by dedup_hash_entries().
+ * @param count Set to the number of names collected.
+ * @return Number of entries of that size, with match set only those with
+ *         the same partial hash.
+ */
+static int dedup_group(const char *filename, const dedup_t *sum, int match,
+                       char ***names, int *count)
+{
+  int found = 0;
+  int size = 0;
+  *names = NULL;
+  *count = 0;
+
+  LOCK(&dedup_database.lock);
+  if (!dedup_database.entries) {
+    UNLOCK(&dedup_database.lock);
+    return 0;
+  }
+  uint32_t slot = dedup_size_slot(sum->size);
+  uint32_t n;
+  for (; (n = dedup_database.by_size[slot]); slot = (slot + 1) & dedup_database.mask) {
+    dedup_t *dp = &dedup_database.entry[n - 1];
+    if (dp->size != sum->size || !strcmp(DEDUP_NAME(dp), filename))
+      continue;
+    if (match && (!(dp->hashed & DEDUP_HASHED_PARTIAL) || dp->partial != sum->partial))
+      continue;
+    found++;
+    if (match ? (dp->hashed & DEDUP_HASHED_FULL) : (dp->hashed & DEDUP_HASHED_PARTIAL))
+      continue;
+    if (*count == size) {
+      size = size ? size * 2 : 16;
+      char **p = realloc(*names, size * sizeof(char *));
+      if (!p)
+        break;
+      *names = p;
+    }
+    (*names)[(*count)++] = strdup(DEDUP_NAME(dp));
+  }
+  UNLOCK(&dedup_database.lock);
+  return found;
+}
+
+/** Hash files from the dedup database and record the hashes in their
+ * entries. Entries of files that cannot be read are dropped.
+ * @param names File names, freed along with the array.
+ * @param size Size of the files.
+ * @param full TRUE if the full hash is needed.
+ */
+static void dedup_hash_entries(char **names, int count, uint64_t size, int full)
+{
+  int i;
+  for (i = 0; i < count; i++) {
+    if (!names[i])
+      continue;
+    dedup_t sum;
+    memset(&sum, 0, sizeof(sum));
+    sum.size = size;
+    int failed = dedup_hash_sum(names[i], &sum, full);
+
+    int len;
+    LOCK(&dedup_database.lock);
+    int n = dedup_find_name(names[i], gethash(names[i], &len));
+    /* the entry may have been replaced in the meantime */
+    if (n >= 0 && dedup_database.entry[n].size == size) {
+      dedup_t update = dedup_database.entry[n];
+      dedup_remove(n);
+      if (failed) {
+        DEBUG_("cannot hash '%s', dropping it from dedup DB", names[i]);
+      }
+      else {
+        if (sum.hashed & DEDUP_HASHED_PARTIAL)
+          update.partial = sum.partial;
+        if (sum.hashed & DEDUP_HASHED_FULL)
+          memcpy(update.md5, sum.md5, DIGEST_SIZE);
+        update.hashed |= sum.hashed;
+        dedup_add(&update, names[i]);
+      }
+    }
+    UNLOCK(&dedup_database.lock);
+    free(names[i]);
+  }
+  free(names);
+}
+
+/** Hash a file as far as needed to tell if it has a duplicate: not at all
+ * if no other file has the same size, only partially if none of those has
+ * the same partial hash, and fully otherwise. The entries of the same size
+ * are hashed as far along the way.
+ * @param filename File name.
+ * @param sum Size and hashes already known, with no hashed flags if there
+ *            are none; set to the size and the hashes made.
+ * @return 0 on success, 1 on failure.
+ */
+static int dedup_prefilter(const char *filename, dedup_t *sum)
+{
+  char **names;
+  int count;
+
+  if (!sum->hashed) {
+    memset(sum, 0, sizeof(*sum));
+    off_t size = dedup_file_size(filename);
+    if (size < 0)
+      return 1;
+    sum->size = size;
+  }
+  uint64_t size = sum->size;
+
+  if (!dedup_group(filename, sum, FALSE, &names, &count)) {
+    DEBUG_("'%s' has a size of its own, not hashing it", filename);
+    free(names);
+    return 0;
+  }
+  if (!(sum->hashed & DEDUP_HASHED_PARTIAL) && dedup_hash_sum(filename, sum, FALSE)) {
+    for (; count > 0; count--)
+      free(names[count - 1]);
+    free(names);
+    return 1;
+  }
+  dedup_hash_entries(names, count, size, FALSE);
+
+  if (!dedup_group(filename, sum, TRUE, &names, &count)) {
+    free(names);
+    return 0;
+  }
+  if (!(sum->hashed & DEDUP_HASHED_FULL) && dedup_hash_sum(filename, sum, TRUE)) {
+    for (; count > 0; count--)
+      free(names[count - 1]);
+    free(names);
+    return 1;
+  }
+  dedup_hash_entries(names, count, size, TRUE);
+  return 0;
+}
+
+/** Link a hashed file to a file with the same contents, or add it to the
+ * dedup database if there is none.
+ * @param sum Size and hashes of the file, see dedup_prefilter().
+ * @param target File found by dedup_match(), or NULL.
+ * @param failed TRUE if the file could not be hashed.
+ */
+static void dedup_link(file_t *file, const dedup_t *sum, const char *target, int failed)
+{
+  NEED_LOCK(&file->lock);
   if (failed) {
     DEBUG_("deduping '%s' failed", file->filename);
     /* While this looks suspicious, it is not a deduplication error, so we
@@ -330,68 +1701,287 @@ void do_dedup(file_t *file)
     file->deduped = TRUE;
     return;
   }
-  if (!(file->status & CANCEL)) {
-    /* No failure, no cancellation; let's link to identical file from dedup DB. */
-    DEBUG_("MD5 for '%s': %02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
-           file->filename, md5[0], md5[1], md5[2], md5[3], md5[4], md5[5], md5[6], md5[7], md5[8],
-           md5[9], md5[10], md5[11], md5[12], md5[13], md5[14], md5[15]);
-    const char *target = hardlink_file(md5, file->filename);
-    if (target) {
-        /* file linked to may have a different compressor */
-        compressor_t *c = NULL;
-        off_t s;
-        if (file_read_header_name(target, &c, &s) < 0) {
-          ERR_("failed to read '%s' header", target);
-        }
-        else {
-          file->compressor = c;
-        }
+  /* No failure, no cancellation; let's link to identical file from dedup DB. */
+  if (hardlink_file(sum, file->filename, target)) {
+      /* file linked to may have a different compressor */
+      compressor_t *c = NULL;
+      off_t s;
+      if (file_read_header_name(target, &c, &s) < 0) {
+        ERR_("failed to read '%s' header", target);
+      }
+      else {
+        file->compressor = c;
+      }
+  }
+  file->deduped = TRUE;
+}
+
+/** Acknowledge the cancellation of deduping a file. */
+static void dedup_cancelled(file_t *file)
+{
+  NEED_LOCK(&file->lock);
+  DEBUG_("deduping '%s' cancelled", file->filename);
+  file->status &= ~CANCEL;
+  pthread_cond_broadcast(&file->cond);
+}
+
+/** Attempt deduplication of file.
+ * @param file File to be deduplicated.
+ */
+void do_dedup(file_t *file)
+{
+  NEED_LOCK(&file->lock);
+  STAT_(STAT_DO_DEDUP);
+  
+  /* The file may have been hashed while it was compressed or written. */
+  dedup_t sum;
+  if (!dedup_hash_take(file, &sum))
+    memset(&sum, 0, sizeof(sum));
+  file->status |= DEDUPING;
+  /* No need to keep the file under lock while calculating the hash; should
+     it change in the meantime, we will be informed through file->status. */
+  UNLOCK(&file->lock);
+  
+  /* Calculate hash, and find a file with the same contents. */
+  int failed = dedup_prefilter(file->filename, &sum);
+  char *target = failed || !(sum.hashed & DEDUP_HASHED_FULL) ? NULL :
+                 dedup_match(sum.md5, file->filename);
+  
+  /* See if everything went fine. */
+  LOCK(&file->lock);
+  if (file->status & CANCEL)
+    dedup_cancelled(file);
+  else
+    dedup_link(file, &sum, target, failed);
+  file->status &= ~DEDUPING;
+  free(target);
+}
+
+/* A file taken into a batch by do_dedup_batch(). */
+typedef struct {
+  file_t *file;
+  char *filename;	/* file->filename when it was taken */
+  unsigned int version;	/* file->version when it was taken */
+  uint64_t location;	/* where its data starts on the backing device */
+  dedup_t sum;
+  int failed;		/* could not be hashed */
+  int skip;		/* in use or changed, left for another time */
+} dedup_batch_t;
+
+/** Where the data of a file starts on the backing device, so that a batch
+ * can be read in the order it is laid out. Filesystems that cannot tell
+ * are ordered by inode number, which most of them allocate along with the
+ * data.
+ */
+static uint64_t dedup_location(const char *name)
+{
+  struct stat st;
+  uint64_t location = 0;
+  int fd = open(name, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  if (fstat(fd, &st) == 0)
+    location = st.st_ino;
+#if defined(HAVE_LINUX_FS_H) && defined(FS_IOC_FIEMAP)
+  struct fiemap *fm = calloc(1, sizeof(struct fiemap) + sizeof(struct fiemap_extent));
+  if (fm) {
+    fm->fm_length = FIEMAP_MAX_OFFSET;
+    fm->fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, fm) == 0 && fm->fm_mapped_extents == 1)
+      location = fm->fm_extents[0].fe_physical;
+    free(fm);
+  }
+#endif
+  close(fd);
+  return location;
+}
+
+static int dedup_batch_cmp(const void *a, const void *b)
+{
+  const dedup_batch_t *ba = a;
+  const dedup_batch_t *bb = b;
+  if (ba->sum.size != bb->sum.size)
+    return ba->sum.size < bb->sum.size ? -1 : 1;
+  if (ba->location != bb->location)
+    return ba->location < bb->location ? -1 : 1;
+  return 0;
+}
+
+/** Check that a file has not been used or changed since it was taken into
+ * the batch. */
+static int dedup_batch_valid(const dedup_batch_t *b)
+{
+  file_t *file = b->file;
+  NEED_LOCK(&file->lock);
+  return file->accesses == 1 && !file->deleted && file->version == b->version &&
+         !strcmp(file->filename, b->filename);
+}
+
+/** Hash a file of a batch as far as needed.
+ * @param peers TRUE if other files of the batch have the same size, it is
+ *              then hashed completely right away.
+ */
+static void dedup_batch_hash(dedup_batch_t *b, int peers)
+{
+  file_t *file = b->file;
+  if (b->failed)
+    return;
+
+  LOCK(&file->lock);
+  if (!dedup_batch_valid(b)) {
+    b->skip = TRUE;
+    UNLOCK(&file->lock);
+    return;
+  }
+  file->status |= DEDUPING;
+  UNLOCK(&file->lock);
+
+  if (peers && !(b->sum.hashed & DEDUP_HASHED_FULL))
+    b->failed = dedup_hash_sum_buf(b->filename, &b->sum, TRUE, DEDUP_BATCH_BUF_SIZE);
+  if (!b->failed)
+    b->failed = dedup_prefilter(b->filename, &b->sum);
+
+  LOCK(&file->lock);
+  if (file->status & CANCEL) {
+    dedup_cancelled(file);
+    b->skip = TRUE;
+  }
+  file->status &= ~DEDUPING;
+  UNLOCK(&file->lock);
+}
+
+/** Link a hashed file of a batch, see do_dedup(). */
+static void dedup_batch_link(dedup_batch_t *b)
+{
+  file_t *file = b->file;
+  if (b->skip)
+    return;
+
+  char *target = b->failed || !(b->sum.hashed & DEDUP_HASHED_FULL) ? NULL :
+                 dedup_match(b->sum.md5, b->filename);
+  LOCK(&file->lock);
+  if (dedup_batch_valid(b))
+    dedup_link(file, &b->sum, target, b->failed);
+  else
+    DEBUG_("'%s' has changed, not deduping it", b->filename);
+  UNLOCK(&file->lock);
+  free(target);
+}
+
+/** Attempt deduplication of several files at once (-o dedup_batch).
+ * The files are ordered by size and then by where their data is, so the
+ * files that have to be hashed are read in one sweep over the disk, with
+ * bigger reads than one at a time; files of the same size are all hashed
+ * before any of them is linked, so duplicates within the batch are found
+ * without waiting for the next pass.
+ * Files in use, or changed while they were hashed, are left alone and not
+ * marked deduplicated, as are the files not looked at once aborting()
+ * returns TRUE.
+ * @param files Files to be deduplicated, not locked.
+ * @param count Number of files.
+ * @param aborting Tells when to give up on the rest of the batch.
+ */
+void do_dedup_batch(file_t **files, int count, int (*aborting)(void))
+{
+  dedup_batch_t *batch = calloc(count, sizeof(dedup_batch_t));
+  int i, j, k;
+  int taken = 0;
+
+  if (!batch) {
+    for (i = 0; i < count; i++) {
+      LOCK(&files[i]->lock);
+      if (files[i]->accesses == 1 && !files[i]->deleted)
+        do_dedup(files[i]);
+      UNLOCK(&files[i]->lock);
+    }
+    return;
+  }
+
+  for (i = 0; i < count; i++) {
+    file_t *file = files[i];
+    dedup_batch_t *b = &batch[taken];
+    LOCK(&file->lock);
+    if (file->accesses == 1 && !file->deleted && (b->filename = strdup(file->filename))) {
+      STAT_(STAT_DO_DEDUP);
+      b->file = file;
+      b->version = file->version;
+      /* The file may have been hashed while it was compressed or written. */
+      if (!dedup_hash_take(file, &b->sum))
+        memset(&b->sum, 0, sizeof(b->sum));
+      taken++;
+    }
+    UNLOCK(&file->lock);
+  }
+
+  for (i = 0; i < taken; i++) {
+    dedup_batch_t *b = &batch[i];
+    if (!b->sum.hashed) {
+      off_t size = dedup_file_size(b->filename);
+      if (size < 0) {
+        b->failed = TRUE;
+        b->sum.size = DEDUP_SIZE_UNKNOWN;
+        continue;
+      }
+      b->sum.size = size;
     }
-    file->deduped = TRUE;
+    b->location = dedup_location(b->filename);
   }
-  else {
-    /* Acknowledge the cancellation. */
-    DEBUG_("deduping '%s' cancelled", file->filename);
-    file->status &= ~CANCEL;
-    pthread_cond_broadcast(&file->cond);
+  qsort(batch, taken, sizeof(dedup_batch_t), dedup_batch_cmp);
+
+  for (i = 0; i < taken; i = j) {
+    for (j = i + 1; j < taken && batch[j].sum.size == batch[i].sum.size; j++)
+      ;
+    if (aborting && aborting())
+      break;
+    for (k = i; k < j; k++)
+      dedup_batch_hash(&batch[k], j - i > 1);
+    for (k = i; k < j; k++)
+      dedup_batch_link(&batch[k]);
   }
-  file->status &= ~DEDUPING;
+
+  for (i = 0; i < taken; i++)
+    free(batch[i].filename);
+  free(batch);
 }
 
 /** Reverse deduplication in case a hardlinked file is written to.
+ * Descriptors of the file still refer to the shared file afterwards and
+ * have to be opened again.
  * @param file File to be undeduplicated.
+ * @param copy FALSE if the data is about to be truncated anyway, so the
+ *             file only needs to be replaced by an empty one.
+ * @return TRUE if the file has been replaced, 0 if there was nothing to do,
+ *         FAIL on failure with errno set.
  */
-int do_undedup(file_t *file)
+int do_undedup(file_t *file, int copy)
 {
+  off_t reserved = 0;
+
   NEED_LOCK(&file->lock);
   DEBUG_("undeduping '%s'", file->filename);
   
   /* First, check if there is actually something to be done. */
   struct stat st;
-  if (lstat(file->filename, &st) < 0)
-    return 0;
-  if (st.st_nlink < 2)
+  if (lstat(file->filename, &st) < 0 || st.st_nlink < 2) {
+    file->undedup = FALSE;
     return 0;
+  }
   
   struct stat attr_st;
   char *filename_attr = fuseattr_name(file->filename);
-  if (lstat(filename_attr, &attr_st) < 0) {
+  if (!dedup_attr_get(file->filename, &attr_st)) {
     attr_st = st;
   }
 
   STAT_(STAT_DO_UNDEDUP);
   
   /* Check if we have enough space on the backing store to undedup. */
-  struct statvfs stat;
-  if(statvfs(file->filename, &stat) < 0) {
-    goto out_eio;
-  }
-  if(stat.f_bsize * stat.f_bavail < st.st_size) {
-          if(!(geteuid() == 0 && stat.f_bsize * stat.f_bfree >= st.st_size)) {
-                  errno = ENOSPC;
-                  free(filename_attr);
-                  return FAIL;
-          }
+  if (copy) {
+    if (!space_reserve(st.st_size)) {
+      free(filename_attr);
+      return FAIL;
+    }
+    reserved = st.st_size;
   }
   
   /* XXX: Is this actually necessary? After all, we create an identical
@@ -405,37 +1995,25 @@ int do_undedup(file_t *file)
     ERR_("undedup: failed to create temp file");
     goto out_eio;
   }
-  int fd_in = open(file->filename, O_RDONLY);
-  if (fd_in == -1) {
-    ERR_("undedup: failed to open input file '%s'", file->filename);
-    close(fd_out);
-    unlink(temp);
-    free(temp);
-    goto out_eio;
-  }
-  char buf[4096];
-  for(;;) {
-    int count = read(fd_in, buf, 4096);
-    if (count < 0) {
-      ERR_("undedup: read() failed on input file '%s'", file->filename);
-      close(fd_in);
+  if (copy) {
+    int fd_in = open(file->filename, O_RDONLY);
+    if (fd_in == -1) {
+      ERR_("undedup: failed to open input file '%s'", file->filename);
       close(fd_out);
       unlink(temp);
       free(temp);
       goto out_eio;
     }
-    else if (count == 0) /* EOF */
-      break;
-    if (write(fd_out, buf, count) != count) {
-      ERR_("undedup: write() failed on output file '%s'", temp);
+    if (file_copy(fd_in, fd_out) == FAIL) {
+      ERR_("undedup: failed to copy '%s' to '%s': %s", file->filename, temp, strerror(errno));
       close(fd_in);
       close(fd_out);
       unlink(temp);
       free(temp);
       goto out_eio;
     }
+    close(fd_in);
   }
-  close(fd_in);
   /* fix owner and mode of the new file */
   fchown(fd_out, attr_st.st_uid, attr_st.st_gid);
   fchmod(fd_out, attr_st.st_mode);
@@ -455,6 +2033,7 @@ int do_undedup(file_t *file)
     free(temp);
     goto out_eio;
   }
+  free(temp);
   /* fix timestamps */
   struct utimbuf utbuf;
   utbuf.actime = attr_st.st_atime;
@@ -466,12 +2045,16 @@ int do_undedup(file_t *file)
 
   /* remove attribute file, if any */
   unlink(filename_attr);
+  dedup_attr_forget(file->filename);
   free(filename_attr);
   
+  space_release(reserved, reserved);
+  file->undedup = FALSE;
   errno = 0;
-  return 0;
+  return TRUE;
 
 out_eio:
+  space_release(reserved, 0);
   errno = EIO;
   free(filename_attr);
   return FAIL;
@@ -493,187 +2076,713 @@ void dedup_discard(file_t *file)
   file->deduped = FALSE;
   DEBUG_("dedup_discard file '%s'", file->filename);
   STAT_(STAT_DEDUP_DISCARD);
-  dedup_t* dp;
   int len;
   unsigned int hash = gethash(file->filename, &len);
-  list_for_each_entry(dp, &dedup_database.head_filename[hash & DATABASE_HASH_MASK], list_filename_hash) {
-    if (dp->filename_hash == hash && !strcmp(dp->filename, file->filename)) {
-      DEBUG_("found file '%s', discarding", file->filename);
-      list_del(&dp->list_filename_hash);
-      list_del(&dp->list_md5);
-      dedup_database.entries--;
-      free(dp->filename);
-      free(dp);
-      return;
-    }
+  LOCK(&dedup_database.lock);
+  int n = dedup_find_name(file->filename, hash);
+  if (n >= 0) {
+    DEBUG_("found file '%s', discarding", file->filename);
+    dedup_remove(n);
   }
+  UNLOCK(&dedup_database.lock);
 }
 
+/* The database file is an image of the in-memory database: a header
+   followed by the entry array, the three indexes and the name buffer. It is
+   mapped copy-on-write when mounting, so mounting takes the same time no
+   matter how many entries there are; arrays that have to grow are copied
+   out of the mapping.
+
+   Changes are appended to a log (DEDUP_LOG_FILE) as they are made, so the
+   database survives a crash. The log starts with the generation of the
+   database file it applies to. Once it grows beyond DEDUP_LOG_MAX, and at
+   unmount, a new database file is written and the log starts over.
+
+   Databases in the older list format are converted when loaded, which
+   takes the size of every file.
+   The database records the hash its entries have been made with; it is
+   kept unless another hash has been asked for, in which case the hashes
+   are dropped and made again when needed. */
+
 #define DEDUP_MAGIC "DEDUP"
 #define DEDUP_MAGIC_SIZE (sizeof(DEDUP_MAGIC) - 1)
-#define DEDUP_VERSION 2
+#define DEDUP_VERSION 3
+#define DEDUP_VERSION_LIST 2
+#define DEDUP_LOG_MAGIC "DEDUPLOG"
+#define DEDUP_LOG_MAGIC_SIZE (sizeof(DEDUP_LOG_MAGIC) - 1)
+#define DEDUP_LOG_MAX (16 * 1024 * 1024)
+
+/* Header of the database file; the magic and version are at the same
+   place as in the list format. */
+typedef struct {
+  char magic[DEDUP_MAGIC_SIZE];
+  unsigned char version[2];
+  unsigned char entry_size;	/* sizeof(dedup_t) */
+  uint64_t generation;
+  uint64_t entries;
+  uint64_t slots;		/* size of each index */
+  uint64_t names_used;
+  uint64_t names_garbage;
+  uint64_t digest;		/* type of the hash, see digest_t */
+} dedup_image_t;
+
+#define DEDUP_IMAGE_HEADER 64	/* bytes reserved for dedup_image_t */
+
+/* Paths of the database file and the log, set when mounting because we
+   are not in the backing FS root yet */
+static char *dedup_db_path = DEDUP_DB_FILE;
+static char *dedup_log_path = DEDUP_LOG_FILE;
+static char *dedup_attrs_path = DEDUP_ATTRS_FILE;
 
 /** Initialize the deduplication database.
  */
 void dedup_init_db(void)
 {
-  int i;
-  for (i = 0; i < DATABASE_HASH_SIZE; i++) {
-    dedup_database.head_filename[i].prev = dedup_database.head_filename[i].next = &(dedup_database.head_filename[i]);
-    dedup_database.head_md5[i].prev = dedup_database.head_md5[i].next = &(dedup_database.head_md5[i]);
-  }
+  dedup_free(dedup_database.entry);
+  dedup_free(dedup_database.by_md5);
+  dedup_free(dedup_database.by_filename);
+  dedup_free(dedup_database.by_size);
+  dedup_free(dedup_database.names);
+  if (dedup_database.map)
+    munmap(dedup_database.map, dedup_database.map_size);
+  dedup_database.entries = 0;
+  dedup_database.capacity = 0;
+  dedup_database.entry = NULL;
+  dedup_database.mask = 0;
+  dedup_database.by_md5 = NULL;
+  dedup_database.by_filename = NULL;
+  dedup_database.by_size = NULL;
+  dedup_database.names = NULL;
+  dedup_database.names_used = 0;
+  dedup_database.names_size = 0;
+  dedup_database.names_garbage = 0;
+  dedup_database.map = NULL;
+  dedup_database.map_size = 0;
+  dedup_filter_free(dedup_filters.md5);
+  dedup_filter_free(dedup_filters.name);
+  dedup_filters.md5 = NULL;
+  dedup_filters.name = NULL;
+  dedup_attrs_clear();
 }
 
-/** Load the dedup DB saved when last mounted.
- * @param root Path to the backing filesystem's root.
+/** Add an entry of an older database, which has a full hash but no size.
+ * The size is set by dedup_fill_sizes().
  */
-void dedup_load(const char *root)
+static void dedup_add_nosize(const unsigned char *md5, const char *filename)
 {
-  dedup_init_db();
-  
-  dedup_t *dp;
+  dedup_t sum;
+  memset(&sum, 0, sizeof(sum));
+  memcpy(sum.md5, md5, DIGEST_SIZE);
+  sum.size = DEDUP_SIZE_UNKNOWN;
+  sum.hashed = DEDUP_HASHED_FULL;
+  dedup_add(&sum, filename);
+}
 
-  /* we're not in the backing FS root yet, so we need to compose an
-     absolute path */
-  char fn[strlen(root) + 1 + strlen(DEDUP_DB_FILE) + 1];
-  sprintf(fn, "%s/%s", root, DEDUP_DB_FILE);
-  FILE *db_fp = fopen(fn, "r");
-  if (!db_fp) {
+/** Load a dedup DB in the list format.
+ * @param db_fp Database file, positioned after the header.
+ * @return 0 on success, 1 if the file is broken.
+ */
+static int dedup_load_list(FILE *db_fp)
+{
+  /* load data */
+  uint32_t filename_length;
+  unsigned char md5[16];
+  char *filename;
+  /* every entry starts with the length of the filename */
+  while (fread(&filename_length, 4, 1, db_fp) == 1) {
+    /* allocate filename */
+    filename = (char *)malloc(filename_length + 1);
+    /* read filename */
+    if (fread(filename, 1, filename_length, db_fp) != filename_length) {
+      ERR_("failed to load filename of %d characters", filename_length);
+      free(filename);
+      return 1;
+    }
+    filename[filename_length] = 0;	/* string termination */
+
+    /* read MD5 hash */
+    if (fread(md5, 16, 1, db_fp) != 1) {
+      ERR_("failed to load MD5 for %s", filename);
+      free(filename);
+      return 1;
+    }
+
+    /* add to in-core dedup DB, ignoring files in exluded paths */
+    if (!is_excluded(filename))
+      dedup_add_nosize(md5, filename);
+    free(filename);
+  }
+  return 0;
+}
+
+#define DEDUP_LOAD_NONE 0		/* nothing loaded */
+#define DEDUP_LOAD_MAPPED 1		/* database file in use, its log applies */
+#define DEDUP_LOAD_CONVERTED 2		/* older format loaded, to be written anew */
+
+/** Map a dedup DB file, converting it if it is in an older format.
+ * @param digest Set to the hash of the entries loaded.
+ * @return DEDUP_LOAD_NONE, DEDUP_LOAD_MAPPED or DEDUP_LOAD_CONVERTED.
+ */
+static int dedup_load_image(digest_t **digest)
+{
+  int fd = open(dedup_db_path, O_RDONLY);
+  if (fd < 0) {
     if (errno == ENOENT) {
       DEBUG_("no dedup DB found");
     }
     else {
       ERR_("failed to open dedup DB for reading: %s", strerror(errno));
     }
-    return;
+    return DEDUP_LOAD_NONE;
   }
-  
+
   /* check header */
-  char header[DEDUP_MAGIC_SIZE];
+  dedup_image_t header;
   uint16_t version;
-  if (fread(header, DEDUP_MAGIC_SIZE, 1, db_fp) != 1)
+  struct stat st;
+  if (fstat(fd, &st) < 0 || pread(fd, &header, sizeof(header), 0) < DEDUP_MAGIC_SIZE + 2)
     goto out;
-  if (memcmp(header, DEDUP_MAGIC, DEDUP_MAGIC_SIZE)) {
+  if (memcmp(header.magic, DEDUP_MAGIC, DEDUP_MAGIC_SIZE)) {
     ERR_("dedup DB magic not found");
     goto out;
   }
-  if (fread(&version, 2, 1, db_fp) != 1)
-    goto out;
-  if (version != DEDUP_VERSION) {
+  memcpy(&version, header.version, 2);
+  if (version == DEDUP_VERSION_LIST) {
+    INFO_("converting dedup DB");
+    FILE *db_fp = fdopen(fd, "r");
+    if (!db_fp)
+      goto out;
+    fseek(db_fp, DEDUP_MAGIC_SIZE + 2, SEEK_SET);
+    if (dedup_load_list(db_fp)) {
+      fclose(db_fp);
+      ERR_("failed to load dedup DB");
+      dedup_init_db();
+      return DEDUP_LOAD_NONE;
+    }
+    fclose(db_fp);
+    /* the list format always used MD5 */
+    *digest = &digest_md5;
+    return DEDUP_LOAD_CONVERTED;
+  }
+  size_t entry_size = sizeof(dedup_t);
+  if (version != DEDUP_VERSION || header.entry_size != entry_size) {
     DEBUG_("verion mismatch, ignoring dedup DB");
     goto out;
   }
-  
-  /* load data */
-  uint32_t filename_length;
-  /* every entry starts with the length of the filename */
-  while (fread(&filename_length, 4, 1, db_fp) == 1) {
-    /* allocate DB entry */
-    dp = (dedup_t *)malloc(sizeof(dedup_t));
-    /* allocate filename */
-    dp->filename = (char *)malloc(filename_length + 1);
-    /* read filename */
-    if (fread(dp->filename, 1, filename_length, db_fp) != filename_length) {
-      ERR_("failed to load filename of %d characters", filename_length);
-      free(dp->filename);
-      free(dp);
-      goto out;
-    }
-    dp->filename[filename_length] = 0;	/* string termination */
+  if (!find_digest(header.digest)) {
+    ERR_("dedup DB uses unknown hash %d", (int)header.digest);
+    goto out;
+  }
 
-    /* read MD5 hash */
-    if (fread(dp->md5, 16, 1, db_fp) != 1) {
-      ERR_("failed to load MD5 for %s", dp->filename);
-      free(dp->filename);
-      free(dp);
-      goto out;
-    }
+  /* sanity checks; the entries themselves are trusted, looking at all
+     of them would take as long as reading them */
+  size_t entries_size = header.entries * entry_size;
+  size_t index_size = header.slots * sizeof(uint32_t);
+  if (header.entries == 0) {
+    /* nothing to map, but the log may have entries */
+    close(fd);
+    dedup_database.generation = header.generation;
+    *digest = find_digest(header.digest);
+    return DEDUP_LOAD_MAPPED;
+  }
+  if (header.slots & (header.slots - 1) ||
+      header.entries >= header.slots || header.slots > UINT32_MAX ||
+      header.names_garbage > header.names_used ||
+      st.st_size < DEDUP_IMAGE_HEADER + entries_size + 3 * index_size + header.names_used) {
+    ERR_("dedup DB is broken");
+    goto out;
+  }
 
-    /* ignore files in exluded paths */
-    if (is_excluded(dp->filename)) {
-      free(dp->filename);
-      free(dp);
-      continue;
-    }
+  char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    ERR_("failed to map dedup DB: %s", strerror(errno));
+    goto out;
+  }
+  close(fd);
 
-    int len;
-    dp->filename_hash = gethash(dp->filename, &len);
+  dedup_database.map = map;
+  dedup_database.map_size = st.st_size;
+  dedup_database.generation = header.generation;
+  dedup_database.entries = dedup_database.capacity = header.entries;
+  dedup_database.entry = (dedup_t *)(map + DEDUP_IMAGE_HEADER);
+  dedup_database.mask = header.slots - 1;
+  dedup_database.by_md5 = (uint32_t *)(map + DEDUP_IMAGE_HEADER + entries_size);
+  dedup_database.by_filename = (uint32_t *)(map + DEDUP_IMAGE_HEADER + entries_size + index_size);
+  dedup_database.by_size = (uint32_t *)(map + DEDUP_IMAGE_HEADER + entries_size + 2 * index_size);
+  dedup_database.names = map + DEDUP_IMAGE_HEADER + entries_size + 3 * index_size;
+  dedup_database.names_used = dedup_database.names_size = header.names_used;
+  dedup_database.names_garbage = header.names_garbage;
+  *digest = find_digest(header.digest);
+  return DEDUP_LOAD_MAPPED;
 
-    /* add to in-core dedup DB */
-    list_add_tail(&dp->list_filename_hash, &dedup_database.head_filename[dp->filename_hash & DATABASE_HASH_MASK]);
-    list_add_tail(&dp->list_md5, &dedup_database.head_md5[md5_to_hash(dp->md5)]);
-    dedup_database.entries++;
-  }
-  
-  fclose(db_fp);
-  /* Very soon, we will change this filesystem without updating the dedup DB,
-     and it would be dangerous to keep an out-of-date database on disk. */
-  unlink(fn);
-  return;
 out:
-  fclose(db_fp);
-  unlink(fn); /* it's broken */
-  ERR_("failed to load dedup DB");
+  close(fd);
+  return DEDUP_LOAD_NONE;
 }
 
-static int dedup_db_write_header(FILE *db_fp)
+/** Write the database to a new database file.
+ * @return 0 on success, 1 on failure.
+ */
+static int dedup_write_image(void)
 {
-  if (fwrite("DEDUP", DEDUP_MAGIC_SIZE, 1, db_fp) == EOF)
+  char tmpname[strlen(dedup_db_path) + sizeof(".new")];
+  sprintf(tmpname, "%s.new", dedup_db_path);
+  FILE *db_fp = fopen(tmpname, "w");
+  if (!db_fp) {
+    ERR_("failed to open dedup DB for writing");
     return 1;
+  }
+
+  uint64_t generation = time(NULL);
+  if (generation <= dedup_database.generation)
+    generation = dedup_database.generation + 1;
+
+  char buf[DEDUP_IMAGE_HEADER];
+  dedup_image_t *header = (dedup_image_t *)buf;
   uint16_t version = DEDUP_VERSION;
-  if (fwrite(&version, 1, 2, db_fp) == EOF)
-    return 1;
+  memset(buf, 0, sizeof(buf));
+  memcpy(header->magic, DEDUP_MAGIC, DEDUP_MAGIC_SIZE);
+  memcpy(header->version, &version, 2);
+  header->entry_size = sizeof(dedup_t);
+  header->generation = generation;
+  header->entries = dedup_database.entries;
+  header->slots = dedup_database.by_md5 ? dedup_database.mask + 1 : 0;
+  header->names_used = dedup_database.names_used;
+  header->names_garbage = dedup_database.names_garbage;
+  header->digest = dedup_digest->type;
+
+  size_t index_size = header->slots * sizeof(uint32_t);
+  if (fwrite(buf, sizeof(buf), 1, db_fp) != 1 ||
+      fwrite(dedup_database.entry, sizeof(dedup_t), dedup_database.entries, db_fp) != dedup_database.entries ||
+      (index_size && fwrite(dedup_database.by_md5, index_size, 1, db_fp) != 1) ||
+      (index_size && fwrite(dedup_database.by_filename, index_size, 1, db_fp) != 1) ||
+      (index_size && fwrite(dedup_database.by_size, index_size, 1, db_fp) != 1) ||
+      (dedup_database.names_used && fwrite(dedup_database.names, dedup_database.names_used, 1, db_fp) != 1) ||
+      fflush(db_fp) || fsync(fileno(db_fp))) {
+    fclose(db_fp);
+    goto out;
+  }
+  if (fclose(db_fp) || rename(tmpname, dedup_db_path))
+    goto out;
+
+  dedup_database.generation = generation;
   return 0;
+out:
+  unlink(tmpname);
+  ERR_("failed to write dedup DB");
+  return 1;
 }
 
-static int dedup_db_write_entry(FILE *db_fp, const char *filename, unsigned char *md5)
+/** Write the attributes in the overlay for the database file just written.
+ */
+static void dedup_attrs_save(void)
 {
-  /* length of filename */
-  uint32_t len = strlen(filename);
-  if (fwrite(&len, 1, 4, db_fp) == EOF)
-    return 1;
-  /* filename */
-  if (fputs(filename, db_fp) == EOF)
-    return 1;
-  /* MD 5 hash */
-  if (fwrite(md5, 1, 16, db_fp) == EOF)
-    return 1;
-  /* no need to save filename hash, it can be easily regenerated
-     when loading */
-  return 0;
+  char tmpname[strlen(dedup_attrs_path) + sizeof(".new")];
+  sprintf(tmpname, "%s.new", dedup_attrs_path);
+  FILE *fp = fopen(tmpname, "w");
+  if (!fp) {
+    ERR_("failed to open dedup attribute overlay for writing");
+    return;
+  }
+
+  int ok = fwrite(DEDUP_ATTRS_MAGIC, DEDUP_ATTRS_MAGIC_SIZE, 1, fp) == 1 &&
+           fwrite(&dedup_database.generation, sizeof(uint64_t), 1, fp) == 1;
+  uint32_t i;
+  LOCK(&dedup_attrs.lock);
+  for (i = 0; ok && dedup_attrs.head && i <= dedup_attrs.mask; i++) {
+    dedup_attr_t *attr;
+    for (attr = dedup_attrs.head[i]; ok && attr; attr = attr->next) {
+      if (!attr->present)
+        continue;
+      dedup_attr_image_t image;
+      image.atime = attr->atim.tv_sec;
+      image.atime_nsec = attr->atim.tv_nsec;
+      image.mtime = attr->mtim.tv_sec;
+      image.mtime_nsec = attr->mtim.tv_nsec;
+      image.uid = attr->uid;
+      image.gid = attr->gid;
+      image.mode = attr->mode;
+      ok = fputc(DEDUP_ATTR_PRESENT, fp) != EOF &&
+           fwrite(&image, sizeof(image), 1, fp) == 1 &&
+           fwrite(attr->filename, strlen(attr->filename) + 1, 1, fp) == 1;
+    }
+  }
+  UNLOCK(&dedup_attrs.lock);
+
+  if (fclose(fp) || !ok || rename(tmpname, dedup_attrs_path)) {
+    unlink(tmpname);
+    ERR_("failed to write dedup attribute overlay");
+  }
 }
 
-/** Save the current dedup DB.
+/** Read back the attribute overlay saved at the last unmount.
+ * It is removed, so that it is not used again after a crash.
  */
-void dedup_save(void)
+static void dedup_attrs_load(void)
 {
-  dedup_t *dp;
-  /* assuming that cwd is the backing filesystem's root */
-  FILE* db_fp = fopen(DEDUP_DB_FILE, "w");
-  if (!db_fp) {
-    ERR_("failed to open dedup DB for writing");
+  int fd = open(dedup_attrs_path, O_RDONLY);
+  if (fd < 0)
+    return;
+  unlink(dedup_attrs_path);
+
+  struct stat st;
+  char *buf = NULL;
+  if (fstat(fd, &st) < 0 || !(buf = malloc(st.st_size + 1)) ||
+      read(fd, buf, st.st_size) != st.st_size) {
+    close(fd);
+    free(buf);
+    return;
+  }
+  close(fd);
+
+  uint64_t generation;
+  char *p = buf + DEDUP_ATTRS_MAGIC_SIZE + sizeof(generation);
+  char *end = buf + st.st_size;
+  if (p > end || memcmp(buf, DEDUP_ATTRS_MAGIC, DEDUP_ATTRS_MAGIC_SIZE)) {
+    ERR_("dedup attribute overlay is broken");
+    free(buf);
+    return;
+  }
+  memcpy(&generation, buf + DEDUP_ATTRS_MAGIC_SIZE, sizeof(generation));
+  if (generation != dedup_database.generation) {
+    DEBUG_("dedup attribute overlay is out of date, ignoring");
+    free(buf);
+    return;
+  }
+  *end = 0;
+
+  /* a truncated last record is dropped */
+  int count = 0;
+  LOCK(&dedup_attrs.lock);
+  while (p < end) {
+    char kind = *p++;
+    struct stat st_attr;
+    dedup_attr_image_t image;
+    if (kind != DEDUP_ATTR_PRESENT) {
+      ERR_("dedup attribute overlay is broken");
+      break;
+    }
+    if (p + sizeof(image) > end)
+      break;
+    memcpy(&image, p, sizeof(image));
+    p += sizeof(image);
+    memset(&st_attr, 0, sizeof(st_attr));
+    st_attr.st_atim.tv_sec = image.atime;
+    st_attr.st_atim.tv_nsec = image.atime_nsec;
+    st_attr.st_mtim.tv_sec = image.mtime;
+    st_attr.st_mtim.tv_nsec = image.mtime_nsec;
+    st_attr.st_uid = image.uid;
+    st_attr.st_gid = image.gid;
+    st_attr.st_mode = image.mode;
+    size_t len = strlen(p);
+    if (p + len >= end)
+      break;
+    int hash_len;
+    dedup_attr_t *attr = dedup_attr_new(p, gethash(p, &hash_len), &st_attr);
+    if (!attr)
+      break;
+    dedup_attr_insert(attr);
+    count++;
+    p += len + 1;
+  }
+  UNLOCK(&dedup_attrs.lock);
+  free(buf);
+  DEBUG_("loaded %d dedup attribute overlay entries", count);
+}
+
+/** Start a new log for the current database file.
+ */
+static void dedup_log_reset(void)
+{
+  if (dedup_database.log_fd >= 0)
+    close(dedup_database.log_fd);
+  dedup_database.log_fd = open(dedup_log_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+  if (dedup_database.log_fd < 0) {
+    ERR_("failed to create dedup log: %s", strerror(errno));
+    return;
+  }
+  char buf[DEDUP_LOG_MAGIC_SIZE + sizeof(uint64_t)];
+  memcpy(buf, DEDUP_LOG_MAGIC, DEDUP_LOG_MAGIC_SIZE);
+  memcpy(buf + DEDUP_LOG_MAGIC_SIZE, &dedup_database.generation, sizeof(uint64_t));
+  if (write(dedup_database.log_fd, buf, sizeof(buf)) != sizeof(buf)) {
+    ERR_("failed to write dedup log: %s", strerror(errno));
+    close(dedup_database.log_fd);
+    dedup_database.log_fd = -1;
+    return;
+  }
+  dedup_database.log_size = sizeof(buf);
+}
+
+/** Write a new database file and start over with the log.
+ */
+static void dedup_checkpoint(void)
+{
+  if (dedup_write_image()) {
+    /* the database file and the log no longer describe the database, and
+       an outdated database would link files with different contents */
+    unlink(dedup_db_path);
+    if (dedup_database.log_fd >= 0) {
+      close(dedup_database.log_fd);
+      dedup_database.log_fd = -1;
+    }
+    unlink(dedup_log_path);
+    return;
+  }
+  dedup_log_reset();
+}
+
+/* An added entry is logged as DEDUP_LOG_ENTRY followed by this and the
+   file name. */
+typedef struct {
+  unsigned char md5[16];
+  uint64_t partial;
+  uint64_t size;
+  unsigned char hashed;
+} __attribute__((packed)) dedup_log_entry_t;
+
+/** Append a change to the log.
+ * @param op DEDUP_LOG_ENTRY or DEDUP_LOG_REMOVE
+ * @param dp Added entry.
+ * @param filename File name.
+ */
+static void dedup_log(char op, const dedup_t *dp, const char *filename)
+{
+  if (dedup_database.log_fd < 0)
+    return;
+
+  size_t len = strlen(filename) + 1;
+  char rec[1 + sizeof(dedup_log_entry_t) + len];
+  size_t size = 0;
+  rec[size++] = op;
+  if (op == DEDUP_LOG_ENTRY) {
+    dedup_log_entry_t entry;
+    memcpy(entry.md5, dp->md5, 16);
+    entry.partial = dp->partial;
+    entry.size = dp->size;
+    entry.hashed = dp->hashed;
+    memcpy(rec + size, &entry, sizeof(entry));
+    size += sizeof(entry);
+  }
+  memcpy(rec + size, filename, len);
+  size += len;
+
+  if (write(dedup_database.log_fd, rec, size) != size) {
+    ERR_("failed to write dedup log: %s", strerror(errno));
+    /* the database is written at unmount, until then there is none */
+    close(dedup_database.log_fd);
+    dedup_database.log_fd = -1;
+    unlink(dedup_db_path);
+    unlink(dedup_log_path);
     return;
   }
+  dedup_database.log_size += size;
+  if (dedup_database.log_size > DEDUP_LOG_MAX)
+    dedup_checkpoint();
+}
+
+/** Apply the changes from the log to the mapped database file.
+ * @return TRUE if the log belongs to the database file, FALSE if a new log
+ *         has to be started.
+ */
+static int dedup_replay(void)
+{
+  int fd = open(dedup_log_path, O_RDONLY);
+  if (fd < 0)
+    return FALSE;
 
-  /* write header */
-  if (dedup_db_write_header(db_fp))
+  struct stat st;
+  char *buf = NULL;
+  int ok = FALSE;
+  if (fstat(fd, &st) < 0 || st.st_size < DEDUP_LOG_MAGIC_SIZE + sizeof(uint64_t))
     goto out;
-  
-  /* write data */
+  buf = malloc(st.st_size + 1);
+  if (!buf || read(fd, buf, st.st_size) != st.st_size)
+    goto out;
+
+  uint64_t generation;
+  memcpy(&generation, buf + DEDUP_LOG_MAGIC_SIZE, sizeof(uint64_t));
+  if (memcmp(buf, DEDUP_LOG_MAGIC, DEDUP_LOG_MAGIC_SIZE) ||
+      generation != dedup_database.generation) {
+    DEBUG_("dedup log does not match dedup DB, ignoring it");
+    goto out;
+  }
+
+  /* a truncated last record is dropped */
+  char *end = buf + st.st_size;
+  char *p = buf + DEDUP_LOG_MAGIC_SIZE + sizeof(uint64_t);
+  char *rec = p;
+  int count = 0;
+  *end = 0;
+  while (p < end) {
+    rec = p;
+    char op = *p++;
+    dedup_log_entry_t entry;
+    if (op == DEDUP_LOG_ENTRY) {
+      if (p + sizeof(entry) > end)
+        break;
+      memcpy(&entry, p, sizeof(entry));
+      p += sizeof(entry);
+    }
+    else if (op != DEDUP_LOG_REMOVE)
+      break;
+    if (p >= end || p + strlen(p) >= end)
+      break;
+
+    int len;
+    int n = dedup_find_name(p, gethash(p, &len));
+    if (n >= 0)
+      dedup_remove(n);
+    if (op == DEDUP_LOG_ENTRY) {
+      dedup_t sum;
+      memset(&sum, 0, sizeof(sum));
+      memcpy(sum.md5, entry.md5, 16);
+      sum.partial = entry.partial;
+      sum.size = entry.size;
+      sum.hashed = entry.hashed;
+      dedup_add(&sum, p);
+    }
+    p += len;
+    rec = p;
+    count++;
+  }
+  DEBUG_("replayed %d dedup log records", count);
+  /* appending starts after the last complete record */
+  dedup_database.log_size = rec - buf;
+  ok = TRUE;
+out:
+  free(buf);
+  close(fd);
+  return ok;
+}
+
+/** Rebuild the database from its entries, with fix() applied to each.
+ * @param fix Returns FALSE if the entry is to be dropped.
+ */
+static void dedup_rebuild(int (*fix)(const char *root, const char *filename, dedup_t *sum),
+                          const char *root)
+{
+  int count = dedup_database.entries;
+  dedup_t *entry = malloc(count * sizeof(dedup_t) + 1);
+  char **names = malloc(count * sizeof(char *) + 1);
+  if (!entry || !names) {
+    free(entry);
+    free(names);
+    return;
+  }
+
   int i;
-  for (i = 0; i < DATABASE_HASH_SIZE; i++) {
-    list_for_each_entry(dp, &dedup_database.head_filename[i], list_filename_hash) {
-      if (dedup_db_write_entry(db_fp, dp->filename, dp->md5))
-        goto out;
+  for (i = 0; i < count; i++) {
+    entry[i] = dedup_database.entry[i];
+    names[i] = strdup(DEDUP_NAME(&dedup_database.entry[i]));
+  }
+  dedup_init_db();
+
+  for (i = 0; i < count; i++) {
+    if (names[i] && fix(root, names[i], &entry[i]))
+      dedup_add(&entry[i], names[i]);
+    free(names[i]);
+  }
+  free(entry);
+  free(names);
+}
+
+static int dedup_forget_hashes(const char *root, const char *filename, dedup_t *sum)
+{
+  sum->hashed = 0;
+  return TRUE;
+}
+
+static int dedup_fill_size(const char *root, const char *filename, dedup_t *sum)
+{
+  if (sum->size != DEDUP_SIZE_UNKNOWN)
+    return TRUE;
+  char path[strlen(root) + 1 + strlen(filename) + 1];
+  sprintf(path, "%s/%s", root, filename);
+  off_t size = dedup_file_size(path);
+  /* files that are gone are dropped from the database */
+  if (size < 0)
+    return FALSE;
+  sum->size = size;
+  return TRUE;
+}
+
+/** Load the dedup DB saved when last mounted.
+ * @param root Path to the backing filesystem's root.
+ */
+void dedup_load(const char *root)
+{
+  dedup_init_db();
+
+  /* we're not in the backing FS root yet, so we need to compose absolute
+     paths */
+  dedup_db_path = malloc(strlen(root) + 1 + strlen(DEDUP_DB_FILE) + 1);
+  sprintf(dedup_db_path, "%s/%s", root, DEDUP_DB_FILE);
+  dedup_log_path = malloc(strlen(root) + 1 + strlen(DEDUP_LOG_FILE) + 1);
+  sprintf(dedup_log_path, "%s/%s", root, DEDUP_LOG_FILE);
+  dedup_attrs_path = malloc(strlen(root) + 1 + strlen(DEDUP_ATTRS_FILE) + 1);
+  sprintf(dedup_attrs_path, "%s/%s", root, DEDUP_ATTRS_FILE);
+
+  digest_t *digest = dedup_digest;
+  int loaded = dedup_load_image(&digest);
+  if (loaded != DEDUP_LOAD_NONE)
+    dedup_attrs_load();
+  else
+    unlink(dedup_attrs_path);
+  int replayed = loaded != DEDUP_LOAD_NONE && dedup_replay();
+  int mapped = loaded == DEDUP_LOAD_MAPPED;
+
+  if (!mapped && dedup_database.entries) {
+    INFO_("looking up the sizes of %d dedup DB entries", dedup_database.entries);
+    dedup_rebuild(dedup_fill_size, root);
+  }
+  if (digest != dedup_digest) {
+    if (dedup_digest_forced) {
+      /* files are hashed again when needed */
+      INFO_("dropping %s hashes of %d dedup DB entries for %s",
+            digest->name, dedup_database.entries, dedup_digest->name);
+      dedup_rebuild(dedup_forget_hashes, root);
+      mapped = FALSE;
     }
+    else
+      dedup_digest = digest;
   }
+  DEBUG_("dedup hash is %s", dedup_digest->name);
 
-  fclose(db_fp);
-  return;
-out:
-  fclose(db_fp);
-  unlink(DEDUP_DB_FILE);
-  ERR_("failed to write dedup DB");
+  if (!mapped) {
+    /* start over with whatever could be loaded */
+    dedup_checkpoint();
+  }
+  else if (replayed) {
+    dedup_database.log_fd = open(dedup_log_path, O_WRONLY | O_APPEND);
+    if (dedup_database.log_fd < 0 || ftruncate(dedup_database.log_fd, dedup_database.log_size)) {
+      ERR_("failed to open dedup log: %s", strerror(errno));
+      dedup_checkpoint();
+    }
+  }
+  else
+    dedup_log_reset();
+
+  if (dedup_database.entries)
+    INFO_("loaded %d dedup DB entries, %zu bytes of memory per entry",
+          dedup_database.entries, dedup_db_memory() / dedup_database.entries);
+}
+
+/** Save the current dedup DB.
+ */
+void dedup_save(void)
+{
+  if (dedup_write_image()) {
+    unlink(dedup_db_path);
+    unlink(dedup_log_path);
+    return;
+  }
+  dedup_attrs_save();
+  if (dedup_database.log_fd >= 0) {
+    close(dedup_database.log_fd);
+    dedup_database.log_fd = -1;
+  }
+  /* everything in the log is in the database file now */
+  unlink(dedup_log_path);
 }
 
 /** Rename a file in the dedup database.
@@ -693,31 +2802,18 @@ void dedup_rename(file_t *from, file_t *to)
   to->deduped = from->deduped;
 
   /* search for from file in the dedup DB and remove it from there */
-  dedup_t *dp;
-  int found = 0;
   DEBUG_("dedup renaming '%s'/%08x to '%s'/%08x", from->filename, from->filename_hash, to->filename, to->filename_hash);
   LOCK(&dedup_database.lock);
-  list_for_each_entry(dp, &dedup_database.head_filename[from->filename_hash & DATABASE_HASH_MASK], list_filename_hash) {
-    if (dp->filename_hash == from->filename_hash && !strcmp(dp->filename, from->filename)) {
-      DEBUG_("found file '%s' to rename", from->filename);
-      list_del(&dp->list_filename_hash);
-      list_del(&dp->list_md5);
-      found = 1;
-      break;
-    }
-  }
+  int n = dedup_find_name(from->filename, from->filename_hash);
 
   /* it's quite possible that an entry is not in the dedup DB yet, it
      may not have been released yet */
-  if (found) {
-    /* update with the new file name and add it back to the database */
-    /* new filename */
-    free(dp->filename);
-    dp->filename = strdup(to->filename);
-    dp->filename_hash = to->filename_hash;
-    /* add to DB again */
-    list_add_tail(&dp->list_filename_hash, &dedup_database.head_filename[dp->filename_hash & DATABASE_HASH_MASK]);
-    list_add_tail(&dp->list_md5, &dedup_database.head_md5[md5_to_hash(dp->md5)]);
+  if (n >= 0) {
+    DEBUG_("found file '%s' to rename", from->filename);
+    /* add it back to the database with the new file name */
+    dedup_t sum = dedup_database.entry[n];
+    dedup_remove(n);
+    dedup_add(&sum, to->filename);
   }
   UNLOCK(&dedup_database.lock);
 }
@@ -733,11 +2829,13 @@ int dedup_sys_getattr(const char *full, struct stat *stbuf)
   if (res < 0)
     return FAIL;
   DEBUG_("'%s' mtime %zd", full, stbuf->st_mtime);
+  /* only regular files get attribute files */
+  if (!S_ISREG(stbuf->st_mode))
+    return res;
   /* check if we have an attribute file */
-  char *full_attr = fuseattr_name(full);
   struct stat st_attr;
-  if (lstat(full_attr, &st_attr) == 0) {
-    DEBUG_("'%s' mtime %zd", full_attr, st_attr.st_mtime);
+  if (dedup_attr_get(full, &st_attr)) {
+    DEBUG_("'%s' attributes mtime %zd", full, st_attr.st_mtime);
     /* override the stats from the actual file with those
        from the attribute file */
     stbuf->st_uid = st_attr.st_uid;
@@ -748,7 +2846,6 @@ int dedup_sys_getattr(const char *full, struct stat *stbuf)
     stbuf->st_mtim = st_attr.st_mtim;
     stbuf->st_mode = st_attr.st_mode;
   }
-  free(full_attr);
   return res;
 }
 
@@ -771,7 +2868,7 @@ int dedup_sys_chown(const char *full, uid_t uid, gid_t gid)
 
   int res;
   char *full_attr = fuseattr_name(full);
-  if (lstat(full_attr, &st_attr) == 0) {
+  if (dedup_attr_get(full, &st_attr)) {
      DEBUG_("'%s' mtime %zd", full_attr, st_attr.st_mtime);
     /* there is an attribute file */
     if (st_file.st_uid == uid &&
@@ -792,6 +2889,7 @@ int dedup_sys_chown(const char *full, uid_t uid, gid_t gid)
       /* this attr file is required, update it */
       res = lchown(full_attr, uid, gid);
     }
+    dedup_attr_forget(full);
   }
   else {
     /* no existing attribute file, check if we need one */
@@ -800,6 +2898,7 @@ int dedup_sys_chown(const char *full, uid_t uid, gid_t gid)
       if (create_attr(full_attr, &st_file) < 0)
         return FAIL;
       res = lchown(full_attr, uid, gid);
+      dedup_attr_forget(full);
     }
     else {
       /* we don't */
@@ -828,7 +2927,7 @@ int dedup_sys_chmod(const char *full, mode_t mode)
 
   int res;
   char *full_attr = fuseattr_name(full);
-  if (lstat(full_attr, &st_attr) == 0) {
+  if (dedup_attr_get(full, &st_attr)) {
     DEBUG_("'%s' mtime %zd", full_attr, st_attr.st_mtime);
     /* there is an attribute file */
     if (st_file.st_uid == st_attr.st_uid &&
@@ -849,6 +2948,7 @@ int dedup_sys_chmod(const char *full, mode_t mode)
       /* this attr file is required, update it */
       res = chmod(full_attr, mode);
     }
+    dedup_attr_forget(full);
   }
   else {
     /* no existing attribute file, check if we need one */
@@ -857,6 +2957,7 @@ int dedup_sys_chmod(const char *full, mode_t mode)
       if (create_attr(full_attr, &st_file) < 0)
         return FAIL;
       res = chmod(full_attr, mode);
+      dedup_attr_forget(full);
     }
     else {
       /* we don't */
@@ -886,7 +2987,7 @@ int dedup_sys_utime(const char *full, struct timeval *tv)
 
   int res;
   char *full_attr = fuseattr_name(full);
-  if (lstat(full_attr, &st_attr) == 0) {
+  if (dedup_attr_get(full, &st_attr)) {
     DEBUG_("'%s' mtime %zd", full_attr, st_attr.st_mtime);
     /* there is an attribute file */
     if (st_file.st_uid == st_attr.st_uid &&
@@ -907,6 +3008,7 @@ int dedup_sys_utime(const char *full, struct timeval *tv)
       /* this attr file is required, update it */
       res = lutimes(full_attr, tv);
     }
+    dedup_attr_forget(full);
   }
   else {
     /* no existing attribute file, check if we need one */
@@ -922,6 +3024,7 @@ int dedup_sys_utime(const char *full, struct timeval *tv)
       if (create_attr(full_attr, &st_file) < 0)
         return FAIL;
       res = lutimes(full_attr, tv);
+      dedup_attr_forget(full);
     }
     else {
       /* we don't */
@@ -939,6 +3042,7 @@ int dedup_sys_unlink(const char *full)
 {
   char *full_attr = fuseattr_name(full);
   unlink(full_attr);
+  dedup_attr_forget(full);
   free(full_attr);
   return unlink(full);
 }
@@ -960,8 +3064,13 @@ int dedup_sys_rename(const char *full_from, const char *full_to)
   if (lstat(full_from, &st_from) == 0) {
     DEBUG_("'%s' mtime %zd", full_from, st_from.st_mtime);
     /* Only regular files get special treatment. */
-    if (!S_ISREG(st_from.st_mode))
-      return rename(full_from, full_to);
+    if (!S_ISREG(st_from.st_mode)) {
+      res = rename(full_from, full_to);
+      /* the files in a directory have other names now */
+      if (res == 0 && S_ISDIR(st_from.st_mode))
+        dedup_attr_forget_dir(full_from);
+      return res;
+    }
 
     /* Does it have more than one link? */
     if (st_from.st_nlink > 1) {
@@ -980,6 +3089,8 @@ int dedup_sys_rename(const char *full_from, const char *full_to)
           char *full_to_attr = fuseattr_name(full_to);
           /* These files may or may not exist, so we don't check for errors. */
           rename(full_from_attr, full_to_attr);
+          dedup_attr_forget(full_from);
+          dedup_attr_forget(full_to);
           free(full_from_attr);
           free(full_to_attr);
           return res;
@@ -995,6 +3106,8 @@ int dedup_sys_rename(const char *full_from, const char *full_to)
   char *full_to_attr = fuseattr_name(full_to);
   /* These files may or may not exist, so we don't check for errors. */
   rename(full_from_attr, full_to_attr);
+  dedup_attr_forget(full_from);
+  dedup_attr_forget(full_to);
   free(full_from_attr);
   free(full_to_attr);
   return res;
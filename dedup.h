@@ -2,10 +2,12 @@
 #include <sys/stat.h>
 #include "structs.h"
 
-const char *hardlink_file(unsigned char *md5, const char *filename);
+char *dedup_match(unsigned char *md5, const char *filename);
+int hardlink_file(const dedup_t *sum, const char *filename, const char *target);
 
 void do_dedup(file_t *file);
-int do_undedup(file_t *file);
+void do_dedup_batch(file_t **files, int count, int (*aborting)(void));
+int do_undedup(file_t *file, int copy);
 void dedup_discard(file_t *file);
 void dedup_rename(file_t *from, file_t *to);
 
@@ -13,10 +15,15 @@ void dedup_load(const char *dir);
 void dedup_save();
 
 int dedup_hash_file(const char *name, unsigned char *md5);
-void dedup_add(unsigned char *md5, const char *filename);
+void dedup_hash_start(file_t *file);
+void dedup_hash_update(file_t *file, const void *buf, size_t len);
+void dedup_hash_finish(file_t *file, off_t size);
+void dedup_hash_drop(file_t *file);
+void dedup_add(const dedup_t *sum, const char *filename);
 int dedup_db_has_md5(unsigned char *md5);
 int dedup_db_has_filehash(unsigned int filename_hash);
 void dedup_init_db(void);
+size_t dedup_db_memory(void);
 
 int dedup_sys_getattr(const char *full, struct stat *stbuf);
 int dedup_sys_chown(const char *full, uid_t uid, gid_t gid);
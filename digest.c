@@ -0,0 +1,221 @@
+/* Content hashes for deduplication in fusecompress.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Deduplication identifies files by a DIGEST_SIZE byte hash of their
+ * uncompressed contents.
+ *
+ *  md5 = MD5 through mhash. Collision resistant, so files with the same
+ *        hash are linked right away, but slow.
+ *  murmur3 = 128-bit MurmurHash3 (x64 variant), several times faster
+ *            than MD5. Not collision resistant: files with the same hash
+ *            are compared before they are linked.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <mhash.h>
+
+#include "structs.h"
+#include "utils.h"
+#include "digest.h"
+
+static void *md5_init(void)
+{
+	MHASH mh = mhash_init(MHASH_MD5);
+
+	return mh == MHASH_FAILED ? NULL : mh;
+}
+
+static void md5_update(void *ctx, const void *buf, size_t len)
+{
+	mhash((MHASH) ctx, buf, len);
+}
+
+static void md5_final(void *ctx, unsigned char *digest)
+{
+	mhash_deinit((MHASH) ctx, digest);
+}
+
+digest_t digest_md5 = {
+	.type = 0x00,
+	.name = "md5",
+	.verify = FALSE,
+	.init = md5_init,
+	.update = md5_update,
+	.final = md5_final,
+};
+
+typedef struct {
+	uint64_t h1;
+	uint64_t h2;
+	uint64_t len;		/* Bytes hashed so far */
+	unsigned char tail[16];	/* Bytes of an incomplete block */
+} murmur3_t;
+
+#define MURMUR3_C1 0x87c37b91114253d5ULL
+#define MURMUR3_C2 0x4cf5ad432745937fULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+static inline void murmur3_block(murmur3_t *m, const unsigned char *block)
+{
+	uint64_t k1;
+	uint64_t k2;
+
+	memcpy(&k1, block, 8);
+	memcpy(&k2, block + 8, 8);
+	k1 = from_le64(k1);
+	k2 = from_le64(k2);
+
+	k1 *= MURMUR3_C1;
+	k1 = rotl64(k1, 31);
+	k1 *= MURMUR3_C2;
+	m->h1 ^= k1;
+	m->h1 = rotl64(m->h1, 27);
+	m->h1 += m->h2;
+	m->h1 = m->h1 * 5 + 0x52dce729;
+
+	k2 *= MURMUR3_C2;
+	k2 = rotl64(k2, 33);
+	k2 *= MURMUR3_C1;
+	m->h2 ^= k2;
+	m->h2 = rotl64(m->h2, 31);
+	m->h2 += m->h1;
+	m->h2 = m->h2 * 5 + 0x38495ab5;
+}
+
+static void *murmur3_init(void)
+{
+	return calloc(1, sizeof(murmur3_t));
+}
+
+static void murmur3_update(void *ctx, const void *buf, size_t len)
+{
+	murmur3_t           *m = ctx;
+	const unsigned char *p = buf;
+	size_t               fill = m->len & 15;
+
+	m->len += len;
+
+	// Complete the block left over from the last call
+	//
+	if (fill)
+	{
+		size_t n = 16 - fill < len ? 16 - fill : len;
+
+		memcpy(m->tail + fill, p, n);
+		p += n;
+		len -= n;
+		if (fill + n < 16)
+			return;
+		murmur3_block(m, m->tail);
+	}
+
+	for (; len >= 16; p += 16, len -= 16)
+		murmur3_block(m, p);
+
+	memcpy(m->tail, p, len);
+}
+
+static void murmur3_final(void *ctx, unsigned char *digest)
+{
+	murmur3_t *m = ctx;
+	uint64_t   k1 = 0;
+	uint64_t   k2 = 0;
+	int        i;
+
+	for (i = (m->len & 15) - 1; i >= 8; i--)
+		k2 = (k2 << 8) | m->tail[i];
+	for (; i >= 0; i--)
+		k1 = (k1 << 8) | m->tail[i];
+
+	if (m->len & 15)
+	{
+		k2 *= MURMUR3_C2;
+		k2 = rotl64(k2, 33);
+		k2 *= MURMUR3_C1;
+		m->h2 ^= k2;
+
+		k1 *= MURMUR3_C1;
+		k1 = rotl64(k1, 31);
+		k1 *= MURMUR3_C2;
+		m->h1 ^= k1;
+	}
+
+	m->h1 ^= m->len;
+	m->h2 ^= m->len;
+	m->h1 += m->h2;
+	m->h2 += m->h1;
+	m->h1 = fmix64(m->h1);
+	m->h2 = fmix64(m->h2);
+	m->h1 += m->h2;
+	m->h2 += m->h1;
+
+	m->h1 = to_le64(m->h1);
+	m->h2 = to_le64(m->h2);
+	memcpy(digest, &m->h1, 8);
+	memcpy(digest + 8, &m->h2, 8);
+	free(m);
+}
+
+digest_t digest_murmur3 = {
+	.type = 0x01,
+	.name = "murmur3",
+	.verify = TRUE,
+	.init = murmur3_init,
+	.update = murmur3_update,
+	.final = murmur3_final,
+};
+
+// Table of supported hashes, indexed by type
+//
+static digest_t *digests[] = {
+	&digest_md5,
+	&digest_murmur3,
+};
+
+digest_t *find_digest(int type)
+{
+	if (type < 0 || type >= sizeof(digests) / sizeof(digests[0]))
+		return NULL;
+
+	return digests[type];
+}
+
+digest_t *find_digest_name(const char *name)
+{
+	int i;
+
+	for (i = 0; i < sizeof(digests) / sizeof(digests[0]); i++)
+		if (!strcmp(name, digests[i]->name))
+			return digests[i];
+	return NULL;
+}
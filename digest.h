@@ -0,0 +1,36 @@
+/* Content hashes for deduplication in fusecompress.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include "structs.h"
+
+extern digest_t digest_md5;
+extern digest_t digest_murmur3;
+
+/**
+ * @return Hash with the given ID, as recorded in the dedup DB, or NULL.
+ */
+digest_t *find_digest(int type);
+
+/**
+ * @return Hash with the given name, or NULL.
+ */
+digest_t *find_digest_name(const char *name);
+
+#endif
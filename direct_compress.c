@@ -21,6 +21,8 @@
 
 #include <pthread.h>
 #include <assert.h>
+#include <stdio.h>
+#include <limits.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -29,6 +31,7 @@
 #include <syslog.h>
 #include <errno.h>
 #include <utime.h>
+#include <time.h>
  
 #include "structs.h"
 #include "globals.h"
@@ -38,17 +41,370 @@
 #include "direct_compress.h"
 #include "compress.h"
 #include "background_compress.h"
+#include "disk_cache.h"
+#include "space.h"
 #include "utils.h"
+#include "journal.h"
 #ifdef WITH_DEDUP
 #include "dedup.h"
 #endif
 
-/*  MAX_DATABASE_LEN = When the database has this many entries, we clean the database
+/*  MAX_DATABASE_LEN = When the database has this many entries, the janitor trims least recently
+                       used idle files from it until it is down to MIN_DATABASE_LEN
+    MAX_DATABASE_AGE = Idle files not used for this many seconds are trimmed anyway
+    MAX_DATABASE_RECENT = When this many files have been added or released since the last
+                          check, the janitor looks for files to compress or deduplicate
 
     Note that these are soft targets and can grow over these sizes if you have a ton of open files.
-    Making these big will only slow us down, as we have to scan through the entire database on new files.
+    Lookups are hashed, so a big database costs only memory.
+
+    JANITOR_INTERVAL = Seconds between janitor runs when nobody asks for one
+    JANITOR_MIN_DELAY = Milliseconds between two janitor runs
+
+    HOT_MAX_BACKOFF = A file written to again shortly after its background compression has
+                      its cool-down doubled, up to compress_cooldown << HOT_MAX_BACKOFF
+    HOT_WINDOW = Writes within this many cool-downs after the compression count as "shortly"
 */
-#define MAX_DATABASE_LEN 30
+#define MAX_DATABASE_LEN 32768
+#define MIN_DATABASE_LEN (MAX_DATABASE_LEN / 4 * 3)
+#define MAX_DATABASE_AGE 600
+#define MAX_DATABASE_RECENT 30
+
+#define JANITOR_INTERVAL 5
+#define JANITOR_MIN_DELAY 100
+
+#define HOT_MAX_BACKOFF 6
+#define HOT_WINDOW 4
+
+static inline unsigned int direct_bucket(unsigned int filename_hash)
+{
+	return (filename_hash ^ (filename_hash >> 14)) & FILE_DATABASE_HASH_MASK;
+}
+
+static inline pthread_mutex_t *direct_stripe(unsigned int bucket)
+{
+	return &database.stripe[bucket % FILE_DATABASE_STRIPES];
+}
+
+static inline unsigned int direct_ino_bucket(dev_t dev, ino_t ino)
+{
+	return (unsigned int) (ino ^ (ino >> 14) ^ dev) & FILE_DATABASE_HASH_MASK;
+}
+
+static struct list_head *direct_init_chains(void)
+{
+	int               i;
+	struct list_head *head;
+
+	head = malloc(sizeof(struct list_head) * FILE_DATABASE_HASH_SIZE);
+	if (!head)
+	{
+		CRIT_("No memory!");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < FILE_DATABASE_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&head[i]);
+
+	return head;
+}
+
+void direct_init_db(void)
+{
+	int i;
+
+	database.head = direct_init_chains();
+	database.alias_head = direct_init_chains();
+	database.ino_head = direct_init_chains();
+	for (i = 0; i < FILE_DATABASE_STRIPES; i++)
+		pthread_mutex_init(&database.stripe[i], &locktype);
+
+	pthread_mutex_init(&database.lock, &locktype);
+	pthread_mutex_init(&database.recent_lock, &locktype);
+	pthread_mutex_init(&database.ino_lock, &locktype);
+}
+
+// Returns the live file_t indexed for the inode or NULL. Called with
+// ino_lock held.
+//
+static file_t *direct_ino_find(dev_t dev, ino_t ino)
+{
+	file_t *file;
+
+	NEED_LOCK(&database.ino_lock);
+
+	list_for_each_entry(file, &database.ino_head[direct_ino_bucket(dev, ino)], ino_list)
+	{
+		if (file->ino == ino && file->dev == dev)
+			return file;
+	}
+	return NULL;
+}
+
+/**
+ * Add file to the inode index, or move it if its inode has changed.
+ *
+ * If another file_t is in use for the same inode (two names have been
+ * looked up at the same time), both are marked as shared. The background
+ * compression leaves them alone, as a rewrite through one of them would
+ * invalidate the state kept in the other.
+ */
+void direct_ino_register(file_t *file)
+{
+	file_t *other;
+
+	NEED_LOCK(&file->lock);
+
+	if (!inode_identity || !file->ino)
+		return;
+
+	LOCK(&database.ino_lock);
+	list_del_init(&file->ino_list);
+
+	other = direct_ino_find(file->dev, file->ino);
+	if (other)
+	{
+		// Reading the fields of other without its lock is racy, but
+		// the worst outcome is a file that isn't compressed
+		//
+		if (other->deleted && other->accesses == 0)
+		{
+			// Stale entry of a file that is gone, the inode
+			// has been reused
+			//
+			list_del_init(&other->ino_list);
+		}
+		else
+		{
+			DEBUG_("'%s' and '%s' share an inode", file->filename, other->filename);
+			other->shared = TRUE;
+			file->shared = TRUE;
+			UNLOCK(&database.ino_lock);
+			return;
+		}
+	}
+	list_add(&file->ino_list, &database.ino_head[direct_ino_bucket(file->dev, file->ino)]);
+
+	UNLOCK(&database.ino_lock);
+}
+
+static void direct_ino_unregister(file_t *file)
+{
+	NEED_LOCK(&file->lock);
+
+	LOCK(&database.ino_lock);
+	list_del_init(&file->ino_list);
+	UNLOCK(&database.ino_lock);
+}
+
+// Remove alias from the database and destroy it. Called with the stripe
+// lock of its bucket held.
+//
+static void direct_alias_del(alias_t *alias)
+{
+	NEED_LOCK(&alias->file->lock);
+
+	list_del(&alias->list);
+	list_del(&alias->file_list);
+	__sync_sub_and_fetch(&database.entries, 1);
+
+	free(alias);
+}
+
+/**
+ * Make filename another name of file, which has been found through the
+ * inode index. Called with the stripe lock of bucket held.
+ *
+ * @return Locked file or NULL if it is no longer the right file.
+ */
+static file_t *direct_alias_new(unsigned int bucket, unsigned int hash,
+                                const char *filename, int len, const struct stat *st)
+{
+	file_t  *file;
+	alias_t *alias;
+
+	NEED_LOCK(direct_stripe(bucket));
+
+	// Take a reference, so that the file can't be trimmed while we
+	// wait for its lock with the index unlocked
+	//
+	LOCK(&database.ino_lock);
+	file = direct_ino_find(st->st_dev, st->st_ino);
+	if (file)
+		__sync_add_and_fetch(&file->refs, 1);
+	UNLOCK(&database.ino_lock);
+
+	if (!file)
+		return NULL;
+
+	LOCK(&file->lock);
+	__sync_sub_and_fetch(&file->refs, 1);
+
+	if ((file->deleted && file->accesses == 0) ||
+	    file->ino != st->st_ino || file->dev != st->st_dev)
+	{
+		UNLOCK(&file->lock);
+		return NULL;
+	}
+
+	alias = malloc(sizeof(alias_t) + len);
+	if (!alias)
+	{
+		UNLOCK(&file->lock);
+		return NULL;
+	}
+	DEBUG_("('%s') is another name of '%s'", filename, file->filename);
+
+	alias->file = file;
+	alias->filename_hash = hash;
+	alias->len = len;
+	alias->deleted = FALSE;
+	alias->filename = (char *) alias + sizeof(alias_t);
+	memcpy(alias->filename, filename, len);
+
+	list_add(&alias->list, &database.alias_head[bucket]);
+	list_add(&alias->file_list, &file->aliases);
+	__sync_add_and_fetch(&database.entries, 1);
+
+	return file;
+}
+
+/**
+ * Drop aliases from one hash chain. Without force, only those of files
+ * idle since cutoff are dropped, and busy files are skipped like in
+ * direct_open_evict_bucket(). Removed names are always dropped.
+ */
+static void direct_alias_evict_bucket(int bucket, time_t cutoff, int force)
+{
+	alias_t         *alias;
+	alias_t         *safe = NULL;
+	file_t          *file;
+	pthread_mutex_t *stripe;
+
+	stripe = direct_stripe(bucket);
+	LOCK(stripe);
+
+	list_for_each_entry_safe(alias, safe, &database.alias_head[bucket], list)
+	{
+		file = alias->file;
+		if (force)
+		{
+			LOCK(&file->lock);
+		}
+		else
+		{
+			if (!alias->deleted && (file->accesses != 0 || file->last_use > cutoff))
+				continue;
+			if (pthread_mutex_trylock(&file->lock) != 0)
+				continue;
+		}
+		direct_alias_del(alias);
+		UNLOCK(&file->lock);
+	}
+
+	UNLOCK(stripe);
+}
+
+/**
+ * Queue file to be looked at by direct_open_purge_recent(). Called when
+ * a file is added to the database and when its last user goes away.
+ */
+void direct_recent(file_t *file)
+{
+	NEED_LOCK(&file->lock);
+
+	file->last_use = time(NULL);
+
+	LOCK(&database.recent_lock);
+	if (list_empty(&file->recent))
+	{
+		list_add_tail(&file->recent, &database.recent);
+		database.recent_entries++;
+	}
+	UNLOCK(&database.recent_lock);
+}
+
+static void direct_recent_del(file_t *file)
+{
+	NEED_LOCK(&file->lock);
+
+	LOCK(&database.recent_lock);
+	if (!list_empty(&file->recent))
+	{
+		list_del_init(&file->recent);
+		if (file->cooling)
+		{
+			file->cooling = FALSE;
+			database.cooling_entries--;
+		}
+		else
+			database.recent_entries--;
+	}
+	UNLOCK(&database.recent_lock);
+}
+
+static inline time_t direct_cooldown(file_t *file)
+{
+	return (time_t) compress_cooldown << file->hot_backoff;
+}
+
+// Check if file has been written to less than its cool-down ago.
+//
+static inline int direct_cooling(file_t *file, time_t now)
+{
+	return file->last_write && now - file->last_write < direct_cooldown(file);
+}
+
+// Check if file has been compressed recently enough for a write to make
+// it a repeat offender. Such files keep their history in the database.
+//
+static inline int direct_hot(file_t *file, time_t now)
+{
+	return file->compressed_at &&
+	       now - file->compressed_at < HOT_WINDOW * direct_cooldown(file);
+}
+
+/**
+ * Record a modification of file. Files that are written to again shortly
+ * after they have been compressed in the background get a longer
+ * cool-down, files that have been left alone for long start over.
+ */
+void direct_modified(file_t *file)
+{
+	time_t now = time(NULL);
+
+	NEED_LOCK(&file->lock);
+
+	if (file->compressed_at)
+	{
+		if (!direct_hot(file, now))
+			file->hot_backoff = 0;
+		else if (file->hot_backoff < HOT_MAX_BACKOFF)
+		{
+			file->hot_backoff++;
+			DEBUG_("'%s' rewritten after compression, cool-down now %lds",
+			       file->filename, (long) direct_cooldown(file));
+		}
+		file->compressed_at = 0;
+	}
+	file->last_write = now;
+}
+
+// Park an idle file that is still cooling down, so that the janitor
+// looks at it again later.
+//
+static void direct_cool(file_t *file)
+{
+	NEED_LOCK(&file->lock);
+
+	LOCK(&database.recent_lock);
+	if (list_empty(&file->recent))
+	{
+		file->cooling = TRUE;
+		list_add_tail(&file->recent, &database.cooling);
+		database.cooling_entries++;
+	}
+	UNLOCK(&database.recent_lock);
+}
 
 void flush_file_cache(file_t* file)
 {
@@ -76,15 +432,150 @@ void direct_open_delete(file_t *file)
 	NEED_LOCK(&file->lock);
 
 	flush_file_cache(file);
+	compress_resume_discard(file);
+#ifdef WITH_DEDUP
+	dedup_hash_drop(file);
+#endif
 	
 	// It's out of the database, so we can unlock and destroy it
 	//
 	UNLOCK(&file->lock);
 	pthread_mutex_destroy(&file->lock);
 
+	if (file->filename != (char *) file + sizeof(file_t))
+		free(file->filename);
 	free(file);
 }
 
+/**
+ * Schedule an idle file for background compression or deduplication.
+ * Files written to less than their cool-down ago are left for later,
+ * unless force is set.
+ *
+ * @return TRUE if the file has been queued or is cooling down, FALSE if
+ *         there is nothing to do.
+ */
+static int direct_open_schedule(file_t *file, int force)
+{
+	NEED_LOCK(&file->lock);
+
+	if (!force && direct_cooling(file, time(NULL)))
+	{
+		direct_cool(file);
+		return TRUE;
+	}
+
+	// Check if file should be compressed
+	//
+	// file must not be deleted, must not have assigned a compressor,
+	// must be bigger than minimal size and compressor can be assigned
+	// with this file.
+	// Also, the backing FS must have at least enough space to store the
+	// file uncompressed (worst case), so files of unknown size are left
+	// alone.
+	if ((!file->deleted) &&
+	    (!file->compressor) &&
+	    (file->size != (off_t) -1) && (file->size > min_filesize_background) &&
+	    space_check(file->size) &&
+	    !read_only &&
+	    choose_compressor(file))
+	{
+		DEBUG_("compress file in background");
+		background_compress(file);
+		return TRUE;
+	}
+#ifdef WITH_DEDUP
+	else if (dedup_enabled && !file->deleted && !file->deduped &&
+		 !is_excluded(file->filename)) {
+		DEBUG_("deduplicating file in background");
+		background_dedup(file);
+		return TRUE;
+	}
+#endif
+	return FALSE;
+}
+
+// Check if file can be removed from the database: it must have no other
+// names and no lookups through the inode index may be pending. If so,
+// it is removed from the index.
+//
+static int direct_open_trimmable(file_t *file)
+{
+	NEED_LOCK(&file->lock);
+
+	// Keep the failure on record, a new file_t would serve the data
+	//
+	if (file->status & BROKEN)
+		return FALSE;
+
+	if (!list_empty(&file->aliases))
+		return FALSE;
+
+	LOCK(&database.ino_lock);
+	if (file->refs)
+	{
+		UNLOCK(&database.ino_lock);
+		return FALSE;
+	}
+	list_del_init(&file->ino_list);
+	UNLOCK(&database.ino_lock);
+
+	return TRUE;
+}
+
+// Remove file from the database and destroy it. Called with the
+// stripe lock of its bucket held.
+//
+static void direct_open_trim(file_t *file)
+{
+	NEED_LOCK(&file->lock);
+
+	DEBUG_("trim from database");
+	list_del(&file->list);
+	direct_recent_del(file);
+	__sync_sub_and_fetch(&database.entries, 1);
+
+	// It's out of the database, so we can destroy it
+	//
+	direct_open_delete(file);
+}
+
+/**
+ * Trim idle files not used since cutoff from one hash chain. Files that
+ * are busy are skipped, so the janitor never waits for file locks while
+ * it holds a stripe lock.
+ */
+static void direct_open_evict_bucket(int bucket, time_t cutoff)
+{
+	file_t          *file;
+	file_t          *safe = NULL;
+	pthread_mutex_t *stripe;
+	time_t           now = time(NULL);
+
+	stripe = direct_stripe(bucket);
+	LOCK(stripe);
+
+	list_for_each_entry_safe(file, safe, &database.head[bucket], list)
+	{
+		if (file->accesses != 0 || file->last_use > cutoff)
+			continue;
+		if (pthread_mutex_trylock(&file->lock) != 0)
+			continue;
+
+		/* check again after locking */
+		if (file->accesses == 0 && !direct_hot(file, now) &&
+		    !direct_open_schedule(file, FALSE) &&
+		    direct_open_trimmable(file))
+		{
+			direct_open_trim(file);
+			continue;
+		}
+		UNLOCK(&file->lock);
+	}
+
+	UNLOCK(stripe);
+}
+
 /**
  * Truncate database
  *
@@ -93,100 +584,280 @@ void direct_open_delete(file_t *file)
  */
 void _direct_open_purge(int force)
 {
-	file_t *file;
-	file_t *safe = NULL;
+	int              i;
+	file_t          *file;
+	file_t          *safe = NULL;
+	pthread_mutex_t *stripe;
 
 	NEED_LOCK(&database.lock);
 
 	DEBUG_("cleaning db, entries %d", database.entries);
 
-	list_for_each_entry_safe(file, safe, &database.head, list)
+	if (!database.head)
+		return;
+
+	// Aliases pin their files, so they go first
+	//
+	for (i = 0; i < FILE_DATABASE_HASH_SIZE; i++)
+		direct_alias_evict_bucket(i, time(NULL), force);
+
+	for (i = 0; i < FILE_DATABASE_HASH_SIZE; i++)
+	{
+		stripe = direct_stripe(i);
+		LOCK(stripe);
+
+		list_for_each_entry_safe(file, safe, &database.head[i], list)
+		{
+
+			DEBUG_("('%s'), accesses: %d, deleted: %d, compressor: %p, size: %zi",
+					file->filename, file->accesses, file->deleted,
+					file->compressor, file->size);
+
+			if (file->accesses == 0)
+			{
+				LOCK(&file->lock);
+				/* check again after locking */
+				if (file->accesses == 0 && !direct_open_schedule(file, force) &&
+				    direct_open_trimmable(file))
+				{
+					direct_open_trim(file);
+					continue;
+				}
+				UNLOCK(&file->lock);
+			}
+			else
+			{
+				if (force)
+				{
+					LOCK(&file->lock);
+					DEBUG_("Forcing trim from database");
+					DEBUG_("This could happend only in debug mode, "
+					       "when fusecompress was terminated with "
+					       "some files still opened. Don't report "
+					       "this as bug please.");
+					list_del(&file->list);
+					direct_recent_del(file);
+					direct_ino_unregister(file);
+					__sync_sub_and_fetch(&database.entries, 1);
+
+					// It's out of the database, so we can destroy it
+					//
+					/* The background compression thread seems to still use this lock
+					   sometimes, leading to massive data corruption. This is triggered
+					   by using LZMA. The bright side is that this code here is only run
+					   on unmount, so losing a few bytes by not freeing the file
+					   descriptor won't hurt us. */
+					//direct_open_delete(file);
+					UNLOCK(&file->lock);
+				}
+			}
+		}
+
+		UNLOCK(stripe);
+	}
+}
+
+inline void direct_open_purge(void)
+{
+	_direct_open_purge(FALSE);
+}
+
+inline void direct_open_purge_force(void)
+{
+	_direct_open_purge(TRUE);
+}
+
+/**
+ * Look at the files that have been added or released since the last call
+ * and schedule the idle ones for background compression or deduplication.
+ * They stay in the database, so their cached state survives.
+ */
+static void direct_open_purge_recent(void)
+{
+	file_t *file;
+	int     count;
+
+	NEED_LOCK(&database.lock);
+
+	count = database.recent_entries;
+	while (count-- > 0)
+	{
+		LOCK(&database.recent_lock);
+		if (list_empty(&database.recent))
+		{
+			UNLOCK(&database.recent_lock);
+			break;
+		}
+		file = list_entry(database.recent.next, file_t, recent);
+		list_del_init(&file->recent);
+		database.recent_entries--;
+		UNLOCK(&database.recent_lock);
+
+		// Only purging frees file_t and we hold database.lock,
+		// so the file cannot go away under us.
+		//
+		LOCK(&file->lock);
+		if (file->accesses == 0)
+			direct_open_schedule(file, FALSE);
+		UNLOCK(&file->lock);
+	}
+}
+
+/**
+ * Look at the files that are cooling down again. Those that have cooled
+ * down are scheduled, the others go back to the end of the list.
+ */
+static void direct_open_purge_cooling(void)
+{
+	file_t *file;
+	int     count;
+
+	NEED_LOCK(&database.lock);
+
+	count = database.cooling_entries;
+	while (count-- > 0)
+	{
+		LOCK(&database.recent_lock);
+		if (list_empty(&database.cooling))
+		{
+			UNLOCK(&database.recent_lock);
+			break;
+		}
+		file = list_entry(database.cooling.next, file_t, recent);
+		list_del_init(&file->recent);
+		file->cooling = FALSE;
+		database.cooling_entries--;
+		UNLOCK(&database.recent_lock);
+
+		// Files in use are queued again by direct_recent() when
+		// they are released
+		//
+		LOCK(&file->lock);
+		if (file->accesses == 0)
+			direct_open_schedule(file, FALSE);
+		UNLOCK(&file->lock);
+	}
+}
+
+/**
+ * Evict files idle for longer than MAX_DATABASE_AGE. While the database
+ * is still bigger than MAX_DATABASE_LEN, the age limit is halved and the
+ * database walked again, which gives an approximate LRU order without
+ * having to maintain a global LRU list in the lookup path.
+ */
+static void direct_open_evict(void)
+{
+	int    i;
+	time_t now;
+	time_t age;
+
+	NEED_LOCK(&database.lock);
+
+	now = time(NULL);
+	age = MAX_DATABASE_AGE;
+
+	do {
+		for (i = 0; i < FILE_DATABASE_HASH_SIZE; i++)
+		{
+			direct_alias_evict_bucket(i, now - age, FALSE);
+			direct_open_evict_bucket(i, now - age);
+		}
+		DEBUG_("evicted files idle for %lds, entries %d", (long) age, database.entries);
+		age /= 2;
+	} while (age > 0 && database.entries > MIN_DATABASE_LEN + comp_database.entries);
+}
+
+static inline int direct_open_need_purge(void)
+{
+	return database.entries > MAX_DATABASE_LEN + comp_database.entries ||
+	       database.recent_entries > MAX_DATABASE_RECENT;
+}
+
+static void janitor_unlock(void *arg)
+{
+	UNLOCK(&database.lock);
+}
+
+static void janitor_deadline(struct timespec *deadline, long msec)
+{
+	clock_gettime(CLOCK_REALTIME, deadline);
+	deadline->tv_sec += msec / 1000;
+	deadline->tv_nsec += (msec % 1000) * 1000000;
+	if (deadline->tv_nsec >= 1000000000)
+	{
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+/**
+ * Janitor thread. Schedules recently released files for background
+ * compression and evicts old entries from the database, so that
+ * lookups in direct_open() never have to do it themselves.
+ */
+void *thread_janitor(void *arg)
+{
+	time_t           next_aging = 0;
+	time_t           next_checkpoint = 0;
+	time_t           last_cooling = 0;
+	int              cancel_state;
+	struct timespec  deadline;
+
+	// database.lock is only released while waiting, which is also
+	// where the thread gets canceled.
+	//
+	LOCK(&database.lock);
+	pthread_cleanup_push(janitor_unlock, NULL);
+
+	while (TRUE)
 	{
+		janitor_deadline(&deadline, JANITOR_INTERVAL * 1000);
+		while (!direct_open_need_purge())
+		{
+			if (pthread_cond_timedwait(&database.cond, &database.lock, &deadline) == ETIMEDOUT)
+				break;
+		}
 
-		DEBUG_("('%s'), accesses: %d, deleted: %d, compressor: %p, size: %zi",
-				file->filename, file->accesses, file->deleted,
-				file->compressor, file->size);
+		// Keep the free space figures fresh for all the
+		// candidates of this run
+		//
+		space_refresh();
 
-		if (file->accesses == 0)
+		direct_open_purge_recent();
+		if (time(NULL) != last_cooling)
 		{
-		        LOCK(&file->lock);
-		        /* check again after locking */
-		        if (file->accesses == 0) {
-                          // Check if file should be compressed
-                          //
-                          // file must not be deleted, must not have assigned a compressor,
-                          // must be bigger than minimal size or have unknown size ( == 0) and
-                          // compressor can be assigned with this file.
-                          // Also, the backing FS must have at least enough space to store the
-                          // file uncompressed (worst case).
-                          struct statvfs stat;
-                          if ((!file->deleted) &&
-                              (!file->compressor) &&
-                              ((file->size == (off_t) -1) || (file->size > min_filesize_background)) &&
-                              statvfs(file->filename, &stat) == 0 &&
-                              (stat.f_bsize * stat.f_bavail >= file->size || (geteuid() == 0 && stat.f_bsize * stat.f_bfree >= file->size)) &&
-                              !read_only &&
-                              choose_compressor(file))
-                          {
-                                  DEBUG_("compress file in background");
-                                  background_compress(file);
-                          }
-#ifdef WITH_DEDUP
-                          else if (dedup_enabled && !file->deleted && !file->deduped &&
-                                   !is_excluded(file->filename)) {
-                                  DEBUG_("deduplicating file in background");
-                                  background_dedup(file);
-                          }
-#endif
-                          else
-                          {
-                                  DEBUG_("trim from database");
-                                  list_del(&file->list);
-                                  database.entries--;
-
-                                  // It's out of the database, so we can destroy it
-                                  //
-                                  direct_open_delete(file);
-                                  continue;
-                          }
-                        }
-			UNLOCK(&file->lock);
+			direct_open_purge_cooling();
+			last_cooling = time(NULL);
 		}
-		else
+		if (database.entries > MAX_DATABASE_LEN + comp_database.entries ||
+		    time(NULL) >= next_aging)
 		{
-			if (force)
-			{
-			        LOCK(&file->lock);
-				DEBUG_("Forcing trim from database");
-				DEBUG_("This could happend only in debug mode, "
-				       "when fusecompress was terminated with "
-				       "some files still opened. Don't report "
-				       "this as bug please.");
-				list_del(&file->list);
-				database.entries--;
-	
-				// It's out of the database, so we can destroy it
-				//
-				/* The background compression thread seems to still use this lock
-				   sometimes, leading to massive data corruption. This is triggered
-				   by using LZMA. The bright side is that this code here is only run
-				   on unmount, so losing a few bytes by not freeing the file
-				   descriptor won't hurt us. */
-				//direct_open_delete(file);
-				UNLOCK(&file->lock);
-			}
-		}			
-	}
-}
+			direct_open_evict();
+			next_aging = time(NULL) + MAX_DATABASE_AGE / 2;
+		}
 
-inline void direct_open_purge(void)
-{
-	_direct_open_purge(FALSE);
-}
+		// Syncing the queue journal may take a while, it must neither
+		// hold up lookups nor be canceled halfway
+		//
+		if (time(NULL) >= next_checkpoint)
+		{
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+			UNLOCK(&database.lock);
+			journal_checkpoint();
+			LOCK(&database.lock);
+			pthread_setcancelstate(cancel_state, NULL);
+			next_checkpoint = time(NULL) + JANITOR_INTERVAL;
+		}
 
-inline void direct_open_purge_force(void)
-{
-	_direct_open_purge(TRUE);
+		// Don't spin when there is nothing that could be evicted
+		//
+		janitor_deadline(&deadline, JANITOR_MIN_DELAY);
+		while (pthread_cond_timedwait(&database.cond, &database.lock, &deadline) != ETIMEDOUT)
+			;
+	}
+
+	pthread_cleanup_pop(1);
+	return NULL;
 }
 
 file_t* direct_new_file(unsigned int filename_hash, const char *filename, int len)
@@ -227,11 +898,29 @@ file_t* direct_new_file(unsigned int filename_hash, const char *filename, int le
 	file->compressor = NULL;
 	file->type = 0;
 	file->dontcompress = FALSE;
+	file->shared = FALSE;
 	file->skipped = 0;
 	file->status = 0;
 
 	file->cache = NULL;
 	file->cache_size = 0;
+	file->read_opens = 0;
+	file->ino = 0;
+	file->dev = 0;
+	file->nlink = 0;
+	file->refs = 0;
+	file->version = 1;
+	file->kernel_version = 0;
+	file->last_use = time(NULL);
+	file->last_write = 0;
+	file->compressed_at = 0;
+	file->hot_backoff = 0;
+	file->cooling = FALSE;
+	file->resume = NULL;
+	file->queued[0] = 0;
+	file->queued[1] = 0;
+	file->hasher = NULL;
+	file->undedup = FALSE;
 	
 	file->filename_hash = filename_hash;
 	file->filename = (char *) file + sizeof(file_t);
@@ -240,28 +929,23 @@ file_t* direct_new_file(unsigned int filename_hash, const char *filename, int le
 	pthread_mutex_init(&file->lock, &locktype);
 	pthread_cond_init(&file->cond, NULL);
 	INIT_LIST_HEAD(&file->head);
+	INIT_LIST_HEAD(&file->recent);
+	INIT_LIST_HEAD(&file->aliases);
+	INIT_LIST_HEAD(&file->ino_list);
 
 	return file;
 }
 
-// Returns locked database entry
-file_t *direct_open(const char *filename, int stabile)
+// Returns locked file from the given bucket or NULL
+static file_t *direct_lookup(unsigned int bucket, unsigned int hash, const char *filename, int len)
 {
-	int          len;
-	int          hysteresis;
-	unsigned int hash;
-	file_t      *file;
-	file_t      *safe = NULL;
-
-	assert(filename);
-
-	DEBUG_("('%s')", filename);
-
-	hash = gethash(filename, &len);
+	file_t  *file;
+	alias_t *alias;
+	alias_t *safe = NULL;
 
-	LOCK(&database.lock);
+	NEED_LOCK(direct_stripe(bucket));
 
-	list_for_each_entry_safe(file, safe, &database.head, list)
+	list_for_each_entry(file, &database.head[bucket], list)
 	{
 	        /* file can only be free()d after it has been removed from the database,
 	           which we have locked, so it's safe to access it for reading without
@@ -269,54 +953,153 @@ file_t *direct_open(const char *filename, int stabile)
 	        if (unlikely(file->filename_hash == hash)) {
                   LOCK(&file->lock);
 
-//		  DEBUG_("%d: ('%s'), size: %lli, deleted: %d",
-//			 i++, file->filename, file->size, file->deleted);
-
-                  if (likely((memcmp(file->filename, filename, len) == 0)))
+                  if (likely((strcmp(file->filename, filename) == 0)))
                   {
-                          // Return file with lock. This file is requested and that
-                          // means that file cannot be in deleted state.
-                          //
-                          file->deleted = FALSE;
-                          UNLOCK(&database.lock);
-
-                          if (stabile == TRUE)
-                          {
-                                  // TODO: Caller require stable enviroment. The question is:
-                                  // does he need decompressed file or would he work with compressed fine?
-                                  // And has compression been running for a long time? Is it before end or does it
-                                  // just started now? What is better?
-                                  //
-                                  // Caller require stable enviroment - cancel compressing
-                                  // if it is running now or block until decompression ends...
-                                  //
-                                  while (file->status & (COMPRESSING | DECOMPRESSING | DEDUPING))
-                                  {
-                                          file->status |= CANCEL;
-                                          pthread_cond_wait(&file->cond, &file->lock);
-                                  }
-                          }
                           return file;
                   }
                   UNLOCK(&file->lock);
                 }
 	}
 
-	hysteresis = comp_database.entries;
+	list_for_each_entry_safe(alias, safe, &database.alias_head[bucket], list)
+	{
+		if (alias->filename_hash != hash || alias->len != len ||
+		    memcmp(alias->filename, filename, len) != 0)
+			continue;
+
+		file = alias->file;
+		LOCK(&file->lock);
+		if (!alias->deleted)
+			return file;
+
+		// The name has been removed, it may be a different file now
+		//
+		direct_alias_del(alias);
+		UNLOCK(&file->lock);
+	}
+	return NULL;
+}
+
+// Returns locked database entry
+file_t *direct_open(const char *filename, int stabile)
+{
+	int              len;
+	unsigned int     hash;
+	unsigned int     bucket;
+	pthread_mutex_t *stripe;
+	file_t          *file;
+	struct stat      st;
+	int              have_st = FALSE;
+
+	assert(filename);
+
+	DEBUG_("('%s')", filename);
+
+	hash = gethash(filename, &len);
+	bucket = direct_bucket(hash);
+	stripe = direct_stripe(bucket);
+
+	LOCK(stripe);
 
-	if (database.entries++ > MAX_DATABASE_LEN + hysteresis)
+	file = direct_lookup(bucket, hash, filename, len);
+	if (!file && inode_identity)
+	{
+		// This may be another name of a file we know. Don't keep
+		// the stripe locked while asking the backing filesystem.
+		//
+		UNLOCK(stripe);
+		have_st = (lstat(filename, &st) == 0 && S_ISREG(st.st_mode));
+		LOCK(stripe);
+
+		file = direct_lookup(bucket, hash, filename, len);
+		if (!file && have_st)
+			file = direct_alias_new(bucket, hash, filename, len, &st);
+	}
+	if (file)
 	{
-		direct_open_purge();
+		// Return file with lock. This file is requested and that
+		// means that file cannot be in deleted state.
+		//
+		file->deleted = FALSE;
+		file->last_use = time(NULL);
+		UNLOCK(stripe);
+
+		if (stabile == TRUE)
+		{
+			// TODO: Caller require stable enviroment. The question is:
+			// does he need decompressed file or would he work with compressed fine?
+			// And has compression been running for a long time? Is it before end or does it
+			// just started now? What is better?
+			//
+			// Caller require stable enviroment - cancel compressing
+			// if it is running now or block until decompression ends...
+			//
+			while (file->status & (COMPRESSING | DECOMPRESSING | DEDUPING))
+			{
+				file->status |= CANCEL;
+				pthread_cond_wait(&file->cond, &file->lock);
+			}
+		}
+		return file;
 	}
 
 	file = direct_new_file(hash, filename, len);
+	if (have_st)
+	{
+		file->ino = st.st_ino;
+		file->dev = st.st_dev;
+		file->nlink = st.st_nlink;
+	}
 
 	// Return file with read-lock
 	//
 	LOCK(&file->lock);
-	list_add_tail(&file->list, &database.head);
+	list_add_tail(&file->list, &database.head[bucket]);
+	__sync_add_and_fetch(&database.entries, 1);
+	direct_recent(file);
+	direct_ino_register(file);
+
+	UNLOCK(stripe);
+
+	// Wake up the janitor. Not holding database.lock here may lose
+	// the wakeup, but then the janitor runs on its timer anyway.
+	//
+	if (direct_open_need_purge())
+		pthread_cond_signal(&database.cond);
+
+	return file;
+}
+
+/**
+ * Look up a file that has been found in the backing directory rather
+ * than through the mount, and have the janitor consider it for
+ * background work like a file that has just been released.
+ *
+ * @param stbuf Result of lstat() of the file.
+ * @return Locked database entry, or NULL if its header can't be read.
+ */
+file_t *direct_open_found(const char *filename, const struct stat *stbuf)
+{
+	file_t *file;
+	off_t   size;
+
+	file = direct_open(filename, FALSE);
+
+	// The janitor ignores files of unknown size
+	//
+	if (file->size == (off_t) -1)
+	{
+		size = stbuf->st_size;
+		if (size >= sizeof(header_t) &&
+		    file_read_header_name(filename, &file->compressor, &size) == FAIL)
+		{
+			UNLOCK(&file->lock);
+			return NULL;
+		}
+		file->size = size;
+	}
+	direct_recent(file);
 
-	UNLOCK(&database.lock);
 	return file;
 }
 
@@ -339,6 +1122,12 @@ int direct_close(file_t *file, descriptor_t *descriptor)
 
 		ret = file->compressor->close(descriptor->handle);
 
+#ifdef WITH_DEDUP
+		// Keep the hash of the data written for do_dedup()
+		//
+		if (dedup_enabled && ret == 0)
+			dedup_hash_finish(file, file->size);
+#endif
 		descriptor->offset = 0;
 		descriptor->handle = NULL;
 	}
@@ -372,6 +1161,61 @@ static inline off_t bytes_to_skip(off_t now, off_t req)
 	else return req;
 }
 
+/* A file opened for reading this many times while in the database is
+   considered hot and copied to the disk cache on the next read from its
+   beginning. */
+#define DISK_CACHE_HOT_OPENS 2
+
+/**
+ * Serve a read from a decompressed copy in the disk cache, creating the
+ * copy if necessary.
+ *
+ * @return Number of bytes read, or FAIL with errno set to 0 if there is
+ *         no copy and none could be made.
+ */
+static int direct_decompress_cached(file_t *file, descriptor_t *descriptor, void *buffer, size_t size, off_t offset)
+{
+	int fd;
+	int ret;
+
+	NEED_LOCK(&file->lock);
+
+	if (descriptor->cache_fd == FAIL)
+	{
+		/* an invalidated copy is still being read from */
+		if (descriptor->cache_stale_fd != FAIL)
+		{
+			errno = 0;
+			return FAIL;
+		}
+		fd = disk_cache_open(file, descriptor);
+		if (fd == FAIL)
+			fd = disk_cache_fill(file, descriptor);
+		if (fd == FAIL)
+		{
+			errno = 0;
+			return FAIL;
+		}
+		descriptor->cache_fd = fd;
+
+		/* the streaming decoder is no longer needed */
+		if (descriptor->handle)
+		{
+			file->compressor->close(descriptor->handle);
+			descriptor->handle = NULL;
+			descriptor->offset = 0;
+			lseek(descriptor->fd, sizeof(header_t), SEEK_SET);
+		}
+	}
+
+	fd = disk_cache_pin(descriptor);
+	UNLOCK(&file->lock);
+	ret = pread(fd, buffer, size, offset);
+	LOCK(&file->lock);
+	disk_cache_unpin(descriptor);
+	return ret;
+}
+
 int direct_decompress(file_t *file, descriptor_t *descriptor, void *buffer, size_t size, off_t offset)
 {
 	int len,ret;
@@ -408,6 +1252,15 @@ int direct_decompress(file_t *file, descriptor_t *descriptor, void *buffer, size
 		file->type = READ;
 	}
 
+	if (disk_cache_dir && file->type == READ &&
+	    (descriptor->cache_fd != FAIL ||
+	     (offset == 0 && !descriptor->handle && file->read_opens >= DISK_CACHE_HOT_OPENS)))
+	{
+		ret = direct_decompress_cached(file, descriptor, buffer, size, offset);
+		if (ret != FAIL || errno)
+			return ret;
+	}
+
 	size_t s = 0;
 	if (cache_this_read && (file->type & READ) && file->cache && file->cache_size > offset / DC_PAGE_SIZE && file->cache[offset / DC_PAGE_SIZE])
 	{
@@ -441,7 +1294,7 @@ int direct_decompress(file_t *file, descriptor_t *descriptor, void *buffer, size
 			decomp_cache_size >= max_decomp_cache_size ||
 			bytes_to_skip(descriptor->offset, offset) > max_decomp_cache_size - decomp_cache_size
 		     ) &&
-		     !read_only && /* cannot decompress on r/o filesystem */
+		     (!read_only || (disk_cache_dir && file->type == READ)) && /* cannot decompress on r/o filesystem */
 		     (	/* already did a lot of skipping, have a non-small file and are requested to read from a non-current position */
 			file->skipped + bytes_to_skip(descriptor->offset, offset) > file->size &&
 			file->size > 131072 && 
@@ -455,22 +1308,35 @@ int direct_decompress(file_t *file, descriptor_t *descriptor, void *buffer, size
 			offset, descriptor->offset, size, (!(file->type & READ)), file->size, file->skipped);
 		STAT_(STAT_FALLBACK);
 
-		DEBUG_("calling do_decompress, descriptor->fd %d",descriptor->fd);
-		if (!do_decompress(file))
+		/* Reading with seeks from a file nobody writes to: rather than
+		   decompressing it in place, keep a copy in the disk cache. */
+		if (disk_cache_dir && file->type == READ)
 		{
-			DEBUG_("do_decompress failed, descriptor->fd %d",descriptor->fd);
-			return FAIL;
+			ret = direct_decompress_cached(file, descriptor, buffer, size, offset);
+			if (ret != FAIL || errno)
+				return ret < 0 ? ret : s + ret;
 		}
 
-		file->size = -1;
-		file->skipped = 0;
+		/* no copy could be made, keep skipping on a r/o filesystem */
+		if (!read_only)
+		{
+			DEBUG_("calling do_decompress, descriptor->fd %d",descriptor->fd);
+			if (!do_decompress(file))
+			{
+				DEBUG_("do_decompress failed, descriptor->fd %d",descriptor->fd);
+				return FAIL;
+			}
 
-		int fd = descriptor->fd;
-		UNLOCK(&file->lock);
-		ret = pread(fd, buffer, size, offset);
-		LOCK(&file->lock);
-		if (ret < 0) return ret;
-		else return s + ret;
+			file->size = -1;
+			file->skipped = 0;
+
+			int fd = descriptor->fd;
+			UNLOCK(&file->lock);
+			ret = pread(fd, buffer, size, offset);
+			LOCK(&file->lock);
+			if (ret < 0) return ret;
+			else return s + ret;
+		}
 	}
 
 	if (offset < descriptor->offset)
@@ -619,6 +1485,8 @@ int direct_compress(file_t *file, descriptor_t *descriptor, const void *buffer,
 	
 	NEED_LOCK(&file->lock);
 
+	file->version++;
+	disk_cache_invalidate(file);
 	flush_file_cache(file); /* This may be superfluous. It did fix issue #32, but that may have been only
 	                           due to the fact that it destroyed the cache falsely inherited by file_to
 	                           in direct_rename(), which should have already been destroyed there. */
@@ -650,6 +1518,10 @@ int direct_compress(file_t *file, descriptor_t *descriptor, const void *buffer,
 			file->filename, offset, descriptor->offset, (!(file->type & WRITE)), file->accesses);
 		STAT_(STAT_FALLBACK);
 
+#ifdef WITH_DEDUP
+		if (dedup_enabled)
+			dedup_hash_drop(file);
+#endif
 		DEBUG_("calling do_decompress, descriptor->fd %d",descriptor->fd);
 		if (!do_decompress(file))
 		{
@@ -698,6 +1570,12 @@ int direct_compress(file_t *file, descriptor_t *descriptor, const void *buffer,
 
 			return FAIL;
 		}
+#ifdef WITH_DEDUP
+		// Hash the data for dedup as it is written
+		//
+		if (dedup_enabled)
+			dedup_hash_start(file);
+#endif
 	}
 	assert(descriptor->handle);
 
@@ -709,8 +1587,16 @@ int direct_compress(file_t *file, descriptor_t *descriptor, const void *buffer,
 
 	if (len == FAIL)
 	{
+#ifdef WITH_DEDUP
+		if (dedup_enabled)
+			dedup_hash_drop(file);
+#endif
 		return FAIL;
 	}
+#ifdef WITH_DEDUP
+	if (dedup_enabled)
+		dedup_hash_update(file, buffer, len);
+#endif
 	descriptor->offset += len;
 
 	// When writing we're always at EOF
@@ -758,6 +1644,7 @@ inline void direct_delete(file_t *file)
 
 	file->deleted = TRUE;
 	file->size = (off_t) -1;
+	file->version++;
 }
 
 // Move information from file_from to file_to when file_from is
@@ -781,6 +1668,7 @@ file_t* direct_rename(file_t *file_from, file_t *file_to)
 	/* file_to may be an existing file that is overwritten, so we need to
 	   destroy its cache */
 	flush_file_cache(file_to);
+	file_to->version++;
 	
 	file_to->size = file_from->size;
 	file_to->compressor = file_from->compressor;
@@ -806,17 +1694,31 @@ file_t* direct_rename(file_t *file_from, file_t *file_to)
 	/* same for background compression queue */
 	LOCK(&comp_database.lock);
 	compress_t* cp;
-	list_for_each_entry(cp, &comp_database.head, list)
+	int i;
+	int moved[2] = { 0, 0 };
+	for (i = 0; i < comp_database.entries; i++)
 	{
+		cp = comp_database.heap[i];
 		if(cp->file == file_from) {
 			DEBUG_("remove %s from background queue",file_from->filename);
 			cp->file = file_to;
 			file_from->accesses--;
 			file_to->accesses++;
+			file_from->queued[cp->is_dedup]--;
+			file_to->queued[cp->is_dedup]++;
+			moved[cp->is_dedup] = TRUE;
 		}
 	}
 	UNLOCK(&comp_database.lock);
 
+	/* an entry being worked on stays with file_from, and is marked done
+	   under its name */
+	for (i = 0; i < 2; i++)
+	{
+		if (moved[i])
+			journal_renamed(file_from->filename, file_to->filename, i);
+	}
+
 	/* Normally, file_from->accesses is 0 here. In some cases it is
 	   still 1 because thread_compress() has already removed the file
 	   from the database with the intention of compressing it. It will
@@ -827,6 +1729,242 @@ file_t* direct_rename(file_t *file_from, file_t *file_to)
 	// The file refered by file_from is now deleted
 	direct_delete(file_from);
 
+	// file_to now stands for the inode of file_from
+	//
+	if (inode_identity)
+	{
+		file_to->ino = file_from->ino;
+		file_to->dev = file_from->dev;
+		file_to->nlink = file_from->nlink;
+		direct_ino_unregister(file_from);
+		direct_ino_register(file_to);
+	}
+
+	return file_to;
+}
+
+static int direct_has_aliases(file_t *file)
+{
+	alias_t *alias;
+
+	NEED_LOCK(&file->lock);
+
+	list_for_each_entry(alias, &file->aliases, file_list)
+	{
+		if (!alias->deleted)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+// Give file a new primary name. The file stays in the hash chain of its
+// old name, where it no longer matches, and is found by the inode index
+// under the new one.
+//
+static void direct_set_filename(file_t *file, const char *filename)
+{
+	char *copy;
+
+	NEED_LOCK(&file->lock);
+
+	copy = strdup(filename);
+	if (!copy)
+	{
+		CRIT_("No memory!");
+		exit(EXIT_FAILURE);
+	}
+	if (file->filename != (char *) file + sizeof(file_t))
+		free(file->filename);
+	file->filename = copy;
+}
+
+// Mark all aliases of file called filename as removed.
+//
+// Returns TRUE if filename is also the primary name of file.
+//
+static int direct_drop_name(file_t *file, const char *filename)
+{
+	alias_t *alias;
+
+	NEED_LOCK(&file->lock);
+
+	list_for_each_entry(alias, &file->aliases, file_list)
+	{
+		if (strcmp(alias->filename, filename) == 0)
+			alias->deleted = TRUE;
+	}
+	return strcmp(file->filename, filename) == 0;
+}
+
+/**
+ * Forget that file is called filename after the name has been unlinked.
+ * The file is only deleted if no other name of it is known.
+ */
+void direct_unlink_name(file_t *file, const char *filename)
+{
+	alias_t *alias;
+
+	NEED_LOCK(&file->lock);
+
+	if (!inode_identity)
+	{
+		direct_delete(file);
+		return;
+	}
+
+	if (!direct_drop_name(file, filename))
+		return;
+
+	list_for_each_entry(alias, &file->aliases, file_list)
+	{
+		if (!alias->deleted)
+		{
+			DEBUG_("('%s') is now known as '%s'", filename, alias->filename);
+			direct_set_filename(file, alias->filename);
+			return;
+		}
+	}
+	direct_delete(file);
+}
+
+// Move the journal records of the queued work of file over to its new
+// name, before it gets it.
+//
+static void direct_journal_renamed(file_t *file, const char *from, const char *to)
+{
+	int i;
+
+	NEED_LOCK(&file->lock);
+
+	for (i = 0; i < 2; i++)
+	{
+		if (file->queued[i] > 0)
+			journal_renamed(from, to, i);
+	}
+}
+
+static inline int direct_below(const char *filename, const char *dir, size_t len)
+{
+	return strncmp(filename, dir, len) == 0 && filename[len] == '/';
+}
+
+/**
+ * Update the database after directory from has been renamed to to: the
+ * files below it move over to their new names, so that open files and
+ * background work keep finding their backing files. Other names of
+ * hard-linked files below it are dropped, they are found again through
+ * the inode index.
+ */
+void direct_rename_dir(const char *from, const char *to)
+{
+	LIST_HEAD(moved);
+	file_t          *file;
+	file_t          *safe = NULL;
+	alias_t         *alias;
+	alias_t         *alias_safe = NULL;
+	pthread_mutex_t *stripe;
+	size_t           from_len = strlen(from);
+	char             filename[PATH_MAX];
+	int              len;
+	int              i;
+
+	DEBUG_("('%s' -> '%s')", from, to);
+
+	if (!database.head)
+		return;
+
+	// Take the files out of their hash chains first, the chains of
+	// their new names may be under other stripe locks
+	//
+	for (i = 0; i < FILE_DATABASE_HASH_SIZE; i++)
+	{
+		stripe = direct_stripe(i);
+		LOCK(stripe);
+
+		list_for_each_entry_safe(alias, alias_safe, &database.alias_head[i], list)
+		{
+			if (!direct_below(alias->filename, from, from_len))
+				continue;
+			LOCK(&alias->file->lock);
+			alias->deleted = TRUE;
+			UNLOCK(&alias->file->lock);
+		}
+
+		list_for_each_entry_safe(file, safe, &database.head[i], list)
+		{
+			if (!direct_below(file->filename, from, from_len))
+				continue;
+			if (snprintf(filename, sizeof(filename), "%s%s", to,
+			             file->filename + from_len) >= sizeof(filename))
+				continue;
+
+			LOCK(&file->lock);
+			direct_journal_renamed(file, file->filename, filename);
+			direct_set_filename(file, filename);
+			file->filename_hash = gethash(filename, &len);
+			list_move_tail(&file->list, &moved);
+			UNLOCK(&file->lock);
+		}
+
+		UNLOCK(stripe);
+	}
+
+	list_for_each_entry_safe(file, safe, &moved, list)
+	{
+		i = direct_bucket(file->filename_hash);
+		stripe = direct_stripe(i);
+		LOCK(stripe);
+		list_move_tail(&file->list, &database.head[i]);
+		UNLOCK(stripe);
+	}
+}
+
+/**
+ * Update the database after from has been renamed to to. file_from and
+ * file_to are the files that have been looked up by these names before.
+ *
+ * @return The file called to
+ */
+file_t *direct_rename_name(file_t *file_from, file_t *file_to,
+                           const char *from, const char *to)
+{
+	NEED_LOCK(&file_from->lock);
+	NEED_LOCK(&file_to->lock);
+
+	// Renaming a name to another name of the same file does nothing
+	//
+	if (file_from == file_to)
+		return file_to;
+
+	// Files with a single name keep their state in the file_t of the
+	// new name, so that lookups of it don't need the inode index
+	//
+	if (!inode_identity ||
+	    (!direct_has_aliases(file_from) && !direct_has_aliases(file_to)))
+	{
+		return direct_rename(file_from, file_to);
+	}
+
+	// file_to loses its name. If it was the only one, make sure file_to
+	// can't be found by it anymore, the name now belongs to file_from.
+	//
+	flush_file_cache(file_to);
+	direct_unlink_name(file_to, to);
+	if (file_to->deleted)
+	{
+		direct_set_filename(file_to, "");
+		direct_ino_unregister(file_to);
+	}
+
+	// Lookups of to find file_from through the inode index and
+	// make the name an alias
+	//
+	if (direct_drop_name(file_from, from))
+	{
+		direct_journal_renamed(file_from, from, to);
+		direct_set_filename(file_from, to);
+	}
+
 	return file_to;
 }
 
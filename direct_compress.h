@@ -21,18 +21,27 @@
 #define DIRECT_COMPRESS_H
 
 #include <errno.h>
+#include <sys/stat.h>
 
 #include "structs.h"
 #include "compress.h"
 
+void direct_init_db(void);
+void direct_recent(file_t *file);
+void direct_modified(file_t *file);
 int direct_close(file_t *file, descriptor_t *descriptor);
 file_t *direct_open(const char *filename, int stabile);
+file_t *direct_open_found(const char *filename, const struct stat *stbuf);
 void direct_open_purge(void);
 void direct_open_purge_force(void);
 int direct_decompress(file_t *file, descriptor_t *descriptor,void *buffer, size_t size, off_t offset);
 int direct_compress(file_t *file, descriptor_t *descriptor, const void *buffer, size_t size, off_t offset);
 void direct_delete(file_t *file);
 file_t *direct_rename(file_t *file_from, file_t *file_to);
+void direct_unlink_name(file_t *file, const char *filename);
+file_t *direct_rename_name(file_t *file_from, file_t *file_to, const char *from, const char *to);
+void direct_rename_dir(const char *from, const char *to);
+void direct_ino_register(file_t *file);
 
 void flush_file_cache(file_t* file);
 
@@ -0,0 +1,467 @@
+/* Persistent cache of decompressed files for fusecompress.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Hot compressed files that are read with seeks would normally be
+ * decompressed in place by do_decompress() and stay uncompressed until
+ * the database is purged. Instead, we keep a decompressed copy in a
+ * separate directory (which may live on a different, faster device) and
+ * serve reads from there while the compressed original stays untouched.
+ *
+ * A copy is named after the identity of the compressed file it was made
+ * from: backing device, inode, ctime and compressed size. Any change to
+ * the original (write, truncate, recompression, chmod...) changes at least
+ * one of those, so stale copies are never used, even across remounts.
+ */
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "structs.h"
+#include "globals.h"
+#include "log.h"
+#include "file.h"
+#include "disk_cache.h"
+
+#define DISK_CACHE_HASH_SIZE 1024
+#define DISK_CACHE_TEMP "tmp."
+
+/* Files bigger than this fraction of the cache are never cached, they
+   would just flush everything else. */
+#define DISK_CACHE_MAX_FILE_SHARE 4
+
+typedef struct {
+	dev_t		 dev;		/**< device of the compressed original */
+	ino_t		 ino;		/**< inode of the compressed original */
+	struct timespec	 ctime;		/**< ctime of the compressed original */
+	off_t		 csize;		/**< size of the compressed original */
+	off_t		 size;		/**< size of the decompressed copy */
+	struct list_head hash;
+	struct list_head lru;
+	char		 name[80];
+} disk_cache_entry_t;
+
+static struct {
+	pthread_mutex_t	 lock;
+	int		 fd;		/**< fd of the cache directory */
+	off_t		 size;		/**< bytes used and reserved */
+	unsigned int	 seq;		/**< temp file name sequence */
+	struct list_head hash[DISK_CACHE_HASH_SIZE];
+	struct list_head lru;		/**< most recently used first */
+} disk_cache = {
+	.lock = LOCK_INITIALIZER,
+	.fd = FAIL,
+};
+
+static inline struct list_head *disk_cache_bucket(ino_t ino)
+{
+	return &disk_cache.hash[ino & (DISK_CACHE_HASH_SIZE - 1)];
+}
+
+static void disk_cache_name(disk_cache_entry_t *entry)
+{
+	snprintf(entry->name, sizeof(entry->name), "%llx-%llx-%llx.%lx-%llx",
+		 (unsigned long long) entry->dev,
+		 (unsigned long long) entry->ino,
+		 (unsigned long long) entry->ctime.tv_sec,
+		 entry->ctime.tv_nsec,
+		 (unsigned long long) entry->csize);
+}
+
+static void disk_cache_insert(disk_cache_entry_t *entry)
+{
+	NEED_LOCK(&disk_cache.lock);
+
+	list_add(&entry->hash, disk_cache_bucket(entry->ino));
+	list_add(&entry->lru, &disk_cache.lru);
+}
+
+/**
+ * Remove entry from the index and delete the copy. Descriptors that
+ * still have it open keep reading the unlinked file.
+ */
+static void disk_cache_remove(disk_cache_entry_t *entry)
+{
+	NEED_LOCK(&disk_cache.lock);
+
+	DEBUG_("evicting '%s'", entry->name);
+	list_del(&entry->hash);
+	list_del(&entry->lru);
+	disk_cache.size -= entry->size;
+	if (unlinkat(disk_cache.fd, entry->name, 0) == FAIL && errno != ENOENT)
+		WARN_("failed to remove cached copy '%s': %s", entry->name, strerror(errno));
+	free(entry);
+}
+
+static disk_cache_entry_t *disk_cache_lookup(ino_t ino)
+{
+	disk_cache_entry_t *entry;
+
+	NEED_LOCK(&disk_cache.lock);
+
+	list_for_each_entry(entry, disk_cache_bucket(ino), hash)
+	{
+		if (entry->ino == ino)
+			return entry;
+	}
+	return NULL;
+}
+
+/**
+ * Make room for size bytes by dropping the least recently used copies.
+ *
+ * @return TRUE if the space could be reserved.
+ */
+static int disk_cache_reserve(off_t size)
+{
+	disk_cache_entry_t *entry;
+
+	NEED_LOCK(&disk_cache.lock);
+
+	if (size > disk_cache_max_size / DISK_CACHE_MAX_FILE_SHARE)
+		return FALSE;
+
+	while (disk_cache.size + size > disk_cache_max_size &&
+	       !list_empty(&disk_cache.lru))
+	{
+		entry = list_entry(disk_cache.lru.prev, disk_cache_entry_t, lru);
+		disk_cache_remove(entry);
+	}
+	if (disk_cache.size + size > disk_cache_max_size)
+		return FALSE;
+
+	disk_cache.size += size;
+	return TRUE;
+}
+
+static void disk_cache_signature(disk_cache_entry_t *entry, const struct stat *st)
+{
+	entry->dev = st->st_dev;
+	entry->ino = st->st_ino;
+	entry->ctime = st->st_ctim;
+	entry->csize = st->st_size;
+	disk_cache_name(entry);
+}
+
+int disk_cache_init(const char *dir)
+{
+	DIR *dp;
+	struct dirent *de;
+	struct stat st;
+	disk_cache_entry_t *entry;
+	unsigned long long dev, ino, sec, csize;
+	unsigned long nsec;
+	int i;
+
+	for (i = 0; i < DISK_CACHE_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&disk_cache.hash[i]);
+	INIT_LIST_HEAD(&disk_cache.lru);
+
+	disk_cache.fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (disk_cache.fd == FAIL)
+	{
+		ERR_("failed to open cache directory '%s': %s", dir, strerror(errno));
+		return FAIL;
+	}
+
+	dp = fdopendir(dup(disk_cache.fd));
+	if (!dp)
+	{
+		ERR_("failed to read cache directory '%s': %s", dir, strerror(errno));
+		file_close(&disk_cache.fd);
+		return FAIL;
+	}
+
+	LOCK(&disk_cache.lock);
+	while ((de = readdir(dp)) != NULL)
+	{
+		if (de->d_name[0] == '.')
+			continue;
+
+		/* leftovers from an interrupted fill */
+		if (!strncmp(de->d_name, DISK_CACHE_TEMP, sizeof(DISK_CACHE_TEMP) - 1))
+		{
+			unlinkat(disk_cache.fd, de->d_name, 0);
+			continue;
+		}
+
+		if (sscanf(de->d_name, "%llx-%llx-%llx.%lx-%llx",
+			   &dev, &ino, &sec, &nsec, &csize) != 5 ||
+		    fstatat(disk_cache.fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == FAIL ||
+		    !S_ISREG(st.st_mode))
+		{
+			DEBUG_("ignoring '%s' in cache directory", de->d_name);
+			continue;
+		}
+
+		entry = malloc(sizeof(disk_cache_entry_t));
+		if (!entry)
+		{
+			ERR_("out of memory");
+			break;
+		}
+		entry->dev = dev;
+		entry->ino = ino;
+		entry->ctime.tv_sec = sec;
+		entry->ctime.tv_nsec = nsec;
+		entry->csize = csize;
+		entry->size = st.st_size;
+		disk_cache_name(entry);
+
+		/* We don't know how recently the copies were used, so the
+		   order in which readdir() returns them has to do. */
+		disk_cache_insert(entry);
+		disk_cache.size += entry->size;
+	}
+	closedir(dp);
+
+	/* the budget may have been lowered since the last mount */
+	while (disk_cache.size > disk_cache_max_size && !list_empty(&disk_cache.lru))
+		disk_cache_remove(list_entry(disk_cache.lru.prev, disk_cache_entry_t, lru));
+
+	DEBUG_("disk cache holds %zd bytes", disk_cache.size);
+	UNLOCK(&disk_cache.lock);
+
+	return 0;
+}
+
+int disk_cache_open(file_t *file, descriptor_t *descriptor)
+{
+	struct stat st;
+	disk_cache_entry_t key;
+	disk_cache_entry_t *entry;
+	int fd = FAIL;
+
+	NEED_LOCK(&file->lock);
+
+	if (disk_cache.fd == FAIL)
+		return FAIL;
+
+	if (fstat(descriptor->fd, &st) == FAIL)
+		return FAIL;
+	disk_cache_signature(&key, &st);
+
+	LOCK(&disk_cache.lock);
+	entry = disk_cache_lookup(st.st_ino);
+	if (entry)
+	{
+		if (strcmp(entry->name, key.name))
+		{
+			/* the original has changed behind our back */
+			disk_cache_remove(entry);
+		}
+		else
+		{
+			fd = openat(disk_cache.fd, entry->name, O_RDONLY);
+			if (fd == FAIL)
+			{
+				disk_cache_remove(entry);
+			}
+			else
+			{
+				list_del(&entry->lru);
+				list_add(&entry->lru, &disk_cache.lru);
+				DEBUG_("serving '%s' from cached copy '%s'", file->filename, entry->name);
+			}
+		}
+	}
+	UNLOCK(&disk_cache.lock);
+
+	return fd;
+}
+
+int disk_cache_fill(file_t *file, descriptor_t *descriptor)
+{
+	disk_cache_entry_t *entry;
+	compressor_t *compressor = NULL;
+	struct stat st;
+	char temp[32];
+	int fd_source;
+	int fd_temp;
+	off_t size = (off_t) -1;
+	off_t header_size;
+
+	NEED_LOCK(&file->lock);
+
+	if (disk_cache.fd == FAIL || !file->compressor)
+		return FAIL;
+
+	fd_source = file_open(file->filename, O_RDONLY);
+	if (fd_source == FAIL)
+		return FAIL;
+
+	if (fstat(fd_source, &st) == FAIL ||
+	    file_read_header_fd(fd_source, &compressor, &size) == FAIL ||
+	    !compressor)
+	{
+		file_close(&fd_source);
+		return FAIL;
+	}
+
+	entry = malloc(sizeof(disk_cache_entry_t));
+	if (!entry)
+	{
+		file_close(&fd_source);
+		return FAIL;
+	}
+	disk_cache_signature(entry, &st);
+	entry->size = size;
+
+	LOCK(&disk_cache.lock);
+	if (!disk_cache_reserve(size))
+	{
+		UNLOCK(&disk_cache.lock);
+		DEBUG_("'%s' does not fit into the disk cache", file->filename);
+		free(entry);
+		file_close(&fd_source);
+		return FAIL;
+	}
+	snprintf(temp, sizeof(temp), DISK_CACHE_TEMP "%d.%u", getpid(), disk_cache.seq++);
+	UNLOCK(&disk_cache.lock);
+
+	fd_temp = openat(disk_cache.fd, temp, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd_temp == FAIL)
+	{
+		WARN_("failed to create '%s' in cache directory: %s", temp, strerror(errno));
+		goto fail;
+	}
+
+	/* Decompression may take a while, but the caller needs the data
+	   before it can continue anyway, just like with do_decompress(). */
+	header_size = compressor->decompress(fd_source, fd_temp);
+	if (header_size != size)
+	{
+		WARN_("decompression of '%s' into the disk cache failed", file->filename);
+		file_close(&fd_temp);
+		unlinkat(disk_cache.fd, temp, 0);
+		goto fail;
+	}
+
+	/* Readers only get a read-only fd, reopen it before the copy can
+	   be seen (and evicted) under its final name. */
+	file_close(&fd_temp);
+	fd_temp = openat(disk_cache.fd, temp, O_RDONLY);
+	if (fd_temp == FAIL)
+	{
+		WARN_("failed to reopen '%s' in cache directory: %s", temp, strerror(errno));
+		unlinkat(disk_cache.fd, temp, 0);
+		goto fail;
+	}
+
+	if (renameat(disk_cache.fd, temp, disk_cache.fd, entry->name) == FAIL)
+	{
+		WARN_("failed to rename '%s' in cache directory: %s", temp, strerror(errno));
+		file_close(&fd_temp);
+		unlinkat(disk_cache.fd, temp, 0);
+		goto fail;
+	}
+	file_close(&fd_source);
+
+	LOCK(&disk_cache.lock);
+	{
+		disk_cache_entry_t *old = disk_cache_lookup(entry->ino);
+		if (old)
+		{
+			/* Don't let disk_cache_remove() unlink the copy we
+			   have just created under the same name. */
+			if (!strcmp(old->name, entry->name))
+				old->name[0] = 0;
+			disk_cache_remove(old);
+		}
+	}
+	disk_cache_insert(entry);
+	UNLOCK(&disk_cache.lock);
+
+	DEBUG_("cached '%s' as '%s'", file->filename, entry->name);
+	return fd_temp;
+
+fail:
+	LOCK(&disk_cache.lock);
+	disk_cache.size -= size;
+	UNLOCK(&disk_cache.lock);
+	free(entry);
+	file_close(&fd_source);
+	return FAIL;
+}
+
+void disk_cache_invalidate(file_t *file)
+{
+	descriptor_t *descriptor;
+	disk_cache_entry_t *entry;
+
+	NEED_LOCK(&file->lock);
+
+	if (disk_cache.fd == FAIL)
+		return;
+
+	list_for_each_entry(descriptor, &file->head, list)
+	{
+		if (descriptor->cache_fd == FAIL)
+			continue;
+		if (descriptor->cache_pins)
+		{
+			/* A reader is still using the fd without the file
+			   lock, closing it now would let the number be reused
+			   under its pread(). */
+			assert(descriptor->cache_stale_fd == FAIL);
+			descriptor->cache_stale_fd = descriptor->cache_fd;
+			descriptor->cache_fd = FAIL;
+		}
+		else
+			file_close(&descriptor->cache_fd);
+	}
+
+	if (!file->ino)
+		return;
+
+	LOCK(&disk_cache.lock);
+	entry = disk_cache_lookup(file->ino);
+	if (entry)
+		disk_cache_remove(entry);
+	UNLOCK(&disk_cache.lock);
+}
+
+int disk_cache_pin(descriptor_t *descriptor)
+{
+	NEED_LOCK(&descriptor->file->lock);
+	assert(descriptor->cache_fd != FAIL);
+
+	descriptor->cache_pins++;
+	return descriptor->cache_fd;
+}
+
+void disk_cache_unpin(descriptor_t *descriptor)
+{
+	int err = errno;
+
+	NEED_LOCK(&descriptor->file->lock);
+	assert(descriptor->cache_pins > 0);
+
+	if (--descriptor->cache_pins == 0 && descriptor->cache_stale_fd != FAIL)
+		file_close(&descriptor->cache_stale_fd);
+	errno = err;
+}
@@ -0,0 +1,67 @@
+/* Persistent cache of decompressed files for fusecompress.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef DISK_CACHE_H
+#define DISK_CACHE_H
+
+#include "structs.h"
+
+/**
+ * Open the cache directory and index the copies left there by previous
+ * mounts. Must be called before the working directory is changed if
+ * dir is a relative path.
+ *
+ * @return 0 on success, FAIL if the directory is unusable.
+ */
+int disk_cache_init(const char *dir);
+
+/**
+ * Look up a valid decompressed copy of the file the descriptor refers to.
+ *
+ * @return Read-only fd to the cached copy or FAIL if there is none.
+ */
+int disk_cache_open(file_t *file, descriptor_t *descriptor);
+
+/**
+ * Decompress the file the descriptor refers to into the cache.
+ *
+ * @return Read-only fd to the new copy or FAIL.
+ */
+int disk_cache_fill(file_t *file, descriptor_t *descriptor);
+
+/**
+ * Forget any cached copy of the file and detach it from all descriptors.
+ * Must be called whenever the contents of a compressed file change.
+ * Copies that are being read from are closed by the last disk_cache_unpin().
+ */
+void disk_cache_invalidate(file_t *file);
+
+/**
+ * Take a reference on the cached copy of the descriptor, so that it may
+ * be read from after the file lock has been dropped.
+ *
+ * @return The fd of the copy.
+ */
+int disk_cache_pin(descriptor_t *descriptor);
+
+/**
+ * Drop a reference taken by disk_cache_pin(), closing the copy if it has
+ * been invalidated in the meantime. Preserves errno.
+ */
+void disk_cache_unpin(descriptor_t *descriptor);
+
+#endif
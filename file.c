@@ -28,9 +28,13 @@
 #include "file.h"
 #include "utils.h"
 
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
 compressor_t *find_compressor(const header_t *fh)
 {
-	if (fh->type > sizeof(compressors) / sizeof(compressors[0]))
+	if (fh->type >= sizeof(compressors) / sizeof(compressors[0]))
 		return NULL;
 
 	return compressors[fh->type];
@@ -243,6 +247,64 @@ int file_open(const char *filename, int mode)
 	return fd;
 }
 
+/* Bytes copied per call by file_copy() */
+#define FILE_COPY_CHUNK (8 * 1024 * 1024)
+#define FILE_COPY_BUF (256 * 1024)
+
+/**
+ * Copy everything from the current offset of fd_in to the end of the
+ * file to fd_out, inside the kernel if it can.
+ *
+ * @return 0 on success, FAIL with errno set on error
+ */
+int file_copy(int fd_in, int fd_out)
+{
+	ssize_t  rd;
+	ssize_t  wr;
+	char    *buf;
+
+	// Both calls continue at the file offsets, so the next method
+	// can take over where one gives up
+	//
+#ifdef HAVE_COPY_FILE_RANGE
+	while ((rd = copy_file_range(fd_in, NULL, fd_out, NULL, FILE_COPY_CHUNK, 0)) > 0)
+		;
+	if (rd == 0)
+		return 0;
+	if (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP)
+		return FAIL;
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+	while ((rd = sendfile(fd_out, fd_in, NULL, FILE_COPY_CHUNK)) > 0)
+		;
+	if (rd == 0)
+		return 0;
+	if (errno != ENOSYS && errno != EINVAL)
+		return FAIL;
+#endif
+
+	buf = malloc(FILE_COPY_BUF);
+	if (!buf)
+	{
+		errno = ENOMEM;
+		return FAIL;
+	}
+	while ((rd = read(fd_in, buf, FILE_COPY_BUF)) > 0)
+	{
+		wr = write(fd_out, buf, rd);
+		if (wr != rd)
+		{
+			if (wr >= 0)
+				errno = ENOSPC;
+			rd = FAIL;
+			break;
+		}
+	}
+	free(buf);
+
+	return rd == 0 ? 0 : FAIL;
+}
+
 inline void file_close(int *fd)
 {
 	assert(fd);
@@ -52,17 +52,36 @@
 #include "background_compress.h"
 #include "compress_lzo.h"
 #include "dedup.h"
-
-static char DOT = '.';
+#include "digest.h"
+#include "disk_cache.h"
+#include "inplace.h"
+#include "journal.h"
+#include "crawler.h"
+#include "lowlevel.h"
+
+static char DOT[] = ".";
 static int cmpdirFd;	// Open fd to cmpdir for fchdir.
 
 static inline const char* fusecompress_getpath(const char *path)
 {
 	if (path[1] == 0)
-		return &DOT;
+		return DOT;
 	return ++path;
 }
 
+// Caller of the operation, the low-level backend passes it on by itself
+//
+static void fusecompress_caller(uid_t *uid, gid_t *gid)
+{
+	struct fuse_context *fc;
+
+	if (lowlevel_caller(uid, gid))
+		return;
+	fc = fuse_get_context();
+	*uid = fc->uid;
+	*gid = fc->gid;
+}
+
 static int fusecompress_getattr(const char *path, struct stat *stbuf)
 {
 	int           res;
@@ -85,12 +104,15 @@ static int fusecompress_getattr(const char *path, struct stat *stbuf)
 			return -EINPROGRESS;
 		}
 		else if (!strcmp(&full[3], "stat")) {
-                  stbuf->st_size = 0;
                   stbuf->st_mode = S_IFREG;
                   stbuf->st_nlink = comp_database.entries;
 #ifdef WITH_DEDUP
+                  /* memory used by the dedup DB, divide by st_blocks
+                     for the size per entry */
+                  stbuf->st_size = dedup_db_memory();
                   stbuf->st_blocks = dedup_database.entries;
 #else
+                  stbuf->st_size = 0;
                   stbuf->st_blocks = 0;
 #endif
                   return 0;
@@ -228,7 +250,6 @@ static int fusecompress_mknod(const char *path, mode_t mode, dev_t rdev)
 	const char *full;
 	uid_t uid;
 	gid_t gid;
-	struct fuse_context *fc;
 	file_t     *file;
 #ifdef CONFIG_OSX
 	int fd;
@@ -240,12 +261,12 @@ static int fusecompress_mknod(const char *path, mode_t mode, dev_t rdev)
 
 	file = direct_open(full, TRUE);
 
-	fc = fuse_get_context();
+	fusecompress_caller(&uid, &gid);
 #ifdef HAVE_SETFSUID
-	uid = setfsuid(fc->uid);
+	uid = setfsuid(uid);
 #endif
 #ifdef HAVE_SETFSGID
-	gid = setfsgid(fc->gid);
+	gid = setfsgid(gid);
 #endif
 	
 #ifdef CONFIG_OSX
@@ -283,18 +304,17 @@ static int fusecompress_mkdir(const char *path, mode_t mode)
 	const char *full;
 	uid_t uid;
 	gid_t gid;
-	struct fuse_context *fc;
 
 	full = fusecompress_getpath(path);
 
 	DEBUG_("('%s')", full);
 
-	fc = fuse_get_context();
+	fusecompress_caller(&uid, &gid);
 #ifdef HAVE_SETFSUID
-	uid = setfsuid(fc->uid);
+	uid = setfsuid(uid);
 #endif
 #ifdef HAVE_SETFSGID
-	gid = setfsgid(fc->gid);
+	gid = setfsgid(gid);
 #endif
 	
 	if (mkdir(full, mode) == -1)
@@ -348,9 +368,9 @@ static int fusecompress_unlink(const char *path)
 	
 	if (res == 0)
 	{
-		// Mark file as deleted
+		// Mark file as deleted, unless it has other names
 		//
-		direct_delete(file);
+		direct_unlink_name(file, full);
 	} 
 	else
 	{
@@ -372,8 +392,10 @@ static int fusecompress_symlink(const char *from, const char *to)
 	if (symlink(from, full_to) == -1)
 		return -errno;
 
-	struct fuse_context *fc = fuse_get_context();
-	lchown(full_to, fc->uid, fc->gid);
+	uid_t uid;
+	gid_t gid;
+	fusecompress_caller(&uid, &gid);
+	lchown(full_to, uid, gid);
 
 	return 0;
 }
@@ -399,8 +421,11 @@ static int fusecompress_rename(const char *from, const char *to)
 	file_to->accesses++;
 	UNLOCK(&file_to->lock);
 
+	// Both names may be links to the same file
+	//
 	LOCK(&file_from->lock);
-	LOCK(&file_to->lock);
+	if (file_to != file_from)
+		LOCK(&file_to->lock);
 
 	file_from->accesses--;
 	file_to->accesses--;
@@ -421,16 +446,27 @@ static int fusecompress_rename(const char *from, const char *to)
 		if (dedup_enabled)
 			dedup_rename(file_from, file_to);
 #endif
-		file_to = direct_rename(file_from, file_to);
+		file_to = direct_rename_name(file_from, file_to, full_from, full_to);
 	}
 	else
 	{
 		ret = -errno;
 	}
 
-	UNLOCK(&file_to->lock);
+	if (file_to != file_from)
+		UNLOCK(&file_to->lock);
 	UNLOCK(&file_from->lock);
 
+	// Files below a renamed directory are known by their old names
+	//
+	if (ret == 0)
+	{
+		struct stat st;
+
+		if (lstat(full_to, &st) == 0 && S_ISDIR(st.st_mode))
+			direct_rename_dir(full_from, full_to);
+	}
+
 	return ret;
 }
 
@@ -444,14 +480,21 @@ static int fusecompress_link(const char *from, const char *to)
 	full_from = fusecompress_getpath(from);
 	full_to = fusecompress_getpath(to);
 	
-	file = direct_open(full_from,TRUE);
-	if(file->compressor && !do_decompress(file)) {
-		res = -errno;
+	// When files are identified by inode, all links share the file_t
+	// and are compressed in place, otherwise the file has to stay
+	// uncompressed
+	//
+	if (!inode_identity)
+	{
+		file = direct_open(full_from,TRUE);
+		if(file->compressor && !do_decompress(file)) {
+			res = -errno;
+			UNLOCK(&file->lock);
+			return res;
+		}
+		file->dontcompress = TRUE;
 		UNLOCK(&file->lock);
-		return res;
 	}
-	file->dontcompress = TRUE;
-	UNLOCK(&file->lock);
 
 	if (link(full_from, full_to) == FAIL)
 		return -errno;
@@ -499,6 +542,40 @@ static int fusecompress_chown(const char *path, uid_t uid, gid_t gid)
 	return 0;
 }
 
+#ifdef WITH_DEDUP
+// Give the file a copy of the data it shares with deduplicated files
+// before it is changed. Open descriptors are moved over to the copy.
+//
+static int fusecompress_undedup(file_t *file, int copy)
+{
+	int           res;
+	struct stat   statbuf;
+	descriptor_t *descriptor;
+
+	res = do_undedup(file, copy);
+	if (res != TRUE)
+		return res;
+
+	list_for_each_entry(descriptor, &file->head, list)
+	{
+		direct_close(file, descriptor);
+		file_close(&descriptor->fd);
+		descriptor->fd = file_open(file->filename, O_RDWR);
+		if (descriptor->fd != FAIL && file->compressor)
+			lseek(descriptor->fd, sizeof(header_t), SEEK_SET);
+	}
+
+	if (lstat(file->filename, &statbuf) == 0)
+	{
+		file->ino = statbuf.st_ino;
+		file->dev = statbuf.st_dev;
+		file->nlink = statbuf.st_nlink;
+		direct_ino_register(file);
+	}
+	return res;
+}
+#endif
+
 static int fusecompress_truncate(const char *path, off_t size)
 {
 	int         ret = 0;
@@ -513,14 +590,33 @@ static int fusecompress_truncate(const char *path, off_t size)
 
 	file = direct_open(full, TRUE);
 
+	if (file->status & BROKEN)
+	{
+		ret = -EIO;
+		goto out;
+	}
+
 #ifdef WITH_DEDUP
 	if (dedup_enabled)
+	{
+		// The data doesn't have to be copied if it is all cut off
+		//
+		if (fusecompress_undedup(file, size > 0) == FAIL)
+		{
+			ret = -errno;
+			goto out;
+		}
 		dedup_discard(file);
+	}
 #endif
 	// And finally do the actual decompress (note, that we only decompress
 	// if size > 0, no need to run through that time consuming process
 	// when we're 0'ing a file out!)
 	//
+	file->version++;
+	disk_cache_invalidate(file);
+	direct_modified(file);
+
 	if ((size > 0 ) && file->compressor && (!do_decompress(file)))
 	{
 		ret = -errno;
@@ -633,6 +729,15 @@ static int fusecompress_open(const char *path, struct fuse_file_info *fi)
 
 	file = direct_open(full, TRUE);
 
+	// An in-place rewrite of the file has failed halfway
+	//
+	if (file->status & BROKEN)
+	{
+		UNLOCK(&file->lock);
+		free(descriptor);
+		return -EIO;
+	}
+
 	// if user wants to open file in O_WRONLY, we must open file for reading too
 	// (we need to read header...)
 	//
@@ -652,8 +757,11 @@ static int fusecompress_open(const char *path, struct fuse_file_info *fi)
 	}
 	
 #ifdef WITH_DEDUP
-	if (dedup_enabled && (fi->flags & (O_RDWR | O_CREAT | O_TRUNC))) {
-		if (do_undedup(file) == FAIL) {
+	// Files opened for writing are only undeduplicated once they are
+	// written to, except when their data is going away anyway
+	//
+	if (dedup_enabled && (fi->flags & O_TRUNC)) {
+		if (fusecompress_undedup(file, FALSE) == FAIL) {
 			UNLOCK(&file->lock);
 			return -errno;
 		}
@@ -678,11 +786,37 @@ static int fusecompress_open(const char *path, struct fuse_file_info *fi)
 		return -errno;
 	}
 	
-	if(S_ISREG(statbuf.st_mode) && statbuf.st_nlink > 1) {
+#ifdef WITH_DEDUP
+	if (dedup_enabled && (fi->flags & O_ACCMODE) != O_RDONLY &&
+	    S_ISREG(statbuf.st_mode) && statbuf.st_nlink > 1) {
+		file->undedup = TRUE;
+	}
+#endif
+	if(S_ISREG(statbuf.st_mode) && statbuf.st_nlink > 1 && !inode_identity &&
+	   !file->undedup) {
 		file->dontcompress = TRUE;
 	}
 
 	DEBUG_("\tsize on disk: %zi", statbuf.st_size);
+	if (file->ino != statbuf.st_ino || file->dev != statbuf.st_dev)
+	{
+		file->ino = statbuf.st_ino;
+		file->dev = statbuf.st_dev;
+		direct_ino_register(file);
+	}
+	file->nlink = statbuf.st_nlink;
+
+	// Let the kernel keep its page cache if nothing has changed since
+	// the file was last opened. Other hard links have their own cache
+	// in the kernel, so writes through them would go unnoticed (deduped
+	// files are exempt, they are unlinked before being written to).
+	//
+	if (file->kernel_version == file->version &&
+	    (statbuf.st_nlink == 1 || dedup_enabled))
+	{
+		fi->keep_cache = 1;
+	}
+	file->kernel_version = file->version;
 
 	if (statbuf.st_size >= sizeof(header_t))
 	{
@@ -709,8 +843,17 @@ static int fusecompress_open(const char *path, struct fuse_file_info *fi)
 	descriptor->file = file;
 	descriptor->offset = 0;
 	descriptor->handle = NULL;
+	descriptor->cache_fd = FAIL;
+	descriptor->cache_stale_fd = FAIL;
+	descriptor->cache_pins = 0;
 	file->accesses++;
 
+	if (disk_cache_dir && file->compressor && (fi->flags & O_ACCMODE) == O_RDONLY)
+	{
+		file->read_opens++;
+		descriptor->cache_fd = disk_cache_open(file, descriptor);
+	}
+
 	// The file size has to be -1 (invalid) or the same as we think it is
 	//
 	DEBUG_("\tfile->size: %zi", file->size);
@@ -753,7 +896,22 @@ static int fusecompress_read(const char *path, char *buf, size_t size, off_t off
 
 	LOCK(&file->lock);
 
-	if (file->compressor)
+	if (file->status & BROKEN)
+	{
+		UNLOCK(&file->lock);
+		return -EIO;
+	}
+
+	if (descriptor->cache_fd != FAIL)
+	{
+		int fd = disk_cache_pin(descriptor);
+		UNLOCK(&file->lock);
+		res = pread(fd, buf, size, offset);
+		LOCK(&file->lock);
+		disk_cache_unpin(descriptor);
+		UNLOCK(&file->lock);
+	}
+	else if (file->compressor)
 	{
 		res = direct_decompress(file, descriptor, buf, size, offset);
 		UNLOCK(&file->lock);
@@ -798,8 +956,18 @@ static int fusecompress_write(const char *path, const char *buf, size_t size,
 	assert(file);
 
 	LOCK(&file->lock);
+
+	if (file->status & BROKEN)
+	{
+		UNLOCK(&file->lock);
+		return -EIO;
+	}
 	
 #ifdef WITH_DEDUP
+	if (file->undedup && fusecompress_undedup(file, TRUE) == FAIL) {
+		UNLOCK(&file->lock);
+		return -errno;
+	}
 	if (dedup_enabled)
 		dedup_discard(file);
 #endif
@@ -823,6 +991,7 @@ static int fusecompress_write(const char *path, const char *buf, size_t size,
 			file->compressor ? file->compressor->name : "null");
 	}
 	file->dontcompress = TRUE;
+	direct_modified(file);
 
 	if (file->compressor)
 	{
@@ -880,11 +1049,17 @@ static int fusecompress_release(const char *path, struct fuse_file_info *fi)
 	//
 	list_del(&descriptor->list);
 	file->accesses--;
+	if (file->accesses == 0)
+		direct_recent(file);
 
 	DEBUG_("file_closing %s (fd %d)",path,descriptor->fd);
 	/* file may have already been closed by a failing do_decompress() */
 	if (descriptor->fd != -1)
 	 	file_close(&descriptor->fd);
+	if (descriptor->cache_fd != -1)
+		file_close(&descriptor->cache_fd);
+	if (descriptor->cache_stale_fd != -1)
+		file_close(&descriptor->cache_stale_fd);
 	free(descriptor);
 
 	UNLOCK(&file->lock);
@@ -941,7 +1116,7 @@ static void *fusecompress_init(struct fuse_conn_info* conn)
 	pthread_mutexattr_settype(&locktype, PTHREAD_MUTEX_ERRORCHECK_NP);
 #endif
 
-	pthread_mutex_init(&database.lock, &locktype);
+	direct_init_db();
 	pthread_mutex_init(&comp_database.lock, &locktype);
 #ifdef WITH_DEDUP
 	pthread_mutex_init(&dedup_database.lock, &locktype);
@@ -953,6 +1128,11 @@ static void *fusecompress_init(struct fuse_conn_info* conn)
 		exit(EXIT_FAILURE);
 	}
 
+	// Finish rewriting hard-linked files if we crashed doing it
+	//
+	if (!read_only)
+		inplace_recover();
+
 	// Get parameters of the underlaying filesystem and set minimal
 	// filesize for background and direct compression.
 	//
@@ -981,7 +1161,15 @@ static void *fusecompress_init(struct fuse_conn_info* conn)
 	DEBUG_("min_filesize_background: %d",
 		min_filesize_background);
 
-	pthread_create(&pt_comp, NULL, thread_compress, NULL);
+	// Pick up the work left over by the last unmount
+	//
+	if (!read_only)
+		journal_load();
+
+	background_compress_start();
+	pthread_create(&pt_janitor, NULL, thread_janitor, NULL);
+	if (crawl_enabled && !read_only)
+		crawler_start();
 
 	return NULL;
 }
@@ -989,11 +1177,22 @@ static void *fusecompress_init(struct fuse_conn_info* conn)
 static void fusecompress_destroy(void *arg)
 {
 	int r;
+	int timeout = FALSE;
+	time_t start = time(NULL);
 	struct timespec delay = {
 		.tv_sec = 1,
 		.tv_nsec = 0,
 	};
 	
+	crawler_stop();
+
+	// The janitor would only get in the way of the forced purges below
+	//
+	DEBUG_("Canceling pt_janitor");
+	pthread_cancel(pt_janitor);
+	pthread_cond_signal(&database.cond);
+	pthread_join(pt_janitor, NULL);
+
 	// Free database and add stuff to the background compressor if neccesary
 	//
 	INFO_("Compressing remaining files in cache");
@@ -1011,7 +1210,13 @@ static void fusecompress_destroy(void *arg)
 			}
 			UNLOCK(&comp_database.lock);
 		}
-		else
+		if (unmount_deadline >= 0 && time(NULL) - start >= unmount_deadline)
+		{
+			UNLOCK(&database.lock);
+			timeout = TRUE;
+			break;
+		}
+		if (database.entries != 0)
 		{
 			INFO_("There are still #%d files in the cache...", database.entries);
  
@@ -1028,13 +1233,32 @@ static void fusecompress_destroy(void *arg)
 		}
 	} while (1);
 	
-	INFO_("Finished compressing background files");
+	if (timeout)
+	{
+		// Give up on the rest, the next mount takes over
+		//
+		INFO_("Unmount deadline reached, saving remaining work");
+		background_compress_abort();
+		DEBUG_("All threads stopped!");
 
-	DEBUG_("Canceling pt_comp");
-	pthread_cancel(pt_comp);
-	pthread_cond_signal(&comp_database.cond);
-	pthread_join(pt_comp, NULL);
-	DEBUG_("All threads stopped!");
+		LOCK(&database.lock);
+		direct_open_purge_force();
+		UNLOCK(&database.lock);
+	}
+	else
+	{
+		INFO_("Finished compressing background files");
+
+		DEBUG_("Stopping compress workers");
+		background_compress_stop();
+		DEBUG_("All threads stopped!");
+	}
+
+	// Keep what is still queued for the next mount, the journal goes
+	// away if nothing is
+	//
+	if (!read_only)
+		journal_save();
 
 	statistics_print();
 
@@ -1172,6 +1396,8 @@ int main(int argc, char *argv[])
 	
 	int detach = 1;
 	int noterm = 0; /* do not exit on SIGTERM */
+	int lowlevel = 0; /* use the low-level FUSE API */
+	char *timeout_opts[2] = { NULL, NULL }; /* entry_timeout, attr_timeout */
 
 	fusev[fusec++] = argv[0];
 #ifdef DEBUG
@@ -1182,7 +1408,7 @@ int main(int argc, char *argv[])
 #ifndef CONFIG_OSX
 			 "nonempty,"
 #endif
-			 "kernel_cache,default_permissions";
+			 "default_permissions";
 
 	if (geteuid() == 0)
 	{
@@ -1197,6 +1423,7 @@ int main(int argc, char *argv[])
 	cache_decompressed_data = 0;
 	decomp_cache_size = 0;
 	max_decomp_cache_size = 100 * 1024 * 1024;
+	disk_cache_max_size = (off_t) 1024 * 1024 * 1024;
 	dont_compress_beyond = -1;
 	dedup_enabled = FALSE;
 	dedup_redup = FALSE;
@@ -1257,6 +1484,14 @@ int main(int argc, char *argv[])
 						max_decomp_cache_size = strtol(o + 11, NULL, 10) * 1024 * 1024;
 						DEBUG_("max_decomp_cache_size set to %d", max_decomp_cache_size);
 					}
+					else if (!strncmp(o, "cachedir=", 9) && strlen(o) > 9) {
+						disk_cache_dir = o + 9;
+						DEBUG_("disk_cache_dir set to %s", disk_cache_dir);
+					}
+					else if (!strncmp(o, "cachedir_size=", 14) && strlen(o) > 14) {
+						disk_cache_max_size = (off_t) strtol(o + 14, NULL, 10) * 1024 * 1024;
+						DEBUG_("disk_cache_max_size set to %zd", disk_cache_max_size);
+					}
 					else if (!strncmp(o, "level=", 6) && strlen(o) == 7) {
 						if(isdigit(o[6]) && o[6] >= '1' && o[6] <= '9')
 							compresslevel[2] = o[6];
@@ -1281,6 +1516,50 @@ int main(int argc, char *argv[])
 					{
 						noterm = 0;
 					}
+					else if (!strncmp(o, "workers=", 8) && strlen(o) > 8) {
+						comp_workers = strtol(o + 8, NULL, 10);
+						if (comp_workers < 1)
+							comp_workers = 1;
+						DEBUG_("comp_workers set to %d", comp_workers);
+					}
+					else if (!strncmp(o, "bwlimit=", 8) && strlen(o) > 8) {
+						throttle_bwlimit = (off_t) strtol(o + 8, NULL, 10) * 1024;
+						DEBUG_("throttle_bwlimit set to %zd", throttle_bwlimit);
+					}
+					else if (!strncmp(o, "cpushare=", 9) && strlen(o) > 9) {
+						throttle_cpushare = strtol(o + 9, NULL, 10);
+						DEBUG_("throttle_cpushare set to %d", throttle_cpushare);
+					}
+					else if (!strncmp(o, "psi=", 4) && strlen(o) > 4) {
+						throttle_psi = strtol(o + 4, NULL, 10);
+						DEBUG_("throttle_psi set to %d", throttle_psi);
+					}
+					else if (!strncmp(o, "cooldown=", 9) && strlen(o) > 9) {
+						compress_cooldown = strtol(o + 9, NULL, 10);
+						DEBUG_("compress_cooldown set to %d", compress_cooldown);
+					}
+					else if (!strncmp(o, "deadline=", 9) && strlen(o) > 9) {
+						unmount_deadline = strtol(o + 9, NULL, 10);
+						DEBUG_("unmount_deadline set to %d", unmount_deadline);
+					}
+					else if (!strcmp(o, "crawl")) {
+						crawl_enabled = TRUE;
+					}
+					else if (!strcmp(o, "lowlevel")) {
+						lowlevel = 1;
+					}
+					else if (!strncmp(o, "entry_timeout=", 14) && strlen(o) > 14) {
+						lowlevel_entry_timeout = strtod(o + 14, NULL);
+						timeout_opts[0] = o;
+					}
+					else if (!strncmp(o, "attr_timeout=", 13) && strlen(o) > 13) {
+						lowlevel_attr_timeout = strtod(o + 13, NULL);
+						timeout_opts[1] = o;
+					}
+					else if (!strncmp(o, "crawlrate=", 10) && strlen(o) > 10) {
+						crawl_rate = strtol(o + 10, NULL, 10);
+						DEBUG_("crawl_rate set to %d", crawl_rate);
+					}
 					else if (!strncmp(o, "maxcompress=", 12) && strlen(o) > 12) {
 						dont_compress_beyond = strtol(o + 12, NULL, 10) * 1024 * 1024;
 						DEBUG_("dont_compress_beyond set to %zd", dont_compress_beyond);
@@ -1312,6 +1591,23 @@ int main(int argc, char *argv[])
 					else if (!strcmp(o, "redup")) {
 						dedup_redup = TRUE;
 					}
+					else if (!strncmp(o, "dedup_hash=", 11) && strlen(o) > 11) {
+						dedup_digest = find_digest_name(o + 11);
+						if (!dedup_digest) {
+							print_help();
+							exit(EXIT_FAILURE);
+						}
+						dedup_digest_forced = TRUE;
+					}
+					else if (!strcmp(o, "dedup_chunks")) {
+						dedup_chunks = TRUE;
+					}
+					else if (!strcmp(o, "dedup_reflink")) {
+						dedup_reflink = TRUE;
+					}
+					else if (!strcmp(o, "dedup_batch")) {
+						dedup_batch = TRUE;
+					}
 #endif
 					else
 					{
@@ -1378,8 +1674,26 @@ int main(int argc, char *argv[])
 	if(!detach) fusev[fusec++] = "-f";
 
 	if (!dedup_enabled) {
-		fusev[fusec++] = "-o";
-		fusev[fusec++] = "use_ino";
+		// The low-level backend passes the inode numbers on by itself
+		//
+		if (!lowlevel) {
+			fusev[fusec++] = "-o";
+			fusev[fusec++] = "use_ino";
+		}
+		inode_identity = TRUE;
+	}
+
+	// The timeouts are libfuse options, unless the low-level backend
+	// takes care of them
+	//
+	if (!lowlevel) {
+		int i;
+		for (i = 0; i < 2; i++) {
+			if (timeout_opts[i]) {
+				fusev[fusec++] = "-o";
+				fusev[fusec++] = timeout_opts[i];
+			}
+		}
 	}
 	
 	if (!mountpoint) {
@@ -1491,6 +1805,11 @@ trysomethingelse:
 		exit(EXIT_FAILURE);
 	}
 
+	if (disk_cache_dir && disk_cache_init(disk_cache_dir) == FAIL) {
+		CRIT_("Failed to use cache directory %s", disk_cache_dir);
+		exit(EXIT_FAILURE);
+	}
+
 	umask(0);
 	
 #ifdef DEBUG
@@ -1508,7 +1827,10 @@ trysomethingelse:
 		dedup_load(root);
 #endif
 	
-	ret = fuse_main(fusec, fusev, &fusecompress_oper, NULL);
+	if (lowlevel)
+		ret = lowlevel_main(fusec, fusev, &fusecompress_oper, cmpdirFd);
+	else
+		ret = fuse_main(fusec, fusev, &fusecompress_oper, NULL);
 	
 #ifdef WITH_DEDUP
 	if (dedup_enabled)
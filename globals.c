@@ -12,8 +12,13 @@
 
 #include "structs.h"
 #include "compress.h"
+#ifdef WITH_DEDUP
+#include "digest.h"
+#endif
 
-pthread_t           pt_comp;	/* compress thread */
+pthread_t          *pt_comp;	/* compress worker threads */
+int                 comp_workers = 1;	/* number of compress workers */
+pthread_t           pt_janitor;	/* database janitor thread */
 pthread_mutexattr_t locktype;
 
 // Files smaller than this are not compressed
@@ -27,6 +32,16 @@ int max_decomp_cache_size;
 
 int dedup_enabled;
 int dedup_redup;
+#ifdef WITH_DEDUP
+digest_t *dedup_digest = &digest_murmur3;	/* hash for new dedup DBs */
+int dedup_digest_forced;	/* set if an existing dedup DB has to be rehashed
+				   with dedup_digest */
+int dedup_chunks;	/* set if files are compressed with module_chunk */
+int dedup_reflink;	/* set if duplicates are cloned rather than hard-linked */
+int dedup_batch;	/* set if workers dedup the queued files in batches */
+#endif
+
+int inode_identity;	/* set if file_t are shared by all hard links of a file */
 
 compressor_t *compressor_default = NULL;
 
@@ -34,7 +49,7 @@ compressor_t *compressor_default = NULL;
 // it is vital to sort modules according it's type. E.g. module_null
 // has type 0x0 or module_gzip has type 0x02.
 //
-compressor_t *compressors[5] = {
+compressor_t *compressors[6] = {
 	&module_null,
 #ifdef HAVE_BZIP2
 	&module_bz2,
@@ -56,6 +71,11 @@ compressor_t *compressors[5] = {
 #else
 	NULL,
 #endif
+#ifdef WITH_DEDUP
+	&module_chunk,
+#else
+	NULL,
+#endif
 };
 
 char *incompressible[] = {
@@ -97,26 +117,61 @@ char *mmapped_dirs[] = {
 
 size_t dont_compress_beyond; /* maximum size of files to compress in the bg compress thread */
 
-database_t database = {
-	.head = LIST_HEAD_INIT(database.head),
+int unmount_deadline = 60;	/* seconds unmount may spend on pending background work before
+				   saving it for the next mount, -1 for no limit */
+
+int crawl_enabled;		/* set to walk the backing directory for files to compress */
+int crawl_rate = 1000;		/* files per second looked at by the crawler, 0 for no limit */
+
+double lowlevel_entry_timeout = 1.0;	/* seconds the kernel may cache names with -o lowlevel */
+double lowlevel_attr_timeout = 1.0;	/* seconds the kernel may cache attributes with -o lowlevel */
+
+int compress_cooldown;		/* seconds a file must not be written to before it is compressed
+				   in the background, 0 to compress right away */
+
+off_t throttle_bwlimit;		/* bytes per second for background work, 0 for no limit */
+int throttle_cpushare = 100;	/* percentage of a CPU each background worker may use */
+int throttle_psi;		/* back off while pressure stalls exceed this percentage, 0 to ignore */
+
+char *disk_cache_dir = NULL;	/* directory holding decompressed copies of hot files */
+off_t disk_cache_max_size;	/* size budget of disk_cache_dir */
+
+file_database_t database = {
+	/* .head[], .alias_head[], .ino_head[] and the locks of the
+	   chains are set up by direct_init_db() */
 	.lock = PTHREAD_MUTEX_INITIALIZER,
-	.cond = PTHREAD_COND_INITIALIZER,		// Not used
+	.cond = PTHREAD_COND_INITIALIZER,		// When the janitor is needed
 	.entries = 0,
+	.head = NULL,
+	.recent_lock = PTHREAD_MUTEX_INITIALIZER,
+	.recent_entries = 0,
+	.recent = LIST_HEAD_INIT(database.recent),
+	.cooling_entries = 0,
+	.cooling = LIST_HEAD_INIT(database.cooling),
 };
 
-database_t comp_database = {
-	.head = LIST_HEAD_INIT(comp_database.head),
-	.lock = PTHREAD_MUTEX_INITIALIZER,
-	.cond = PTHREAD_COND_INITIALIZER,		// When new item is added to the list
+comp_database_t comp_database = {
+	.lock = LOCK_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,		// When new item is added to the queue
 	.entries = 0,
+	.size = 0,
+	.heap = NULL,
 };
 
 #ifdef WITH_DEDUP
 dedup_hash_t dedup_database = {
-        /* .head_filename[] and .head_md5[] cannot be initialized statically */
-	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.lock = LOCK_INITIALIZER,
 	.cond = PTHREAD_COND_INITIALIZER,		// When new item is added to the list
 	.entries = 0,
+	.capacity = 0,
+	.entry = NULL,
+	.mask = 0,
+	.by_md5 = NULL,
+	.by_filename = NULL,
+	.by_size = NULL,
+	.names = NULL,
+	.map = NULL,
+	.log_fd = -1,
 };
 #endif
 
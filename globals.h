@@ -15,35 +15,63 @@ extern int decomp_cache_size;
 extern int max_decomp_cache_size;
 
 extern size_t dont_compress_beyond;
+extern int compress_cooldown;
+extern int unmount_deadline;
+extern int crawl_enabled;
+extern int crawl_rate;
+extern double lowlevel_entry_timeout;
+extern double lowlevel_attr_timeout;
+
+extern off_t throttle_bwlimit;
+extern int throttle_cpushare;
+extern int throttle_psi;
+
+extern char *disk_cache_dir;
+extern off_t disk_cache_max_size;
 
 extern int dedup_enabled;
 extern int dedup_redup;
+#ifdef WITH_DEDUP
+extern digest_t *dedup_digest;
+extern int dedup_digest_forced;
+extern int dedup_chunks;
+extern int dedup_reflink;
+extern int dedup_batch;
+#endif
+
+extern int inode_identity;
 
 #define DC_PAGE_SIZE (4096)
 
-extern pthread_t pt_comp;
+extern pthread_t *pt_comp;
+extern int comp_workers;
+extern pthread_t pt_janitor;
 
 extern pthread_mutexattr_t locktype;
 
 extern compressor_t *compressor_default;
-extern compressor_t *compressors[5];
+extern compressor_t *compressors[6];
 extern char *incompressible[];
 extern char **user_incompressible;
 extern char **user_exclude_paths;
 extern char *mmapped_dirs[];
 
-extern database_t database;
-extern database_t comp_database;
+extern file_database_t database;
+extern comp_database_t comp_database;
 extern dedup_hash_t dedup_database;
 
 void *thread_compress(void *arg);
+void *thread_janitor(void *arg);
 
 #define FUSECOMPRESS_PREFIX "._fC"
 
 #define TEMP FUSECOMPRESS_PREFIX "tmp"		/* Template is: ._.tmpXXXXXX */
 #define FUSE ".fuse_hidden"	/* Temporary FUSE file */
 #define DEDUP_DB_FILE FUSECOMPRESS_PREFIX "dedup_db"
+#define DEDUP_LOG_FILE FUSECOMPRESS_PREFIX "dedup_log"
+#define DEDUP_ATTRS_FILE FUSECOMPRESS_PREFIX "dedup_attrs"
 #define DEDUP_ATTR FUSECOMPRESS_PREFIX "at_"
+#define CHUNK_STORE FUSECOMPRESS_PREFIX "chunks"
 
 extern char compresslevel[];
 #define COMPRESSLEVEL_BACKGROUND (compresslevel) /* See above, this is for background compress */
@@ -0,0 +1,326 @@
+/* In-place replacement of hard-linked files for fusecompress.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Files are normally (de)compressed into a temporary file that is then
+ * renamed over the original. That gives a new inode, which would split
+ * a hard-linked file into one copy per link. For these files, the new
+ * contents are copied back into the original inode instead.
+ *
+ * Copying is not atomic, so before the first byte of the original is
+ * overwritten, a journal record naming the target and the temporary file
+ * is made durable under INPLACE_RECORD. If we crash during the copy, the
+ * record survives and inplace_recover() redoes the copy on the next mount.
+ * The temporary file is only removed after the record.
+ *
+ * Record layout: INPLACE_MAGIC, inode of the target, then the names of the
+ * temporary file and of the target, each terminated by a NUL.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "structs.h"
+#include "globals.h"
+#include "log.h"
+#include "file.h"
+#include "inplace.h"
+
+#define INPLACE_RECORD FUSECOMPRESS_PREFIX "inplace"
+#define INPLACE_MAGIC "fCinpl1"
+#define INPLACE_BUFSIZE (64 * 1024)
+#define INPLACE_RETRIES 3
+
+/**
+ * Copy all of fd_from over fd_to and make it durable.
+ *
+ * @return 0 on success, FAIL on error.
+ */
+static int inplace_copy(int fd_from, int fd_to)
+{
+	char    *buf;
+	ssize_t  len;
+	ssize_t  done;
+	ssize_t  res;
+	off_t    offset = 0;
+
+	buf = malloc(INPLACE_BUFSIZE);
+	if (!buf)
+		return FAIL;
+
+	while ((len = pread(fd_from, buf, INPLACE_BUFSIZE, offset)) != 0)
+	{
+		if (len == FAIL)
+		{
+			if (errno == EINTR)
+				continue;
+			goto fail;
+		}
+		for (done = 0; done < len; done += res)
+		{
+			res = pwrite(fd_to, buf + done, len - done, offset + done);
+			if (res == FAIL)
+			{
+				if (errno != EINTR)
+					goto fail;
+				res = 0;
+			}
+		}
+		offset += len;
+	}
+	free(buf);
+
+	if (ftruncate(fd_to, offset) == FAIL)
+		return FAIL;
+	return fsync(fd_to);
+
+fail:
+	free(buf);
+	return FAIL;
+}
+
+static int inplace_sync_dir(void)
+{
+	int fd;
+	int res;
+
+	fd = open(".", O_RDONLY);
+	if (fd == FAIL)
+		return FAIL;
+	res = fsync(fd);
+	close(fd);
+	return res;
+}
+
+/**
+ * Write the journal record for rewriting target from temp and make it
+ * durable.
+ *
+ * @return Name of the record (to be freed by the caller) or NULL.
+ */
+static char *inplace_record(const char *target, ino_t ino, const char *temp)
+{
+	int       fd;
+	int       ok;
+	char     *tmp;
+	char     *record;
+	uint64_t  ino64 = ino;
+
+	record = malloc(sizeof(INPLACE_RECORD) + strlen(temp));
+	if (!record)
+		return NULL;
+	// Temporary names are unique, reuse the random part
+	//
+	strcpy(record, INPLACE_RECORD);
+	strcat(record, temp + sizeof(TEMP) - 1);
+
+	tmp = file_create_temp(&fd);
+	if (fd == FAIL)
+	{
+		free(record);
+		return NULL;
+	}
+
+	ok = write(fd, INPLACE_MAGIC, sizeof(INPLACE_MAGIC)) == sizeof(INPLACE_MAGIC) &&
+	     write(fd, &ino64, sizeof(ino64)) == sizeof(ino64) &&
+	     write(fd, temp, strlen(temp) + 1) == strlen(temp) + 1 &&
+	     write(fd, target, strlen(target) + 1) == strlen(target) + 1 &&
+	     fsync(fd) == 0;
+	ok = (close(fd) == 0) && ok;
+
+	if (!ok || rename(tmp, record) == FAIL || inplace_sync_dir() == FAIL)
+	{
+		unlink(tmp);
+		unlink(record);
+		free(tmp);
+		free(record);
+		return NULL;
+	}
+	free(tmp);
+
+	return record;
+}
+
+int inplace_replace(const char *filename, const char *temp, int fd_temp)
+{
+	int          fd;
+	int          tries;
+	char        *record;
+	struct stat  stbuf;
+
+	DEBUG_("('%s' <- '%s')", filename, temp);
+
+	if (fsync(fd_temp) == FAIL)
+		return INPLACE_FAILED;
+
+	fd = file_open(filename, O_WRONLY);
+	if (fd == FAIL)
+		return INPLACE_FAILED;
+
+	if (fstat(fd, &stbuf) == FAIL)
+	{
+		file_close(&fd);
+		return INPLACE_FAILED;
+	}
+
+	record = inplace_record(filename, stbuf.st_ino, temp);
+	if (!record)
+	{
+		ERR_("failed to write journal record for '%s'", filename);
+		file_close(&fd);
+		return INPLACE_FAILED;
+	}
+
+	// Point of no return: the target is rewritten from here on. The
+	// temporary file is intact, so a failed copy can simply be redone.
+	//
+	for (tries = 1; inplace_copy(fd_temp, fd) == FAIL; tries++)
+	{
+		if (tries == INPLACE_RETRIES)
+		{
+			CRIT_("rewriting '%s' failed: %s, will retry on next mount",
+			      filename, strerror(errno));
+			file_close(&fd);
+			free(record);
+			return INPLACE_PENDING;
+		}
+		WARN_("rewriting '%s' failed: %s, retrying",
+		      filename, strerror(errno));
+	}
+	file_close(&fd);
+
+	unlink(record);
+	unlink(temp);
+	free(record);
+
+	return INPLACE_OK;
+}
+
+/**
+ * Redo the copy described by the record.
+ *
+ * @return 0 if the record has been dealt with, FAIL if it has to be kept.
+ */
+static int inplace_recover_one(const char *record)
+{
+	int          fd;
+	int          fd_temp;
+	int          ret = 0;
+	char        *buf;
+	char        *temp;
+	char        *target;
+	ssize_t      len;
+	uint64_t     ino64;
+	struct stat  stbuf;
+
+	fd = open(record, O_RDONLY);
+	if (fd == FAIL)
+		return FAIL;
+	buf = malloc(sizeof(INPLACE_MAGIC) + sizeof(ino64) + 2 * PATH_MAX + 2);
+	if (!buf)
+	{
+		close(fd);
+		return FAIL;
+	}
+	len = read(fd, buf, sizeof(INPLACE_MAGIC) + sizeof(ino64) + 2 * PATH_MAX + 1);
+	close(fd);
+
+	// A record that is incomplete or does not make sense is removed, its
+	// rename has never happened
+	//
+	if (len < (ssize_t) (sizeof(INPLACE_MAGIC) + sizeof(ino64) + 4) ||
+	    memcmp(buf, INPLACE_MAGIC, sizeof(INPLACE_MAGIC)) != 0)
+	{
+		WARN_("ignoring invalid journal record '%s'", record);
+		goto out;
+	}
+	buf[len] = '\0';
+	memcpy(&ino64, buf + sizeof(INPLACE_MAGIC), sizeof(ino64));
+	temp = buf + sizeof(INPLACE_MAGIC) + sizeof(ino64);
+	target = temp + strlen(temp) + 1;
+	if (target >= buf + len || strncmp(temp, TEMP, sizeof(TEMP) - 1) != 0)
+	{
+		WARN_("ignoring invalid journal record '%s'", record);
+		goto out;
+	}
+
+	fd_temp = open(temp, O_RDONLY);
+	if (fd_temp == FAIL)
+	{
+		ERR_("cannot finish rewriting '%s', '%s' is gone", target, temp);
+		goto out;
+	}
+
+	fd = file_open(target, O_WRONLY);
+	if (fd == FAIL || fstat(fd, &stbuf) == FAIL || stbuf.st_ino != ino64)
+	{
+		// The target has been removed or replaced behind our back,
+		// so there is nothing left to repair
+		//
+		WARN_("'%s' has changed, dropping its pending rewrite", target);
+	}
+	else if (inplace_copy(fd_temp, fd) == FAIL)
+	{
+		ERR_("failed to finish rewriting '%s': %s", target, strerror(errno));
+		ret = FAIL;
+	}
+	else
+	{
+		INFO_("finished interrupted rewrite of '%s'", target);
+	}
+	if (fd != FAIL)
+		close(fd);
+	close(fd_temp);
+
+	if (ret == 0)
+		unlink(temp);
+out:
+	if (ret == 0)
+		unlink(record);
+	free(buf);
+	return ret;
+}
+
+void inplace_recover(void)
+{
+	DIR           *dir;
+	struct dirent *entry;
+
+	dir = opendir(".");
+	if (!dir)
+	{
+		ERR_("cannot look for interrupted rewrites: %s", strerror(errno));
+		return;
+	}
+
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (strncmp(entry->d_name, INPLACE_RECORD, sizeof(INPLACE_RECORD) - 1) == 0)
+			inplace_recover_one(entry->d_name);
+	}
+
+	closedir(dir);
+}
@@ -0,0 +1,44 @@
+/* In-place replacement of hard-linked files for fusecompress.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef INPLACE_H
+#define INPLACE_H
+
+#define INPLACE_OK	0	/* filename has the new contents, temp is gone */
+#define INPLACE_FAILED	1	/* filename is untouched, temp is left to the caller */
+#define INPLACE_PENDING	2	/* filename is half rewritten even after retrying,
+				   temp must be kept until inplace_recover() has
+				   finished the job */
+
+/**
+ * Replace the contents of filename with those of the temporary file temp
+ * without replacing its inode, so that all hard links to it see the new
+ * contents. Once the rewrite has started, it is recorded in a journal
+ * file, so that a crash cannot leave a half-written file behind.
+ *
+ * @param fd_temp Open descriptor of temp.
+ * @return INPLACE_OK, INPLACE_FAILED or INPLACE_PENDING.
+ */
+int inplace_replace(const char *filename, const char *temp, int fd_temp);
+
+/**
+ * Finish rewrites interrupted by a crash. Must be called with the
+ * backing directory as the working directory.
+ */
+void inplace_recover(void);
+
+#endif
@@ -0,0 +1,452 @@
+/* Persistent background queue for fusecompress.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The queue of background compression and deduplication is mirrored in
+ * JOURNAL_FILE in the root of the backing directory. A record is appended
+ * whenever a file is queued and when its queued work is done; a queued
+ * file that is renamed gets both, so its work moves to the new name. The
+ * janitor makes the records durable every few seconds. The next mount
+ * replays the journal and hands the files that still have work pending to
+ * the janitor, which queues them again. This way, unmount may drop the
+ * queue when its deadline expires, and a crash loses at most the last
+ * few seconds of records.
+ *
+ * The journal only ever grows, so it is rewritten with just the pending
+ * files once most of its records are obsolete.
+ *
+ * Layout: JOURNAL_MAGIC, then one record per event, made of the kind of
+ * the event and the name of the file, terminated by a NUL. Lower case
+ * kinds queue work (JOURNAL_COMPRESS or JOURNAL_DEDUP), the upper case
+ * ones mark it done.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "structs.h"
+#include "globals.h"
+#include "log.h"
+#include "file.h"
+#include "direct_compress.h"
+#include "compress.h"
+#include "background_compress.h"
+#include "journal.h"
+
+#define JOURNAL_FILE FUSECOMPRESS_PREFIX "queue"
+#define JOURNAL_MAGIC "fCqueue2"
+
+#define JOURNAL_COMPRESS 'c'
+#define JOURNAL_DEDUP 'd'
+
+/* The journal is rewritten once it has more than this many records and
+   JOURNAL_COMPACT_RATIO times as many as there are files pending */
+#define JOURNAL_COMPACT_MIN 4096
+#define JOURNAL_COMPACT_RATIO 4
+
+typedef struct {
+	char		 kind;		/**< JOURNAL_COMPRESS or JOURNAL_DEDUP */
+	int		 done;		/**< Set if the work has been done */
+	int		 seq;		/**< Position in the journal */
+	const char	*name;
+} journal_record_t;
+
+static struct {
+	pthread_mutex_t	 lock;
+	int		 fd;		/**< Journal open for appending, FAIL if none */
+	int		 records;	/**< Records in the journal */
+	int		 pending;	/**< Estimate of the files with work pending */
+	int		 dirty;		/**< Set if records have not been synced yet */
+} journal = {
+	.lock = LOCK_INITIALIZER,
+	.fd = FAIL,
+};
+
+static int journal_record_cmp(const void *a, const void *b)
+{
+	const journal_record_t *ra = a;
+	const journal_record_t *rb = b;
+	int res;
+
+	res = strcmp(ra->name, rb->name);
+	if (res == 0)
+		res = ra->kind - rb->kind;
+	if (res == 0)
+		res = ra->seq - rb->seq;
+	return res;
+}
+
+/**
+ * Read the journal and find the files that still have work pending.
+ *
+ * @param buf Set to the contents of the journal, which the names of the
+ *            records point into. To be freed by the caller.
+ * @param records Set to the pending records, to be freed by the caller.
+ * @return Number of pending records, FAIL if there is no valid journal.
+ */
+static int journal_read(char **buf, journal_record_t **records)
+{
+	int               fd;
+	int               count = 0;
+	int               pending = 0;
+	int               i;
+	char             *p;
+	char             *end;
+	ssize_t           len;
+	struct stat       stbuf;
+	journal_record_t *r;
+
+	*buf = NULL;
+	*records = NULL;
+
+	fd = open(JOURNAL_FILE, O_RDONLY);
+	if (fd == FAIL)
+		return FAIL;
+	if (fstat(fd, &stbuf) == FAIL ||
+	    (*buf = malloc(stbuf.st_size + 1)) == NULL)
+	{
+		close(fd);
+		return FAIL;
+	}
+	len = read(fd, *buf, stbuf.st_size);
+	close(fd);
+
+	if (len < (ssize_t) sizeof(JOURNAL_MAGIC) ||
+	    memcmp(*buf, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0)
+	{
+		WARN_("ignoring invalid queue journal");
+		free(*buf);
+		*buf = NULL;
+		return FAIL;
+	}
+	(*buf)[len] = '\0';
+	end = *buf + len;
+
+	// Every record takes at least two bytes
+	//
+	r = malloc(sizeof(journal_record_t) * (len / 2 + 1));
+	if (!r)
+	{
+		free(*buf);
+		*buf = NULL;
+		return FAIL;
+	}
+
+	// A truncated last record, as left by a crash, is dropped
+	//
+	for (p = *buf + sizeof(JOURNAL_MAGIC); p + 1 < end; p += strlen(p) + 1)
+	{
+		char kind = *p++;
+
+		if (p + strlen(p) >= end)
+			break;
+		if (tolower(kind) != JOURNAL_COMPRESS && tolower(kind) != JOURNAL_DEDUP)
+		{
+			WARN_("ignoring invalid queue journal record");
+			break;
+		}
+		r[count].kind = tolower(kind);
+		r[count].done = isupper(kind);
+		r[count].seq = count;
+		r[count].name = p;
+		count++;
+	}
+
+	// The last record of a file and kind of work tells whether the
+	// work is still pending
+	//
+	qsort(r, count, sizeof(journal_record_t), journal_record_cmp);
+	for (i = 0; i < count; i++)
+	{
+		if (i + 1 < count && r[i].kind == r[i + 1].kind &&
+		    !strcmp(r[i].name, r[i + 1].name))
+			continue;
+		if (!r[i].done)
+			r[pending++] = r[i];
+	}
+
+	*records = r;
+	return pending;
+}
+
+/**
+ * Replace the journal with one holding only the given records, and open
+ * it for appending.
+ *
+ * @return 0 on success, FAIL on error.
+ */
+static int journal_write(journal_record_t *records, int count)
+{
+	int   fd;
+	int   ok;
+	int   i;
+	char *tmp;
+
+	NEED_LOCK(&journal.lock);
+
+	if (journal.fd != FAIL)
+		file_close(&journal.fd);
+
+	tmp = file_create_temp(&fd);
+	if (fd == FAIL)
+	{
+		ERR_("cannot create queue journal: %s", strerror(errno));
+		return FAIL;
+	}
+
+	ok = write(fd, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) == sizeof(JOURNAL_MAGIC);
+	for (i = 0; ok && i < count; i++)
+	{
+		ok = write(fd, &records[i].kind, 1) == 1 &&
+		     write(fd, records[i].name, strlen(records[i].name) + 1) ==
+		     strlen(records[i].name) + 1;
+	}
+	ok = fsync(fd) == 0 && ok;
+	ok = close(fd) == 0 && ok;
+	if (!ok || rename(tmp, JOURNAL_FILE) == FAIL)
+	{
+		ERR_("cannot write queue journal: %s", strerror(errno));
+		unlink(tmp);
+		free(tmp);
+		return FAIL;
+	}
+	free(tmp);
+
+	journal.records = count;
+	journal.pending = count;
+	journal.dirty = FALSE;
+
+	journal.fd = open(JOURNAL_FILE, O_WRONLY | O_APPEND);
+	if (journal.fd == FAIL)
+	{
+		ERR_("cannot open queue journal: %s", strerror(errno));
+		return FAIL;
+	}
+	return 0;
+}
+
+/**
+ * Drop the obsolete records from the journal.
+ */
+static void journal_compact(void)
+{
+	int               count;
+	char             *buf;
+	journal_record_t *records;
+
+	NEED_LOCK(&journal.lock);
+
+	count = journal_read(&buf, &records);
+	if (count == FAIL)
+		count = 0;
+	DEBUG_("compacting queue journal from %d to %d records", journal.records, count);
+	journal_write(records, count);
+	free(records);
+	free(buf);
+}
+
+static void journal_append(const char *name, char kind)
+{
+	struct iovec iov[2];
+
+	LOCK(&journal.lock);
+	if (journal.fd == FAIL)
+	{
+		UNLOCK(&journal.lock);
+		return;
+	}
+
+	iov[0].iov_base = &kind;
+	iov[0].iov_len = 1;
+	iov[1].iov_base = (char *) name;
+	iov[1].iov_len = strlen(name) + 1;
+
+	// O_APPEND makes this a single record even if it is torn by a crash
+	//
+	if (writev(journal.fd, iov, 2) != (ssize_t) (iov[0].iov_len + iov[1].iov_len))
+	{
+		ERR_("cannot append to queue journal: %s", strerror(errno));
+	}
+	else
+	{
+		journal.records++;
+		journal.pending += islower(kind) ? 1 : -1;
+		journal.dirty = TRUE;
+	}
+	UNLOCK(&journal.lock);
+}
+
+void journal_queued(file_t *file, int dedup)
+{
+	NEED_LOCK(&file->lock);
+	journal_append(file->filename, dedup ? JOURNAL_DEDUP : JOURNAL_COMPRESS);
+}
+
+void journal_done(file_t *file, int dedup)
+{
+	NEED_LOCK(&file->lock);
+	journal_append(file->filename, toupper(dedup ? JOURNAL_DEDUP : JOURNAL_COMPRESS));
+}
+
+void journal_renamed(const char *from, const char *to, int dedup)
+{
+	// Queue the new name first, a crash in between leaves both pending
+	//
+	journal_append(to, dedup ? JOURNAL_DEDUP : JOURNAL_COMPRESS);
+	journal_append(from, toupper(dedup ? JOURNAL_DEDUP : JOURNAL_COMPRESS));
+}
+
+void journal_checkpoint(void)
+{
+	LOCK(&journal.lock);
+	if (journal.fd != FAIL)
+	{
+		if (journal.records > JOURNAL_COMPACT_MIN &&
+		    journal.records > JOURNAL_COMPACT_RATIO * journal.pending)
+		{
+			journal_compact();
+		}
+		else if (journal.dirty)
+		{
+			if (fdatasync(journal.fd) == FAIL)
+				ERR_("cannot sync queue journal: %s", strerror(errno));
+			journal.dirty = FALSE;
+		}
+	}
+	UNLOCK(&journal.lock);
+}
+
+int journal_save(void)
+{
+	int         count = 0;
+	file_t     *file;
+	compress_t *entry;
+
+	// The entries still queued have their records in the journal
+	//
+	while ((entry = background_compress_take()) != NULL)
+	{
+		file = entry->file;
+
+		LOCK(&file->lock);
+		// The file starts over on the next mount
+		//
+		compress_resume_discard(file);
+		file->queued[entry->is_dedup ? 1 : 0]--;
+		if (file->deleted)
+			journal_done(file, entry->is_dedup);
+		else
+			count++;
+		// Give back the access taken by background_compress_dedup()
+		//
+		file->accesses--;
+		UNLOCK(&file->lock);
+		free(entry);
+	}
+
+	LOCK(&journal.lock);
+	if (journal.fd == FAIL)
+	{
+		UNLOCK(&journal.lock);
+		return count ? FAIL : 0;
+	}
+	file_close(&journal.fd);
+	if (count == 0)
+	{
+		// Nothing left to do, whatever the records say
+		//
+		unlink(JOURNAL_FILE);
+	}
+	else
+	{
+		journal_compact();
+		if (journal.fd != FAIL)
+			file_close(&journal.fd);
+		INFO_("saved %d queued files for the next mount", count);
+	}
+	UNLOCK(&journal.lock);
+
+	return count;
+}
+
+/**
+ * Put one file of the journal back into the database, so that the
+ * janitor schedules it.
+ *
+ * @return 0 on success, FAIL if the file is gone or can't be read.
+ */
+static int journal_restore(char kind, const char *name)
+{
+	file_t      *file;
+	struct stat  stbuf;
+
+	if (lstat(name, &stbuf) == FAIL || !S_ISREG(stbuf.st_mode))
+		return FAIL;
+
+	file = direct_open_found(name, &stbuf);
+	if (!file)
+		return FAIL;
+	if (kind == JOURNAL_DEDUP)
+		file->deduped = FALSE;
+	UNLOCK(&file->lock);
+	return 0;
+}
+
+void journal_load(void)
+{
+	int               i;
+	int               count;
+	int               restored = 0;
+	char             *buf;
+	journal_record_t *records;
+
+	count = journal_read(&buf, &records);
+	if (count == FAIL)
+		count = 0;
+
+	// Records of files that are gone would be carried over forever
+	//
+	for (i = 0; i < count; i++)
+	{
+		if (journal_restore(records[i].kind, records[i].name) == 0)
+			records[restored++] = records[i];
+	}
+	if (restored)
+		INFO_("resuming work on %d files queued before the last unmount", restored);
+	if (restored < count)
+		DEBUG_("dropping %d queue records of files that are gone", count - restored);
+	count = restored;
+
+	// The files are in the database now and are queued again by the
+	// janitor. Until then, their records are carried over.
+	//
+	LOCK(&journal.lock);
+	journal_write(records, count);
+	UNLOCK(&journal.lock);
+
+	free(records);
+	free(buf);
+}
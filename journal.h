@@ -0,0 +1,61 @@
+/* Persistent background queue for fusecompress.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "structs.h"
+
+/**
+ * Queue the files that still had work pending when the last mount ended
+ * again, and start journaling the queue. Must be called with the backing
+ * directory as the working directory.
+ */
+void journal_load(void);
+
+/**
+ * Record that file has been queued for compression, or deduplication if
+ * dedup is set.
+ */
+void journal_queued(file_t *file, int dedup);
+
+/**
+ * Record that the work file has been queued for is done.
+ */
+void journal_done(file_t *file, int dedup);
+
+/**
+ * Record that the work queued for a file, for deduplication if dedup is
+ * set, is now pending under its new name to rather than from.
+ */
+void journal_renamed(const char *from, const char *to, int dedup);
+
+/**
+ * Make the records durable, and drop the obsolete ones once there are
+ * many. Called periodically by the janitor.
+ */
+void journal_checkpoint(void);
+
+/**
+ * Empty the background queue and close the journal, which is removed if
+ * no work is left. The workers must have been stopped.
+ *
+ * @return Number of files saved, FAIL on error.
+ */
+int journal_save(void);
+
+#endif
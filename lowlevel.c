@@ -0,0 +1,1338 @@
+/* Low-level FUSE backend for fusecompress.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * With "-o lowlevel", requests come in through the low-level FUSE API,
+ * naming files by the inode numbers handed to the kernel rather than by
+ * paths that libfuse puts together for every operation.
+ *
+ * Every inode the kernel knows about is a node, and the inode number is
+ * the address of the node. A node remembers its parent and its name, and
+ * the number of lookups the kernel has not forgotten yet; it goes away
+ * once the kernel has forgotten it and it has no children left. Nodes
+ * are found by parent and name in a hash table, which rename keeps up to
+ * date, so the kernel's inodes stay valid when a directory above them is
+ * renamed.
+ *
+ * Directories hold an O_PATH descriptor, and whatever fusecompress
+ * doesn't keep state about is done relative to the descriptor of the
+ * parent with the *at() calls: attributes of what is known not to be a
+ * regular file, directory listings, symlinks, special files and
+ * directories. Regular files, names looked up for the first time, and
+ * unlink, rename and link, are passed to the path based operations,
+ * because compression, deduplication and the file database all know a
+ * file by its path from the backing directory; deduplication also
+ * replaces the backing file of a name, which a descriptor held for it
+ * would not notice. As with libfuse, an open file that is unlinked or
+ * renamed over is renamed to a hidden name until its last release, so
+ * that the path based operations still find it.
+ *
+ * So regular files, which most requests are about, still cost a path
+ * put together from the nodes and a walk of it in the backing
+ * filesystem, and that cost grows with their depth; only directories,
+ * symlinks and special files are served without one. For regular files
+ * the backend only buys inodes that stay valid when a directory above
+ * them is renamed.
+ *
+ *  lowlevel = Serve requests through the low-level API, see above.
+ *  entry_timeout = Seconds the kernel may keep a name, as with libfuse.
+ *  attr_timeout = Seconds the kernel may keep attributes, as with libfuse.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include "config.h"
+
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <utime.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#ifdef HAVE_SYS_FSUID_H
+#include <sys/fsuid.h>
+#endif
+
+#include "structs.h"
+#include "globals.h"
+#include "log.h"
+#include "utils.h"
+#include "lowlevel.h"
+
+#ifndef O_PATH
+#define O_PATH O_RDONLY
+#endif
+
+// Inode number libfuse reports in directory listings when inode numbers
+// are not passed through
+//
+#define LOWLEVEL_UNKNOWN_INO 0xffffffff
+
+#define LOWLEVEL_HASH_MIN 1024
+
+typedef struct lowlevel_node {
+	struct lowlevel_node *parent;
+	struct lowlevel_node *next;	/**< Next node in the same hash chain */
+	char          *name;
+	mode_t         type;		/**< S_IFMT bits as of the last lookup */
+	int            fd;		/**< O_PATH descriptor of a directory, FAIL otherwise */
+	unsigned long  nlookup;		/**< Lookups the kernel has not forgotten */
+	int            children;	/**< Nodes that have this one as parent */
+	int            hashed;		/**< Set while the node can be found by name */
+	int            opened;		/**< Open handles of a regular file */
+	int            hidden;		/**< Renamed to a hidden name while open */
+} lowlevel_node_t;
+
+typedef struct {
+	DIR           *dp;
+	struct dirent *entry;		/**< Entry read but not yet passed on */
+	off_t          offset;		/**< Position after the entries passed on */
+} lowlevel_dir_t;
+
+static struct {
+	pthread_mutex_t   lock;		/**< Protects the nodes and the hash table */
+	lowlevel_node_t   root;
+	lowlevel_node_t **head;		/**< Hash chains of the nodes by parent and name */
+	unsigned int      mask;
+	unsigned int      entries;
+	unsigned int      hidden_seq;	/**< Tells hidden names apart */
+	const struct fuse_operations *op;
+} lowlevel = {
+	.lock = LOCK_INITIALIZER,
+};
+
+// Request the current thread is passing on to a path based operation
+// that creates a file as the caller, for lowlevel_caller()
+//
+static __thread fuse_req_t lowlevel_req;
+
+static inline lowlevel_node_t *lowlevel_node(fuse_ino_t ino)
+{
+	if (ino == FUSE_ROOT_ID)
+		return &lowlevel.root;
+	return (lowlevel_node_t *) (uintptr_t) ino;
+}
+
+static inline fuse_ino_t lowlevel_ino(lowlevel_node_t *node)
+{
+	if (node == &lowlevel.root)
+		return FUSE_ROOT_ID;
+	return (fuse_ino_t) (uintptr_t) node;
+}
+
+static unsigned int lowlevel_hash(lowlevel_node_t *parent, const char *name)
+{
+	int len;
+
+	return gethash(name, &len) ^ (unsigned int) ((uintptr_t) parent >> 4) * 2654435761U;
+}
+
+static lowlevel_node_t **lowlevel_find(lowlevel_node_t *parent, const char *name)
+{
+	lowlevel_node_t **p;
+
+	NEED_LOCK(&lowlevel.lock);
+
+	if (!lowlevel.head)
+		return NULL;
+	for (p = &lowlevel.head[lowlevel_hash(parent, name) & lowlevel.mask]; *p; p = &(*p)->next)
+	{
+		if ((*p)->parent == parent && strcmp((*p)->name, name) == 0)
+			return p;
+	}
+	return NULL;
+}
+
+static int lowlevel_hash_insert(lowlevel_node_t *node)
+{
+	unsigned int slot;
+
+	NEED_LOCK(&lowlevel.lock);
+
+	if (lowlevel.entries >= lowlevel.mask)
+	{
+		unsigned int      size = lowlevel.head ? (lowlevel.mask + 1) * 2 : LOWLEVEL_HASH_MIN;
+		lowlevel_node_t **head = calloc(size, sizeof(lowlevel_node_t *));
+		unsigned int      i;
+
+		if (!head && !lowlevel.head)
+			return FAIL;
+		if (head)
+		{
+			for (i = 0; lowlevel.head && i <= lowlevel.mask; i++)
+			{
+				while (lowlevel.head[i])
+				{
+					lowlevel_node_t *n = lowlevel.head[i];
+
+					lowlevel.head[i] = n->next;
+					slot = lowlevel_hash(n->parent, n->name) & (size - 1);
+					n->next = head[slot];
+					head[slot] = n;
+				}
+			}
+			free(lowlevel.head);
+			lowlevel.head = head;
+			lowlevel.mask = size - 1;
+		}
+	}
+
+	slot = lowlevel_hash(node->parent, node->name) & lowlevel.mask;
+	node->next = lowlevel.head[slot];
+	lowlevel.head[slot] = node;
+	node->hashed = TRUE;
+	lowlevel.entries++;
+	return 0;
+}
+
+/**
+ * Take a node out of the hash table, its name now refers to another
+ * file or to none. The node stays around until the kernel forgets it.
+ */
+static void lowlevel_detach(lowlevel_node_t *node)
+{
+	lowlevel_node_t **p;
+
+	NEED_LOCK(&lowlevel.lock);
+
+	if (!node->hashed)
+		return;
+	p = lowlevel_find(node->parent, node->name);
+	assert(p && *p == node);
+	*p = node->next;
+	node->hashed = FALSE;
+	lowlevel.entries--;
+}
+
+/**
+ * Free nodes that neither the kernel nor a child refers to any longer,
+ * starting at node and going up.
+ */
+static void lowlevel_release_node(lowlevel_node_t *node)
+{
+	NEED_LOCK(&lowlevel.lock);
+
+	while (node != &lowlevel.root && node->nlookup == 0 && node->children == 0)
+	{
+		lowlevel_node_t *parent = node->parent;
+
+		lowlevel_detach(node);
+		if (node->fd != FAIL)
+			close(node->fd);
+		free(node->name);
+		free(node);
+
+		parent->children--;
+		node = parent;
+	}
+}
+
+/**
+ * Put together the path of the name in parent, or of parent itself if
+ * name is NULL, as the path based operations get it from libfuse.
+ *
+ * @return 0 on success, negated errno on failure.
+ */
+static int lowlevel_path(lowlevel_node_t *parent, const char *name, char *path)
+{
+	lowlevel_node_t *node;
+	char            *p = path + PATH_MAX - 1;
+	size_t           len;
+
+	*p = '\0';
+
+	LOCK(&lowlevel.lock);
+	if (name)
+	{
+		len = strlen(name);
+		if (len + 1 > p - path)
+		{
+			UNLOCK(&lowlevel.lock);
+			return -ENAMETOOLONG;
+		}
+		p -= len;
+		memcpy(p, name, len);
+		*--p = '/';
+	}
+	for (node = parent; node != &lowlevel.root; node = node->parent)
+	{
+		if (!node->hashed)
+		{
+			UNLOCK(&lowlevel.lock);
+			return -ENOENT;
+		}
+		len = strlen(node->name);
+		if (len + 1 > p - path)
+		{
+			UNLOCK(&lowlevel.lock);
+			return -ENAMETOOLONG;
+		}
+		p -= len;
+		memcpy(p, node->name, len);
+		*--p = '/';
+	}
+	UNLOCK(&lowlevel.lock);
+
+	if (*p == '\0')
+		*--p = '/';
+	memmove(path, p, path + PATH_MAX - p);
+	return 0;
+}
+
+/**
+ * Descriptor for the *at() calls on names in a directory. The node of
+ * a directory is held by the kernel while a request refers to it, so
+ * the descriptor is too.
+ */
+static inline int lowlevel_dirfd(lowlevel_node_t *dir)
+{
+	return dir->fd;
+}
+
+/**
+ * Keep the directory of a node from going away, along with its
+ * descriptor, while the node is looked at in it; a rename may move the
+ * node elsewhere in the meantime.
+ *
+ * @param name Set to the name of the node, NAME_MAX + 1 bytes.
+ * @return The directory, to be passed to lowlevel_unpin(), NULL if the
+ *         node is the top or has no name any longer.
+ */
+static lowlevel_node_t *lowlevel_pin_parent(lowlevel_node_t *node, char *name)
+{
+	lowlevel_node_t *dir = NULL;
+
+	LOCK(&lowlevel.lock);
+	if (node != &lowlevel.root && node->hashed)
+	{
+		dir = node->parent;
+		dir->children++;
+		snprintf(name, NAME_MAX + 1, "%s", node->name);
+	}
+	UNLOCK(&lowlevel.lock);
+	return dir;
+}
+
+static void lowlevel_unpin(lowlevel_node_t *dir)
+{
+	LOCK(&lowlevel.lock);
+	dir->children--;
+	lowlevel_release_node(dir);
+	UNLOCK(&lowlevel.lock);
+}
+
+/**
+ * Attributes of a name in a directory, as the path based getattr would
+ * give them. Only a name known not to be a regular file is looked at in
+ * the directory; anything else, and the magic files at the top, is left
+ * to getattr, which knows the real size of a file, so that a name is not
+ * stat'ed twice.
+ *
+ * @return 0 on success, negated errno on failure.
+ */
+static int lowlevel_stat(lowlevel_node_t *parent, const char *name, struct stat *st)
+{
+	lowlevel_node_t **p;
+	mode_t            type = 0;
+	char              path[PATH_MAX];
+	int               res;
+
+	LOCK(&lowlevel.lock);
+	p = lowlevel_find(parent, name);
+	if (p)
+		type = (*p)->type;
+	UNLOCK(&lowlevel.lock);
+
+	if (type != 0 && !S_ISREG(type))
+	{
+		if (fstatat(lowlevel_dirfd(parent), name, st, AT_SYMLINK_NOFOLLOW) == FAIL)
+		{
+			if (parent != &lowlevel.root || strncmp(name, "_fc", 3) != 0)
+				return -errno;
+		}
+		else if (!S_ISREG(st->st_mode))
+			return 0;
+	}
+
+	res = lowlevel_path(parent, name, path);
+	if (res == 0)
+		res = lowlevel.op->getattr(path, st);
+	return res;
+}
+
+static void lowlevel_set_ino(struct stat *st, lowlevel_node_t *node)
+{
+	// Backing inode numbers are only passed on where use_ino would be
+	// given to libfuse, deduplicated files share them
+	//
+	if (!inode_identity)
+		st->st_ino = (ino_t) lowlevel_ino(node);
+}
+
+/**
+ * Find or make the node of a name the kernel is about to be told about,
+ * and count the lookup.
+ */
+static lowlevel_node_t *lowlevel_get_node(lowlevel_node_t *parent, const char *name, mode_t type)
+{
+	lowlevel_node_t **p;
+	lowlevel_node_t  *node;
+	int               fd = FAIL;
+
+	// Open the directory before taking the lock, it may be on a slow disk
+	//
+	if (S_ISDIR(type))
+	{
+		fd = openat(lowlevel_dirfd(parent), name, O_PATH | O_DIRECTORY | O_NOFOLLOW);
+		if (fd == FAIL)
+			return NULL;
+	}
+
+	LOCK(&lowlevel.lock);
+	p = lowlevel_find(parent, name);
+	if (p)
+	{
+		node = *p;
+		if (node->type != type || (fd != FAIL && node->fd == FAIL))
+		{
+			// Replaced behind our back by a file of another kind
+			//
+			if (node->fd != FAIL)
+				close(node->fd);
+			node->fd = fd;
+			fd = FAIL;
+		}
+		node->type = type;
+	}
+	else
+	{
+		node = calloc(1, sizeof(lowlevel_node_t));
+		if (node)
+		{
+			node->parent = parent;
+			node->name = strdup(name);
+		}
+		if (!node || !node->name || lowlevel_hash_insert(node) == FAIL)
+		{
+			UNLOCK(&lowlevel.lock);
+			if (node)
+				free(node->name);
+			free(node);
+			if (fd != FAIL)
+				close(fd);
+			return NULL;
+		}
+		node->type = type;
+		node->fd = fd;
+		fd = FAIL;
+		parent->children++;
+	}
+	node->nlookup++;
+	UNLOCK(&lowlevel.lock);
+
+	if (fd != FAIL)
+		close(fd);
+	return node;
+}
+
+static void lowlevel_reply_entry(fuse_req_t req, lowlevel_node_t *parent, const char *name)
+{
+	struct fuse_entry_param e;
+	lowlevel_node_t        *node;
+	int                     res;
+
+	memset(&e, 0, sizeof(e));
+	res = lowlevel_stat(parent, name, &e.attr);
+	if (res != 0)
+	{
+		fuse_reply_err(req, -res);
+		return;
+	}
+
+	node = lowlevel_get_node(parent, name, e.attr.st_mode & S_IFMT);
+	if (!node)
+	{
+		fuse_reply_err(req, errno ? errno : ENOMEM);
+		return;
+	}
+	lowlevel_set_ino(&e.attr, node);
+	e.ino = lowlevel_ino(node);
+	e.attr_timeout = lowlevel_attr_timeout;
+	e.entry_timeout = lowlevel_entry_timeout;
+
+	if (fuse_reply_entry(req, &e) == -ENOENT)
+	{
+		// The request was interrupted, the kernel doesn't know about it
+		//
+		LOCK(&lowlevel.lock);
+		node->nlookup--;
+		lowlevel_release_node(node);
+		UNLOCK(&lowlevel.lock);
+	}
+}
+
+static void lowlevel_init(void *userdata, struct fuse_conn_info *conn)
+{
+	lowlevel.op->init(conn);
+}
+
+static void lowlevel_destroy(void *userdata)
+{
+	lowlevel.op->destroy(NULL);
+}
+
+static void lowlevel_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	lowlevel_reply_entry(req, lowlevel_node(parent), name);
+}
+
+static void lowlevel_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	lowlevel_node_t *node = lowlevel_node(ino);
+
+	LOCK(&lowlevel.lock);
+	assert(node->nlookup >= nlookup || node == &lowlevel.root);
+	node->nlookup -= nlookup < node->nlookup ? nlookup : node->nlookup;
+	lowlevel_release_node(node);
+	UNLOCK(&lowlevel.lock);
+
+	fuse_reply_none(req);
+}
+
+/**
+ * Attributes of a node, see lowlevel_stat().
+ *
+ * @return 0 on success, negated errno on failure.
+ */
+static int lowlevel_getattr_node(lowlevel_node_t *node, struct stat *st)
+{
+	char path[PATH_MAX];
+	int  res;
+
+	if (node->fd != FAIL)
+		res = fstat(node->fd, st) == FAIL ? -errno : 0;
+	else
+	{
+		// Regular files go straight to the path based getattr,
+		// anything else is looked at in its directory
+		//
+		if (S_ISREG(node->type))
+		{
+			res = lowlevel_path(node, NULL, path);
+			if (res == 0)
+				res = lowlevel.op->getattr(path, st);
+		}
+		else
+		{
+			char             name[NAME_MAX + 1];
+			lowlevel_node_t *dir = lowlevel_pin_parent(node, name);
+
+			res = -ENOENT;
+			if (dir)
+			{
+				res = lowlevel_stat(dir, name, st);
+				lowlevel_unpin(dir);
+			}
+		}
+	}
+	if (res == 0)
+		lowlevel_set_ino(st, node);
+	return res;
+}
+
+static void lowlevel_reply_attr(fuse_req_t req, lowlevel_node_t *node)
+{
+	struct stat st;
+	int         res;
+
+	res = lowlevel_getattr_node(node, &st);
+	if (res != 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_attr(req, &st, lowlevel_attr_timeout);
+}
+
+static void lowlevel_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	lowlevel_reply_attr(req, lowlevel_node(ino));
+}
+
+/**
+ * Change the attributes of anything but a regular file in its directory,
+ * as the path based operations do with chmod(), lchown() and lutimes().
+ *
+ * @return 0 on success, negated errno on failure.
+ */
+static int lowlevel_setattr_at(lowlevel_node_t *dir, const char *name, mode_t type,
+                               struct stat *attr, int to_set)
+{
+	int fd = lowlevel_dirfd(dir);
+
+	if ((to_set & FUSE_SET_ATTR_MODE) &&
+	    fchmodat(fd, name, attr->st_mode, 0) == FAIL)
+		return -errno;
+	if ((to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) &&
+	    fchownat(fd, name,
+	             (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t) -1,
+	             (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t) -1,
+	             AT_SYMLINK_NOFOLLOW) == FAIL)
+		return -errno;
+	if (to_set & FUSE_SET_ATTR_SIZE)
+		return S_ISDIR(type) ? -EISDIR : -EINVAL;
+	if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))
+	{
+		struct timespec ts[2];
+
+		ts[0].tv_sec = attr->st_atime;
+		ts[0].tv_nsec = (to_set & FUSE_SET_ATTR_ATIME) ? 0 : UTIME_OMIT;
+		ts[1].tv_sec = attr->st_mtime;
+		ts[1].tv_nsec = (to_set & FUSE_SET_ATTR_MTIME) ? 0 : UTIME_OMIT;
+#ifdef FUSE_SET_ATTR_ATIME_NOW
+		if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+			ts[0].tv_nsec = UTIME_NOW;
+		if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+			ts[1].tv_nsec = UTIME_NOW;
+#endif
+		if (utimensat(fd, name, ts, AT_SYMLINK_NOFOLLOW) == FAIL)
+			return -errno;
+	}
+	return 0;
+}
+
+/**
+ * Change the attributes of a regular file, or of the top directory,
+ * through the path based operations.
+ *
+ * @return 0 on success, negated errno on failure.
+ */
+static int lowlevel_setattr_path(lowlevel_node_t *node, struct stat *attr, int to_set)
+{
+	char        path[PATH_MAX];
+	struct stat st;
+	int         res;
+
+	res = lowlevel_path(node, NULL, path);
+	if (res != 0)
+		return res;
+
+	// Same order as libfuse: mode, owner, size, times
+	//
+	if (to_set & FUSE_SET_ATTR_MODE)
+	{
+		res = lowlevel.op->chmod(path, attr->st_mode);
+		if (res != 0)
+			return res;
+	}
+	if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+	{
+		uid_t uid = (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t) -1;
+		gid_t gid = (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t) -1;
+
+		res = lowlevel.op->chown(path, uid, gid);
+		if (res != 0)
+			return res;
+	}
+	if (to_set & FUSE_SET_ATTR_SIZE)
+	{
+		res = lowlevel.op->truncate(path, attr->st_size);
+		if (res != 0)
+			return res;
+	}
+	if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))
+	{
+		struct utimbuf buf;
+
+		// utime() sets both, the one not asked for stays as it is
+		//
+		res = lowlevel.op->getattr(path, &st);
+		if (res != 0)
+			return res;
+		buf.actime = st.st_atime;
+		buf.modtime = st.st_mtime;
+		if (to_set & FUSE_SET_ATTR_ATIME)
+			buf.actime = attr->st_atime;
+		if (to_set & FUSE_SET_ATTR_MTIME)
+			buf.modtime = attr->st_mtime;
+#ifdef FUSE_SET_ATTR_ATIME_NOW
+		if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+			buf.actime = time(NULL);
+		if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+			buf.modtime = time(NULL);
+#endif
+		res = lowlevel.op->utime(path, &buf);
+	}
+	return res;
+}
+
+static void lowlevel_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                             int to_set, struct fuse_file_info *fi)
+{
+	lowlevel_node_t *node = lowlevel_node(ino);
+	lowlevel_node_t *dir = NULL;
+	char             name[NAME_MAX + 1];
+	int              res;
+
+	if (!S_ISREG(node->type))
+		dir = lowlevel_pin_parent(node, name);
+	if (dir)
+	{
+		res = lowlevel_setattr_at(dir, name, node->type, attr, to_set);
+		lowlevel_unpin(dir);
+	}
+	else
+		res = lowlevel_setattr_path(node, attr, to_set);
+
+	if (res != 0)
+		fuse_reply_err(req, -res);
+	else
+		lowlevel_reply_attr(req, node);
+}
+
+static void lowlevel_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+	char             name[NAME_MAX + 1];
+	char             buf[PATH_MAX + 1];
+	lowlevel_node_t *dir = lowlevel_pin_parent(lowlevel_node(ino), name);
+	ssize_t          res = -ENOENT;
+
+	if (dir)
+	{
+		res = readlinkat(lowlevel_dirfd(dir), name, buf, sizeof(buf) - 1);
+		if (res == FAIL)
+			res = -errno;
+		lowlevel_unpin(dir);
+	}
+	if (res < 0)
+	{
+		fuse_reply_err(req, -res);
+		return;
+	}
+	buf[res] = '\0';
+	fuse_reply_readlink(req, buf);
+}
+
+/**
+ * Create things as the caller, as the path based operations do.
+ */
+static void lowlevel_setfsid(fuse_req_t req, uid_t *uid, gid_t *gid)
+{
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+
+#ifdef HAVE_SETFSUID
+	*uid = setfsuid(ctx->uid);
+#endif
+#ifdef HAVE_SETFSGID
+	*gid = setfsgid(ctx->gid);
+#endif
+}
+
+static void lowlevel_restorefsid(uid_t uid, gid_t gid)
+{
+#ifdef HAVE_SETFSUID
+	setfsuid(uid);
+#endif
+#ifdef HAVE_SETFSGID
+	setfsgid(gid);
+#endif
+}
+
+static void lowlevel_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           mode_t mode, dev_t rdev)
+{
+	lowlevel_node_t *dir = lowlevel_node(parent);
+	char             path[PATH_MAX];
+	uid_t            uid = 0;
+	gid_t            gid = 0;
+	int              res;
+
+	if (S_ISREG(mode))
+	{
+		res = lowlevel_path(dir, name, path);
+		if (res == 0)
+		{
+			lowlevel_req = req;
+			res = lowlevel.op->mknod(path, mode, rdev);
+			lowlevel_req = NULL;
+		}
+	}
+	else
+	{
+		lowlevel_setfsid(req, &uid, &gid);
+		res = mknodat(lowlevel_dirfd(dir), name, mode, rdev) == FAIL ? -errno : 0;
+		lowlevel_restorefsid(uid, gid);
+	}
+
+	if (res != 0)
+		fuse_reply_err(req, -res);
+	else
+		lowlevel_reply_entry(req, dir, name);
+}
+
+static void lowlevel_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	lowlevel_node_t *dir = lowlevel_node(parent);
+	uid_t            uid = 0;
+	gid_t            gid = 0;
+	int              res;
+
+	lowlevel_setfsid(req, &uid, &gid);
+	res = mkdirat(lowlevel_dirfd(dir), name, mode) == FAIL ? -errno : 0;
+	lowlevel_restorefsid(uid, gid);
+
+	if (res != 0)
+		fuse_reply_err(req, -res);
+	else
+		lowlevel_reply_entry(req, dir, name);
+}
+
+/**
+ * The name in dir is gone, forget which node it belonged to.
+ */
+static void lowlevel_forget_name(lowlevel_node_t *dir, const char *name)
+{
+	lowlevel_node_t **p;
+
+	LOCK(&lowlevel.lock);
+	p = lowlevel_find(dir, name);
+	if (p)
+		lowlevel_detach(*p);
+	UNLOCK(&lowlevel.lock);
+}
+
+/**
+ * The name in dir has been renamed to newname in newdir, move its node
+ * over. Whatever had the new name before is gone.
+ */
+static void lowlevel_move(lowlevel_node_t *dir, const char *name,
+                          lowlevel_node_t *newdir, const char *newname)
+{
+	lowlevel_node_t **p;
+	lowlevel_node_t  *node;
+	char             *copy;
+
+	copy = strdup(newname);
+
+	LOCK(&lowlevel.lock);
+	p = lowlevel_find(dir, name);
+	node = p ? *p : NULL;
+	if (node)
+		lowlevel_detach(node);
+	p = lowlevel_find(newdir, newname);
+	if (p)
+		lowlevel_detach(*p);
+	if (node && copy)
+	{
+		lowlevel_node_t *olddir = node->parent;
+
+		free(node->name);
+		node->name = copy;
+		copy = NULL;
+		node->parent = newdir;
+		newdir->children++;
+		olddir->children--;
+		if (lowlevel_hash_insert(node) == FAIL)
+			ERR_("cannot keep track of '%s'", newname);
+		lowlevel_release_node(olddir);
+	}
+	UNLOCK(&lowlevel.lock);
+
+	free(copy);
+}
+
+/**
+ * An open file that is about to lose its name in dir is renamed to a
+ * hidden name instead, as libfuse does, and removed on the last release.
+ * Its node keeps a path, which the path based operations on its inode
+ * need, e.g. for fstat() or ftruncate() after unlink().
+ *
+ * @return 1 if the file was hidden, 0 if there is no open file by that
+ *         name, negated errno on failure.
+ */
+static int lowlevel_hide(lowlevel_node_t *dir, const char *name)
+{
+	lowlevel_node_t **p;
+	lowlevel_node_t  *node;
+	char              hidden[NAME_MAX + 1];
+	char              path[PATH_MAX];
+	char              newpath[PATH_MAX];
+	struct stat       st;
+	int               tries;
+	int               res;
+
+	LOCK(&lowlevel.lock);
+	p = lowlevel_find(dir, name);
+	node = p && (*p)->opened > 0 ? *p : NULL;
+	UNLOCK(&lowlevel.lock);
+	if (!node)
+		return 0;
+
+	for (tries = 0; ; tries++)
+	{
+		LOCK(&lowlevel.lock);
+		snprintf(hidden, sizeof(hidden), ".fuse_hidden%08x%08x",
+		         (unsigned int) lowlevel_ino(node), lowlevel.hidden_seq++);
+		UNLOCK(&lowlevel.lock);
+		if (fstatat(lowlevel_dirfd(dir), hidden, &st, AT_SYMLINK_NOFOLLOW) == FAIL)
+			break;
+		if (tries == 10)
+			return -EBUSY;
+	}
+
+	res = lowlevel_path(dir, name, path);
+	if (res == 0)
+		res = lowlevel_path(dir, hidden, newpath);
+	if (res == 0)
+		res = lowlevel.op->rename(path, newpath);
+	if (res != 0)
+		return res;
+	lowlevel_move(dir, name, dir, hidden);
+
+	LOCK(&lowlevel.lock);
+	node->hidden = TRUE;
+	UNLOCK(&lowlevel.lock);
+	return 1;
+}
+
+static void lowlevel_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	lowlevel_node_t *dir = lowlevel_node(parent);
+	char             path[PATH_MAX];
+	int              res;
+
+	res = lowlevel_hide(dir, name);
+	if (res == 0)
+	{
+		res = lowlevel_path(dir, name, path);
+		if (res == 0)
+			res = lowlevel.op->unlink(path);
+		if (res == 0)
+			lowlevel_forget_name(dir, name);
+	}
+	fuse_reply_err(req, res < 0 ? -res : 0);
+}
+
+static void lowlevel_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	lowlevel_node_t *dir = lowlevel_node(parent);
+	int              res;
+
+	res = unlinkat(lowlevel_dirfd(dir), name, AT_REMOVEDIR) == FAIL ? -errno : 0;
+	if (res == 0)
+		lowlevel_forget_name(dir, name);
+	fuse_reply_err(req, -res);
+}
+
+static void lowlevel_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name)
+{
+	lowlevel_node_t       *dir = lowlevel_node(parent);
+	const struct fuse_ctx *ctx = fuse_req_ctx(req);
+
+	if (symlinkat(link, lowlevel_dirfd(dir), name) == FAIL)
+	{
+		fuse_reply_err(req, errno);
+		return;
+	}
+	fchownat(lowlevel_dirfd(dir), name, ctx->uid, ctx->gid, AT_SYMLINK_NOFOLLOW);
+
+	lowlevel_reply_entry(req, dir, name);
+}
+
+static void lowlevel_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                            fuse_ino_t newparent, const char *newname)
+{
+	lowlevel_node_t *dir = lowlevel_node(parent);
+	lowlevel_node_t *newdir = lowlevel_node(newparent);
+	char             path[PATH_MAX];
+	char             newpath[PATH_MAX];
+	int              res;
+
+	// An open file that is replaced stays around under a hidden name
+	//
+	res = lowlevel_hide(newdir, newname);
+	if (res >= 0)
+		res = lowlevel_path(dir, name, path);
+	if (res == 0)
+		res = lowlevel_path(newdir, newname, newpath);
+	if (res == 0)
+		res = lowlevel.op->rename(path, newpath);
+	if (res == 0)
+		lowlevel_move(dir, name, newdir, newname);
+	fuse_reply_err(req, -res);
+}
+
+static void lowlevel_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname)
+{
+	lowlevel_node_t *newdir = lowlevel_node(newparent);
+	char             path[PATH_MAX];
+	char             newpath[PATH_MAX];
+	int              res;
+
+	res = lowlevel_path(lowlevel_node(ino), NULL, path);
+	if (res == 0)
+		res = lowlevel_path(newdir, newname, newpath);
+	if (res == 0)
+		res = lowlevel.op->link(path, newpath);
+
+	if (res != 0)
+		fuse_reply_err(req, -res);
+	else
+		lowlevel_reply_entry(req, newdir, newname);
+}
+
+/**
+ * Release an open handle of node, and remove the file if it was hidden
+ * and this was the last one.
+ *
+ * @return 0 on success, negated errno on failure.
+ */
+static int lowlevel_close(lowlevel_node_t *node, struct fuse_file_info *fi)
+{
+	char path[PATH_MAX];
+	int  res;
+	int  remove;
+
+	res = lowlevel.op->release("/", fi);
+
+	LOCK(&lowlevel.lock);
+	remove = --node->opened == 0 && node->hidden;
+	UNLOCK(&lowlevel.lock);
+	if (remove && lowlevel_path(node, NULL, path) == 0 &&
+	    lowlevel.op->unlink(path) == 0)
+	{
+		LOCK(&lowlevel.lock);
+		lowlevel_detach(node);
+		node->hidden = FALSE;
+		UNLOCK(&lowlevel.lock);
+	}
+	return res;
+}
+
+static void lowlevel_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	lowlevel_node_t *node = lowlevel_node(ino);
+	char             path[PATH_MAX];
+	int              res;
+
+	res = lowlevel_path(node, NULL, path);
+	if (res == 0)
+		res = lowlevel.op->open(path, fi);
+	if (res != 0)
+	{
+		fuse_reply_err(req, -res);
+		return;
+	}
+
+	LOCK(&lowlevel.lock);
+	node->opened++;
+	UNLOCK(&lowlevel.lock);
+	if (fuse_reply_open(req, fi) == -ENOENT)
+		lowlevel_close(node, fi);
+}
+
+// The descriptor in fi knows its file, the path of an open file is only
+// used for debugging output and may be gone by now
+//
+static void lowlevel_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                          struct fuse_file_info *fi)
+{
+	char *buf;
+	int   res;
+
+	buf = malloc(size);
+	if (!buf)
+	{
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	res = lowlevel.op->read("-", buf, size, off, fi);
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_buf(req, buf, res);
+	free(buf);
+}
+
+static void lowlevel_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                           size_t size, off_t off, struct fuse_file_info *fi)
+{
+	int res;
+
+	res = lowlevel.op->write("-", buf, size, off, fi);
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_write(req, res);
+}
+
+static void lowlevel_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	fuse_reply_err(req, -lowlevel_close(lowlevel_node(ino), fi));
+}
+
+static void lowlevel_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                           struct fuse_file_info *fi)
+{
+	fuse_reply_err(req, -lowlevel.op->fsync("-", datasync, fi));
+}
+
+static void lowlevel_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	lowlevel_node_t *node = lowlevel_node(ino);
+	lowlevel_dir_t  *d;
+	int              fd;
+
+	d = malloc(sizeof(lowlevel_dir_t));
+	if (!d)
+	{
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	fd = node->fd == FAIL ? FAIL : openat(node->fd, ".", O_RDONLY | O_DIRECTORY);
+	if (fd == FAIL || !(d->dp = fdopendir(fd)))
+	{
+		int err = node->fd == FAIL ? ENOTDIR : errno;
+
+		if (fd != FAIL)
+			close(fd);
+		free(d);
+		fuse_reply_err(req, err);
+		return;
+	}
+	d->entry = NULL;
+	d->offset = 0;
+
+	fi->fh = (uintptr_t) d;
+	if (fuse_reply_open(req, fi) == -ENOENT)
+	{
+		closedir(d->dp);
+		free(d);
+	}
+}
+
+static void lowlevel_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                             struct fuse_file_info *fi)
+{
+	lowlevel_dir_t *d = (lowlevel_dir_t *) (uintptr_t) fi->fh;
+	char           *buf;
+	char           *p;
+	size_t          rem = size;
+
+	buf = malloc(size);
+	if (!buf)
+	{
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	p = buf;
+
+	if (off != d->offset)
+	{
+		seekdir(d->dp, off);
+		d->entry = NULL;
+		d->offset = off;
+	}
+
+	while (TRUE)
+	{
+		struct stat st;
+		size_t      len;
+		off_t       next;
+
+		if (!d->entry)
+		{
+			errno = 0;
+			d->entry = readdir(d->dp);
+			if (!d->entry)
+			{
+				if (errno && rem == size)
+				{
+					int err = errno;
+
+					free(buf);
+					fuse_reply_err(req, err);
+					return;
+				}
+				break;
+			}
+		}
+		next = telldir(d->dp);
+
+		// Hide the same files as the path based readdir
+		//
+		if (strstr(d->entry->d_name, FUSE) ||
+		    !strncmp(d->entry->d_name, FUSECOMPRESS_PREFIX, sizeof(FUSECOMPRESS_PREFIX) - 1))
+		{
+			d->entry = NULL;
+			d->offset = next;
+			continue;
+		}
+
+		memset(&st, 0, sizeof(st));
+		st.st_ino = inode_identity ? d->entry->d_ino : LOWLEVEL_UNKNOWN_INO;
+		st.st_mode = d->entry->d_type << 12;
+		len = fuse_add_direntry(req, p, rem, d->entry->d_name, &st, next);
+		if (len > rem)
+			break;
+		p += len;
+		rem -= len;
+		d->entry = NULL;
+		d->offset = next;
+	}
+
+	fuse_reply_buf(req, buf, size - rem);
+	free(buf);
+}
+
+static void lowlevel_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	lowlevel_dir_t *d = (lowlevel_dir_t *) (uintptr_t) fi->fh;
+
+	closedir(d->dp);
+	free(d);
+	fuse_reply_err(req, 0);
+}
+
+static void lowlevel_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs st;
+
+	if (fstatvfs(lowlevel.root.fd, &st) == FAIL)
+		fuse_reply_err(req, errno);
+	else
+		fuse_reply_statfs(req, &st);
+}
+
+static struct fuse_lowlevel_ops lowlevel_oper = {
+	.init		= lowlevel_init,
+	.destroy	= lowlevel_destroy,
+	.lookup		= lowlevel_lookup,
+	.forget		= lowlevel_forget,
+	.getattr	= lowlevel_getattr,
+	.setattr	= lowlevel_setattr,
+	.readlink	= lowlevel_readlink,
+	.mknod		= lowlevel_mknod,
+	.mkdir		= lowlevel_mkdir,
+	.unlink		= lowlevel_unlink,
+	.rmdir		= lowlevel_rmdir,
+	.symlink	= lowlevel_symlink,
+	.rename		= lowlevel_rename,
+	.link		= lowlevel_link,
+	.open		= lowlevel_open,
+	.read		= lowlevel_read,
+	.write		= lowlevel_write,
+	.release	= lowlevel_release,
+	.fsync		= lowlevel_fsync,
+	.opendir	= lowlevel_opendir,
+	.readdir	= lowlevel_readdir,
+	.releasedir	= lowlevel_releasedir,
+	.statfs		= lowlevel_statfs,
+};
+
+int lowlevel_caller(uid_t *uid, gid_t *gid)
+{
+	const struct fuse_ctx *ctx;
+
+	if (!lowlevel_req)
+		return FALSE;
+	ctx = fuse_req_ctx(lowlevel_req);
+	*uid = ctx->uid;
+	*gid = ctx->gid;
+	return TRUE;
+}
+
+static void lowlevel_free_nodes(void)
+{
+	unsigned int i;
+
+	for (i = 0; lowlevel.head && i <= lowlevel.mask; i++)
+	{
+		while (lowlevel.head[i])
+		{
+			lowlevel_node_t *node = lowlevel.head[i];
+
+			lowlevel.head[i] = node->next;
+			if (node->fd != FAIL)
+				close(node->fd);
+			free(node->name);
+			free(node);
+		}
+	}
+	free(lowlevel.head);
+	lowlevel.head = NULL;
+	lowlevel.entries = 0;
+}
+
+int lowlevel_main(int argc, char *argv[], const struct fuse_operations *op, int root_fd)
+{
+	struct fuse_args     args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_chan    *ch;
+	struct fuse_session *se;
+	char                *mountpoint = NULL;
+	int                  multithreaded;
+	int                  foreground;
+	int                  err = -1;
+
+	lowlevel.op = op;
+	lowlevel.root.name = "";
+	lowlevel.root.type = S_IFDIR;
+	lowlevel.root.fd = root_fd;
+	lowlevel.root.hashed = TRUE;
+
+	if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == FAIL)
+		return 1;
+
+	ch = fuse_mount(mountpoint, &args);
+	if (ch)
+	{
+		se = fuse_lowlevel_new(&args, &lowlevel_oper, sizeof(lowlevel_oper), NULL);
+		if (se)
+		{
+			if (fuse_set_signal_handlers(se) != FAIL)
+			{
+				fuse_session_add_chan(se, ch);
+				if (fuse_daemonize(foreground) != FAIL)
+					err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+	free(mountpoint);
+	fuse_opt_free_args(&args);
+
+	// Nodes still known to the kernel when it went away, detached nodes
+	// are not in the hash table and only freed with their lookups
+	//
+	lowlevel_free_nodes();
+
+	return err ? 1 : 0;
+}
@@ -0,0 +1,42 @@
+/* Low-level FUSE backend for fusecompress.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef LOWLEVEL_H
+#define LOWLEVEL_H
+
+#include <sys/types.h>
+
+/**
+ * Mount and serve requests through the low-level FUSE API instead of
+ * fuse_main(), taking the same arguments.
+ *
+ * @param op Path based operations the requests are passed on to where
+ *           fusecompress keeps state about a file.
+ * @param root_fd Descriptor of the backing directory.
+ * @return Exit status for main().
+ */
+int lowlevel_main(int argc, char *argv[], const struct fuse_operations *op, int root_fd);
+
+/**
+ * Get the caller of the request the current thread is serving.
+ *
+ * @return TRUE if the thread is serving a request of the low-level
+ *         backend, FALSE if fuse_get_context() has to be asked.
+ */
+int lowlevel_caller(uid_t *uid, gid_t *gid);
+
+#endif
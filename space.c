@@ -0,0 +1,181 @@
+/* Free space tracker for fusecompress.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Background compression, decompression and undeduplication all need to
+ * know whether a temporary copy of a file fits on the backing filesystem.
+ * Instead of calling statvfs() for every decision, the result is cached
+ * and refreshed at most every SPACE_REFRESH_INTERVAL milliseconds, by the
+ * janitor or by whichever caller first notices it is stale. Space
+ * reserved for temporary files still being written is subtracted, so two
+ * concurrent operations cannot both pass the check and then run out of
+ * space.
+ *
+ * The backing directory is our working directory, so we stat ".".
+ * A refresh already sees the part of a temporary file written so far,
+ * which makes the reservations err on the safe side.
+ */
+
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/statvfs.h>
+
+#include "structs.h"
+#include "log.h"
+#include "space.h"
+
+#define SPACE_REFRESH_INTERVAL 1000	/* milliseconds */
+
+static struct {
+	pthread_mutex_t lock;
+	off_t free;		/* Bytes available at the last refresh, -1 if never */
+	off_t total;		/* Size of the filesystem */
+	off_t reserved;		/* Bytes reserved for temporary files */
+	long long refreshed;	/* Time of the last refresh in milliseconds */
+	int refreshing;		/* Set while somebody is calling statvfs() */
+} space = {
+	.lock = LOCK_INITIALIZER,
+	.free = -1,
+	.total = 0,
+	.reserved = 0,
+	.refreshed = 0,
+	.refreshing = FALSE,
+};
+
+static long long space_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Make sure space.free is usable. Called with space.lock held, which is
+ * dropped during statvfs(). Only one thread refreshes at a time, the
+ * others go on with the old value.
+ *
+ * @return TRUE if space.free is valid.
+ */
+static int space_update(void)
+{
+	struct statvfs stat;
+	long long      now;
+	int            res;
+
+	NEED_LOCK(&space.lock);
+
+	now = space_now();
+	if (space.free != -1 &&
+	    (space.refreshing || now - space.refreshed < SPACE_REFRESH_INTERVAL))
+		return TRUE;
+
+	space.refreshing = TRUE;
+	UNLOCK(&space.lock);
+
+	res = statvfs(".", &stat);
+
+	LOCK(&space.lock);
+	space.refreshing = FALSE;
+	if (res == FAIL)
+	{
+		WARN_("statvfs failed: %s", strerror(errno));
+		return space.free != -1;
+	}
+
+	// root may use the reserved blocks too
+	//
+	if (geteuid() == 0)
+		space.free = (off_t) stat.f_frsize * stat.f_bfree;
+	else
+		space.free = (off_t) stat.f_frsize * stat.f_bavail;
+	space.total = (off_t) stat.f_frsize * stat.f_blocks;
+	space.refreshed = now;
+
+	return TRUE;
+}
+
+int space_check(off_t bytes)
+{
+	int ret;
+
+	LOCK(&space.lock);
+	ret = space_update() && space.free - space.reserved >= bytes;
+	UNLOCK(&space.lock);
+
+	return ret;
+}
+
+int space_reserve(off_t bytes)
+{
+	LOCK(&space.lock);
+	if (!space_update())
+	{
+		UNLOCK(&space.lock);
+		errno = EIO;
+		return FALSE;
+	}
+	if (space.free - space.reserved < bytes)
+	{
+		DEBUG_("no space for %zd bytes, free %zd, reserved %zd",
+			bytes, space.free, space.reserved);
+		UNLOCK(&space.lock);
+		errno = ENOSPC;
+		return FALSE;
+	}
+	space.reserved += bytes;
+	UNLOCK(&space.lock);
+
+	return TRUE;
+}
+
+void space_release(off_t bytes, off_t used)
+{
+	LOCK(&space.lock);
+	space.reserved -= bytes;
+	if (space.free != -1)
+		space.free -= used;
+	UNLOCK(&space.lock);
+}
+
+int space_used_percent(void)
+{
+	int ret = 0;
+
+	LOCK(&space.lock);
+	if (space_update() && space.total > 0)
+	{
+		ret = 100 - (space.free - space.reserved) * 100 / space.total;
+		if (ret < 0)
+			ret = 0;
+		if (ret > 100)
+			ret = 100;
+	}
+	UNLOCK(&space.lock);
+
+	return ret;
+}
+
+void space_refresh(void)
+{
+	LOCK(&space.lock);
+	space_update();
+	UNLOCK(&space.lock);
+}
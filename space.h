@@ -0,0 +1,60 @@
+/* Free space tracker for fusecompress.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef SPACE_H
+#define SPACE_H
+
+#include <sys/types.h>
+
+/**
+ * Check if bytes would fit on the backing filesystem right now.
+ *
+ * @return TRUE or FALSE.
+ */
+int space_check(off_t bytes);
+
+/**
+ * Reserve space for a temporary file of the given size.
+ *
+ * @return TRUE on success, FALSE with errno set (ENOSPC if there is not
+ *         enough space).
+ */
+int space_reserve(off_t bytes);
+
+/**
+ * Drop a reservation made by space_reserve().
+ *
+ * @param used Bytes the operation has consumed on the backing filesystem
+ *             in the end (negative if it has freed space). Accounted until
+ *             the next refresh picks it up.
+ */
+void space_release(off_t bytes, off_t used);
+
+/**
+ * How full the backing filesystem is, counting reservations.
+ *
+ * @return Percentage of the filesystem in use, 0 if unknown.
+ */
+int space_used_percent(void);
+
+/**
+ * Refresh the cached statistics if they are older than the refresh
+ * interval. Called periodically by the janitor.
+ */
+void space_refresh(void);
+
+#endif
@@ -10,6 +10,7 @@
 
 #include <pthread.h>
 #include <sys/types.h>
+#include <stdint.h>
 
 #include "list.h"
 
@@ -29,6 +30,9 @@
 # define NEED_LOCK(lock) assert(pthread_mutex_lock(lock) == EDEADLK)
 # define NEED_WR_LOCK(lock) assert(pthread_rwlock_wrlock(lock) == EDEADLK)
 # define NEED_RD_LOCK(lock) assert(pthread_rwlock_rdlock(lock) == EDEADLK)
+
+// NEED_LOCK() only works with error checking mutexes
+# define LOCK_INITIALIZER PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP
 #else
 # define LOCK(lock) pthread_mutex_lock(lock)
 # define LOCK_RD(lock) pthread_rwlock_rdlock(lock)
@@ -40,6 +44,8 @@
 # define NEED_LOCK(lock)
 # define NEED_WR_LOCK(lock)
 # define NEED_RD_LOCK(lock)
+
+# define LOCK_INITIALIZER PTHREAD_MUTEX_INITIALIZER
 #endif
 
 typedef struct
@@ -54,8 +60,26 @@ typedef struct
 	int (*read)(void *file, void *buf, unsigned int len);
 	int (*write)(void *file, void *buf, unsigned int len);
 
+	int resumable;		// Set if the decoder reads concatenated streams, so
+				// that compression can continue with a new stream
+	int expect;		// Percentage of the size compression is expected
+				// to save, orders the background queue
 } compressor_t;
 
+#define DIGEST_SIZE 16
+
+typedef struct
+{
+	char type;		// ID of the hash, recorded in the dedup DB
+	const char *name;
+	int verify;		// Set if the hash is not collision resistant, so
+				// that files have to be compared before linking
+
+	void *(*init)(void);
+	void (*update)(void *ctx, const void *buf, size_t len);
+	void (*final)(void *ctx, unsigned char *digest);	// Frees ctx
+} digest_t;
+
 typedef struct
 {
 	char id[3];		// ID of FuseCompress format
@@ -69,8 +93,30 @@ typedef struct
 
 #define COMPRESSING	(1 << 1)
 #define DECOMPRESSING	(1 << 2)
-#define CANCEL		(1 << 3)
+#define CANCEL		(1 << 3)	/* Set under file->lock, but checked without
+					   it by compress_testcancel() */
 #define DEDUPING	(1 << 4)
+#define BROKEN		(1 << 5)	/* An in-place rewrite has failed halfway,
+					   the data is unusable until inplace_recover()
+					   finishes it on the next mount */
+
+/**
+ * Checkpoint of a cancelled background compression
+ */
+typedef struct {
+	char		*temp;		/**< Temporary file, header and streams for the
+					     first offset bytes of the file */
+	compressor_t	*compressor;
+	off_t		 offset;
+	off_t		 length;	/**< Length of temp at the checkpoint */
+	unsigned int	 version;	/**< file->version at the checkpoint */
+	ino_t		 ino;		/**< Inode of the file at the checkpoint */
+	struct timespec	 mtime;		/**< Modification time of the file at the checkpoint */
+	struct timespec	 ctime;		/**< Change time of the file at the checkpoint */
+	off_t		 size;		/**< Size of the file at the checkpoint */
+} resume_t;
+
+typedef struct dedup_hasher dedup_hasher_t;
 
 /**
  * Used in database
@@ -80,6 +126,7 @@ typedef struct {
 	unsigned int	 filename_hash;
 
 	ino_t		 ino;		/**< inode */
+	dev_t		 dev;		/**< device, with ino the identity of the file */
 	nlink_t		 nlink;		/**< number if hard links */
 
 	int		 deleted;	/**< Boolean, if set file no longer exists */
@@ -89,14 +136,39 @@ typedef struct {
 	compressor_t	*compressor;	/**< NULL if file isn't compressed */
 	off_t		 skipped;	/**< Number of bytes read and discarded while seeking */
 	int		 dontcompress;
+	int		 shared;	/**< Boolean, another file_t is in use for the
+					     same inode, so it must not be rewritten */
 	int		 type;
 	int		 status;
 	int		 deduped;	/**< File has been deduplicated. */
 	
 	void**           cache;
 	int              cache_size;
+	int		 read_opens;	/**< Number of read-only opens, used to find hot files
+					     for the disk cache */
+	unsigned int	 version;	/**< Content version, bumped whenever the data
+					     or the backing file changes */
+	unsigned int	 kernel_version;	/**< Version the kernel page cache was
+						     last populated from */
 	
 	int		 errors_reported;	/**< Number of errors reported for this file */
+	time_t		 last_use;	/**< Time of the last lookup or release, used
+					     for eviction from the database */
+	time_t		 last_write;	/**< Time of the last write through us, 0 if none */
+	time_t		 compressed_at;	/**< Time of the last background compression, reset
+					     by the next write */
+	int		 hot_backoff;	/**< The cool-down of the file is
+					     compress_cooldown << hot_backoff */
+	int		 cooling;	/**< Boolean, recent is an entry in database.cooling
+					     rather than database.recent */
+	resume_t	*resume;	/**< Interrupted background compression, NULL if none */
+	int		 queued[2];	/**< Background queue entries for compression and
+					     for dedup, including those being worked on; their
+					     records in the journal are under filename */
+	dedup_hasher_t	*hasher;	/**< Dedup hash of the data, made while it was
+					     compressed or written, NULL if none */
+	int		 undedup;	/**< Boolean, the data may be shared with deduplicated
+					     files and has to be copied before it is written to */
 
 	pthread_mutex_t	lock;
 	pthread_cond_t cond;
@@ -104,9 +176,29 @@ typedef struct {
 	struct list_head	head;	/**< Head of descriptor_t. This is needed
 					     because truncate has to close all active fd's
 					     and do direct_close */
-	struct list_head	list;
+	struct list_head	list;	/**< Hash chain in the file database */
+	struct list_head	recent;	/**< Entry in database.recent or database.cooling,
+					     empty if not queued */
+	struct list_head	aliases;	/**< Other names of the file (alias_t) */
+	struct list_head	ino_list;	/**< Entry in the inode index, empty if not indexed */
+	int		 refs;		/**< Lookups through the inode index in progress,
+					     updated atomically. File can't be free'd until 0 */
 } file_t;
 
+/**
+ * Additional name of a hard-linked file in the file database.
+ */
+typedef struct {
+	file_t		*file;		/**< File the name refers to */
+	char		*filename;
+	unsigned int	 filename_hash;
+	int		 len;		/**< Length of filename including the NUL */
+	int		 deleted;	/**< Boolean, set if the name has been removed */
+
+	struct list_head	list;		/**< Hash chain in the file database */
+	struct list_head	file_list;	/**< Entry in file->aliases */
+} alias_t;
+
 typedef struct {
 	file_t		*file;		// link back to file_t, can't be free'd until accesses = 0
 
@@ -115,6 +207,9 @@ typedef struct {
 
 	void		*handle;	// for example gzFile
 	off_t		 offset;	// offset in file (this if for compression data)
+	int		 cache_fd;	// decompressed copy in the disk cache or -1
+	int		 cache_stale_fd;	// invalidated copy still being read from or -1
+	int		 cache_pins;	// reads from the copy in progress without the file lock
 
 	struct list_head list;
 } descriptor_t;
@@ -126,20 +221,30 @@ typedef struct {
 	file_t *file;		/**< Pointer to the file_t of the file
 				     scheduled to be compressed/deduplicated at
 				     a safe time. */
-	struct list_head list;
+	time_t key;		/**< Entries with the smallest key are taken first */
+	time_t queued;		/**< When the entry was queued */
+	time_t hold;		/**< Seconds the entry is held back because the
+				     file has just been written */
+	off_t saved;		/**< Bytes the entry is expected to save */
 	int is_dedup;		/**< Set if file is supposed to be deduplicated
                                      and not compressed. */
 } compress_t;
 
+#define DEDUP_HASHED_PARTIAL	(1 << 0)
+#define DEDUP_HASHED_FULL	(1 << 1)
+
 /**
  * Deduplication database entry.
  */
 typedef struct {
-        struct list_head list_filename_hash;
-        struct list_head list_md5;
-        char *filename;
+        unsigned char md5[16];	/**< Hash over the decompressed data, if
+				     DEDUP_HASHED_FULL is set */
+        uint64_t partial;	/**< Hash over the first and last bytes, if
+				     DEDUP_HASHED_PARTIAL is set */
+        uint64_t size;		/**< Size of the decompressed data */
         unsigned int filename_hash;
-        unsigned char md5[16];	/**< MD5 hash over the on-disk data */
+        unsigned int hashed;	/**< DEDUP_HASHED_* flags */
+        size_t filename;	/**< Offset of the file name in dedup_hash_t.names */
 } dedup_t;
 
 /**
@@ -152,21 +257,87 @@ typedef struct {
 	struct list_head head;		/**< Head of the file_t, compress_t, or dedup_t */
 } database_t;
 
-#define DATABASE_HASH_SIZE 65536
-#define DATABASE_HASH_MASK 0xffff
-#define DATABASE_HASH_QUEUE_T uint16_t
+/**
+ * Background queue, a binary min-heap of compress_t ordered by key.
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int entries;			/**< Number of entries in the queue */
+	int size;			/**< Allocated length of heap */
+	compress_t **heap;
+} comp_database_t;
+
+#define FILE_DATABASE_HASH_SIZE 16384
+#define FILE_DATABASE_HASH_MASK (FILE_DATABASE_HASH_SIZE - 1)
+#define FILE_DATABASE_STRIPES 64
+
+/**
+ * File database, file_t hashed by their filename hash. Idle entries are
+ * evicted by the janitor thread.
+ *
+ * Unless deduplication is enabled, a file_t stands for an inode. Other
+ * names it has been looked up by are kept as alias_t in alias_head, and
+ * ino_head indexes file_t by inode so that new names can be matched to them.
+ *
+ * Bucket i of head and alias_head is protected by
+ * stripe[i % FILE_DATABASE_STRIPES]. Lock order is lock -> stripe ->
+ * file_t lock -> recent_lock, ino_lock.
+ */
+typedef struct {
+	pthread_mutex_t lock;		/**< Serializes purging of the database */
+	pthread_cond_t cond;		/**< Wakes up the janitor */
+	int entries;			/**< Number of entries in the database, updated atomically */
+	struct list_head *head;		/**< FILE_DATABASE_HASH_SIZE heads of the hash chains */
+	struct list_head *alias_head;	/**< Same for alias_t */
+	struct list_head *ino_head;	/**< FILE_DATABASE_HASH_SIZE heads of the inode index */
+	pthread_mutex_t ino_lock;	/**< Protects ino_head */
+	pthread_mutex_t stripe[FILE_DATABASE_STRIPES];
+	pthread_mutex_t recent_lock;
+	int recent_entries;		/**< Number of entries in the recent list */
+	struct list_head recent;	/**< file_t that have been added or released since
+					     they were last considered for background
+					     compression or deduplication */
+	int cooling_entries;		/**< Number of entries in the cooling list */
+	struct list_head cooling;	/**< Idle file_t that have been written to less
+					     than their cool-down ago, protected by
+					     recent_lock */
+} file_database_t;
 
 /** Deduplication hash table.
  * Files are hashed by their MD5 sum and their fusecompress filename hash,
  * allowing fast lookup by both content (for deduplication) and name (for 
- * deduplicated file modification).
+ * deduplicated file modification). They are also indexed by size, so that
+ * files are only hashed once another file has the same size.
+ *
+ * The entries are kept in one array; by_md5, by_filename and by_size are
+ * open-addressing indexes into it holding the entry number plus one, or 0
+ * for an empty slot. by_md5 only holds entries with DEDUP_HASHED_FULL.
+ * The file names are stored back to back in names.
+ * Any of the arrays may still point into the mapped database file.
  */
 typedef struct {
 	pthread_mutex_t lock;
 	pthread_cond_t cond;
 	int entries; 			/**< Number of entries in the database */
-	struct list_head head_filename[DATABASE_HASH_SIZE]; /**< Heads of the filename hash lists. */
-	struct list_head head_md5[DATABASE_HASH_SIZE]; /**< Heads of the MD5 hash lists. */
+	int capacity;			/**< Allocated length of entry */
+	dedup_t *entry;
+	uint32_t mask;			/**< Number of index slots minus one */
+	uint32_t *by_md5;		/**< Index by MD5 hash */
+	uint32_t *by_filename;		/**< Index by filename hash */
+	uint32_t *by_size;		/**< Index by size */
+	char *names;			/**< File names, NUL-terminated */
+	size_t names_used;		/**< Bytes of names in use, including garbage */
+	size_t names_size;		/**< Allocated length of names */
+	size_t names_garbage;		/**< Bytes of names of removed entries */
+	void *map;			/**< Mapping of the database file, or NULL */
+	size_t map_size;
+	uint64_t generation;		/**< Generation of the database file, changes
+					     are only replayed from a log of the same
+					     generation */
+	int log_fd;			/**< Log of changes since the database file was
+					     written, -1 if changes are not logged */
+	off_t log_size;
 } dedup_hash_t;
 
 #endif
@@ -0,0 +1,25 @@
+#!/bin/bash -e
+# files that are never looked at through the mount are found by the crawler
+mkdir -p test/a/b
+for i in 1 2 3; do
+  cp /bin/bash test/bash$i
+  cp /bin/bash test/a/b/bash$i
+done
+size=`stat -c %s /bin/bash`
+../fusecompress -d -c gz -o crawl test
+sleep 2
+fusermount -u test
+sleep 1
+test ! -e test/._fCcrawl
+for i in 1 2 3; do
+  test `stat -c %s test/bash$i` -lt $size
+  test `stat -c %s test/a/b/bash$i` -lt $size
+done
+../fusecompress -d -c gz test
+for i in 1 2 3; do
+  cmp /bin/bash test/bash$i
+  cmp /bin/bash test/a/b/bash$i
+done
+fusermount -u test
+sleep 1
+rm -fr test
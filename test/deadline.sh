@@ -0,0 +1,32 @@
+#!/bin/bash -e
+# unmount with a deadline saves pending work, the next mount finishes it
+mkdir test
+for i in 1 2 3 4; do
+  cp /bin/bash test/bash$i
+done
+size=`stat -c %s /bin/bash`
+../fusecompress -d -c gz -o deadline=0,bwlimit=1 test
+for i in 1 2 3 4; do
+  cmp /bin/bash test/bash$i
+done
+fusermount -u test
+sleep 1
+test -f test/._fCqueue
+for i in 1 2 3 4; do
+  test `stat -c %s test/bash$i` -eq $size
+done
+../fusecompress -d -c gz test
+sleep 1
+fusermount -u test
+sleep 1
+test ! -e test/._fCqueue
+for i in 1 2 3 4; do
+  test `stat -c %s test/bash$i` -lt $size
+done
+../fusecompress -d -c gz test
+for i in 1 2 3 4; do
+  cmp /bin/bash test/bash$i
+done
+fusermount -u test
+sleep 1
+rm -fr test
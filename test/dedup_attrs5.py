@@ -0,0 +1,53 @@
+# attributes of deduped files are remembered across mounts, and follow
+# renamed directories
+
+import os
+import shutil
+import sys
+import time
+import stat
+
+os.mkdir('test')
+if os.system('../fusecompress -o dedup,detach test') != 0:
+  os.rmdir('test')
+  sys.exit(2)
+
+text = 'foo'
+
+os.mkdir('test/d')
+open('test/1', 'w').write(text)
+os.chmod('test/1', 0647)
+open('test/d/2', 'w').write(text)
+os.chmod('test/d/2', 0600)
+
+os.system('fusermount -u test')
+time.sleep(1)
+
+assert(os.lstat('test/1').st_nlink == 2)
+assert(os.path.exists('test/._fCdedup_attrs'))
+
+os.system('../fusecompress -o dedup,detach test')
+time.sleep(.1)
+
+assert(stat.S_IMODE(os.lstat('test/1').st_mode) == 0647)
+assert(stat.S_IMODE(os.lstat('test/d/2').st_mode) == 0600)
+
+# the overlay is only used once
+assert(not os.path.exists('test/._fCdedup_attrs'))
+
+os.rename('test/d', 'test/e')
+os.mkdir('test/d')
+open('test/d/2', 'w').write('bar')
+os.chmod('test/d/2', 0640)
+assert(stat.S_IMODE(os.lstat('test/d/2').st_mode) == 0640)
+assert(stat.S_IMODE(os.lstat('test/e/2').st_mode) == 0600)
+
+os.chmod('test/e/2', 0604)
+assert(stat.S_IMODE(os.lstat('test/e/2').st_mode) == 0604)
+assert(stat.S_IMODE(os.lstat('test/1').st_mode) == 0647)
+
+os.system('fusermount -u test')
+time.sleep(1)
+
+shutil.rmtree('test')
+sys.exit(0)
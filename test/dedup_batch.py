@@ -0,0 +1,39 @@
+# dedup the queued files in batches, including duplicates within a batch
+
+import os
+import random
+import shutil
+import sys
+import time
+
+random.seed(2)
+a = ''.join(chr(random.randint(0, 255)) for i in range(300000))
+b = a[:150000] + chr(ord(a[150000]) ^ 1) + a[150001:]
+
+os.mkdir('test')
+
+if os.system('../fusecompress -o dedup,dedup_batch,detach test') != 0:
+  os.rmdir('test')
+  sys.exit(2)	# dedup not available
+for name in ['a1', 'a2', 'a3']:
+  open('test/' + name, 'w').write(a)
+open('test/b', 'w').write(b)
+open('test/c', 'w').write(a[:1000])
+os.system('fusermount -u test')
+time.sleep(2)
+
+# the copies of a share one inode, the others keep their own
+assert(os.lstat('test/a1').st_nlink == 3)
+assert(os.lstat('test/a2').st_ino == os.lstat('test/a1').st_ino)
+assert(os.lstat('test/b').st_nlink == 1)
+assert(os.lstat('test/c').st_nlink == 1)
+
+assert(os.system('../fusecompress -o dedup,dedup_batch,detach test') == 0)
+assert(open('test/a3').read() == a)
+assert(open('test/b').read() == b)
+assert(open('test/c').read() == a[:1000])
+os.system('fusermount -u test')
+time.sleep(2)
+
+shutil.rmtree('test')
+sys.exit(0)
@@ -0,0 +1,54 @@
+# files that only differ in a few places share their chunks
+
+import os
+import random
+import shutil
+import sys
+import time
+
+def chunks():
+  count = 0
+  size = 0
+  for dirpath, dirnames, filenames in os.walk('test/._fCchunks'):
+    for f in filenames:
+      count += 1
+      size += os.lstat(os.path.join(dirpath, f)).st_size
+  return (count, size)
+
+random.seed(1)
+a = ''.join(chr(random.randint(0, 255)) for i in range(2 * 1024 * 1024))
+b = a[:1000000] + 'inserted' + a[1000000:]
+
+os.mkdir('test')
+
+if os.system('../fusecompress -o dedup_chunks,detach,null test') != 0:
+  os.rmdir('test')
+  sys.exit(2)	# dedup not available
+open('test/a', 'w').write(a)
+open('test/b', 'w').write(b)
+os.system('fusermount -u test')
+time.sleep(2)
+
+# b only adds the chunks around the insertion
+(count, size) = chunks()
+assert(count > 1)
+assert(size < len(a) * 1.2)
+
+assert(os.system('../fusecompress -o dedup_chunks,detach,null test') == 0)
+assert(open('test/a').read() == a)
+assert(open('test/b').read() == b)
+os.unlink('test/a')
+os.system('fusermount -u test')
+time.sleep(2)
+
+# the chunks only a has used are removed
+assert(os.system('../fsck.fusecompress -g test') == 0)
+assert(chunks()[0] < count)
+
+assert(os.system('../fusecompress -o dedup_chunks,detach,null test') == 0)
+assert(open('test/b').read() == b)
+os.system('fusermount -u test')
+time.sleep(2)
+
+shutil.rmtree('test')
+sys.exit(0)
@@ -0,0 +1,35 @@
+# the dedup DB survives a crash of fusecompress
+
+import os
+import shutil
+import sys
+import time
+
+os.mkdir('test')
+
+if os.system('../fusecompress -o dedup,detach,gz test') != 0:
+  os.rmdir('test')
+  sys.exit(2)	# dedup not available
+shutil.copy('/bin/sh', 'test/sh1')
+os.system('fusermount -u test')
+time.sleep(2)
+assert(os.path.exists('test/._fCdedup_db'))
+
+# kill it without giving it a chance to save the DB
+assert(os.system('../fusecompress -o dedup,detach,gz test') == 0)
+os.stat('test/sh1')
+os.system('pkill -9 -f "fusecompress -o dedup,detach,gz test"')
+time.sleep(1)
+os.system('fusermount -u test')
+assert(os.path.exists('test/._fCdedup_db'))
+
+# the copy is linked to the file known from the DB
+assert(os.system('../fusecompress -o dedup,detach,gz test') == 0)
+shutil.copy('/bin/sh', 'test/sh2')
+os.system('fusermount -u test')
+time.sleep(2)
+assert(os.lstat('test/sh2').st_nlink == 2)
+assert(not os.path.exists('test/._fCdedup_log'))
+
+shutil.rmtree('test')
+sys.exit(0)
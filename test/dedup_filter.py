@@ -0,0 +1,82 @@
+# redup tells the files in the dedup DB from new ones through Bloom filters,
+# check their answers after entries have been added, removed and renamed,
+# the indexes have grown and the filesystem has been remounted
+
+import os
+import sys
+import shutil
+import time
+
+if not 'deduplication' in os.popen('../fsck.fusecompress --help 2>&1').read():
+  sys.exit(2)
+
+def write(name, data):
+  if os.path.exists(name):
+    os.unlink(name)
+  open(name, 'w').write(data)
+
+def nlink(name):
+  return os.lstat('test/' + name).st_nlink
+
+u = [os.urandom(2000) for i in range(50)]
+
+os.mkdir('test')
+os.mkdir('test/fill')
+for i in range(50):
+  write('test/u%d' % i, u[i])
+for i in range(10):
+  write('test/v%d' % i, u[40 + i])
+# enough entries to grow the indexes while fsck asks for MD5 hashes
+for i in range(1000):
+  write('test/fill/f%d' % i, os.urandom(2000))
+assert(os.system('../fsck.fusecompress -r test') == 0)
+
+# only one of each pair of duplicates has been added, redup finds the other
+assert(os.system('../fusecompress -o detach,dedup,redup,cooldown=0 test') == 0)
+time.sleep(.2)
+for i in range(50):
+  os.stat('test/u%d' % i)
+for i in range(10):
+  os.stat('test/v%d' % i)
+time.sleep(3)
+os.rename('test/u30', 'test/r30')
+os.unlink('test/u31')
+assert(os.system('fusermount -u test') == 0)
+time.sleep(3)
+for i in range(10):
+  assert(nlink('v%d' % i) == 2)
+
+# names in the DB are taken as deduplicated even when they are not, other
+# names are deduplicated
+for i in range(10):
+  write('test/u%d' % i, u[10 + i])
+  write('test/c%d' % i, u[20 + i])
+write('test/r30', u[32])
+write('test/u30', u[33])
+write('test/u31', u[34])
+
+assert(os.system('../fusecompress -o detach,dedup,redup,cooldown=0 test') == 0)
+time.sleep(.2)
+os.stat('test/c0')
+# grow the indexes again, the filters are in use now
+os.mkdir('test/g')
+for i in range(1000):
+  open('test/g/f%d' % i, 'w').write(os.urandom(2000))
+time.sleep(6)
+for i in range(10):
+  os.stat('test/u%d' % i)
+  os.stat('test/c%d' % i)
+for i in ['r30', 'u30', 'u31']:
+  os.stat('test/' + i)
+time.sleep(3)
+assert(os.system('fusermount -u test') == 0)
+time.sleep(3)
+for i in range(10):
+  assert(nlink('u%d' % i) == 1)
+  assert(nlink('c%d' % i) == 2)
+assert(nlink('r30') == 1)
+assert(nlink('u30') == 2)
+assert(nlink('u31') == 2)
+
+shutil.rmtree('test')
+sys.exit(0)
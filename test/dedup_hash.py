@@ -0,0 +1,29 @@
+# dedup with either hash, and switching hashes on an existing DB
+
+import os
+import shutil
+import sys
+import time
+
+os.mkdir('test')
+
+if os.system('../fusecompress -o dedup,dedup_hash=md5,detach,gz test') != 0:
+  os.rmdir('test')
+  sys.exit(2)	# dedup not available
+shutil.copy('/bin/sh', 'test/sh1')
+shutil.copy('/bin/sh', 'test/sh2')
+os.system('fusermount -u test')
+time.sleep(2)
+assert(os.lstat('test/sh2').st_nlink == 2)
+
+# the DB is hashed again, and still finds the files
+assert(os.system('../fusecompress -o dedup,dedup_hash=murmur3,detach,gz test') == 0)
+shutil.copy('/bin/sh', 'test/sh3')
+shutil.copy('/bin/ls', 'test/ls')
+os.system('fusermount -u test')
+time.sleep(2)
+assert(os.lstat('test/sh3').st_nlink == 3)
+assert(os.lstat('test/ls').st_nlink == 1)
+
+shutil.rmtree('test')
+sys.exit(0)
@@ -0,0 +1,50 @@
+# deduped files are only copied once they are written to
+
+import os
+import shutil
+import sys
+import time
+
+os.mkdir('test')
+
+if os.system('../fusecompress -o dedup,detach test') != 0:
+  os.rmdir('test')
+  sys.exit(2)	# dedup not available
+
+shutil.copy('/bin/sh', 'test/sh1')
+shutil.copy('/bin/sh', 'test/sh2')
+shutil.copy('/bin/sh', 'test/sh3')
+
+os.system('fusermount -u test')
+time.sleep(1)
+
+assert(os.lstat('test/sh1').st_nlink == 3)
+
+os.system('../fusecompress -o dedup,detach test')
+
+# opening for writing alone keeps the file deduped
+open('test/sh1', 'r+').close()
+assert(os.lstat('test/sh1').st_nlink == 3)
+
+f = open('test/sh1', 'r+')
+f.seek(10)
+f.write('foo')
+f.close()
+assert(os.lstat('test/sh1').st_nlink == 1)
+assert(open('test/sh1').read() == open('/bin/sh').read()[:10] + 'foo' + open('/bin/sh').read()[13:])
+assert(open('test/sh2').read() == open('/bin/sh').read())
+
+# truncate() doesn't cut off the data of the other copies
+open('test/sh3', 'r+').truncate(100)
+assert(open('test/sh3').read() == open('/bin/sh').read()[:100])
+assert(open('test/sh2').read() == open('/bin/sh').read())
+
+os.system('fusermount -u test')
+time.sleep(1)
+
+assert(os.lstat('test/sh1').st_nlink == 1)
+assert(os.lstat('test/sh2').st_nlink == 1)
+assert(os.lstat('test/sh3').st_nlink == 1)
+
+shutil.rmtree('test')
+sys.exit(0)
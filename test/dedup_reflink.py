@@ -0,0 +1,36 @@
+# dedup by cloning files, where the backing filesystem can
+
+import os
+import shutil
+import sys
+import time
+
+os.mkdir('test')
+
+if os.system('../fusecompress -o dedup,dedup_reflink,detach test') != 0:
+  os.rmdir('test')
+  sys.exit(2)	# dedup not available
+shutil.copy('/bin/sh', 'test/sh1')
+shutil.copy('/bin/sh', 'test/sh2')
+os.chmod('test/sh2', 0600)
+os.system('fusermount -u test')
+time.sleep(2)
+
+if os.lstat('test/sh2').st_nlink == 2:
+  shutil.rmtree('test')
+  sys.exit(2)	# no reflinks, deduped with hardlinks
+
+# each name keeps its own inode and attributes
+assert(os.lstat('test/sh1').st_ino != os.lstat('test/sh2').st_ino)
+assert(os.lstat('test/sh2').st_mode & 0777 == 0600)
+assert(not [f for f in os.listdir('test') if f.startswith('._fCat_')])
+
+assert(os.system('../fusecompress -o dedup,dedup_reflink,detach test') == 0)
+open('test/sh2', 'a').write('foo')
+assert(open('test/sh1').read() == open('/bin/sh').read())
+assert(open('test/sh2').read() == open('/bin/sh').read() + 'foo')
+os.system('fusermount -u test')
+time.sleep(2)
+
+shutil.rmtree('test')
+sys.exit(0)
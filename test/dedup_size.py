@@ -0,0 +1,44 @@
+# files of the same size are only linked if all of their contents match
+
+import os
+import random
+import shutil
+import sys
+import time
+
+random.seed(2)
+a = ''.join(chr(random.randint(0, 255)) for i in range(512 * 1024))
+b = a[:256 * 1024] + 'x' + a[256 * 1024 + 1:]	# same first and last 64 KB
+
+os.mkdir('test')
+
+if os.system('../fusecompress -o dedup,detach,null test') != 0:
+  os.rmdir('test')
+  sys.exit(2)	# dedup not available
+open('test/a', 'w').write(a)
+open('test/b', 'w').write(b)
+open('test/c', 'w').write(a[:-1])
+os.system('fusermount -u test')
+time.sleep(2)
+assert(os.lstat('test/a').st_nlink == 1)
+assert(os.lstat('test/b').st_nlink == 1)
+assert(os.lstat('test/c').st_nlink == 1)
+
+# entries kept unhashed are hashed once a file of the same size shows up
+assert(os.system('../fusecompress -o dedup,detach,null test') == 0)
+open('test/a2', 'w').write(a)
+open('test/c2', 'w').write(a[:-1])
+os.system('fusermount -u test')
+time.sleep(2)
+assert(os.lstat('test/a2').st_nlink == 2)
+assert(os.lstat('test/c2').st_nlink == 2)
+assert(os.lstat('test/b').st_nlink == 1)
+
+assert(os.system('../fusecompress -o dedup,detach,null test') == 0)
+assert(open('test/b').read() == b)
+assert(open('test/c2').read() == a[:-1])
+os.system('fusermount -u test')
+time.sleep(2)
+
+shutil.rmtree('test')
+sys.exit(0)
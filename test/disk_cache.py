@@ -0,0 +1,66 @@
+# check if seeking reads on a compressed file are served from the disk cache
+# while the original stays compressed
+
+import os
+import stat
+import time
+import shutil
+
+os.mkdir('test')
+os.mkdir('cache')
+
+bigsize = 1000
+
+os.system('../fusecompress -o detach test')
+f = open('test/big', 'w')
+for i in range(0, bigsize):
+  f.write(('%04d' % i) * 256)
+f.close()
+os.system('fusermount -u test')
+time.sleep(1)
+
+os.system('../fusecompress -o detach,cachedir=cache test')
+
+f = open('test/big', 'r')
+off1 = 0
+off2 = bigsize * 256 * 4 - 1024
+for i in range(0,10):
+  f.seek(off1)
+  if f.read(4) != '%04d' % (off1 / 1024):
+    print 'wrong data at', off1
+    os.abort()
+  off1 += 4096
+  f.seek(off2)
+  if f.read(4) != '%04d' % (off2 / 1024):
+    print 'wrong data at', off2
+    os.abort()
+  off2 -= 4096
+f.close()
+
+if len(os.listdir('cache')) != 1:
+  print 'no copy in cache directory'
+  os.abort()
+
+os.system('fusermount -u test')
+time.sleep(1)
+
+if os.stat('test/big')[stat.ST_SIZE] > bigsize * 256 * 2:
+  print 'big file decompressed'
+  os.abort()
+
+# the copy must not be used once the original has changed
+os.system('../fusecompress -o detach,cachedir=cache test')
+f = open('test/big', 'w')
+f.write('x' * 4096)
+f.close()
+f = open('test/big', 'r')
+f.seek(2048)
+if f.read(4) != 'xxxx':
+  print 'stale data from cache'
+  os.abort()
+f.close()
+os.system('fusermount -u test')
+time.sleep(1)
+
+shutil.rmtree('test')
+shutil.rmtree('cache')
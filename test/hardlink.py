@@ -0,0 +1,54 @@
+# check that hard-linked files are compressed in place and stay linked
+
+import os
+import sys
+import shutil
+import time
+
+data = 'blafwpegfjwegwegherjhj32r0grobfn23t-=wefopjweofewfjwopefjp' * 1000
+
+os.mkdir('test')
+a = open('test/a','w')
+a.write(data)
+a.close()
+os.link('test/a', 'test/b')
+ino = os.stat('test/a').st_ino
+
+os.system('../fusecompress -o lzo,detach test')
+# look the file up by both names, unmounting compresses it
+a = open('test/a','r')
+a.read()
+a.close()
+os.stat('test/b')
+time.sleep(1)
+os.system('fusermount -u test')
+time.sleep(1)
+
+st = os.stat('test/a')
+if st.st_ino != ino or st.st_nlink != 2 or st.st_size >= len(data):
+  os.abort()
+if os.stat('test/b').st_ino != ino:
+  os.abort()
+
+os.system('../fusecompress -o lzo,detach test')
+b = open('test/b','r')
+if b.read() != data:
+  os.abort()
+b.close()
+
+# writes through one link are seen through the other
+b = open('test/b','r+')
+b.write('2222222222')
+b.close()
+a = open('test/a','r')
+if a.read() != '2222222222' + data[10:]:
+  os.abort()
+a.close()
+os.system('fusermount -u test')
+time.sleep(1)
+
+if os.stat('test/a').st_ino != ino or os.stat('test/b').st_ino != ino:
+  os.abort()
+
+shutil.rmtree('test')
+sys.exit(0)
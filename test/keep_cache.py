@@ -0,0 +1,50 @@
+# check that the kernel page cache kept across opens never serves stale data
+
+import os
+import sys
+import shutil
+import time
+
+os.mkdir('test')
+os.system('../fusecompress -o lzo,detach test')
+a = open('test/a','w')
+a.write('blafwpegfjwegwegherjhj32r0grobfn23t-=wefopjweofewfjwopefjp' * 1000)
+a.close()
+time.sleep(1)
+os.system('fusermount -u test')
+time.sleep(1)
+os.system('../fusecompress -o lzo,detach test')
+
+# populate the page cache, then read again with it kept
+for i in range(3):
+  a = open('test/a','r')
+  if not a.read(4096).startswith('blafwpeg'):
+    os.abort()
+  a.close()
+
+# overwrite the file, the next open must not see the old pages
+a = open('test/a','w')
+a.write('1111111111111111111111111111111111111111111111111111111111' * 1000)
+a.close()
+a = open('test/a','r')
+if not '111111' in a.read(4096):
+  os.abort()
+a.close()
+
+# writes through another hard link bypass the cache of this name
+os.link('test/a', 'test/l')
+a = open('test/a','r')
+a.read(4096)
+a.close()
+l = open('test/l','r+')
+l.write('2222222222')
+l.close()
+a = open('test/a','r')
+if not a.read(4096).startswith('2222222222'):
+  os.abort()
+a.close()
+
+os.system('fusermount -u test')
+time.sleep(1)
+shutil.rmtree('test')
+sys.exit(0)
@@ -0,0 +1,70 @@
+# serve a deep tree through the low-level backend, renaming directories under
+# open names and using files unlinked while open
+
+import os
+import random
+import shutil
+import sys
+import time
+
+random.seed(3)
+a = ''.join(chr(random.randint(0, 255)) for i in range(200000))
+
+os.mkdir('test')
+
+if os.system('../fusecompress -o lowlevel,entry_timeout=5,attr_timeout=5,detach test') != 0:
+  os.rmdir('test')
+  sys.exit(2)	# low-level API not available
+os.makedirs('test/d1/d2/d3')
+open('test/d1/d2/d3/f', 'w').write(a)
+os.symlink('d2/d3/f', 'test/d1/l')
+os.mkfifo('test/d1/p')
+fd = open('test/d1/d2/d3/f', 'r+')
+os.rename('test/d1/d2', 'test/d1/e2')
+# the open name follows the directory
+assert(os.fstat(fd.fileno()).st_size == len(a))
+fd.seek(1000)
+assert(fd.read(4096) == a[1000:5096])
+fd.close()
+assert(open('test/d1/e2/d3/f').read() == a)
+assert(os.readlink('test/d1/l') == 'd2/d3/f')
+assert(sorted(os.listdir('test/d1')) == ['e2', 'l', 'p'])
+os.chmod('test/d1/e2', 0700)
+assert(os.stat('test/d1/e2').st_mode & 0777 == 0700)
+os.link('test/d1/e2/d3/f', 'test/d1/g')
+os.unlink('test/d1/e2/d3/f')
+assert(open('test/d1/g').read() == a)
+assert(not os.path.exists('test/d1/e2/d3/f'))
+os.rmdir('test/d1/e2/d3')
+
+# a file unlinked while open can still be used through its descriptor
+fd = open('test/d1/t', 'w+')
+fd.write(a)
+fd.flush()
+os.unlink('test/d1/t')
+assert(not os.path.exists('test/d1/t'))
+assert(os.fstat(fd.fileno()).st_size == len(a))
+os.fchmod(fd.fileno(), 0600)
+assert(os.fstat(fd.fileno()).st_mode & 0777 == 0600)
+os.ftruncate(fd.fileno(), 5000)
+assert(os.fstat(fd.fileno()).st_size == 5000)
+fd.seek(0)
+assert(fd.read() == a[:5000])
+assert(sorted(os.listdir('test/d1')) == ['e2', 'g', 'l', 'p'])
+fd.close()
+os.system('fusermount -u test')
+time.sleep(2)
+
+# the backing tree matches what was done through the mount
+assert(os.path.isdir('test/d1/e2'))
+assert(not os.path.exists('test/d1/d2'))
+assert(os.path.islink('test/d1/l'))
+assert(not [n for n in os.listdir('test/d1') if n.startswith('.fuse_hidden')])
+
+assert(os.system('../fusecompress -o lowlevel,detach test') == 0)
+assert(open('test/d1/g').read() == a)
+os.system('fusermount -u test')
+time.sleep(2)
+
+shutil.rmtree('test')
+sys.exit(0)
@@ -0,0 +1,57 @@
+#!/bin/bash -e
+# pending work survives a crash through the queue journal
+mkdir test
+for i in 1 2 3 4; do
+  cp /bin/bash test/bash$i
+done
+size=`stat -c %s /bin/bash`
+../fusecompress -d -c gz -o cooldown=0,bwlimit=1 test
+for i in 1 2 3 4; do
+  cmp /bin/bash test/bash$i
+done
+# give the janitor time to queue the files and sync the journal
+sleep 12
+pkill -9 -f "fusecompress -d -c gz -o cooldown=0,bwlimit=1 test"
+sleep 1
+fusermount -u test
+test -f test/._fCqueue
+../fusecompress -d -c gz test
+sleep 1
+fusermount -u test
+sleep 1
+test ! -e test/._fCqueue
+for i in 1 2 3 4; do
+  test `stat -c %s test/bash$i` -lt $size
+done
+../fusecompress -d -c gz test
+for i in 1 2 3 4; do
+  cmp /bin/bash test/bash$i
+done
+fusermount -u test
+sleep 1
+
+# files renamed while queued, by themselves or with their directory, are
+# resumed under their new names
+cp /bin/bash test/bash5
+mkdir test/sub
+cp /bin/bash test/sub/bash6
+../fusecompress -d -c gz -o cooldown=0,bwlimit=1 test
+cmp /bin/bash test/bash5
+cmp /bin/bash test/sub/bash6
+sleep 12
+mv test/bash5 test/moved5
+mv test/sub test/sub2
+# give the janitor time to sync the records of the renames
+sleep 12
+pkill -9 -f "fusecompress -d -c gz -o cooldown=0,bwlimit=1 test"
+sleep 1
+fusermount -u test
+grep -qa moved5 test/._fCqueue
+../fusecompress -d -c gz test
+sleep 1
+fusermount -u test
+sleep 1
+test ! -e test/._fCqueue
+test `stat -c %s test/moved5` -lt $size
+test `stat -c %s test/sub2/bash6` -lt $size
+rm -fr test
@@ -0,0 +1,99 @@
+#include "structs.h"
+#include "globals.h"
+#include "background_compress.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MB (1024 * 1024)
+
+static int used;
+static compressor_t gz = { .name = "gz", .expect = 60 };
+
+comp_database_t comp_database = { .lock = LOCK_INITIALIZER };
+pthread_t *pt_comp;
+int comp_workers = 1;
+size_t dont_compress_beyond = -1;
+
+int space_used_percent(void)
+{
+  return used;
+}
+compressor_t *choose_compressor(const file_t *file)
+{
+  return strstr(file->filename, ".jpg") ? NULL : &gz;
+}
+void do_compress(file_t *file)
+{
+}
+void journal_queued(file_t *file, int dedup)
+{
+}
+void journal_done(file_t *file, int dedup)
+{
+}
+
+static void queue(const char *name, off_t size, time_t last_write)
+{
+  static pthread_mutex_t lock = LOCK_INITIALIZER;
+  file_t *file = calloc(1, sizeof(file_t));
+
+  file->filename = strdup(name);
+  file->size = size;
+  file->last_write = last_write;
+  file->lock = lock;
+  LOCK(&file->lock);
+  background_compress(file);
+  UNLOCK(&file->lock);
+}
+
+static void expect(const char *name)
+{
+  compress_t *entry = background_compress_take();
+
+  if (!entry || strcmp(entry->file->filename, name))
+  {
+    fprintf(stderr, "expected %s, got %s\n", name,
+            entry ? entry->file->filename : "nothing");
+    exit(1);
+  }
+  free(entry);
+}
+
+int main(int argc, char** argv)
+{
+  time_t now = time(NULL);
+
+  // the most bytes saved first, nothing for files left uncompressed
+  used = 50;
+  queue("small", 4 * MB, 0);
+  queue("huge.jpg", 1024 * MB, 0);
+  queue("big", 64 * MB, 0);
+  queue("mid", 16 * MB, 0);
+  expect("big");
+  expect("mid");
+  expect("small");
+  expect("huge.jpg");
+
+  // a file just written waits unless the space is needed
+  queue("fresh", 64 * MB, now);
+  queue("old", 4 * MB, 0);
+  expect("old");
+  expect("fresh");
+  queue("fresh", 64 * MB, now);
+  queue("old", 4 * MB, 0);
+  used = 100;
+  expect("fresh");
+  expect("old");
+
+  // and the queue is re-keyed when it is no longer needed
+  queue("fresh", 64 * MB, now);
+  queue("old", 4 * MB, 0);
+  used = 50;
+  expect("old");
+  expect("fresh");
+  if (background_compress_take())
+    abort();
+  return 0;
+}
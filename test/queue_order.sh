@@ -0,0 +1,5 @@
+#!/bin/sh -e
+# order of the background queue
+gcc -g -I.. -o queue_order queue_order.c ../background_compress.c ../log.c -lpthread
+./queue_order
+rm queue_order
@@ -0,0 +1,37 @@
+# rename a directory with an open file below it, then keep using the file
+# and make a new file under the old name
+
+import os
+import shutil
+import sys
+import time
+
+a = 'abcd' * 50000
+
+os.mkdir('test')
+os.system('../fusecompress test')
+
+os.makedirs('test/d/e')
+fd = open('test/d/e/f', 'w+')
+fd.write(a)
+fd.flush()
+os.rename('test/d', 'test/n')
+fd.seek(1000)
+assert(fd.read(4096) == a[1000:5096])
+fd.seek(0)
+fd.write('x' * 10)
+os.ftruncate(fd.fileno(), 100000)
+assert(os.fstat(fd.fileno()).st_size == 100000)
+fd.close()
+assert(open('test/n/e/f').read() == 'x' * 10 + a[10:100000])
+
+# the old name is a different file now
+os.makedirs('test/d/e')
+open('test/d/e/f', 'w').write('y')
+assert(os.stat('test/d/e/f').st_size == 1)
+assert(open('test/d/e/f').read() == 'y')
+
+os.system('fusermount -u test')
+time.sleep(2)
+shutil.rmtree('test')
+sys.exit(0)
@@ -0,0 +1,59 @@
+# a cancelled compression is not resumed after the file has been rewritten
+# to the same size and mtime
+
+import os
+import shutil
+import time
+
+def data(n):
+  # compresses to about half, so the tempfile shows the progress
+  return os.urandom(n).translate(''.join(chr(97 + (i & 15)) for i in range(256)))
+
+def tempsize(back):
+  return max([os.lstat(back + '/' + f).st_size for f in os.listdir(back)
+              if f.startswith('._fCtmp')] or [0])
+
+size = 4 * 1024 * 1024
+a = data(size)
+b = data(size)
+
+os.mkdir('test')
+open('test/f', 'w').write(a)
+os.utime('test/f', (1000000000, 1000000000))
+# the backing directory stays reachable under the mount
+dfd = os.open('test', os.O_RDONLY)
+back = '/proc/self/fd/%d' % dfd
+
+assert(os.system('../fusecompress -c gz -o cooldown=0,bwlimit=256,detach test') == 0)
+assert(open('test/f').read() == a)
+# wait until more than the minimum for a checkpoint has been compressed
+for i in range(120):
+  if tempsize(back) >= 768 * 1024:
+    break
+  time.sleep(0.5)
+assert(tempsize(back) >= 768 * 1024)
+
+# opening cancels the compression, which keeps a checkpoint
+f = open('test/f', 'r+')
+f.write(b)
+f.close()
+os.utime('test/f', (1000000000, 1000000000))
+assert(os.stat('test/f').st_size == size)
+
+# only the ctime tells the rewrite apart
+for i in range(240):
+  if os.lstat(back + '/f').st_size < size:
+    break
+  time.sleep(0.5)
+assert(os.lstat(back + '/f').st_size < size)
+assert(open('test/f').read() == b)
+os.system('fusermount -u test')
+time.sleep(1)
+
+assert(os.system('../fusecompress -c gz -o detach test') == 0)
+assert(open('test/f').read() == b)
+assert(not [f for f in os.listdir('test') if f.startswith('._fCtmp')])
+os.system('fusermount -u test')
+time.sleep(1)
+os.close(dfd)
+shutil.rmtree('test')
@@ -0,0 +1,23 @@
+#!/bin/bash -e
+# compress files written outside the mount with several background workers
+mkdir test
+for i in 1 2 3 4 5 6 7 8; do
+  cp /bin/bash test/bash$i
+done
+size=`stat -c %s /bin/bash`
+../fusecompress -d -c gz -o workers=4 test
+for i in 1 2 3 4 5 6 7 8; do
+  cmp /bin/bash test/bash$i
+done
+fusermount -u test
+sleep 1
+for i in 1 2 3 4 5 6 7 8; do
+  test `stat -c %s test/bash$i` -lt $size
+done
+../fusecompress -d -c gz -o workers=4 test
+for i in 1 2 3 4 5 6 7 8; do
+  cmp /bin/bash test/bash$i
+done
+fusermount -u test
+sleep 1
+rm -fr test
@@ -0,0 +1,218 @@
+/* Throttling of background work for fusecompress.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Background compression and deduplication hashing call throttle_io()
+ * after every chunk. Three independent limits apply:
+ *
+ *  throttle_bwlimit = Bytes per second for all background workers
+ *                     together, a token bucket allowing bursts of
+ *                     THROTTLE_BURST milliseconds.
+ *  throttle_cpushare = Percentage of a CPU each worker may use. The CPU
+ *                      time of the calling thread is measured and the
+ *                      thread sleeps in proportion to it.
+ *  throttle_psi = Pressure stall threshold in percent. While the "some"
+ *                 avg10 figure of /proc/pressure/io or /proc/pressure/cpu
+ *                 is above it, workers back off for increasing periods
+ *                 up to THROTTLE_MAX_SLEEP.
+ *
+ * A single call never sleeps longer than THROTTLE_MAX_SLEEP, debts are
+ * carried over to the next call. That way a worker still checks for
+ * cancellation often enough when a file it works on is opened.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "structs.h"
+#include "globals.h"
+#include "log.h"
+#include "throttle.h"
+
+#define THROTTLE_BURST 100		/* milliseconds */
+#define THROTTLE_MAX_SLEEP 100		/* milliseconds */
+#define THROTTLE_PSI_INTERVAL 1000	/* milliseconds between reads of /proc/pressure */
+#define THROTTLE_PSI_MIN_BACKOFF 10	/* milliseconds */
+
+#define NSEC 1000000000LL
+#define MSEC 1000000LL
+
+static struct {
+	pthread_mutex_t lock;
+	long long next;		/* Time the bandwidth budget is used up to */
+	long long psi_checked;	/* Time of the last read of /proc/pressure */
+	int psi_high;		/* Set if the pressure is above throttle_psi */
+	long long backoff;	/* Current backoff while the pressure is high */
+} throttle = {
+	.lock = LOCK_INITIALIZER,
+	.next = 0,
+	.psi_checked = 0,
+	.psi_high = FALSE,
+	.backoff = 0,
+};
+
+/* CPU time of the calling worker at its last call, and the sleep it owes */
+static __thread long long throttle_cpu_last = -1;
+static __thread long long throttle_cpu_debt = 0;
+
+static long long throttle_clock(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (long long) ts.tv_sec * NSEC + ts.tv_nsec;
+}
+
+/**
+ * Read the "some avg10" figure from a pressure file.
+ *
+ * @return Percentage, or -1 if unavailable.
+ */
+static double throttle_psi_read(const char *name)
+{
+	FILE   *f;
+	double  avg10;
+	int     res;
+
+	f = fopen(name, "r");
+	if (!f)
+		return -1;
+	res = fscanf(f, "some avg10=%lf", &avg10);
+	fclose(f);
+
+	return res == 1 ? avg10 : -1;
+}
+
+static long long throttle_bandwidth(long long now, size_t bytes)
+{
+	long long wait;
+
+	if (!throttle_bwlimit)
+		return 0;
+
+	LOCK(&throttle.lock);
+	if (throttle.next < now - THROTTLE_BURST * MSEC)
+		throttle.next = now - THROTTLE_BURST * MSEC;
+	throttle.next += (long long) bytes * NSEC / throttle_bwlimit;
+	wait = throttle.next - now;
+	UNLOCK(&throttle.lock);
+
+	return wait;
+}
+
+static long long throttle_cpu(void)
+{
+	long long cpu;
+	long long used;
+
+	if (throttle_cpushare <= 0 || throttle_cpushare >= 100)
+		return 0;
+
+	cpu = throttle_clock(CLOCK_THREAD_CPUTIME_ID);
+	if (throttle_cpu_last == -1)
+		throttle_cpu_last = cpu;
+	used = cpu - throttle_cpu_last;
+	throttle_cpu_last = cpu;
+
+	// Using X ns of CPU time at a share of S percent takes X * 100 / S
+	// ns of wall time, the difference is slept off
+	//
+	throttle_cpu_debt += used * (100 - throttle_cpushare) / throttle_cpushare;
+	return throttle_cpu_debt;
+}
+
+static long long throttle_pressure(long long now)
+{
+	long long wait = 0;
+	double    io;
+	double    cpu;
+
+	if (!throttle_psi)
+		return 0;
+
+	LOCK(&throttle.lock);
+	if (now - throttle.psi_checked >= THROTTLE_PSI_INTERVAL * MSEC)
+	{
+		throttle.psi_checked = now;
+		UNLOCK(&throttle.lock);
+
+		io = throttle_psi_read("/proc/pressure/io");
+		cpu = throttle_psi_read("/proc/pressure/cpu");
+
+		LOCK(&throttle.lock);
+		throttle.psi_high = io > throttle_psi || cpu > throttle_psi;
+		if (!throttle.psi_high)
+			throttle.backoff = 0;
+		else if (throttle.backoff == 0)
+			throttle.backoff = THROTTLE_PSI_MIN_BACKOFF * MSEC;
+		else if (throttle.backoff < THROTTLE_MAX_SLEEP * MSEC)
+			throttle.backoff *= 2;
+		if (throttle.psi_high)
+			DEBUG_("pressure io %.2f cpu %.2f, backing off %lld ms",
+			       io, cpu, throttle.backoff / MSEC);
+	}
+	if (throttle.psi_high)
+		wait = throttle.backoff;
+	UNLOCK(&throttle.lock);
+
+	return wait;
+}
+
+void throttle_io(size_t bytes)
+{
+	long long        now;
+	long long        wait;
+	long long        cpu_wait;
+	long long        psi_wait;
+	struct timespec  delay;
+
+	if (!throttle_bwlimit && !throttle_psi &&
+	    (throttle_cpushare <= 0 || throttle_cpushare >= 100))
+		return;
+
+	now = throttle_clock(CLOCK_MONOTONIC);
+
+	wait = throttle_bandwidth(now, bytes);
+	cpu_wait = throttle_cpu();
+	if (cpu_wait > wait)
+		wait = cpu_wait;
+	psi_wait = throttle_pressure(now);
+	if (psi_wait > wait)
+		wait = psi_wait;
+
+	// Short waits are collected until they are worth a sleep
+	//
+	if (wait < MSEC)
+		return;
+	if (wait > THROTTLE_MAX_SLEEP * MSEC)
+		wait = THROTTLE_MAX_SLEEP * MSEC;
+
+	delay.tv_sec = wait / NSEC;
+	delay.tv_nsec = wait % NSEC;
+	while (nanosleep(&delay, &delay) == -1 && errno == EINTR)
+		;
+
+	if (throttle_cpu_debt > 0)
+	{
+		throttle_cpu_debt -= wait;
+		if (throttle_cpu_debt < 0)
+			throttle_cpu_debt = 0;
+	}
+}
@@ -0,0 +1,30 @@
+/* Throttling of background work for fusecompress.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place, Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <sys/types.h>
+
+/**
+ * Account for bytes processed by background work (compression or
+ * hashing) and sleep if a limit has been exceeded. Called after every
+ * chunk; never sleeps for long, so that cancellation stays responsive.
+ */
+void throttle_io(size_t bytes);
+
+#endif
@@ -19,14 +19,12 @@
 #endif
 
 #include <ftw.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
-#ifdef WITH_DEDUP
-#include <mhash.h>
-#endif
 
 #define BUFSIZE 131072	/* read buffer size */
 #define MAXOPENFD 400	/* max number of dirs ftw() keeps open */
@@ -48,6 +46,10 @@ int compress_testcancel(void *x)
 {
 	return 0;
 }
+ssize_t compress_read(void *x, int fd, void *buf, size_t size)
+{
+	return read(fd, buf, size);
+}
 
 /* FuseCompress file header magic bytes */
 const unsigned char magic[] = { 037, 0135, 0211 };
@@ -62,6 +64,11 @@ int warnings = 0;
 int rebuild_dedup_db = 0;
 int dedup_now = 0;
 FILE *dedup_db_fp;
+int collect_chunks = 0;
+char **chunks;		/* chunks referenced by chunk maps */
+size_t chunks_used;
+size_t chunks_size;
+int chunks_removed = 0;
 #endif
 size_t total_size = 0;
 
@@ -122,6 +129,64 @@ void warn(const char* fpath, int warning)
 	}
 }
 
+#ifdef WITH_DEDUP
+void add_chunk(const char *path, void *arg)
+{
+	if (chunks_used == chunks_size)
+	{
+		chunks_size = chunks_size ? chunks_size * 2 : 1024;
+		chunks = realloc(chunks, chunks_size * sizeof(char *));
+		if (!chunks)
+		{
+			perror("realloc");
+			exit(1);
+		}
+	}
+	chunks[chunks_used++] = strdup(path);
+}
+
+/* remember the chunks a chunk-mapped file refers to
+   returns FAIL if they could not be read */
+int add_chunks(const char *fpath)
+{
+	compressor_t *compr = NULL;
+	off_t size;
+	int fd;
+	int res;
+
+	fd = file_open(fpath, O_RDONLY);
+	if (fd < 0)
+		return FAIL;
+	res = file_read_header_fd(fd, &compr, &size);
+	if (res != FAIL && compr != &module_chunk)
+		res = FAIL;
+	if (res != FAIL)
+		res = chunk_refs(fd, add_chunk, NULL);
+	close(fd);
+	return res == FAIL ? FAIL : 0;
+}
+
+int cmp_chunk(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* remove chunks that are not referenced by any file */
+int sweep_chunk(const char *fpath, const struct stat *sb, int typeflag, struct FTW* ftwbuf)
+{
+	if (!S_ISREG(sb->st_mode))
+		return 0;
+	if (chunks_used && bsearch(&fpath, chunks, chunks_used, sizeof(char *), cmp_chunk))
+		return 0;
+
+	if (verbose)
+		fprintf(stderr, "%s: removing unreferenced chunk\n", fpath);
+	if (unlink(fpath) == 0)
+		chunks_removed++;
+	return 0;
+}
+#endif
+
 /* check file for errors in compressed data
    everything that is not a FuseCompress-compressed regular file is ignored */
 int checkfile(const char *fpath, const struct stat *sb, int typeflag, struct FTW* ftwbuf)
@@ -163,7 +228,12 @@ int checkfile(const char *fpath, const struct stat *sb, int typeflag, struct FTW
 
 #ifdef WITH_DEDUP
 	int hashed = FALSE;
-	unsigned char md5[16];
+	unsigned char md5[DIGEST_SIZE];
+	dedup_t sum;
+	memset(&sum, 0, sizeof(sum));
+	sum.size = sb->st_size;
+	/* chunks are checked like files, but they are not files to dedup */
+	int chunk = !strncmp(fpath, "./" CHUNK_STORE "/", sizeof("./" CHUNK_STORE "/") - 1);
 #endif
 	if (!memcmp(m, magic, 3))
 	{
@@ -173,15 +243,18 @@ int checkfile(const char *fpath, const struct stat *sb, int typeflag, struct FTW
 		res = file_read_header_fd(fd, &compr, &size);
 		if (res == FAIL)
 			return fix(fd, fpath, BROKEN_HEADER);
+#ifdef WITH_DEDUP
+		sum.size = size;
+#endif
 
 		handle = compr->open(fd, "r");
 		if (!handle)
 			return fix(fd, fpath, FAIL_OPEN_DECOMP);
 
 #ifdef WITH_DEDUP
-		MHASH mh = NULL;
+		void *mh = NULL;
 		if (rebuild_dedup_db) {
-			mh = mhash_init(MHASH_MD5);
+			mh = dedup_digest->init();
 		}
 #endif
 		total_size += size;
@@ -194,18 +267,27 @@ int checkfile(const char *fpath, const struct stat *sb, int typeflag, struct FTW
 				return fix(fd, fpath, SHORT_READ_DECOMP);
 #ifdef WITH_DEDUP
 			if (rebuild_dedup_db)
-				mhash(mh, buf, res);
+				dedup_digest->update(mh, buf, res);
 #endif
 			size -= res;
 		}
 #ifdef WITH_DEDUP
 		if (rebuild_dedup_db) {
-			mhash_deinit(mh, md5);
+			dedup_digest->final(mh, md5);
 			hashed = TRUE;
 		}
 #endif
 		if (compr->close(handle) < 0)
 			return fix(fd, fpath, FAIL_CLOSE_DECOMP);
+#ifdef WITH_DEDUP
+		/* chunks must not be swept if we don't know all of
+		   the ones that are in use */
+		if (collect_chunks && compr == &module_chunk &&
+		    add_chunks(fpath) == FAIL) {
+			fprintf(stderr, "%s: cannot read chunk references\n", fpath);
+			errors_found++;
+		}
+#endif
 		
 		if (verbose)
 			fprintf(stderr, "ok");
@@ -219,15 +301,19 @@ int checkfile(const char *fpath, const struct stat *sb, int typeflag, struct FTW
 	}
 	
 #ifdef WITH_DEDUP
-	if (rebuild_dedup_db) {
+	if (rebuild_dedup_db && !chunk) {
 		if (!hashed)
 			dedup_hash_file(fpath, md5);
+		memcpy(sum.md5, md5, sizeof(sum.md5));
+		sum.hashed = DEDUP_HASHED_FULL;
 		if (dedup_now) {
-			if (hardlink_file(md5, fpath + 2))
+			char *target = dedup_match(md5, fpath + 2);
+			if (hardlink_file(&sum, fpath + 2, target))
 				fprintf(stderr, " deduped");
+			free(target);
 		}
 		else if (!dedup_db_has_md5(md5)) {
-			dedup_add(md5, fpath + 2);
+			dedup_add(&sum, fpath + 2);
 		}
 	}
 #endif
@@ -245,6 +331,7 @@ void usage(char *n)
 #ifdef WITH_DEDUP
 	fprintf(stderr, " -r\tRebuild deduplication database\n");
 	fprintf(stderr, " -l\tDeduplicate files while building database\n");
+	fprintf(stderr, " -g\tRemove chunks no longer referenced by any file\n");
 #endif
 	fprintf(stderr, " -v\tBe verbose\n");
 	exit(1);
@@ -258,7 +345,7 @@ int main(int argc, char **argv)
 	{
 		next_option = getopt(argc, argv, "dpv"
 #ifdef WITH_DEDUP
-		"rl"
+		"rlg"
 #endif
 		);
 		switch (next_option)
@@ -276,6 +363,9 @@ int main(int argc, char **argv)
 			case 'l':
 				dedup_now = 1;
 				break;
+			case 'g':
+				collect_chunks = 1;
+				break;
 #endif
 			case 'v':
 				verbose++;
@@ -307,6 +397,20 @@ int main(int argc, char **argv)
 	if (rebuild_dedup_db) {
 		dedup_save();
 	}
+	/* a file that could not be read may have lost the references to
+	   its chunks, so nothing is removed then */
+	if (collect_chunks && errors_found > errors_fixed)
+		fprintf(stderr, "not removing chunks, there are unfixed errors\n");
+	else if (collect_chunks) {
+		qsort(chunks, chunks_used, sizeof(char *), cmp_chunk);
+		if (nftw(CHUNK_STORE, sweep_chunk, MAXOPENFD, FTW_MOUNT|FTW_PHYS) < 0 && errno != ENOENT)
+		{
+			perror("nftw");
+			exit(1);
+		}
+		if (chunks_removed)
+			fprintf(stderr, "%d unreferenced chunks removed\n", chunks_removed);
+	}
 #endif
 
 	if (warnings) fprintf(stderr, "%d warnings\n", warnings);
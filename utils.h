@@ -44,6 +44,14 @@ static inline uint64_t to_le64(uint64_t v)
 {
     return __cpu_to_le64(v);
 }
+static inline uint32_t from_le32(uint32_t v)
+{
+    return __le32_to_cpu(v);
+}
+static inline uint32_t to_le32(uint32_t v)
+{
+    return __cpu_to_le32(v);
+}
 #else
 #ifdef FC_LITTLE_ENDIAN
 static inline uint64_t from_le64(uint64_t v)
@@ -54,6 +62,14 @@ static inline uint64_t to_le64(uint64_t v)
 {
     return v;
 }
+static inline uint32_t from_le32(uint32_t v)
+{
+    return v;
+}
+static inline uint32_t to_le32(uint32_t v)
+{
+    return v;
+}
 #else
 #error no generic big-endian support
 #endif